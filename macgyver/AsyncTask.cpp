@@ -18,13 +18,17 @@ bool Fmi::AsyncTask::log_time = false;
 
 Fmi::AsyncTask::AsyncTask(const std::string& name,
                           std::function<void()> task,
-                          std::function<void()> notify)
+                          std::function<void()> notify,
+                          std::shared_ptr<TaskInstrumentation> instrumentation,
+                          std::chrono::steady_clock::time_point enqueued)
 
     : name(name),
       status(none),
       done(false),
       notify(notify),
       ex(nullptr),
+      instrumentation(std::move(instrumentation)),
+      enqueued(enqueued),
       task_thread([this, task]() { run(task); })
 {
     LOG_TIME("created");
@@ -127,7 +131,10 @@ void Fmi::AsyncTask::run(std::function<void()> task)
     status = active;
     Fmi::set_thread_name(name);
     LOG_TIME("started");
-    task();
+    {
+      TaskInstrumentation::Scope scope(instrumentation.get(), name, enqueued);
+      task();
+    }
     LOG_TIME("ended");
     handle_result(ok, nullptr);
   }
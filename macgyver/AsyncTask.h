@@ -1,8 +1,11 @@
 #pragma once
 
+#include "TaskInstrumentation.h"
 #include <boost/thread.hpp>
 
 #include <atomic>
+#include <chrono>
+#include <memory>
 #include <mutex>
 
 namespace Fmi
@@ -34,11 +37,16 @@ class AsyncTask
    *   @param notify function to call when requested function has ended (any reason - success,
    * interrupted, exception thrown)
    *
+   *   @param instrumentation optional recorder of the wait and run times of the task
+   *   @param enqueued time the task was requested, the wait is measured from it
+   *
    *   Notification callback is called from task thread, so locking may be required
    */
   AsyncTask(const std::string& name,
             std::function<void()> task,
-            std::function<void()> notify = std::function<void()>());
+            std::function<void()> notify = std::function<void()>(),
+            std::shared_ptr<TaskInstrumentation> instrumentation = nullptr,
+            std::chrono::steady_clock::time_point enqueued = std::chrono::steady_clock::now());
 
   virtual ~AsyncTask();
 
@@ -71,6 +79,8 @@ class AsyncTask
   std::atomic<bool> done;
   const std::function<void()> notify;
   std::exception_ptr ex;
+  const std::shared_ptr<TaskInstrumentation> instrumentation;
+  const std::chrono::steady_clock::time_point enqueued;
   boost::thread task_thread;
 
   AsyncTask(const AsyncTask&) = delete;
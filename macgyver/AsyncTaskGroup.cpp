@@ -22,6 +22,7 @@ Fmi::AsyncTaskGroup::~AsyncTaskGroup()
 
 void Fmi::AsyncTaskGroup::add(const std::string& name, const std::function<void()>& task)
 {
+  const auto enqueued = std::chrono::steady_clock::now();
   while (get_num_active_tasks() >= max_paralell_tasks)
   {
     wait_some();
@@ -36,7 +37,9 @@ void Fmi::AsyncTaskGroup::add(const std::string& name, const std::function<void(
         [this, task_id] ()
         {
             on_task_completed_callback(task_id);
-        }));
+        },
+        instrumentation,
+        enqueued));
     active_tasks[task_id] = new_task;
   }
 }
@@ -149,6 +152,24 @@ bool Fmi::AsyncTaskGroup::stop_on_error(bool enable)
   return stop_on_error_.exchange(enable);
 }
 
+void Fmi::AsyncTaskGroup::enable_instrumentation(const std::string& name,
+                                                 const TaskInstrumentationOptions& options)
+{
+  auto new_instrumentation = std::make_shared<TaskInstrumentation>(name, options);
+  std::unique_lock<std::mutex> lock(m1);
+  instrumentation.swap(new_instrumentation);
+  lock.unlock();
+  // The previous instrumentation, if any, is destroyed outside the lock
+}
+
+Fmi::TaskInstrumentationStats Fmi::AsyncTaskGroup::get_instrumentation_stats() const
+{
+  std::unique_lock<std::mutex> lock(m1);
+  const auto current = instrumentation;
+  lock.unlock();
+  return current ? current->statistics() : TaskInstrumentationStats();
+}
+
 bool Fmi::AsyncTaskGroup::wait_some()
 {
   std::unique_lock<std::mutex> lock(m1);
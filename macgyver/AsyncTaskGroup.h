@@ -115,6 +115,21 @@ class AsyncTaskGroup
    */
   bool stop_on_error(bool enable);
 
+  /**
+   *  @brief Start recording the wait and run times of the tasks added after the call
+   *
+   *  The wait of a task includes the time add() blocked for a free slot. The
+   *  tasks are recorded also per task name.
+   */
+  void enable_instrumentation(const std::string& name,
+                              const TaskInstrumentationOptions& options =
+                                  TaskInstrumentationOptions());
+
+  /**
+   *  @brief Get the recorded task timings, empty if instrumentation is not enabled
+   */
+  TaskInstrumentationStats get_instrumentation_stats() const;
+
  private:
   bool wait_some();
   void on_task_completed_callback(std::size_t task_id);
@@ -131,6 +146,7 @@ class AsyncTaskGroup
   boost::signals2::signal<void(const std::string&)> signal_task_failed;
   std::atomic_bool stop_requested;
   std::atomic_bool stop_on_error_;
+  std::shared_ptr<TaskInstrumentation> instrumentation;
 
   /**
    *   @brief Information about exceptions that have caused termination of async tasks
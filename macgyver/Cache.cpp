@@ -1,7 +1,16 @@
 #include "Cache.h"
 #include "Exception.h"
+#include "MappedFile.h"
+#include "ThreadName.h"
 #include <boost/spirit/include/qi.hpp>
+#include <algorithm>
+#include <cstdio>
 #include <fstream>
+#include <limits>
+#include <map>
+#include <set>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace Fmi
 {
@@ -36,8 +45,21 @@ bool parse_size_t(const std::string& input, std::size_t& result)
   }
 }
 
-FileCache::FileCache(const fs::path& directory, std::size_t maxSize)
-    : itsSize(0), itsMaxSize(maxSize), itsDirectory(directory)
+bool syncPath(const fs::path& path)
+{
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  const bool ok = (::fsync(fd) == 0);
+  ::close(fd);
+  return ok;
+}
+
+FileCache::FileCache(const fs::path& directory,
+                     std::size_t maxSize,
+                     bool writeBehind,
+                     const CacheCompression& compression)
+    : itsMaxSize(maxSize), itsCompression(compression), itsDirectory(directory)
 {
   try
   {
@@ -78,6 +100,9 @@ FileCache::FileCache(const fs::path& directory, std::size_t maxSize)
 
     // Load any available contents
     update();
+
+    if (writeBehind)
+      itsWriter = std::make_unique<Fmi::AsyncTask>("upd-fcache-wr", [this]() { runWriter(); });
   }
   catch (...)
   {
@@ -85,54 +110,161 @@ FileCache::FileCache(const fs::path& directory, std::size_t maxSize)
   }
 }
 
-std::optional<std::string> FileCache::find(std::size_t key)
+FileCache::~FileCache()
 {
   try
   {
-    UpgradeReadLock theLock(itsMutex);
-    std::error_code err;
+    // Store the queued values before stopping the writer
+    if (itsWriter)
+    {
+      {
+        boost::unique_lock<boost::mutex> lock(itsQueueMutex);
+        itsStopping = true;
+      }
+      itsQueueCondition.notify_all();
+      itsWriter->wait();
+    }
 
-    auto it = itsContentMap.left.find(key);
+    // Record the final LRU order for a fast restart
+    writeJournal();
+  }
+  catch (...)
+  {
+  }
+}
 
-    if (it == itsContentMap.left.end())
-    {
-      ++itsMissCount;
+// Look up the file of the key, or the value if it has not been written yet
+bool FileCache::lookup(std::size_t key,
+                       fs::path& path,
+                       std::size_t& size,
+                       std::shared_ptr<const std::string>& pending)
+{
+  auto& shard = getShard(key);
+  ReadLock lock(shard.mutex);
+  auto it = shard.map.find(key);
+  if (it == shard.map.end())
+  {
+    ++shard.missCount;
+    return false;
+  }
+  path = it->second->file.path;
+  size = it->second->file.fileSize;
+  pending = it->second->pending;
+  return true;
+}
+
+std::optional<std::string> FileCache::find(std::size_t key)
+{
+  try
+  {
+    fs::path fullPath;
+    std::size_t size = 0;
+    std::shared_ptr<const std::string> pending;
+    if (!lookup(key, fullPath, size, pending))
       return std::optional<std::string>();
-    }
 
-    // Found in the map, but somebody may have cleaned the file
+    auto& shard = getShard(key);
+    std::string ret;
+    if (pending)
+      ret = *pending;
+    else
+    {
+      // Found in the map, but somebody may have cleaned the file. Small files are
+      // read faster than mapped, findView() avoids the copy.
+      std::ifstream file(fullPath, std::ios::in | std::ios::binary);
+      if (!file)
+      {
+        // Should we remove the entry here? It will be re-inserted anyways eventually
+        ++shard.missCount;
+        return std::optional<std::string>();
+      }
 
-    fs::path fullPath = it->second.path;
+      ret.resize(size);
+      file.read(&ret[0], size);  // Should work, c++11 guarantees strings to be contiguous
+      if (!file)
+      {
+        ++shard.missCount;
+        return std::optional<std::string>();
+      }
+    }
 
-    if (!fs::exists(fullPath, err))
+    if (isEncoded(ret))
     {
-      // Should we remove the entry here? It will be re-inserted anyways eventually
-      ++itsMissCount;
-      return std::optional<std::string>();
+      try
+      {
+        ret = decodeValue(ret);
+      }
+      catch (...)
+      {
+        ++shard.missCount;  // corrupted file, will be replaced by the next insert
+        return std::optional<std::string>();
+      }
     }
 
-    std::size_t size = it->second.fileSize;
+    // This implements LRU eviction behaviour
+    touch(shard, key);
+    ++shard.hitCount;
+    return std::optional<std::string>(std::move(ret));
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
 
-    // Read and return the file
+FileCache::View FileCache::findView(std::size_t key)
+{
+  try
+  {
+    fs::path path;
+    std::size_t size = 0;
+    std::shared_ptr<const std::string> pending;
+    if (!lookup(key, path, size, pending))
+      return View();
+
+    View view;
+    if (pending)
+      view = View(pending, *pending);
+    else if (size == 0)
+      view = View(std::make_shared<const std::string>(), std::string_view());
+    else
+    {
+      // Found in the map, but somebody may have cleaned the file
+      try
+      {
+        auto mapping = std::make_shared<const Fmi::MappedFile>(path.string(), std::ios_base::in);
+        if (mapping->size() == size)
+          view = View(mapping, std::string_view(mapping->const_data(), size));
+      }
+      catch (const std::exception&)
+      {
+      }
+    }
 
-    std::ifstream file(fullPath, std::ios::in|std::ios::binary);
-    if (!file)
+    if (view && isEncoded(view.view()))
     {
-      // Report file opening error
-      ++itsMissCount;
-      return std::optional<std::string>();
+      try
+      {
+        auto value = std::make_shared<const std::string>(decodeValue(view.view()));
+        view = View(value, *value);
+      }
+      catch (...)
+      {
+        view = View();
+      }
     }
 
-    std::string ret;
-    ret.resize(size);
-    file.read(&ret[0], size);  // Should work, c++11 guarantees strings to be contiguous
+    auto& shard = getShard(key);
+    if (!view)
+    {
+      ++shard.missCount;
+      return view;
+    }
 
     // This implements LRU eviction behaviour
-    UpgradeWriteLock ugLock(theLock);
-    itsContentMap.right.relocate(itsContentMap.right.end(), itsContentMap.project_right(it));
-
-    ++itsHitCount;
-    return std::optional<std::string>(std::move(ret));
+    touch(shard, key);
+    ++shard.hitCount;
+    return view;
   }
   catch (...)
   {
@@ -144,19 +276,14 @@ bool FileCache::insert(std::size_t key, const std::string& value, bool performCl
 {
   try
   {
-    WriteLock theLock(itsMutex);
+    auto& shard = getShard(key);
     std::error_code err;
 
-    auto it = itsContentMap.left.find(key);
-    if (it != itsContentMap.left.end())
     {
-      if (fs::exists(it->second.path, err))
-        return true;  // Already in the cache and disk
-
-      // Found in map, but not on the disk. Someone has cleaned it without our knowledge
-      // Remove from the map and proceed with insert
-      itsSize -= it->second.fileSize;
-      itsContentMap.left.erase(it);
+      ReadLock lock(shard.mutex);
+      auto it = shard.map.find(key);
+      if (it != shard.map.end() && (it->second->pending || fs::exists(it->second->file.path, err)))
+        return true;  // Already in the cache and disk or in the write queue
     }
 
     std::pair<std::string, std::string> subDirAndFilename = getFileDirAndName(key);
@@ -167,9 +294,10 @@ bool FileCache::insert(std::size_t key, const std::string& value, bool performCl
     fs::path cacheDir = itsDirectory / subDir;
     fs::path fullPath = cacheDir / fileName;
 
-    bool isValid = checkForDiskSpace(cacheDir, value, performCleanup);
+    auto stored = std::make_shared<const std::string>(encodeValue(value, itsCompression));
+    std::size_t fileSize = stored->size();
 
-    if (!isValid)
+    if (!reserveDiskSpace(fileSize, performCleanup))
     {
 #ifdef MYDEBUG
       std::cout << "Insert: No disk space for key: " << key << std::endl;
@@ -177,26 +305,109 @@ bool FileCache::insert(std::size_t key, const std::string& value, bool performCl
       return false;  // Not possible to cache this value
     }
 
-    isValid = writeFile(cacheDir, fileName, value);
+    // The entry is visible to find() with the value in memory until it has been written
+    WriteItem item{key, cacheDir, fileName, stored};
+    {
+      WriteLock lock(shard.mutex);
+      auto it = shard.map.find(key);
+      if (it != shard.map.end())
+      {
+        if (it->second->pending || fs::exists(it->second->file.path, err))
+        {
+          // Inserted by someone else meanwhile
+          itsSize -= fileSize;
+          return true;
+        }
+
+        // Found in map, but not on the disk. Someone has cleaned it without our knowledge
+        // Remove from the map and proceed with insert
+        eraseEntry(shard, it);
+      }
+
+      shard.list.emplace_back(key, fullPath, fileSize, ++itsSequence, item.value);
+      shard.map.emplace(key, std::prev(shard.list.end()));
+      ++shard.insertCount;
+    }
+    flushJournal();
+
+    if (fileSize < value.size())
+    {
+      ++itsCompressedInserts;
+      itsCompressionSavings += value.size() - fileSize;
+    }
 
-    if (!isValid)
+    if (!itsWriter)
     {
-#ifdef MYDEBUG
-      std::cout << "Insert: Unable to write key: " << key << std::endl;
-#endif
-      return false;  // Something went wrong with file write
+      const bool ok = persist(item);
+      flushJournal();
+      return ok;
     }
 
-    std::size_t fileSize = value.size();
+    {
+      boost::unique_lock<boost::mutex> lock(itsQueueMutex);
+      itsQueue.push_back(std::move(item));
+    }
+    itsQueueCondition.notify_all();
+    return true;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
 
-    itsContentMap.insert(MapType::value_type(key, FileCacheStruct(fullPath, fileSize)));
+void FileCache::flush()
+{
+  try
+  {
+    {
+      boost::unique_lock<boost::mutex> lock(itsQueueMutex);
+      while (!itsQueue.empty() || itsWriting)
+        itsQueueCondition.wait(lock);
+    }
+    writeJournal();
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
 
-    // Successfull insert. Update cache size information
-    itsSize += fileSize;
+// Write a queued value and mark the entry stored, or drop it if the write failed
+bool FileCache::persist(const WriteItem& item)
+{
+  try
+  {
+    bool ok = writeFile(item.dir, item.fileName, *item.value);
 
-    ++itsInsertCount;
+    auto& shard = getShard(item.key);
+    WriteLock lock(shard.mutex);
+    auto it = shard.map.find(item.key);
+    if (it == shard.map.end() || it->second->pending != item.value)
+    {
+      // Evicted before it was written
+      if (ok)
+      {
+        std::error_code err;
+        fs::remove(item.dir / item.fileName, err);
+      }
+      return false;
+    }
 
-    return true;
+    if (ok)
+    {
+      it->second->pending.reset();
+      appendJournal('A', item.key, it->second->file.fileSize, it->second->sequence);
+    }
+    else
+    {
+#ifdef MYDEBUG
+      std::cout << "Insert: Unable to write key: " << item.key << std::endl;
+#endif
+      ++itsWriteFailures;
+      eraseEntry(shard, it);
+    }
+    return ok;
   }
   catch (...)
   {
@@ -204,17 +415,112 @@ bool FileCache::insert(std::size_t key, const std::string& value, bool performCl
   }
 }
 
+void FileCache::runWriter()
+{
+  while (true)
+  {
+    std::deque<WriteItem> batch;
+    {
+      boost::unique_lock<boost::mutex> lock(itsQueueMutex);
+      while (itsQueue.empty() && !itsStopping)
+        itsQueueCondition.wait(lock);
+      if (itsQueue.empty())
+        return;
+      batch.swap(itsQueue);
+      itsWriting = true;
+    }
+
+    for (const auto& item : batch)
+    {
+      try
+      {
+        persist(item);
+      }
+      catch (...)
+      {
+        ++itsWriteFailures;
+      }
+    }
+    flushJournal();
+
+    {
+      boost::unique_lock<boost::mutex> lock(itsQueueMutex);
+      itsWriting = false;
+    }
+    itsQueueCondition.notify_all();
+  }
+}
+
+// Caller holds the exclusive shard lock
+void FileCache::eraseEntry(Shard& shard,
+                           std::unordered_map<std::size_t, ListType::iterator>::iterator it)
+{
+  itsSize -= it->second->file.fileSize;
+  if (!it->second->pending)
+    appendJournal('R', it->first, it->second->file.fileSize, it->second->sequence);
+  shard.list.erase(it->second);
+  shard.map.erase(it);
+}
+
+// Move the entry to the MRU end of its shard with a new global sequence number.
+// Accesses are not journaled, the new order is recorded when the journal is rewritten.
+void FileCache::touch(Shard& shard, std::size_t key)
+{
+  WriteLock lock(shard.mutex);
+  auto it = shard.map.find(key);
+  if (it == shard.map.end())
+    return;
+  it->second->sequence = ++itsSequence;
+  shard.list.splice(shard.list.end(), shard.list, it->second);
+}
+
+// Add entries found on disk oldest first, locking each shard once
+void FileCache::addEntries(const std::vector<JournalEntry>& entries)
+{
+  std::array<std::vector<const JournalEntry*>, NumShards> byShard;
+  for (const auto& entry : entries)
+    byShard[(entry.key * 2654435761ULL) % NumShards].push_back(&entry);
+
+  const std::string directory = itsDirectory.string() + '/';
+  for (std::size_t s = 0; s < NumShards; s++)
+  {
+    auto& shard = itsShards[s];
+    WriteLock lock(shard.mutex);
+    shard.map.reserve(shard.map.size() + byShard[s].size());
+    for (const auto* entry : byShard[s])
+    {
+      if (shard.map.find(entry->key) != shard.map.end())
+        continue;
+      const auto dirAndName = getFileDirAndName(entry->key);
+      shard.list.emplace_back(entry->key,
+                              directory + dirAndName.first + '/' + dirAndName.second,
+                              entry->size,
+                              entry->sequence,
+                              nullptr);
+      shard.map.emplace(entry->key, std::prev(shard.list.end()));
+      itsSize += entry->size;
+    }
+  }
+}
+
 std::vector<std::size_t> FileCache::getContent() const
 {
   try
   {
-    ReadLock lock(itsMutex);
-    std::vector<std::size_t> result;
-    result.reserve(itsContentMap.size());
-    for (auto it = itsContentMap.right.begin(); it != itsContentMap.right.end(); ++it)
+    // Merge the shards in global LRU order
+    std::vector<std::pair<std::uint64_t, std::size_t>> items;
+    for (const auto& shard : itsShards)
     {
-      result.push_back(it->second);
+      ReadLock lock(shard.mutex);
+      for (const auto& entry : shard.list)
+        items.emplace_back(entry.sequence.load(), entry.key);
     }
+    std::sort(items.begin(), items.end());
+
+    std::vector<std::size_t> result;
+    result.reserve(items.size());
+    for (const auto& item : items)
+      result.push_back(item.second);
     return result;
   }
   catch (...)
@@ -225,15 +531,31 @@ std::vector<std::size_t> FileCache::getContent() const
 
 CacheStats FileCache::statistics() const
 {
-  ReadLock lock(itsMutex);
-  return CacheStats(itsStartTime, itsMaxSize, itsSize, itsInsertCount, itsHitCount, itsMissCount, itsEvictionCount);
+  CacheStats stats(itsStartTime, itsMaxSize, itsSize, 0, 0, 0, itsEvictionCount);
+  for (const auto& shard : itsShards)
+  {
+    ReadLock lock(shard.mutex);
+    stats.inserts += shard.insertCount;
+    stats.hits += shard.hitCount;
+    stats.misses += shard.missCount;
+  }
+  {
+    boost::unique_lock<boost::mutex> lock(itsQueueMutex);
+    stats.counters["queued_writes"] = itsQueue.size();
+  }
+  stats.counters["write_failures"] = itsWriteFailures;
+  if (itsCompression.enabled())
+  {
+    stats.counters["compressed_inserts"] = itsCompressedInserts;
+    stats.counters["compression_saved_bytes"] = itsCompressionSavings;
+  }
+  return stats;
 }
 
 std::size_t FileCache::getSize() const
 {
   try
   {
-    ReadLock theLock(itsMutex);
     return itsSize;
   }
   catch (...)
@@ -246,7 +568,7 @@ bool FileCache::clean(std::size_t spaceNeeded)
 {
   try
   {
-    WriteLock theLock(itsMutex);
+    std::lock_guard<std::mutex> lock(itsSpaceMutex);
     return performCleanup(spaceNeeded);
   }
   catch (...)
@@ -255,6 +577,7 @@ bool FileCache::clean(std::size_t spaceNeeded)
   }
 }
 
+// Caller holds itsSpaceMutex
 bool FileCache::performCleanup(std::size_t space_needed)
 {
   try
@@ -262,25 +585,41 @@ bool FileCache::performCleanup(std::size_t space_needed)
     std::error_code err;
     while ((itsMaxSize - itsSize) < space_needed)
     {
-      if (itsContentMap.empty())
+      // The globally least recently used entry is the oldest of the shard heads
+      Shard* oldest = nullptr;
+      std::uint64_t sequence = 0;
+      for (auto& shard : itsShards)
+      {
+        ReadLock lock(shard.mutex);
+        if (!shard.list.empty() && (!oldest || shard.list.front().sequence < sequence))
+        {
+          oldest = &shard;
+          sequence = shard.list.front().sequence;
+        }
+      }
+
+      if (!oldest)
       {
         // Can't clean an empty map or we have deleted everything
+        flushJournal();
         return false;
       }
 
-      fs::path& thisPath = itsContentMap.right.front().first.path;
-      std::size_t fileSize = itsContentMap.right.front().first.fileSize;
-      fs::remove(thisPath, err);
+      WriteLock lock(oldest->mutex);
+      if (oldest->list.empty())
+        continue;
+
+      fs::remove(oldest->list.front().file.path, err);
       if (err)
       {
         // Do something when error. Don't know what though.
-        // Also, the file can be already deleted.
+        // Also, the file can be already deleted, or not yet written by the write-behind queue.
       }
-      itsContentMap.right.pop_front();
-      itsSize -= fileSize;
+      eraseEntry(*oldest, oldest->map.find(oldest->list.front().key));
       ++itsEvictionCount;
     }
 
+    flushJournal();
     return true;
   }
   catch (...)
@@ -289,65 +628,405 @@ bool FileCache::performCleanup(std::size_t space_needed)
   }
 }
 
+// Journal layout: magic, version, the subdirectories with their modification
+// times at the time of writing, followed by appended records
+namespace
+{
+const char JournalMagic[8] = {'F', 'M', 'I', 'F', 'C', 'J', 'N', 'L'};
+const std::uint32_t JournalVersion = 1;
+const char* const JournalName = "index.journal";
+
+// Records are buffered before writing them in batches, and the journal is
+// rewritten once the appended records outnumber the entries by the factor
+const std::size_t JournalFlushRecords = 256;
+const std::size_t JournalCompactionFactor = 4;
+const std::size_t JournalMinRecords = 1024;
+
+struct JournalRecord
+{
+  char op = 0;  // 'A' = stored or accessed, 'R' = removed
+  std::uint64_t key = 0;
+  std::uint64_t size = 0;
+  std::uint64_t sequence = 0;
+};
+
+template <typename T>
+void writePod(std::ostream& out, const T& value)
+{
+  out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+void appendPod(std::string& out, const T& value)
+{
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+bool readPod(std::istream& in, T& value)
+{
+  return !!in.read(reinterpret_cast<char*>(&value), sizeof(value));
+}
+
+// The fields are serialized one by one, the struct layout is not a file format
+void appendRecord(std::string& out,
+                  char op,
+                  std::uint64_t key,
+                  std::uint64_t size,
+                  std::uint64_t sequence)
+{
+  appendPod(out, op);
+  appendPod(out, key);
+  appendPod(out, size);
+  appendPod(out, sequence);
+}
+
+bool readRecord(std::istream& in, JournalRecord& record)
+{
+  return readPod(in, record.op) && readPod(in, record.key) && readPod(in, record.size) &&
+         readPod(in, record.sequence);
+}
+
+std::int64_t modificationTime(const fs::path& path)
+{
+  std::error_code err;
+  auto t = fs::last_write_time(path, err);
+  if (err)
+    return std::numeric_limits<std::int64_t>::min();
+  return t.time_since_epoch().count();
+}
+
+// Top level subdirectories of the cache
+std::vector<std::string> listSubdirectories(const fs::path& directory)
+{
+  std::vector<std::string> result;
+  std::error_code err;
+  for (fs::directory_iterator it(directory, err), end; !err && it != end; it.increment(err))
+  {
+    if (it->is_directory(err))
+      result.push_back(it->path().filename().string());
+  }
+  return result;
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Load the index from the journal and scan what it does not cover
+ *
+ * Journal entries are trusted for subdirectories whose modification time
+ * equals the one recorded when the journal was written. Other
+ * subdirectories, or all of them if the journal is missing or corrupt, are
+ * scanned in parallel. Scanned files keep the LRU sequence from the
+ * journal if it knows them. The newest entries are loaded up to the
+ * maximum size.
+ */
+// ----------------------------------------------------------------------
+
 void FileCache::update()
 {
   try
   {
-    fs::recursive_directory_iterator iter(itsDirectory);
-    fs::recursive_directory_iterator end;
-    std::error_code err;
+    std::map<std::string, std::int64_t> recordedTimes;
+    std::unordered_map<std::size_t, JournalEntry> journal;
+    readJournal(recordedTimes, journal);
+
+    // Subdirectories are named by the lowest byte of the key
+    std::vector<std::string> scanDirs;
+    std::array<bool, 256> trusted{};
+    for (const auto& dir : listSubdirectories(itsDirectory))
+    {
+      std::size_t lowByte = 0;
+      auto it = recordedTimes.find(dir);
+      if (it != recordedTimes.end() && it->second == modificationTime(itsDirectory / dir) &&
+          parse_size_t(dir, lowByte) && lowByte < trusted.size() &&
+          getFileDirAndName(lowByte).first == dir)
+        trusted[lowByte] = true;
+      else
+        scanDirs.push_back(dir);
+    }
+
+    std::vector<JournalEntry> entries;
+    for (const auto& item : journal)
+      if (trusted[item.first & 0xffu])
+        entries.push_back(item.second);
+
+    scanDirectories(scanDirs, journal, entries);
+
+    // Keep the most recently used entries which fit, then add them oldest first
+    std::sort(entries.begin(),
+              entries.end(),
+              [](const auto& a, const auto& b) { return a.sequence > b.sequence; });
+    std::size_t total = 0;
+    std::size_t count = 0;
+    while (count < entries.size() && total + entries[count].size < itsMaxSize)
+      total += entries[count++].size;
+    entries.resize(count);
+
+    // Renumber oldest first, unknown files (sequence zero) count as the oldest
+    std::reverse(entries.begin(), entries.end());
+    for (auto& entry : entries)
+      entry.sequence = ++itsSequence;
+    addEntries(entries);
+
+    writeJournal();
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!")
+        .addParameter("Directory", itsDirectory.string());
+  }
+}
 
-    std::string current_subdir;
+// Read the journal, returns false if it is missing or corrupt. A truncated last record
+// is ignored, the subdirectory modification times reveal unrecorded changes.
+bool FileCache::readJournal(std::map<std::string, std::int64_t>& recordedTimes,
+                            std::unordered_map<std::size_t, JournalEntry>& entries) const
+{
+  std::ifstream in(itsDirectory / JournalName, std::ios::in | std::ios::binary);
+  if (!in)
+    return false;
+
+  char magic[sizeof(JournalMagic)];
+  std::uint32_t version = 0;
+  std::uint32_t ndirs = 0;
+  if (!in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), JournalMagic) ||
+      !readPod(in, version) || version != JournalVersion || !readPod(in, ndirs))
+    return false;
 
-    for (; iter != end; iter++)
+  for (std::uint32_t i = 0; i < ndirs; i++)
+  {
+    std::uint32_t length = 0;
+    std::int64_t mtime = 0;
+    if (!readPod(in, length) || length > 255)
     {
-      const auto& entry = *iter;
+      recordedTimes.clear();
+      return false;
+    }
+    std::string name(length, '\0');
+    if (!in.read(&name[0], length) || !readPod(in, mtime))
+    {
+      recordedTimes.clear();
+      return false;
+    }
+    recordedTimes[name] = mtime;
+  }
 
-      const auto& status = entry.status(err);
+  JournalRecord record;
+  while (readRecord(in, record))
+  {
+    if (record.op == 'A')
+      entries[record.key] = JournalEntry{record.key, record.size, record.sequence};
+    else if (record.op == 'R')
+      entries.erase(record.key);
+    else
+      break;
+  }
+  return true;
+}
+
+// Scan the given subdirectories in parallel threads, taking the LRU sequence
+// from the journal when it knows the file
+void FileCache::scanDirectories(const std::vector<std::string>& dirs,
+                                const std::unordered_map<std::size_t, JournalEntry>& journal,
+                                std::vector<JournalEntry>& entries) const
+{
+  if (dirs.empty())
+    return;
+
+  std::atomic<std::size_t> next{0};
+  std::vector<std::vector<JournalEntry>> results(dirs.size());
+  std::vector<std::exception_ptr> errors(dirs.size());
+  auto scan = [&](std::size_t i)
+  {
+    std::error_code err;
+    for (fs::directory_iterator it(itsDirectory / dirs[i], err), end; !err && it != end;
+         it.increment(err))
+    {
+      if (!it->is_regular_file(err))
+        continue;
+
+      std::size_t key;
+      if (!getKey(dirs[i], it->path().filename().string(), key))
+        continue;
+
+      std::error_code sizeErr;
+      std::size_t fileSize = it->file_size(sizeErr);
+      if (sizeErr)
+        continue;
+
+      auto pos = journal.find(key);
+      std::uint64_t sequence = 0;
+      if (pos != journal.end() && pos->second.size == fileSize)
+        sequence = pos->second.sequence;
+      results[i].push_back(JournalEntry{key, fileSize, sequence});
+    }
+  };
 
-      bool isFile = fs::is_regular_file(status);
-      if (isFile)
+  // An exception escaping a std::thread would terminate the process
+  auto worker = [&]()
+  {
+    for (std::size_t i = next++; i < dirs.size(); i = next++)
+    {
+      try
       {
-        const auto& path = entry.path();
+        scan(i);
+      }
+      catch (...)
+      {
+        errors[i] = std::current_exception();
+      }
+    }
+  };
 
-        if (path.parent_path() == itsDirectory)
-        {
-          // Top level file without corresponding subdir. These are not created by us and should be
-          // ignored
-          continue;
-        }
+  const std::size_t nthreads = std::max<std::size_t>(
+      1, std::min<std::size_t>(dirs.size(), std::thread::hardware_concurrency()));
+  std::vector<std::thread> threads;
+  try
+  {
+    for (std::size_t n = 1; n < nthreads; n++)
+    {
+      threads.emplace_back(
+          [&worker, n]()
+          {
+            Fmi::set_thread_name("ini-fcache-" + std::to_string(n));
+            worker();
+          });
+    }
+  }
+  catch (...)
+  {
+    // Fewer threads will do, the started ones must still be joined
+  }
+  worker();  // in the calling thread, which keeps its name
+  for (auto& thread : threads)
+    thread.join();
+
+  for (const auto& error : errors)
+    if (error)
+      std::rethrow_exception(error);
 
-        std::string subDir = path.parent_path().stem().string();
+  for (const auto& result : results)
+    entries.insert(entries.end(), result.begin(), result.end());
+}
 
-        std::string fileName = path.filename().string();  // Key in the map is filename itself
+// Rewrite the journal with the current contents and start appending to it
+void FileCache::writeJournal()
+{
+  std::lock_guard<std::mutex> lock(itsJournalFileMutex);
+  rewriteJournal();
+}
 
-        std::size_t key;
+// Caller holds itsJournalFileMutex. Buffered records are dropped since the
+// shards reflect them. Records appended while the shards are collected may
+// repeat changes included in the snapshot, which is harmless since each
+// record sets the final state of its key.
+void FileCache::rewriteJournal()
+{
+  itsJournal.close();
 
-        bool valid = getKey(subDir, fileName, key);
+  // Modification times are read first, so that files written meanwhile mark
+  // their directory modified
+  std::vector<std::pair<std::string, std::int64_t>> dirs;
+  for (const auto& dir : listSubdirectories(itsDirectory))
+    dirs.emplace_back(dir, modificationTime(itsDirectory / dir));
 
-        if (valid)
-        {
-          std::size_t fileSize = fs::file_size(path, err);
-          if (!err)
-          {
-            std::size_t expected_size = itsSize + fileSize;
-            if (expected_size < itsMaxSize)
-            {
-              auto res =
-                  itsContentMap.insert(MapType::value_type(key, FileCacheStruct(path, fileSize)));
-              if (res.second)
-                itsSize += fileSize;  // Added new entry, update size information
-            }
-          }
-        }
+  {
+    std::lock_guard<std::mutex> lock(itsJournalMutex);
+    itsJournalBuffer.clear();
+    itsJournalBuffered = 0;
+  }
+
+  // Queued values may already be on disk without a record, their
+  // directories must be scanned on restart
+  std::string records;
+  std::size_t count = 0;
+  std::set<std::string> pendingDirs;
+  for (const auto& shard : itsShards)
+  {
+    ReadLock shardLock(shard.mutex);
+    for (const auto& entry : shard.list)
+    {
+      if (entry.pending)
+        pendingDirs.insert(entry.file.path.parent_path().filename().string());
+      else
+      {
+        appendRecord(records, 'A', entry.key, entry.file.fileSize, entry.sequence.load());
+        ++count;
       }
     }
   }
-  catch (...)
+
+  const fs::path path = itsDirectory / JournalName;
+  fs::path tmpPath = path;
+  tmpPath += ".tmp";
   {
-    throw Fmi::Exception::Trace(BCP, "Operation failed!")
-        .addParameter("Directory", itsDirectory.string());
+    std::ofstream out(tmpPath, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!out)
+      return;
+
+    out.write(JournalMagic, sizeof(JournalMagic));
+    writePod(out, JournalVersion);
+    writePod(out, static_cast<std::uint32_t>(dirs.size()));
+    for (const auto& dir : dirs)
+    {
+      writePod(out, static_cast<std::uint32_t>(dir.first.size()));
+      out.write(dir.first.data(), dir.first.size());
+      writePod(out,
+               pendingDirs.count(dir.first) > 0 ? std::numeric_limits<std::int64_t>::min()
+                                                : dir.second);
+    }
+    out.write(records.data(), records.size());
+
+    if (!out)
+      return;
+  }
+
+  std::error_code err;
+  fs::rename(tmpPath, path, err);
+  if (err)
+    return;
+  itsJournal.open(path, std::ios::out | std::ios::binary | std::ios::app);
+  itsJournalRecords = 0;
+  itsJournalLive = count;
+}
+
+// Caller may hold a shard lock, the record is only buffered
+void FileCache::appendJournal(char op, std::size_t key, std::size_t size, std::uint64_t sequence)
+{
+  std::lock_guard<std::mutex> lock(itsJournalMutex);
+  appendRecord(itsJournalBuffer, op, key, size, sequence);
+  ++itsJournalBuffered;
+}
+
+// Write the buffered records once there are enough of them, or if forced.
+// Caller must not hold a shard lock.
+void FileCache::flushJournal(bool force)
+{
+  if (!force && itsJournalBuffered < JournalFlushRecords)
+    return;
+
+  std::lock_guard<std::mutex> fileLock(itsJournalFileMutex);
+  std::string buffer;
+  std::size_t count = 0;
+  {
+    std::lock_guard<std::mutex> lock(itsJournalMutex);
+    if (itsJournalBuffer.empty())
+      return;
+    buffer.swap(itsJournalBuffer);
+    count = itsJournalBuffered.exchange(0);
   }
+
+  if (itsJournal.is_open())
+  {
+    itsJournal.write(buffer.data(), buffer.size());
+    itsJournal.flush();
+  }
+
+  itsJournalRecords += count;
+  if (itsJournalRecords > JournalCompactionFactor * std::max(itsJournalLive, JournalMinRecords))
+    rewriteJournal();
 }
 
 bool FileCache::writeFile(const fs::path& theDir,
@@ -415,17 +1094,12 @@ bool FileCache::writeFile(const fs::path& theDir,
   }
 }
 
-bool FileCache::checkForDiskSpace(const fs::path& thePath,
-                                  const std::string& theValue,
-                                  bool doCleanup)
-
+// Reserve room for a value of the given size, evicting if allowed
+bool FileCache::reserveDiskSpace(std::size_t valueSize, bool doCleanup)
 {
   try
   {
-    (void)thePath;
-    // Get serialization information of the value to be inserted
-
-    std::size_t valueSize = theValue.size();
+    std::lock_guard<std::mutex> lock(itsSpaceMutex);
 
     // Sanity check for very large inputs
 
@@ -462,6 +1136,7 @@ bool FileCache::checkForDiskSpace(const fs::path& thePath,
       }
     }
 
+    itsSize += valueSize;
     return true;
   }
   catch (...)
@@ -474,23 +1149,12 @@ std::pair<std::string, std::string> FileCache::getFileDirAndName(std::size_t has
 {
   try
   {
-    std::ostringstream out;
-    std::string subDirectory;
-    std::string fileName;
-
-    out << std::hex;
-
-    out << (hashValue & 0xffu);
-
-    subDirectory = out.str();
-
-    out.str("");
-
-    out << (hashValue >> 0x8u);
-
-    fileName = out.str();
-
-    return std::make_pair(subDirectory, fileName);
+    // Called for every entry when loading the journal, hence no ostringstream
+    char subDirectory[32];
+    char fileName[32];
+    std::snprintf(subDirectory, sizeof(subDirectory), "%zx", hashValue & 0xffu);
+    std::snprintf(fileName, sizeof(fileName), "%zx", hashValue >> 0x8u);
+    return std::make_pair(std::string(subDirectory), std::string(fileName));
   }
   catch (...)
   {
@@ -5,23 +5,42 @@
 // ======================================================================
 #pragma once
 
-// bimap kept for FileCache; Cache template uses unordered_map + list
-#include <boost/bimap.hpp>
-#include <boost/bimap/list_of.hpp>
-#include <boost/bimap/unordered_set_of.hpp>
 #include <boost/functional/hash.hpp>
 #include <boost/thread/shared_mutex.hpp>
+#include <algorithm>
 #include <array>
 #include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
 #include <filesystem>
+#include <fstream>
+#include <future>
 #include <list>
+#include <map>
+#include <mutex>
+#include <memory>
 #include <optional>
+#include <queue>
 #include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
+#include "AsyncTask.h"
+#include "CacheCompression.h"
+#include "CacheInstrumentation.h"
+#include "CacheMissRatio.h"
+#include "CachePolicy.h"
 #include "CacheStats.h"
 #include "DateTime.h"
+#include "Exception.h"
+#include "Hash.h"
+#include "ThreadName.h"
 
 namespace Fmi
 {
@@ -40,6 +59,111 @@ struct TrivialSizeFunction
   static std::size_t getSize(const ValueType& /* theValue */) { return 1; }
 };
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Hash function for cache keys
+ *
+ * Lookup keys of other types than the key type must hash equal to the
+ * equivalent key. Strings are hashed as character ranges so that for
+ * example std::string_view and const char* can be used to find
+ * std::string keys.
+ */
+// ----------------------------------------------------------------------
+
+template <class KeyType>
+struct CacheKeyHash
+{
+  std::size_t operator()(const KeyType& key) const { return boost::hash<KeyType>{}(key); }
+};
+
+template <>
+struct CacheKeyHash<std::string>
+{
+  std::size_t operator()(std::string_view key) const
+  {
+    return boost::hash_range(key.begin(), key.end());
+  }
+};
+
+// True if K can be used to look up keys of type KeyType. Numbers are
+// converted to the key type instead.
+template <class KeyType, class K, class = void>
+struct IsCacheLookupKey : std::false_type
+{
+};
+
+template <class KeyType, class K>
+struct IsCacheLookupKey<
+    KeyType,
+    K,
+    std::void_t<decltype(CacheKeyHash<KeyType>{}(std::declval<const K&>())),
+                decltype(std::declval<const K&>() == std::declval<const KeyType&>())>>
+    : std::bool_constant<!std::is_same_v<K, KeyType> && !std::is_arithmetic_v<K> &&
+                         !std::is_enum_v<K>>
+{
+};
+
+// Flush a file or directory to stable storage, false on failure
+bool syncPath(const std::filesystem::path& path);
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Serializer for Cache::save and Cache::load
+ *
+ * Handles std::string and trivially copyable keys and values in native
+ * byte order. Custom serializers provide the same four methods.
+ */
+// ----------------------------------------------------------------------
+
+template <class KeyType, class ValueType>
+struct BinarySerializer
+{
+  void writeKey(std::ostream& out, const KeyType& key) const { write(out, key); }
+  void writeValue(std::ostream& out, const ValueType& value) const { write(out, value); }
+  KeyType readKey(std::istream& in) const { return read<KeyType>(in); }
+  ValueType readValue(std::istream& in) const { return read<ValueType>(in); }
+
+ private:
+  template <typename T>
+  static void write(std::ostream& out, const T& value)
+  {
+    if constexpr (std::is_same_v<T, std::string>)
+    {
+      const std::uint64_t length = value.size();
+      out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+      out.write(value.data(), value.size());
+    }
+    else
+    {
+      static_assert(std::is_trivially_copyable_v<T>, "BinarySerializer needs trivially copyable types");
+      out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+  }
+
+  template <typename T>
+  static T read(std::istream& in)
+  {
+    T value{};
+    if constexpr (std::is_same_v<T, std::string>)
+    {
+      // Read in chunks so that a corrupt length fails at the end of the data
+      // instead of allocating all of it first
+      constexpr std::uint64_t chunk = 64 * 1024;
+      std::uint64_t length = 0;
+      in.read(reinterpret_cast<char*>(&length), sizeof(length));
+      while (in && value.size() < length)
+      {
+        const std::size_t pos = value.size();
+        value.resize(pos + std::min(chunk, length - pos));
+        in.read(value.data() + pos, value.size() - pos);
+      }
+    }
+    else
+      in.read(reinterpret_cast<char*>(&value), sizeof(value));
+    return value;
+  }
+};
+
 // ----------------------------------------------------------------------
 /*!
  * \brief Object stored in the cache (returned by getContent)
@@ -63,6 +187,22 @@ struct CacheReportingObject
   std::size_t itsSize = 0;
 };
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief Entry summary passed to Cache::visit, the value is shared and not copied
+ */
+// ----------------------------------------------------------------------
+
+template <class KeyType, class ValueType>
+struct CacheEntryInfo
+{
+  KeyType key;
+  std::shared_ptr<const ValueType> value;
+  std::size_t size = 0;
+  std::size_t hits = 0;
+  std::size_t shard = 0;
+};
+
 // ----------------------------------------------------------------------
 /*!
  * \brief LRU cache with cache striping to reduce lock contention
@@ -73,344 +213,1811 @@ struct CacheReportingObject
  * pure-read operations such as statistics() and size() can run concurrently
  * with in-progress finds.  insert(), upsert(), clear() and resize() take a
  * full exclusive lock on the affected shard.
+ *
+ * The replacement policy is pluggable, see CachePolicy.h. LRUPolicy is the
+ * default, TinyLFUPolicy protects the working set against scans and
+ * ClockPolicy serves hits under a shared lock only.
+ *
+ * Entries may be given a time-to-live, either per insert or through a
+ * default TTL for the whole cache. Expired entries are never returned by
+ * find(). They are reclaimed lazily by find() and insert(), and by
+ * expire(), which pops only the expired items off a per-shard deadline
+ * heap. startExpirySweeper() calls expire() periodically in a background
+ * thread. Misses may be cached too with insertNegative(), so that
+ * repeated failing requests can be answered without hitting the backend.
+ *
+ * With enableRefresh() entries also have a soft deadline. A hit after it
+ * still returns the stale value, but schedules one refresh of the key on
+ * the given thread pool. After the hard deadline (the TTL) the entry is a
+ * miss as usual.
+ *
+ * getOrCompute() coalesces concurrent misses of the same key: only one
+ * caller runs the factory while the others wait for its result. The
+ * table of computations in flight is sharded like the entries.
+ *
+ * findMany(), insertMany() and upsertMany() process a batch of keys with
+ * one lock acquisition per shard instead of one per key.
+ *
+ * Values are stored as shared pointers to const values. findHandle()
+ * returns the pointer itself, which stays valid even if the entry is
+ * evicted, and find() copies the value only after releasing the lock.
+ *
+ * save() and load() write and read a snapshot of the contents so that a
+ * restarted process does not begin with a cold cache.
+ *
+ * find() and findHandle() accept also other key types which compare equal
+ * to the key type and hash equally with CacheKeyHash, for example
+ * std::string_view for std::string keys, and a hash precomputed with
+ * hashKey(), which is then used for both the shard and the bucket.
+ *
+ * visit() walks the contents one shard at a time in chunks, holding the
+ * shard lock only while a chunk of entry summaries is collected, so that
+ * large caches can be reported without stalling lookups. visitSampled()
+ * reports a stable pseudo-random fraction of the keys. getContent() and
+ * getTextContent() copy everything under the locks.
+ *
+ * enableNearCache() puts a tiny direct-mapped cache of value handles in
+ * front of the shards in each thread, so that the hottest keys are found
+ * without touching the shard locks or hit counters. Each shard has a
+ * generation number bumped whenever an entry is removed from it, be it
+ * by an upsert, erase, eviction, expiration or clear(), and a cached
+ * handle is used only if its shard generation has not changed. Near hits
+ * are reported separately as "near_hits", they do not update the LRU
+ * order or the entry hit counts.
+ * Each thread holds at most NearCacheTables * NearCacheSlots handles per
+ * cache type. The handles of a destroyed cache are released the next time
+ * the thread uses a near cache of the same type, or when it exits.
+ *
+ * enableMissRatioCurve() starts tracking sampled reuse distances of the
+ * looked up keys, and missRatioCurve() then estimates the hit ratio the
+ * cache would have at other sizes, assuming LRU replacement. See
+ * CacheMissRatio.h.
+ *
+ * detailedStatistics() reports sizes and hit ratios per shard. With
+ * ShardInstrumentation as the Instrumentation parameter it also reports
+ * lock wait histograms, upgrade counts and the hottest keys, see
+ * CacheInstrumentation.h.
  */
 // ----------------------------------------------------------------------
 
 template <class KeyType,
           class ValueType,
           class SizeFunc = TrivialSizeFunction<ValueType>,
-          std::size_t NumShards = 16>
+          std::size_t NumShards = 16,
+          class Policy = LRUPolicy,
+          class Instrumentation = NoInstrumentation>
 class Cache
 {
  public:
   using CacheReportingObjectType = CacheReportingObject<KeyType, ValueType>;
   using ItemVector = std::vector<std::pair<KeyType, ValueType>>;
+  using ValueHandle = std::shared_ptr<const ValueType>;
+  using Clock = std::chrono::steady_clock;
+  using Duration = Clock::duration;
+  using TimePoint = Clock::time_point;
+  using DetailedStats = CacheDetailedStats<KeyType>;
+  using EntryInfo = CacheEntryInfo<KeyType, ValueType>;
+
+  // Key types usable in lookups in addition to KeyType
+  template <class K>
+  static constexpr bool IsLookupKey = IsCacheLookupKey<KeyType, K>::value;
+
+  static constexpr std::size_t DefaultVisitChunk = 256;
+
+  // Near cache slots per thread, and the number of caches a thread can use at once
+  static constexpr std::size_t NearCacheSlots = 32;
+  static constexpr std::size_t NearCacheTables = 4;
+
+  // Default constructor eases the use as data member
+  Cache() : Cache(0) {}
+
+  Cache(const Cache& other) = delete;
+  Cache(Cache&& other) = delete;
+  Cache& operator=(const Cache& other) = delete;
+  Cache& operator=(Cache&& other) = delete;
+
+  explicit Cache(std::size_t maxSize)
+      : itsMaxSizePerShard((maxSize + NumShards - 1) / NumShards)
+  {
+    static_assert(NumShards > 0, "NumShards must be greater than 0");
+    for (auto& shard : itsShards)
+      shard.policy.reset(itsMaxSizePerShard);
+  }
+
+  // A zero default TTL means entries do not expire unless given a TTL on insert
+  Cache(std::size_t maxSize, Duration defaultTTL) : Cache(maxSize) { itsDefaultTTL = defaultTTL; }
+
+  ~Cache()
+  {
+    // Threads release their near copies of our values once they notice
+    if (itsNearCacheId != 0)
+    {
+      itsNearCacheToken.reset();
+      nearCacheRetirements().fetch_add(1, std::memory_order_release);
+    }
+
+    // Queued refreshes must not touch a destroyed cache, running ones are waited for
+    if (itsRefreshControl)
+    {
+      boost::unique_lock<boost::shared_mutex> lock(itsRefreshControl->mutex);
+      itsRefreshControl->cache = nullptr;
+    }
+  }
+
+  void setDefaultTTL(Duration defaultTTL) { itsDefaultTTL = defaultTTL; }
+
+  Duration defaultTTL() const { return itsDefaultTTL; }
+
+  // Enable the per-thread near cache. Call before the cache is shared by threads.
+  void enableNearCache()
+  {
+    static std::atomic<std::uint64_t> nextId{1};
+    if (itsNearCacheId == 0)
+    {
+      itsNearCacheId = nextId.fetch_add(1);
+      itsNearCacheToken = std::make_shared<char>(0);
+    }
+  }
+
+  bool nearCacheEnabled() const { return itsNearCacheId != 0; }
+
+  // Start estimating the miss ratio curve. Call before the cache is shared by threads.
+  void enableMissRatioCurve(double samplingRate = 0.01, std::size_t maxTrackedKeys = 100000)
+  {
+    itsReuseTracker = std::make_unique<ReuseDistanceTracker>(samplingRate, maxTrackedKeys);
+  }
+
+  // ----------------------------------------------------------------------
+  /*!
+   * \brief Estimate the hit ratio at the given multiples of the maximum size
+   *
+   * Sizes are converted to entries using the current average entry size.
+   * Returns no points unless enableMissRatioCurve() has been called.
+   */
+  // ----------------------------------------------------------------------
+  MissRatioCurve missRatioCurve(const std::vector<double>& factors = {0.25, 0.5, 1, 2, 4}) const
+  {
+    MissRatioCurve curve;
+    if (!itsReuseTracker)
+      return curve;
+
+    std::size_t totalSize = 0;
+    std::size_t entries = 0;
+    for (const auto& shard : itsShards)
+    {
+      boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+      totalSize += shard.size;
+      entries += shard.map.size();
+    }
+    const double entrySize = (entries > 0 ? static_cast<double>(totalSize) / entries : 1.0);
+
+    curve.samplingRate = itsReuseTracker->samplingRate();
+    curve.sampledLookups = itsReuseTracker->sampledLookups();
+    curve.trackedKeys = itsReuseTracker->trackedKeys();
+    for (double factor : factors)
+    {
+      MissRatioPoint point;
+      point.size = static_cast<std::size_t>(factor * maxSize());
+      point.entries = point.size / entrySize;
+      point.hitRatio = itsReuseTracker->hitRatio(point.entries);
+      curve.points.push_back(point);
+    }
+    return curve;
+  }
+
+  // ----------------------------------------------------------------------
+  /*!
+   * \brief Enable stale-while-revalidate refreshes
+   *
+   * Entries inserted from now on become stale after softTTL and expire after
+   * hardTTL, which replaces the default TTL. A hit on a stale entry schedules
+   * refresher(key) on the pool, at most once per key at a time, and upserts
+   * the result. If the refresher throws, or the pool rejects the task, the
+   * entry stays stale and the next hit tries again. Both count as failures,
+   * an exception from the pool is counted separately as a schedule error.
+   * The pool is typically a Fmi::ThreadPool::ThreadPool, anything with
+   * bool schedule(const std::function<void()>&) will do. The pool must be
+   * shut down before it is destroyed, the cache may go first.
+   */
+  // ----------------------------------------------------------------------
+  template <typename Pool>
+  void enableRefresh(Pool& pool,
+                     std::function<ValueType(const KeyType&)> refresher,
+                     Duration softTTL,
+                     Duration hardTTL)
+  {
+    if (itsRefreshControl)
+      throw Fmi::Exception(BCP, "Cache refreshes have already been enabled");
+    if (softTTL <= Duration::zero() || hardTTL < softTTL)
+      throw Fmi::Exception(BCP, "Cache refresh needs 0 < soft TTL <= hard TTL");
+
+    auto control = std::make_shared<RefreshControl>();
+    control->cache = this;
+    control->refresher = std::move(refresher);
+    control->schedule = [&pool](const std::function<void()>& task) { return pool.schedule(task); };
+    itsRefreshControl = std::move(control);
+    itsSoftTTL = softTTL;
+    itsDefaultTTL = hardTTL;
+  }
+
+  // ----------------------------------------------------------------------
+  /*!
+   * \brief Get cache statistics (shared lock per shard, non-blocking for finds)
+   */
+  // ----------------------------------------------------------------------
+  CacheStats statistics() const
+  {
+    CacheStats stats(itsStartTime);
+    stats.maxsize = itsMaxSizePerShard * NumShards;
+    for (const auto& shard : itsShards)
+    {
+      boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+      stats.size += shard.size;
+      stats.inserts += shard.insertCount;
+      stats.evictions += shard.evictionCount;
+      stats.hits += shard.hitCount.load(std::memory_order_relaxed);
+      stats.misses += shard.missCount.load(std::memory_order_relaxed);
+      stats.counters["expirations"] += shard.expirationCount;
+      stats.counters["negative_hits"] += shard.negativeHitCount.load(std::memory_order_relaxed);
+      stats.counters["coalesced_waits"] += shard.coalescedCount;
+      shard.policy.report(stats);
+    }
+    if (itsNearCacheId != 0)
+    {
+      std::size_t nearHits = 0;
+      for (const auto& counter : itsNearHits)
+        nearHits += counter.value.load(std::memory_order_relaxed);
+      stats.counters["near_hits"] = nearHits;
+    }
+    if (itsRefreshControl)
+    {
+      stats.counters["stale_hits"] = itsStaleHits.load(std::memory_order_relaxed);
+      stats.counters["refreshes"] = itsRefreshes.load(std::memory_order_relaxed);
+      stats.counters["refresh_failures"] = itsRefreshFailures.load(std::memory_order_relaxed);
+      stats.counters["refresh_schedule_errors"] =
+          itsRefreshScheduleErrors.load(std::memory_order_relaxed);
+    }
+    return stats;
+  }
+
+  // ----------------------------------------------------------------------
+  /*!
+   * \brief Get statistics per shard, and instrumentation results if enabled
+   */
+  // ----------------------------------------------------------------------
+  DetailedStats detailedStatistics() const
+  {
+    DetailedStats stats;
+    stats.totals = statistics();
+    stats.instrumented = Instrumentation::Enabled;
+    stats.shards.resize(NumShards);
+    for (std::size_t s = 0; s < NumShards; s++)
+    {
+      const auto& shard = itsShards[s];
+      auto& result = stats.shards[s];
+      boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+      result.size = shard.size;
+      result.maxsize = itsMaxSizePerShard;
+      result.inserts = shard.insertCount;
+      result.evictions = shard.evictionCount;
+      result.hits = shard.hitCount.load(std::memory_order_relaxed);
+      result.misses = shard.missCount.load(std::memory_order_relaxed);
+      shard.instrumentation.report(result);
+      shard.instrumentation.hotKeys(stats.hotkeys);
+    }
+    std::sort(stats.hotkeys.begin(),
+              stats.hotkeys.end(),
+              [](const auto& a, const auto& b) { return a.count > b.count; });
+    return stats;
+  }
+
+  // Insert value; returns false if key already present or value exceeds shard capacity.
+  // An admission filtering policy may evict the new entry immediately.
+  bool insert(const KeyType& key, const ValueType& value)
+  {
+    return insertEntry(key, value, itsDefaultTTL, false, nullptr);
+  }
+
+  // Insert value which expires after the given time, zero means never
+  bool insert(const KeyType& key, const ValueType& value, Duration ttl)
+  {
+    return insertEntry(key, value, ttl, false, nullptr);
+  }
+
+  // Insert value; fills evictedItems with any entries that were displaced
+  bool insert(const KeyType& key, const ValueType& value, ItemVector& evictedItems)
+  {
+    evictedItems.clear();
+    return insertEntry(key, value, itsDefaultTTL, false, &evictedItems);
+  }
+
+  // Upsert: insert or replace existing entry. Always counts as an insert.
+  // Returns false only if value exceeds shard capacity.
+  bool upsert(const KeyType& key, const ValueType& value)
+  {
+    return insertEntry(key, value, itsDefaultTTL, true, nullptr);
+  }
+
+  bool upsert(const KeyType& key, const ValueType& value, Duration ttl)
+  {
+    return insertEntry(key, value, ttl, true, nullptr);
+  }
+
+  // ----------------------------------------------------------------------
+  /*!
+   * \brief Find several values, locking each shard only once
+   *
+   * results must have room for count values. Returns the number of hits.
+   */
+  // ----------------------------------------------------------------------
+  std::size_t findMany(const KeyType* keys, std::size_t count, std::optional<ValueType>* results)
+  {
+    ShardGroups groups;
+    groupByShard(
+        count, [keys](std::size_t i) -> const KeyType& { return keys[i]; }, groups);
+    if (itsReuseTracker)
+      for (std::size_t i = 0; i < count; i++)
+        itsReuseTracker->access(groups.hashes[i]);
+
+    // Values are copied to the results only after releasing the locks
+    std::vector<ValueHandle> handles(count);
+
+    std::size_t totalHits = 0;
+    std::vector<std::size_t> pending;
+    for (std::size_t s = 0; s < NumShards; s++)
+    {
+      const std::size_t first = groups.offsets[s];
+      const std::size_t last = groups.offsets[s + 1];
+      if (first == last)
+        continue;
+
+      auto& shard = itsShards[s];
+      std::size_t hits = 0;
+      std::size_t misses = 0;
+
+      if constexpr (Policy::SharedHits)
+      {
+        auto lock = lockShard<boost::shared_lock<boost::shared_mutex>>(shard);
+        for (std::size_t j = first; j < last; j++)
+        {
+          const std::size_t i = groups.order[j];
+          shard.policy.recordAccess(groups.hashes[i]);
+          shard.instrumentation.recordAccess(keys[i]);
+          auto mapIt = shard.map.find(lookupKey(keys[i], groups.hashes[i]));
+          if (mapIt == shard.map.end() || isExpired(*mapIt->second))
+          {
+            ++misses;
+            continue;
+          }
+          shard.policy.touchShared(mapIt->second);
+          mapIt->second->hits.fetch_add(1, std::memory_order_relaxed);
+          refreshIfStale(*mapIt->second);
+          handles[i] = mapIt->second->value;
+          ++hits;
+        }
+      }
+      else
+      {
+        auto lock = lockShard<boost::upgrade_lock<boost::shared_mutex>>(shard);
+        pending.clear();
+        for (std::size_t j = first; j < last; j++)
+        {
+          const std::size_t i = groups.order[j];
+          shard.policy.recordAccess(groups.hashes[i]);
+          shard.instrumentation.recordAccess(keys[i]);
+          auto mapIt = shard.map.find(lookupKey(keys[i], groups.hashes[i]));
+          if (mapIt == shard.map.end())
+            ++misses;
+          else if (isExpired(*mapIt->second) || !shard.policy.touchShared(mapIt->second))
+            pending.push_back(i);
+          else
+          {
+            mapIt->second->hits.fetch_add(1, std::memory_order_relaxed);
+            refreshIfStale(*mapIt->second);
+            handles[i] = mapIt->second->value;
+            ++hits;
+          }
+        }
+
+        // Reordering and removal of expired entries need the exclusive lock. The
+        // keys are searched again since duplicate keys may have removed the entry.
+        if (!pending.empty())
+        {
+          const TimePoint start = lockWaitStart();
+          boost::upgrade_to_unique_lock<boost::shared_mutex> wlock(lock);
+          lockWaitEnd(shard, start);
+          shard.instrumentation.recordUpgrade();
+          for (const std::size_t i : pending)
+          {
+            auto mapIt = shard.map.find(lookupKey(keys[i], groups.hashes[i]));
+            if (mapIt != shard.map.end() && isExpired(*mapIt->second))
+            {
+              removeEntry(shard, mapIt);
+              ++shard.expirationCount;
+              mapIt = shard.map.end();
+            }
+            if (mapIt == shard.map.end())
+            {
+              ++misses;
+              continue;
+            }
+            shard.policy.touch(mapIt->second);
+            mapIt->second->hits.fetch_add(1, std::memory_order_relaxed);
+            refreshIfStale(*mapIt->second);
+            handles[i] = mapIt->second->value;
+            ++hits;
+          }
+        }
+      }
+
+      shard.hitCount.fetch_add(hits, std::memory_order_relaxed);
+      shard.missCount.fetch_add(misses, std::memory_order_relaxed);
+      totalHits += hits;
+    }
+
+    for (std::size_t i = 0; i < count; i++)
+    {
+      if (handles[i])
+        results[i] = *handles[i];
+      else
+        results[i].reset();
+    }
+    return totalHits;
+  }
+
+  std::vector<std::optional<ValueType>> findMany(const std::vector<KeyType>& keys)
+  {
+    std::vector<std::optional<ValueType>> results(keys.size());
+    findMany(keys.data(), keys.size(), results.data());
+    return results;
+  }
+
+  // Insert several values locking each shard only once, returns the number of inserted values
+  std::size_t insertMany(const std::pair<KeyType, ValueType>* items, std::size_t count)
+  {
+    return insertManyEntries(items, count, false);
+  }
+
+  std::size_t insertMany(const ItemVector& items)
+  {
+    return insertManyEntries(items.data(), items.size(), false);
+  }
+
+  std::size_t upsertMany(const std::pair<KeyType, ValueType>* items, std::size_t count)
+  {
+    return insertManyEntries(items, count, true);
+  }
+
+  std::size_t upsertMany(const ItemVector& items)
+  {
+    return insertManyEntries(items.data(), items.size(), true);
+  }
+
+  // ----------------------------------------------------------------------
+  /*!
+   * \brief Find the value, or compute and insert it on a miss
+   *
+   * Only one caller runs the factory for a given key at a time, others
+   * wait for the same result. Exceptions thrown by the factory are passed
+   * to all waiting callers and nothing is cached. A nonzero timeout limits
+   * the time spent waiting for another caller's computation. The factory
+   * must not request the same key recursively.
+   */
+  // ----------------------------------------------------------------------
+  template <typename Factory>
+  ValueType getOrCompute(const KeyType& key,
+                         Factory&& factory,
+                         Duration timeout = Duration::zero())
+  {
+    if (auto value = find(key))
+      return *value;
+
+    const std::size_t hash = getHash(key);
+    auto& shard = itsShards[getShardIndexByHash(hash)];
+    std::promise<ValueType> promise;
+
+    {
+      boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
+
+      // Somebody may have completed the computation after our find
+      auto mapIt = shard.map.find(lookupKey(key, hash));
+      if (mapIt != shard.map.end() && !isExpired(*mapIt->second))
+      {
+        ValueHandle handle = mapIt->second->value;
+        lock.unlock();
+        return *handle;
+      }
+
+      auto inflightIt = shard.inflight.find(key);
+      if (inflightIt != shard.inflight.end())
+      {
+        auto future = inflightIt->second;
+        ++shard.coalescedCount;
+        lock.unlock();
+
+        if (timeout > Duration::zero() &&
+            future.wait_for(timeout) != std::future_status::ready)
+          throw Fmi::Exception(BCP, "Timed out waiting for a cached value to be computed");
+        return future.get();
+      }
+
+      shard.inflight.emplace(key, promise.get_future().share());
+    }
+
+    try
+    {
+      ValueHandle handle = std::make_shared<const ValueType>(factory());
+      {
+        boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
+        insertLocked(shard, hash, key, handle, itsDefaultTTL, false, nullptr);
+        shard.inflight.erase(key);
+      }
+      promise.set_value(*handle);
+      return *handle;
+    }
+    catch (...)
+    {
+      {
+        boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
+        shard.inflight.erase(key);
+      }
+      promise.set_exception(std::current_exception());
+      throw;
+    }
+  }
+
+  // Remember for the given time that the key has no value (or producing it failed).
+  // Negative entries do not count towards the cache size and are replaced by inserts.
+  void insertNegative(const KeyType& key, Duration ttl)
+  {
+    const std::size_t hash = getHash(key);
+    auto& shard = itsShards[getShardIndexByHash(hash)];
+    boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
+
+    const TimePoint now = Clock::now();
+    expire(shard, now);
+
+    const TimePoint expires = now + ttl;
+    shard.negatives[key] = expires;
+    shard.expiryQueue.push(Expiry{expires, key, true});
+  }
+
+  // Returns true if the key has been marked missing with insertNegative and has not expired
+  bool findNegative(const KeyType& key) const
+  {
+    const std::size_t hash = getHash(key);
+    const auto& shard = itsShards[getShardIndexByHash(hash)];
+    boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+
+    if (shard.negatives.empty())
+      return false;
+
+    auto it = shard.negatives.find(key);
+    if (it == shard.negatives.end() || it->second <= Clock::now())
+      return false;
+
+    shard.negativeHitCount.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Remove all expired entries, returns the number of removed entries
+  std::size_t expire()
+  {
+    std::size_t count = 0;
+    const TimePoint now = Clock::now();
+    for (auto& shard : itsShards)
+    {
+      boost::upgrade_lock<boost::shared_mutex> lock(shard.mutex);
+      if (shard.expiryQueue.empty() || shard.expiryQueue.top().expires > now)
+        continue;
+      boost::upgrade_to_unique_lock<boost::shared_mutex> wlock(lock);
+      count += expire(shard, now);
+    }
+    return count;
+  }
+
+  // Call expire() periodically in a background thread until the cache is destroyed
+  void startExpirySweeper(Duration interval)
+  {
+    const auto ms = std::max<std::int64_t>(
+        1, std::chrono::duration_cast<std::chrono::milliseconds>(interval).count());
+    itsExpirySweeper = std::make_unique<Fmi::AsyncTask>(
+        "upd-cache-exp",
+        [this, ms]()
+        {
+          while (true)
+          {
+            boost::this_thread::sleep_for(boost::chrono::milliseconds(ms));
+            expire();
+          }
+        });
+  }
+
+  // ----------------------------------------------------------------------
+  /*!
+   * \brief Save the contents to a file
+   *
+   * Each shard is written as a section of records in replacement order
+   * (least recently used first for LRU) with the hit counts and remaining
+   * time to live. Only the keys and value handles of one shard are held in
+   * memory at a time, and shards are locked only while collecting them.
+   * The file is written under a temporary name, synced to disk and renamed
+   * into place, and the temporary file is removed if writing fails.
+   * The serializer provides writeKey(ostream&, key) and
+   * writeValue(ostream&, value), see BinarySerializer.
+   */
+  // ----------------------------------------------------------------------
+  template <typename Serializer>
+  void save(const std::filesystem::path& path, const Serializer& serializer) const
+  {
+    std::filesystem::path tmpPath = path;
+    tmpPath += ".tmp";
+
+    try
+    {
+      writeSnapshot(tmpPath, serializer);
+      if (!syncPath(tmpPath))
+        throw Fmi::Exception(BCP, "Failed to sync cache snapshot")
+            .addParameter("Path", tmpPath.string());
+    }
+    catch (...)
+    {
+      std::error_code ignored;
+      std::filesystem::remove(tmpPath, ignored);
+      throw;
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, path, ec);
+    if (ec)
+    {
+      std::filesystem::remove(tmpPath, ec);
+      throw Fmi::Exception(BCP, "Failed to rename cache snapshot")
+          .addParameter("Path", path.string())
+          .addParameter("Error", ec.message());
+    }
+
+    // Make the rename itself durable. Not all file systems support syncing
+    // directories, the snapshot is complete regardless.
+    const auto directory = path.parent_path();
+    syncPath(directory.empty() ? std::filesystem::path(".") : directory);
+  }
+
+  // ----------------------------------------------------------------------
+  /*!
+   * \brief Load a snapshot written by save()
+   *
+   * Sections are read in parallel threads and inserted in the saved order,
+   * restoring the replacement order and hit counts. Existing entries are
+   * kept. Time spent between saving and loading counts against the TTLs.
+   * If a section holds more than fits in a shard of the same layout, its
+   * least recently used records are skipped without deserializing them.
+   * The serializer provides readKey(istream&) and readValue(istream&).
+   * Returns the number of inserted entries.
+   */
+  // ----------------------------------------------------------------------
+  template <typename Serializer>
+  std::size_t load(const std::filesystem::path& path, const Serializer& serializer)
+  {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+      throw Fmi::Exception(BCP, "Failed to open cache snapshot").addParameter("Path", path.string());
+
+    char magic[sizeof(SnapshotMagic)];
+    in.read(magic, sizeof(magic));
+    const auto version = readPod<std::uint32_t>(in);
+    const auto numSections = readPod<std::uint32_t>(in);
+    const auto savedAt = readPod<std::int64_t>(in);
+    if (!in || std::string(magic, sizeof(magic)) != std::string(SnapshotMagic, sizeof(magic)) ||
+        version != SnapshotVersion)
+      throw Fmi::Exception(BCP, "Not a cache snapshot").addParameter("Path", path.string());
+
+    // Validate the count before allocating the table for it
+    std::error_code ec;
+    const auto fileSize = std::filesystem::file_size(path, ec);
+    if (numSections == 0 || numSections > std::max<std::size_t>(MaxSnapshotSections, NumShards) ||
+        ec || numSections * sizeof(SnapshotSection) > fileSize)
+      throw Fmi::Exception(BCP, "Corrupt cache snapshot section count")
+          .addParameter("Path", path.string())
+          .addParameter("Sections", std::to_string(numSections));
+
+    std::vector<SnapshotSection> sections(numSections);
+    in.read(reinterpret_cast<char*>(sections.data()), sections.size() * sizeof(SnapshotSection));
+    if (!in)
+      throw Fmi::Exception(BCP, "Truncated cache snapshot").addParameter("Path", path.string());
+    in.close();
+
+    const auto age = std::chrono::duration_cast<Duration>(
+        std::chrono::system_clock::now().time_since_epoch() - std::chrono::nanoseconds(savedAt));
+
+    // Trimming sections to the shard size is valid only if they map to the same shards
+    const bool sameLayout = (numSections == NumShards);
+
+    std::atomic<std::size_t> nextSection{0};
+    std::atomic<std::size_t> loaded{0};
+    std::vector<std::exception_ptr> errors(numSections);
+    auto worker = [&]()
+    {
+      for (std::size_t s = nextSection++; s < numSections; s = nextSection++)
+      {
+        try
+        {
+          loaded += loadSection(path, fileSize, sections[s], age, sameLayout, serializer);
+        }
+        catch (...)
+        {
+          errors[s] = std::current_exception();
+        }
+      }
+    };
+
+    const std::size_t nthreads = std::max<std::size_t>(
+        1, std::min<std::size_t>(numSections, std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    try
+    {
+      for (std::size_t n = 1; n < nthreads; n++)
+      {
+        threads.emplace_back(
+            [&worker, n]()
+            {
+              Fmi::set_thread_name("ini-cache-" + std::to_string(n));
+              worker();
+            });
+      }
+    }
+    catch (...)
+    {
+      // Fewer threads will do, the started ones must still be joined
+    }
+    worker();  // in the calling thread, which keeps its name
+    for (auto& thread : threads)
+      thread.join();
+
+    for (const auto& error : errors)
+      if (error)
+        std::rethrow_exception(error);
+
+    return loaded;
+  }
+
+  // Find value; returns empty optional on miss. When the hit needs no
+  // reordering (e.g. the entry is already the most-recently-used element)
+  // no exclusive lock is needed — only the shared (upgrade) lock is held.
+  // This matters when the same key is looked up repeatedly (e.g. 1000
+  // Finnish stations all in Europe/Helsinki): only the first hit splices
+  // the LRU list; the rest stay in shared mode.
+  std::optional<ValueType> find(const KeyType& key)
+  {
+    ValueHandle handle = findNear(key, getHash(key));
+    if (!handle)
+      return {};
+    return *handle;
+  }
+
+  // Find value and also return its hit count
+  std::optional<ValueType> find(const KeyType& key, std::size_t& hits)
+  {
+    ValueHandle handle = findHashed(key, getHash(key), hits);
+    if (!handle)
+      return {};
+    return *handle;
+  }
+
+  // Find value without copying it; returns an empty pointer on miss. The
+  // value remains valid as long as the handle exists, even if evicted.
+  ValueHandle findHandle(const KeyType& key) { return findNear(key, getHash(key)); }
+
+  ValueHandle findHandle(const KeyType& key, std::size_t& hits)
+  {
+    return findHashed(key, getHash(key), hits);
+  }
+
+  // Find with a key of another type without constructing a KeyType
+  template <class K, typename = std::enable_if_t<IsLookupKey<K>>>
+  std::optional<ValueType> find(const K& key)
+  {
+    return find(key, hashKey(key));
+  }
+
+  template <class K, typename = std::enable_if_t<IsLookupKey<K>>>
+  ValueHandle findHandle(const K& key)
+  {
+    return findHandle(key, hashKey(key));
+  }
+
+  // Find with a hash computed earlier with hashKey()
+  template <class K, typename = std::enable_if_t<IsLookupKey<K> || std::is_same_v<K, KeyType>>>
+  std::optional<ValueType> find(const K& key, const Fmi::HashValue& hash)
+  {
+    ValueHandle handle = findHandle(key, hash);
+    if (!handle)
+      return {};
+    return *handle;
+  }
+
+  template <class K, typename = std::enable_if_t<IsLookupKey<K> || std::is_same_v<K, KeyType>>>
+  ValueHandle findHandle(const K& key, const Fmi::HashValue& hash)
+  {
+    return findNear(key, hash.value);
+  }
+
+  // The hash used by the cache for a key or an equivalent lookup key
+  template <class K>
+  static Fmi::HashValue hashKey(const K& key)
+  {
+    return Fmi::HashValue(getHash(key));
+  }
+
+  void clear()
+  {
+    for (auto& shard : itsShards)
+    {
+      boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
+      shard.generation.value.fetch_add(1, std::memory_order_release);
+      shard.policy.clear();
+      shard.map.clear();
+      shard.negatives.clear();
+      shard.expiryQueue = ExpiryQueue();
+      shard.size = 0;
+    }
+  }
+
+  void resize(std::size_t newMaxSize)
+  {
+    itsMaxSizePerShard = (newMaxSize + NumShards - 1) / NumShards;
+    for (auto& shard : itsShards)
+    {
+      boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
+      shard.generation.value.fetch_add(1, std::memory_order_release);
+      shard.policy.reset(itsMaxSizePerShard);
+      evict(shard, nullptr);
+    }
+  }
+
+  void resize(std::size_t newMaxSize, ItemVector& evictedItems)
+  {
+    evictedItems.clear();
+    itsMaxSizePerShard = (newMaxSize + NumShards - 1) / NumShards;
+    for (auto& shard : itsShards)
+    {
+      boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
+      shard.generation.value.fetch_add(1, std::memory_order_release);
+      shard.policy.reset(itsMaxSizePerShard);
+      evict(shard, &evictedItems);
+    }
+  }
+
+  std::size_t size() const
+  {
+    std::size_t total = 0;
+    for (const auto& shard : itsShards)
+    {
+      boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+      total += shard.size;
+    }
+    return total;
+  }
+
+  std::size_t maxSize() const { return itsMaxSizePerShard * NumShards; }
+
+  // Call visitor(const EntryInfo&) for every valid entry. The visitor may
+  // return false to stop. The shard lock is released between chunks of
+  // chunkSize entries and while the visitor runs, hence entries modified
+  // during the walk may or may not be reported, and if a shard grows
+  // meanwhile some entries may be reported twice or skipped.
+  template <typename Visitor>
+  std::size_t visit(Visitor&& visitor, std::size_t chunkSize = DefaultVisitChunk) const
+  {
+    return visitEntries(visitor, 1.0, chunkSize);
+  }
+
+  // As visit(), but only for the given fraction of the keys. The sample is
+  // selected by the key hash and is therefore the same on every call.
+  template <typename Visitor>
+  std::size_t visitSampled(Visitor&& visitor,
+                           double fraction,
+                           std::size_t chunkSize = DefaultVisitChunk) const
+  {
+    return visitEntries(visitor, fraction, chunkSize);
+  }
+
+  std::list<CacheReportingObjectType> getContent() const
+  {
+    std::list<CacheReportingObjectType> result;
+    for (const auto& shard : itsShards)
+    {
+      boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+      shard.policy.forEach([&result](const Entry& entry)
+                           { result.emplace_back(entry.key, *entry.value, entry.hits, entry.size); });
+    }
+    return result;
+  }
+
+  std::string getTextContent() const
+  {
+    std::stringstream output;
+    bool first = true;
+    for (const auto& shard : itsShards)
+    {
+      boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+      shard.policy.forEach(
+          [&output, &first](const Entry& entry)
+          {
+            if (!first)
+              output << ',';
+            first = false;
+            output << *entry.value;
+          });
+    }
+    return output.str();
+  }
+
+ private:
+  struct Entry
+  {
+    Entry(KeyType k, ValueHandle v, std::size_t s, std::size_t h, TimePoint e)
+        : key(std::move(k)), value(std::move(v)), size(s), hash(h), expires(e)
+    {
+    }
+
+    KeyType key;
+    ValueHandle value;
+    std::atomic<std::size_t> hits{0};
+    std::size_t size = 0;
+    std::size_t hash = 0;
+    TimePoint expires = TimePoint::max();
+    TimePoint stale = TimePoint::max();  // soft deadline with refreshes enabled
+    std::atomic<bool> refreshing{false};
+    typename Policy::EntryData policy;
+  };
+
+  // Shared with the scheduled refresh tasks, which may outlive the cache
+  struct RefreshControl
+  {
+    boost::shared_mutex mutex;  // held shared while a refresh runs
+    Cache* cache = nullptr;     // reset by the destructor
+    std::function<ValueType(const KeyType&)> refresher;
+    std::function<bool(const std::function<void()>&)> schedule;
+  };
+
+  using ListType = std::list<Entry>;
+
+  // The shard maps refer to the key stored in the entry and carry its hash,
+  // so that keys are stored once and hashed once per operation. A lookup
+  // key of another type than KeyType carries a comparison function.
+  struct MapKey
+  {
+    const void* key = nullptr;
+    std::size_t hash = 0;
+    bool (*equals)(const void* key, const KeyType& other) = nullptr;
+  };
+
+  struct MapKeyHash
+  {
+    std::size_t operator()(const MapKey& key) const { return key.hash; }
+  };
+
+  struct MapKeyEqual
+  {
+    bool operator()(const MapKey& a, const MapKey& b) const
+    {
+      if (a.hash != b.hash)
+        return false;
+      if (a.equals)
+        return a.equals(a.key, *static_cast<const KeyType*>(b.key));
+      if (b.equals)
+        return b.equals(b.key, *static_cast<const KeyType*>(a.key));
+      return *static_cast<const KeyType*>(a.key) == *static_cast<const KeyType*>(b.key);
+    }
+  };
+
+  using MapType =
+      std::unordered_map<MapKey, typename ListType::iterator, MapKeyHash, MapKeyEqual>;
+
+  static MapKey lookupKey(const KeyType& key, std::size_t hash) { return MapKey{&key, hash}; }
+
+  template <class K>
+  static MapKey lookupKey(const K& key, std::size_t hash)
+  {
+    return MapKey{&key,
+                  hash,
+                  [](const void* k, const KeyType& other) -> bool
+                  { return *static_cast<const K*>(k) == other; }};
+  }
+
+  // Deadline of an entry or a negative entry. Items of replaced or removed
+  // entries are left in the heap and skipped when popped.
+  struct Expiry
+  {
+    TimePoint expires;
+    KeyType key;
+    bool negative = false;
+
+    bool operator>(const Expiry& other) const { return expires > other.expires; }
+  };
+
+  using ExpiryQueue = std::priority_queue<Expiry, std::vector<Expiry>, std::greater<Expiry>>;
+  using NegativeMap = std::unordered_map<KeyType, TimePoint, boost::hash<KeyType>>;
+  using InflightMap =
+      std::unordered_map<KeyType, std::shared_future<ValueType>, boost::hash<KeyType>>;
+
+  // Counter on a cache line of its own
+  struct alignas(64) PaddedCounter
+  {
+    std::atomic<std::uint64_t> value{0};
+  };
+
+  static constexpr std::size_t NearCounterSlots = 16;
+
+  struct Shard
+  {
+    typename Policy::template State<ListType> policy;  // owns the entries
+    MapType map;
+    ExpiryQueue expiryQueue;
+    NegativeMap negatives;
+    InflightMap inflight;  // getOrCompute calls being computed
+    typename Instrumentation::template State<KeyType> instrumentation;
+    mutable boost::shared_mutex mutex;
+    std::size_t size = 0;
+    std::size_t insertCount = 0;
+    std::size_t evictionCount = 0;
+    std::size_t expirationCount = 0;
+    std::size_t coalescedCount = 0;
+    // hit/miss updated lock-free on the miss path (no upgrade needed)
+    mutable std::atomic<std::size_t> hitCount{0};
+    mutable std::atomic<std::size_t> missCount{0};
+    mutable std::atomic<std::size_t> negativeHitCount{0};
+    PaddedCounter generation;  // invalidates near cache copies, read without the lock
+  };
+
+  struct NearSlot
+  {
+    std::optional<KeyType> key;
+    std::size_t hash = 0;
+    std::uint64_t generation = 0;
+    TimePoint expires = TimePoint::max();  // the earlier of the hard and soft deadlines
+    ValueHandle value;
+  };
+
+  struct NearTable
+  {
+    std::uint64_t owner = 0;       // id of the cache using the table
+    std::weak_ptr<char> ownerToken;  // expires when the cache is destroyed
+    std::array<NearSlot, NearCacheSlots> slots;
+  };
+
+  // Number of destroyed caches which had a near cache
+  static std::atomic<std::uint64_t>& nearCacheRetirements()
+  {
+    static std::atomic<std::uint64_t> retirements{0};
+    return retirements;
+  }
+
+  // The near cache table of the calling thread for this cache
+  NearTable& nearTable() const
+  {
+    thread_local std::array<NearTable, NearCacheTables> tables;
+    thread_local std::size_t next = 0;
+    thread_local std::uint64_t retirements = 0;
+
+    // Release the values of destroyed caches
+    const std::uint64_t retired = nearCacheRetirements().load(std::memory_order_acquire);
+    if (retired != retirements)
+    {
+      retirements = retired;
+      for (auto& table : tables)
+        if (table.owner != 0 && table.ownerToken.expired())
+          table = NearTable();
+    }
 
-  // Default constructor eases the use as data member
-  Cache() = default;
+    for (auto& table : tables)
+      if (table.owner == itsNearCacheId)
+        return table;
 
-  Cache(const Cache& other) = delete;
-  Cache(Cache&& other) = delete;
-  Cache& operator=(const Cache& other) = delete;
-  Cache& operator=(Cache&& other) = delete;
+    auto& table = tables[next++ % NearCacheTables];
+    table = NearTable();
+    table.owner = itsNearCacheId;
+    table.ownerToken = itsNearCacheToken;
+    return table;
+  }
 
-  explicit Cache(std::size_t maxSize)
-      : itsMaxSizePerShard((maxSize + NumShards - 1) / NumShards)
+  // Per-thread counter slot, threads share slots only if there are many of them
+  static std::size_t nearCounterIndex()
   {
-    static_assert(NumShards > 0, "NumShards must be greater than 0");
+    static std::atomic<std::size_t> nextIndex{0};
+    thread_local const std::size_t index = nextIndex.fetch_add(1) % NearCounterSlots;
+    return index;
   }
 
-  // ----------------------------------------------------------------------
-  /*!
-   * \brief Get cache statistics (shared lock per shard, non-blocking for finds)
-   */
-  // ----------------------------------------------------------------------
-  CacheStats statistics() const
+  static std::size_t nearSlotIndex(std::size_t hash)
   {
-    std::size_t totalSize = 0, totalInserts = 0, totalEvictions = 0;
-    std::size_t totalHits = 0, totalMisses = 0;
-    for (const auto& shard : itsShards)
+    return ((hash * 0x9E3779B97F4A7C15ULL) >> 32) % NearCacheSlots;
+  }
+
+  template <class K>
+  ValueHandle findNear(const K& key, std::size_t hash)
+  {
+    std::size_t hits = 0;
+    if (itsNearCacheId == 0)
+      return findHashed(key, hash, hits);
+
+    auto& shard = itsShards[getShardIndexByHash(hash)];
+    auto& slot = nearTable().slots[nearSlotIndex(hash)];
+    const std::uint64_t generation = shard.generation.value.load(std::memory_order_acquire);
+    if (slot.value && slot.hash == hash && slot.generation == generation &&
+        std::equal_to<>()(*slot.key, key) &&
+        (slot.expires == TimePoint::max() || slot.expires > Clock::now()))
     {
-      boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
-      totalSize += shard.size;
-      totalInserts += shard.insertCount;
-      totalEvictions += shard.evictionCount;
-      totalHits += shard.hitCount.load(std::memory_order_relaxed);
-      totalMisses += shard.missCount.load(std::memory_order_relaxed);
+      itsNearHits[nearCounterIndex()].value.fetch_add(1, std::memory_order_relaxed);
+      if (itsReuseTracker)
+        itsReuseTracker->access(hash);
+      return slot.value;
+    }
+
+    // The generation was read before the lookup, a concurrent upsert invalidates the copy
+    TimePoint deadline = TimePoint::max();
+    ValueHandle value = findHashed(key, hash, hits, &deadline);
+    if (value)
+    {
+      slot.key = KeyType(key);
+      slot.hash = hash;
+      slot.generation = generation;
+      slot.expires = deadline;
+      slot.value = value;
     }
-    return CacheStats(itsStartTime,
-                      itsMaxSizePerShard * NumShards,
-                      totalSize,
-                      totalInserts,
-                      totalHits,
-                      totalMisses,
-                      totalEvictions);
+    else if (slot.hash == hash)
+      slot.value.reset();
+    return value;
   }
 
-  // Insert value; returns false if key already present or value exceeds shard capacity
-  bool insert(const KeyType& key, const ValueType& value)
+  template <class K>
+  static std::size_t getHash(const K& key)
   {
-    auto& shard = itsShards[getShardIndex(key)];
-    boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
-
-    if (shard.map.count(key))
-      return false;
+    return CacheKeyHash<KeyType>{}(key);
+  }
 
-    std::size_t valueSize = SizeFunc::getSize(value);
-    if (valueSize > itsMaxSizePerShard)
-      return false;
+  static std::size_t getShardIndexByHash(std::size_t hash)
+  {
+    constexpr std::size_t prime = 2654435761ULL;
+    return (hash * prime) % NumShards;
+  }
 
-    shard.size += valueSize;
-    const std::size_t mapSizeBefore = shard.map.size();
-    evictLRU(shard);
-    shard.evictionCount += mapSizeBefore - shard.map.size();
+  std::size_t getShardIndex(const KeyType& key) const { return getShardIndexByHash(getHash(key)); }
 
-    shard.list.emplace_back(key, value, valueSize);
-    shard.map.emplace(key, std::prev(shard.list.end()));
-    ++shard.insertCount;
-    return true;
-  }
+  // Item indices of a batch operation ordered by shard
+  struct ShardGroups
+  {
+    std::vector<std::size_t> hashes;
+    std::vector<std::size_t> order;
+    std::array<std::size_t, NumShards + 1> offsets{};
+  };
 
-  // Insert value; fills evictedItems with any entries that were displaced
-  bool insert(const KeyType& key, const ValueType& value, ItemVector& evictedItems)
+  // Hash every key once and counting sort the items by shard
+  template <typename GetKey>
+  static void groupByShard(std::size_t count, GetKey&& getKey, ShardGroups& groups)
   {
-    evictedItems.clear();
+    groups.hashes.resize(count);
+    groups.order.resize(count);
 
-    auto& shard = itsShards[getShardIndex(key)];
-    boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
+    std::array<std::size_t, NumShards> positions{};
+    for (std::size_t i = 0; i < count; i++)
+    {
+      groups.hashes[i] = getHash(getKey(i));
+      ++positions[getShardIndexByHash(groups.hashes[i])];
+    }
 
-    if (shard.map.count(key))
-      return false;
+    groups.offsets[0] = 0;
+    for (std::size_t s = 0; s < NumShards; s++)
+    {
+      groups.offsets[s + 1] = groups.offsets[s] + positions[s];
+      positions[s] = groups.offsets[s];
+    }
 
-    std::size_t valueSize = SizeFunc::getSize(value);
-    if (valueSize > itsMaxSizePerShard)
-      return false;
+    for (std::size_t i = 0; i < count; i++)
+      groups.order[positions[getShardIndexByHash(groups.hashes[i])]++] = i;
+  }
 
-    shard.size += valueSize;
-    evictLRU(shard, evictedItems);
-    shard.evictionCount += evictedItems.size();
+  std::size_t insertManyEntries(const std::pair<KeyType, ValueType>* items,
+                                std::size_t count,
+                                bool replace)
+  {
+    ShardGroups groups;
+    groupByShard(
+        count, [items](std::size_t i) -> const KeyType& { return items[i].first; }, groups);
 
-    shard.list.emplace_back(key, value, valueSize);
-    shard.map.emplace(key, std::prev(shard.list.end()));
-    ++shard.insertCount;
-    return true;
+    std::vector<ValueHandle> handles;
+    handles.reserve(count);
+    for (std::size_t i = 0; i < count; i++)
+      handles.push_back(std::make_shared<const ValueType>(items[i].second));
+
+    std::size_t inserted = 0;
+    for (std::size_t s = 0; s < NumShards; s++)
+    {
+      const std::size_t first = groups.offsets[s];
+      const std::size_t last = groups.offsets[s + 1];
+      if (first == last)
+        continue;
+
+      auto& shard = itsShards[s];
+      auto lock = lockShard<boost::unique_lock<boost::shared_mutex>>(shard);
+      for (std::size_t j = first; j < last; j++)
+      {
+        const std::size_t i = groups.order[j];
+        if (insertLocked(shard,
+                         groups.hashes[i],
+                         items[i].first,
+                         handles[i],
+                         itsDefaultTTL,
+                         replace,
+                         nullptr))
+          ++inserted;
+      }
+    }
+    return inserted;
   }
 
-  // Upsert: insert or replace existing entry. Always counts as an insert.
-  // Returns false only if value exceeds shard capacity.
-  bool upsert(const KeyType& key, const ValueType& value)
+  // Snapshot file layout: magic, version, section count, save time (ns since
+  // epoch), a table of SnapshotSections and the sections. A record is hits,
+  // TTL in ns (0 = none), size, payload length and the serialized key and value.
+  static constexpr char SnapshotMagic[8] = {'F', 'M', 'I', 'C', 'A', 'C', 'H', 'E'};
+  static constexpr std::uint32_t SnapshotVersion = 1;
+
+  struct SnapshotSection
   {
-    auto& shard = itsShards[getShardIndex(key)];
-    boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
+    std::uint64_t offset = 0;
+    std::uint64_t count = 0;
+    std::uint64_t size = 0;  // sum of entry sizes
+  };
 
-    // Remove existing entry without counting it as an eviction
-    auto mapIt = shard.map.find(key);
-    if (mapIt != shard.map.end())
+  // Sanity limit for the section count of a snapshot made with another shard count
+  static constexpr std::uint32_t MaxSnapshotSections = 1U << 16;
+
+  // Writes the snapshot, see save()
+  template <typename Serializer>
+  void writeSnapshot(const std::filesystem::path& tmpPath, const Serializer& serializer) const
+  {
+    std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!out)
+      throw Fmi::Exception(BCP, "Failed to open cache snapshot for writing")
+          .addParameter("Path", tmpPath.string());
+
+    out.write(SnapshotMagic, sizeof(SnapshotMagic));
+    writePod(out, SnapshotVersion);
+    writePod(out, static_cast<std::uint32_t>(NumShards));
+    writePod(out, static_cast<std::int64_t>(
+                      std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::system_clock::now().time_since_epoch())
+                          .count()));
+
+    // Section table is filled in after the sections have been written
+    const auto tablePos = out.tellp();
+    std::vector<SnapshotSection> sections(NumShards);
+    out.write(reinterpret_cast<const char*>(sections.data()),
+              sections.size() * sizeof(SnapshotSection));
+
+    struct Item
     {
-      shard.size -= mapIt->second->size;
-      shard.list.erase(mapIt->second);
-      shard.map.erase(mapIt);
+      KeyType key;
+      ValueHandle value;
+      std::uint64_t hits;
+      std::uint64_t size;
+      TimePoint expires;
+    };
+
+    std::vector<Item> items;
+    std::ostringstream record;
+    for (std::size_t s = 0; s < NumShards; s++)
+    {
+      const auto& shard = itsShards[s];
+      items.clear();
+      {
+        boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+        items.reserve(shard.map.size());
+        shard.policy.forEach(
+            [&items](const Entry& entry)
+            {
+              items.push_back(
+                  Item{entry.key, entry.value, entry.hits.load(), entry.size, entry.expires});
+            });
+      }
+
+      auto& section = sections[s];
+      section.offset = out.tellp();
+      const TimePoint now = Clock::now();
+      for (const auto& item : items)
+      {
+        std::int64_t ttl = 0;
+        if (item.expires != TimePoint::max())
+        {
+          ttl = std::chrono::duration_cast<std::chrono::nanoseconds>(item.expires - now).count();
+          if (ttl <= 0)
+            continue;
+        }
+
+        record.str(std::string());
+        serializer.writeKey(record, item.key);
+        serializer.writeValue(record, *item.value);
+        const std::string bytes = record.str();
+
+        writePod(out, item.hits);
+        writePod(out, ttl);
+        writePod(out, item.size);
+        writePod(out, static_cast<std::uint64_t>(bytes.size()));
+        out.write(bytes.data(), bytes.size());
+        ++section.count;
+        section.size += item.size;
+      }
     }
 
-    std::size_t valueSize = SizeFunc::getSize(value);
-    if (valueSize > itsMaxSizePerShard)
-      return false;
+    out.seekp(tablePos);
+    out.write(reinterpret_cast<const char*>(sections.data()),
+              sections.size() * sizeof(SnapshotSection));
+    out.close();
+    if (!out)
+      throw Fmi::Exception(BCP, "Failed to write cache snapshot")
+          .addParameter("Path", tmpPath.string());
+  }
 
-    shard.size += valueSize;
-    const std::size_t mapSizeBefore = shard.map.size();
-    evictLRU(shard);
-    shard.evictionCount += mapSizeBefore - shard.map.size();
+  template <typename T>
+  static void writePod(std::ostream& out, const T& value)
+  {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
 
-    shard.list.emplace_back(key, value, valueSize);
-    shard.map.emplace(key, std::prev(shard.list.end()));
-    ++shard.insertCount;
-    return true;
+  template <typename T>
+  static T readPod(std::istream& in)
+  {
+    T value{};
+    in.read(reinterpret_cast<char*>(&value), sizeof(value));
+    return value;
   }
 
-  // Find value; returns empty optional on miss. When the entry is already the
-  // most-recently-used element no exclusive lock is needed — only the shared
-  // (upgrade) lock is held.  This matters when the same key is looked up
-  // repeatedly (e.g. 1000 Finnish stations all in Europe/Helsinki): only the
-  // first hit splices the LRU list; the rest stay in shared mode.
-  std::optional<ValueType> find(const KeyType& key)
+  // Read-only stream buffer over a snapshot record in memory
+  class RecordBuffer : public std::streambuf
   {
-    auto& shard = itsShards[getShardIndex(key)];
-    boost::upgrade_lock<boost::shared_mutex> lock(shard.mutex);
+   public:
+    RecordBuffer(char* data, std::size_t size) { setg(data, data, data + size); }
+    std::size_t remaining() const { return static_cast<std::size_t>(egptr() - gptr()); }
+  };
 
-    auto mapIt = shard.map.find(key);
-    if (mapIt == shard.map.end())
+  template <typename Serializer>
+  std::size_t loadSection(const std::filesystem::path& path,
+                          std::uint64_t fileSize,
+                          const SnapshotSection& section,
+                          Duration age,
+                          bool sameLayout,
+                          const Serializer& serializer)
+  {
+    std::ifstream in(path, std::ios::binary);
+    in.seekg(section.offset);
+
+    // Oldest records which would be evicted anyway are skipped
+    std::uint64_t skipSize = 0;
+    if (sameLayout && section.size > itsMaxSizePerShard)
+      skipSize = section.size - itsMaxSizePerShard;
+
+    std::size_t loaded = 0;
+    std::string record;
+    for (std::uint64_t i = 0; i < section.count; i++)
     {
-      shard.missCount.fetch_add(1, std::memory_order_relaxed);
-      return {};
+      const auto hits = readPod<std::uint64_t>(in);
+      const auto ttl = readPod<std::int64_t>(in);
+      const auto size = readPod<std::uint64_t>(in);
+      const auto length = readPod<std::uint64_t>(in);
+      if (!in)
+        throw Fmi::Exception(BCP, "Truncated cache snapshot").addParameter("Path", path.string());
+
+      Duration remaining = Duration::zero();
+      if (ttl != 0)
+        remaining = std::chrono::nanoseconds(ttl) - age;
+
+      if (skipSize > 0 || (ttl != 0 && remaining <= Duration::zero()))
+      {
+        skipSize -= std::min(skipSize, size);
+        in.seekg(length, std::ios::cur);
+        continue;
+      }
+
+      // The record is read first, so that the serializer cannot be made to read past
+      // it nor to allocate more than the file holds
+      const auto start = static_cast<std::uint64_t>(in.tellg());
+      if (length > fileSize || start > fileSize - length)
+        throw Fmi::Exception(BCP, "Corrupt cache snapshot record").addParameter("Path", path.string());
+      record.resize(length);
+      in.read(record.data(), record.size());
+      if (!in)
+        throw Fmi::Exception(BCP, "Truncated cache snapshot").addParameter("Path", path.string());
+
+      RecordBuffer buffer(record.data(), record.size());
+      std::istream recordIn(&buffer);
+      KeyType key = serializer.readKey(recordIn);
+      ValueHandle value = std::make_shared<const ValueType>(serializer.readValue(recordIn));
+      if (!recordIn || buffer.remaining() != 0)
+        throw Fmi::Exception(BCP, "Corrupt cache snapshot record").addParameter("Path", path.string());
+
+      const std::size_t hash = getHash(key);
+      auto& shard = itsShards[getShardIndexByHash(hash)];
+      boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
+      if (insertLocked(shard, hash, key, value, remaining, false, nullptr))
+      {
+        auto mapIt = shard.map.find(lookupKey(key, hash));
+        if (mapIt != shard.map.end())
+          mapIt->second->hits = hits;
+        ++loaded;
+      }
     }
+    return loaded;
+  }
 
-    // If already at the back of the LRU list (MRU position), skip the
-    // exclusive lock — the splice would be a no-op anyway.
-    if (std::next(mapIt->second) == shard.list.end())
+  // Lock the shard; when instrumented, time the wait if the lock is not free
+  template <typename Lock>
+  static Lock lockShard(Shard& shard)
+  {
+    if constexpr (Instrumentation::Enabled)
     {
-      mapIt->second->hits.fetch_add(1, std::memory_order_relaxed);
-      shard.hitCount.fetch_add(1, std::memory_order_relaxed);
-      return mapIt->second->value;
+      Lock lock(shard.mutex, boost::try_to_lock);
+      if (lock.owns_lock())
+        shard.instrumentation.recordWait(Duration::zero());
+      else
+      {
+        const TimePoint start = Clock::now();
+        lock.lock();
+        shard.instrumentation.recordWait(Clock::now() - start);
+      }
+      return lock;
     }
+    else
+      return Lock(shard.mutex);
+  }
 
-    boost::upgrade_to_unique_lock<boost::shared_mutex> wlock(lock);
-    shard.list.splice(shard.list.end(), shard.list, mapIt->second);
-    mapIt->second->hits.fetch_add(1, std::memory_order_relaxed);
-    shard.hitCount.fetch_add(1, std::memory_order_relaxed);
-    return mapIt->second->value;
+  // Upgrade waits are timed only when instrumented
+  static TimePoint lockWaitStart()
+  {
+    if constexpr (Instrumentation::Enabled)
+      return Clock::now();
+    else
+      return TimePoint();
   }
 
-  // Find value and also return its hit count
-  std::optional<ValueType> find(const KeyType& key, std::size_t& hits)
+  static void lockWaitEnd(const Shard& shard, TimePoint start)
   {
-    auto& shard = itsShards[getShardIndex(key)];
-    boost::upgrade_lock<boost::shared_mutex> lock(shard.mutex);
+    if constexpr (Instrumentation::Enabled)
+      shard.instrumentation.recordWait(Clock::now() - start);
+  }
+
+  // Clock is read only for entries which can expire
+  template <class K>
+  ValueHandle findHashed(const K& key,
+                         std::size_t hash,
+                         std::size_t& hits,
+                         TimePoint* deadline = nullptr)
+  {
+    if (itsReuseTracker)
+      itsReuseTracker->access(hash);
+
+    auto& shard = itsShards[getShardIndexByHash(hash)];
+
+    if constexpr (Policy::SharedHits)
+    {
+      // Hits only update atomics, a plain shared lock lets finds run in parallel
+      auto lock = lockShard<boost::shared_lock<boost::shared_mutex>>(shard);
+
+      shard.policy.recordAccess(hash);
+      shard.instrumentation.recordAccess(key);
+
+      auto mapIt = shard.map.find(lookupKey(key, hash));
+      if (mapIt == shard.map.end() || isExpired(*mapIt->second))
+      {
+        shard.missCount.fetch_add(1, std::memory_order_relaxed);
+        return {};
+      }
+
+      shard.policy.touchShared(mapIt->second);
+      hits = mapIt->second->hits.fetch_add(1, std::memory_order_relaxed) + 1;
+      shard.hitCount.fetch_add(1, std::memory_order_relaxed);
+      refreshIfStale(*mapIt->second);
+      if (deadline)
+        *deadline = std::min(mapIt->second->expires, mapIt->second->stale);
+      return mapIt->second->value;
+    }
+
+    auto lock = lockShard<boost::upgrade_lock<boost::shared_mutex>>(shard);
 
-    auto mapIt = shard.map.find(key);
+    shard.policy.recordAccess(hash);
+    shard.instrumentation.recordAccess(key);
+
+    auto mapIt = shard.map.find(lookupKey(key, hash));
     if (mapIt == shard.map.end())
     {
       shard.missCount.fetch_add(1, std::memory_order_relaxed);
       return {};
     }
 
-    if (std::next(mapIt->second) == shard.list.end())
+    if (isExpired(*mapIt->second))
+    {
+      const TimePoint start = lockWaitStart();
+      boost::upgrade_to_unique_lock<boost::shared_mutex> wlock(lock);
+      lockWaitEnd(shard, start);
+      shard.instrumentation.recordUpgrade();
+      removeEntry(shard, mapIt);
+      ++shard.expirationCount;
+      shard.missCount.fetch_add(1, std::memory_order_relaxed);
+      return {};
+    }
+
+    if (shard.policy.touchShared(mapIt->second))
     {
       hits = mapIt->second->hits.fetch_add(1, std::memory_order_relaxed) + 1;
       shard.hitCount.fetch_add(1, std::memory_order_relaxed);
+      refreshIfStale(*mapIt->second);
+      if (deadline)
+        *deadline = std::min(mapIt->second->expires, mapIt->second->stale);
       return mapIt->second->value;
     }
 
+    const TimePoint start = lockWaitStart();
     boost::upgrade_to_unique_lock<boost::shared_mutex> wlock(lock);
-    shard.list.splice(shard.list.end(), shard.list, mapIt->second);
+    lockWaitEnd(shard, start);
+    shard.instrumentation.recordUpgrade();
+    shard.policy.touch(mapIt->second);
     hits = mapIt->second->hits.fetch_add(1, std::memory_order_relaxed) + 1;
     shard.hitCount.fetch_add(1, std::memory_order_relaxed);
+    refreshIfStale(*mapIt->second);
+    if (deadline)
+      *deadline = std::min(mapIt->second->expires, mapIt->second->stale);
     return mapIt->second->value;
   }
 
-  void clear()
+  static bool isExpired(const Entry& entry)
   {
-    for (auto& shard : itsShards)
-    {
-      boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
-      shard.list.clear();
-      shard.map.clear();
-      shard.size = 0;
-    }
+    return entry.expires != TimePoint::max() && entry.expires <= Clock::now();
   }
 
-  void resize(std::size_t newMaxSize)
+  // Schedule a refresh of a stale entry unless one is pending (caller holds a lock)
+  void refreshIfStale(Entry& entry)
   {
-    itsMaxSizePerShard = (newMaxSize + NumShards - 1) / NumShards;
-    for (auto& shard : itsShards)
+    if (entry.stale == TimePoint::max() || entry.stale > Clock::now())
+      return;
+    itsStaleHits.fetch_add(1, std::memory_order_relaxed);
+    if (entry.refreshing.exchange(true))
+      return;
+
+    auto control = itsRefreshControl;
+    try
     {
-      boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
-      const std::size_t sizeBefore = shard.map.size();
-      evictLRU(shard);
-      shard.evictionCount += sizeBefore - shard.map.size();
+      const bool scheduled = control->schedule(
+          [control, key = entry.key, old = entry.value]()
+          {
+            boost::shared_lock<boost::shared_mutex> lock(control->mutex);
+            if (control->cache)
+              control->cache->refresh(key, old);
+          });
+      if (scheduled)
+        return;
+      itsRefreshFailures.fetch_add(1, std::memory_order_relaxed);  // the pool is full or stopped
     }
-  }
-
-  void resize(std::size_t newMaxSize, ItemVector& evictedItems)
-  {
-    evictedItems.clear();
-    itsMaxSizePerShard = (newMaxSize + NumShards - 1) / NumShards;
-    for (auto& shard : itsShards)
+    catch (...)
     {
-      ItemVector shardEvicted;
-      boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
-      evictLRU(shard, shardEvicted);
-      shard.evictionCount += shardEvicted.size();
-      for (auto& item : shardEvicted)
-        evictedItems.push_back(std::move(item));
+      itsRefreshScheduleErrors.fetch_add(1, std::memory_order_relaxed);
     }
+    entry.refreshing = false;  // try again on the next hit
   }
 
-  std::size_t size() const
+  void refresh(const KeyType& key, const ValueHandle& old)
   {
-    std::size_t total = 0;
-    for (const auto& shard : itsShards)
+    try
     {
-      boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
-      total += shard.size;
+      ValueType value = itsRefreshControl->refresher(key);
+      upsert(key, value);
+      itsRefreshes.fetch_add(1, std::memory_order_relaxed);
     }
-    return total;
-  }
-
-  std::size_t maxSize() const { return itsMaxSizePerShard * NumShards; }
-
-  std::list<CacheReportingObjectType> getContent() const
-  {
-    std::list<CacheReportingObjectType> result;
-    for (const auto& shard : itsShards)
+    catch (...)
     {
-      boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
-      for (const auto& entry : shard.list)
-        result.emplace_back(entry.key, entry.value, entry.hits, entry.size);
+      // Let the next hit try again if the entry has not been replaced meanwhile
+      {
+        const std::size_t hash = getHash(key);
+        auto& shard = itsShards[getShardIndexByHash(hash)];
+        boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+        auto mapIt = shard.map.find(lookupKey(key, hash));
+        if (mapIt != shard.map.end() && mapIt->second->value == old)
+          mapIt->second->refreshing = false;
+      }
+      itsRefreshFailures.fetch_add(1, std::memory_order_relaxed);
     }
-    return result;
   }
 
-  std::string getTextContent() const
+  template <typename Visitor>
+  std::size_t visitEntries(Visitor& visitor, double fraction, std::size_t chunkSize) const
   {
-    std::stringstream output;
-    bool first = true;
-    for (const auto& shard : itsShards)
+    // Sample the entries whose mixed hash falls below the fraction of 2^32
+    const auto limit =
+        static_cast<std::uint64_t>(std::clamp(fraction, 0.0, 1.0) * 4294967296.0);
+    chunkSize = std::max<std::size_t>(chunkSize, 1);
+
+    std::vector<EntryInfo> chunk;
+    chunk.reserve(chunkSize);
+    std::size_t count = 0;
+    for (std::size_t s = 0; s < NumShards; s++)
     {
-      boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
-      for (const auto& entry : shard.list)
+      const auto& shard = itsShards[s];
+      std::size_t bucket = 0;
+      std::size_t buckets = 0;
+      bool done = false;
+      while (!done)
       {
-        if (!first)
-          output << ',';
-        first = false;
-        output << entry.value;
+        // Collect whole hash buckets under the lock
+        chunk.clear();
+        {
+          boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+          const std::size_t n = shard.map.bucket_count();
+          if (buckets != 0 && n != buckets)
+            bucket = bucket * n / buckets;  // rehashed meanwhile, continue near the same spot
+          buckets = n;
+          for (; bucket < n && chunk.size() < chunkSize; ++bucket)
+          {
+            for (auto it = shard.map.begin(bucket); it != shard.map.end(bucket); ++it)
+            {
+              const Entry& entry = *it->second;
+              if (((entry.hash * 0x9E3779B97F4A7C15ULL) >> 32) < limit && !isExpired(entry))
+                chunk.push_back(EntryInfo{entry.key,
+                                          entry.value,
+                                          entry.size,
+                                          entry.hits.load(std::memory_order_relaxed),
+                                          s});
+            }
+          }
+          done = (bucket >= n);
+        }
+
+        for (const auto& info : chunk)
+        {
+          ++count;
+          if constexpr (std::is_same_v<std::invoke_result_t<Visitor&, const EntryInfo&>, bool>)
+          {
+            if (!visitor(info))
+              return count;
+          }
+          else
+            visitor(info);
+        }
       }
     }
-    return output.str();
+    return count;
   }
 
- private:
-  struct Entry
+  bool insertEntry(const KeyType& key,
+                   const ValueType& value,
+                   Duration ttl,
+                   bool replace,
+                   ItemVector* evictedItems)
+  {
+    // Allocate before locking
+    ValueHandle handle = std::make_shared<const ValueType>(value);
+
+    const std::size_t hash = getHash(key);
+    auto& shard = itsShards[getShardIndexByHash(hash)];
+    auto lock = lockShard<boost::unique_lock<boost::shared_mutex>>(shard);
+    return insertLocked(shard, hash, key, handle, ttl, replace, evictedItems);
+  }
+
+  // Caller holds exclusive lock
+  bool insertLocked(Shard& shard,
+                    std::size_t hash,
+                    const KeyType& key,
+                    const ValueHandle& value,
+                    Duration ttl,
+                    bool replace,
+                    ItemVector* evictedItems)
   {
-    Entry(KeyType k, ValueType v, std::size_t s)
-        : key(std::move(k)), value(std::move(v)), size(s)
+    TimePoint expires = TimePoint::max();
+    TimePoint stale = TimePoint::max();
+    if (ttl > Duration::zero() || !shard.expiryQueue.empty())
     {
+      const TimePoint now = Clock::now();
+      expire(shard, now);
+      if (ttl > Duration::zero())
+        expires = now + ttl;
+      if (itsSoftTTL > Duration::zero())
+        stale = std::min(expires, now + itsSoftTTL);
     }
 
-    KeyType key;
-    ValueType value;
-    std::atomic<std::size_t> hits{0};
-    std::size_t size = 0;
-  };
+    auto mapIt = shard.map.find(lookupKey(key, hash));
+    if (mapIt != shard.map.end())
+    {
+      if (!replace && !isExpired(*mapIt->second))
+        return false;
+      // Remove existing entry without counting it as an eviction
+      removeEntry(shard, mapIt);
+    }
 
-  using ListType = std::list<Entry>;
-  using MapType =
-      std::unordered_map<KeyType, typename ListType::iterator, boost::hash<KeyType>>;
+    std::size_t valueSize = SizeFunc::getSize(*value);
+    if (valueSize > itsMaxSizePerShard)
+      return false;
 
-  struct Shard
-  {
-    ListType list;  // front = LRU, back = MRU
-    MapType map;
-    mutable boost::shared_mutex mutex;
-    std::size_t size = 0;
-    std::size_t insertCount = 0;
-    std::size_t evictionCount = 0;
-    // hit/miss updated lock-free on the miss path (no upgrade needed)
-    mutable std::atomic<std::size_t> hitCount{0};
-    mutable std::atomic<std::size_t> missCount{0};
-  };
+    if (!shard.negatives.empty())
+      shard.negatives.erase(key);
+
+    auto it = shard.policy.emplace(key, value, valueSize, hash, expires);
+    it->stale = stale;
+    shard.map.emplace(MapKey{&it->key, hash}, it);
+    shard.size += valueSize;
+    ++shard.insertCount;
+    if (expires != TimePoint::max())
+      shard.expiryQueue.push(Expiry{expires, key, false});
 
-  std::size_t getShardIndex(const KeyType& key) const
+    evict(shard, evictedItems);
+    return true;
+  }
+
+  // Caller holds exclusive lock. Invalidates the near cache copies of the shard.
+  void removeEntry(Shard& shard, typename MapType::iterator mapIt)
   {
-    constexpr std::size_t prime = 2654435761ULL;
-    return (boost::hash<KeyType>{}(key) * prime) % NumShards;
+    shard.generation.value.fetch_add(1, std::memory_order_release);
+    shard.size -= mapIt->second->size;
+    shard.policy.erase(mapIt->second);
+    shard.map.erase(mapIt);
   }
 
-  // Evict LRU entries until shard is within capacity (caller holds exclusive lock)
-  void evictLRU(Shard& shard)
+  // Pop expired deadlines off the heap (caller holds exclusive lock)
+  std::size_t expire(Shard& shard, TimePoint now)
   {
-    while (shard.size > itsMaxSizePerShard && !shard.list.empty())
+    std::size_t count = 0;
+    while (!shard.expiryQueue.empty() && shard.expiryQueue.top().expires <= now)
     {
-      shard.size -= shard.list.front().size;
-      shard.map.erase(shard.list.front().key);
-      shard.list.pop_front();
+      const Expiry& item = shard.expiryQueue.top();
+      if (item.negative)
+      {
+        auto it = shard.negatives.find(item.key);
+        if (it != shard.negatives.end() && it->second == item.expires)
+          shard.negatives.erase(it);
+      }
+      else
+      {
+        auto mapIt = shard.map.find(lookupKey(item.key, getHash(item.key)));
+        if (mapIt != shard.map.end() && mapIt->second->expires == item.expires)
+        {
+          removeEntry(shard, mapIt);
+          ++count;
+        }
+      }
+      shard.expiryQueue.pop();
     }
+    shard.expirationCount += count;
+    return count;
   }
 
-  void evictLRU(Shard& shard, ItemVector& evicted)
+  // Evict entries until shard is within capacity (caller holds exclusive lock)
+  void evict(Shard& shard, ItemVector* evicted)
   {
-    while (shard.size > itsMaxSizePerShard && !shard.list.empty())
+    while (shard.size > itsMaxSizePerShard && !shard.policy.empty())
     {
-      auto& e = shard.list.front();
-      evicted.emplace_back(e.key, e.value);
-      shard.size -= e.size;
-      shard.map.erase(e.key);
-      shard.list.pop_front();
+      auto it = shard.policy.victim();
+      shard.generation.value.fetch_add(1, std::memory_order_release);
+      if (evicted)
+        evicted->emplace_back(it->key, *it->value);
+      shard.size -= it->size;
+      shard.map.erase(lookupKey(it->key, it->hash));
+      shard.policy.erase(it);
+      ++shard.evictionCount;
     }
   }
 
   std::array<Shard, NumShards> itsShards;
   std::size_t itsMaxSizePerShard = 0;
+  Duration itsDefaultTTL = Duration::zero();
+  Duration itsSoftTTL = Duration::zero();
+  std::shared_ptr<RefreshControl> itsRefreshControl;
+  std::atomic<std::size_t> itsStaleHits{0};
+  std::atomic<std::size_t> itsRefreshes{0};
+  std::atomic<std::size_t> itsRefreshFailures{0};
+  std::atomic<std::size_t> itsRefreshScheduleErrors{0};
+  std::uint64_t itsNearCacheId = 0;
+  std::shared_ptr<char> itsNearCacheToken;
+  std::array<PaddedCounter, NearCounterSlots> itsNearHits;
+  std::unique_ptr<ReuseDistanceTracker> itsReuseTracker;
   const DateTime itsStartTime = Fmi::SecondClock::universal_time();
+  std::unique_ptr<Fmi::AsyncTask> itsExpirySweeper;  // must be destroyed before the shards
 };
 
 // Size_t parser for the FileCache
@@ -432,21 +2039,73 @@ struct FileCacheStruct
   std::size_t fileSize;
 };
 
+// ----------------------------------------------------------------------
+/*!
+ * \brief LRU cache of strings stored in files
+ *
+ * The index is sharded like Cache. The size limit and the LRU order are
+ * global: every access stamps the entry with a global sequence number and
+ * cleanup evicts the oldest of the shard LRU heads.
+ *
+ * With write-behind enabled insert() returns once the value is queued and
+ * a writer thread stores it. Queued values are served from memory.
+ *
+ * The index is journaled in an append-only file in the cache directory, so
+ * that a restart needs to scan only the subdirectories modified since the
+ * journal was written. Records of inserts and removals are buffered and
+ * written in batches outside the shard locks. Hits are not journaled, the
+ * LRU order is recorded when the journal is rewritten: when the appended
+ * records outnumber the entries several times, by flush() and on
+ * destruction. After a crash entries accessed since keep their older
+ * positions.
+ *
+ * findView() returns a read-only memory mapping of the file without
+ * copying it; find() reads the file into a string.
+ *
+ * With compression enabled values are stored compressed as described in
+ * CacheCompression.h and the size limit applies to the stored bytes.
+ * Values are decompressed by find() and findView() on a hit.
+ */
+// ----------------------------------------------------------------------
+
 class FileCache
 {
   using MutexType = boost::shared_mutex;
   using ReadLock = boost::shared_lock<MutexType>;
   using WriteLock = boost::unique_lock<MutexType>;
-  using UpgradeReadLock = boost::upgrade_lock<MutexType>;
-  using UpgradeWriteLock = boost::upgrade_to_unique_lock<MutexType>;
-
-  using MapType = boost::bimaps::bimap<boost::bimaps::unordered_set_of<std::size_t,
-                                                                       boost::hash<std::size_t>,
-                                                                       std::equal_to<std::size_t> >,
-                                       boost::bimaps::list_of<FileCacheStruct> >;
 
  public:
-  FileCache(const std::filesystem::path& directory, std::size_t maxSize);
+  static constexpr std::size_t NumShards = 16;
+
+  // Read-only view of a cached value, which stays valid as long as the view
+  // exists even if the entry is evicted
+  class View
+  {
+   public:
+    View() = default;
+
+    explicit operator bool() const { return static_cast<bool>(itsOwner); }
+    const char* data() const { return itsData.data(); }
+    std::size_t size() const { return itsData.size(); }
+    std::string_view view() const { return itsData; }
+    std::string str() const { return std::string(itsData); }
+
+   private:
+    friend class FileCache;
+    View(std::shared_ptr<const void> owner, std::string_view data)
+        : itsOwner(std::move(owner)), itsData(data)
+    {
+    }
+
+    std::shared_ptr<const void> itsOwner;  // memory mapping, queued or decompressed value
+    std::string_view itsData;
+  };
+
+  FileCache(const std::filesystem::path& directory,
+            std::size_t maxSize,
+            bool writeBehind = false,
+            const CacheCompression& compression = CacheCompression());
+  ~FileCache();
 
   FileCache(const FileCache& other) = delete;
   FileCache(FileCache&& other) = delete;
@@ -454,34 +2113,118 @@ class FileCache
   FileCache& operator=(FileCache&& other) = delete;
 
   std::optional<std::string> find(std::size_t key);
+  View findView(std::size_t key);
   bool insert(std::size_t key, const std::string& value, bool performCleanup = true);
+  void flush();  // wait until queued writes are stored and rewrite the journal
   std::vector<std::size_t> getContent() const;
   std::size_t getSize() const;
   bool clean(std::size_t spaceNeeded);
   CacheStats statistics() const;
 
  private:
+  struct Entry
+  {
+    Entry(std::size_t theKey,
+          const std::filesystem::path& thePath,
+          std::size_t theSize,
+          std::uint64_t theSequence,
+          std::shared_ptr<const std::string> thePending)
+        : key(theKey), file(thePath, theSize), sequence(theSequence), pending(std::move(thePending))
+    {
+    }
+
+    std::size_t key;
+    FileCacheStruct file;
+    std::atomic<std::uint64_t> sequence;         // global LRU order
+    std::shared_ptr<const std::string> pending;  // stored bytes not yet written
+  };
+
+  using ListType = std::list<Entry>;
+
+  struct Shard
+  {
+    ListType list;  // LRU first
+    std::unordered_map<std::size_t, ListType::iterator> map;
+    mutable MutexType mutex;
+    std::size_t insertCount = 0;
+    std::atomic<std::size_t> hitCount{0};
+    std::atomic<std::size_t> missCount{0};
+  };
+
+  struct JournalEntry
+  {
+    std::size_t key;
+    std::size_t size;
+    std::uint64_t sequence;
+  };
+
+  struct WriteItem
+  {
+    std::size_t key;
+    std::filesystem::path dir;
+    std::string fileName;
+    std::shared_ptr<const std::string> value;
+  };
+
+  Shard& getShard(std::size_t key) { return itsShards[(key * 2654435761ULL) % NumShards]; }
+  bool lookup(std::size_t key,
+              std::filesystem::path& path,
+              std::size_t& size,
+              std::shared_ptr<const std::string>& pending);
+  void addEntries(const std::vector<JournalEntry>& entries);
+  void eraseEntry(Shard& shard, std::unordered_map<std::size_t, ListType::iterator>::iterator it);
+  void touch(Shard& shard, std::size_t key);
+  bool persist(const WriteItem& item);
+  void runWriter();
   bool performCleanup(std::size_t space_needed);
   void update();
+  bool readJournal(std::map<std::string, std::int64_t>& recordedTimes,
+                   std::unordered_map<std::size_t, JournalEntry>& entries) const;
+  void scanDirectories(const std::vector<std::string>& dirs,
+                       const std::unordered_map<std::size_t, JournalEntry>& journal,
+                       std::vector<JournalEntry>& entries) const;
+  void writeJournal();
+  void rewriteJournal();
+  void appendJournal(char op, std::size_t key, std::size_t size, std::uint64_t sequence);
+  void flushJournal(bool force = false);
   bool writeFile(const std::filesystem::path& theDir,
                  const std::string& fileName,
                  const std::string& theValue) const;
-  bool checkForDiskSpace(const std::filesystem::path& thePath,
-                         const std::string& theValue,
-                         bool doCleanup);
+  bool reserveDiskSpace(std::size_t valueSize, bool doCleanup);
   std::pair<std::string, std::string> getFileDirAndName(std::size_t hashValue) const;
   bool getKey(const std::string& directory, const std::string& filename, std::size_t& key) const;
 
-  std::size_t itsSize = 0;
+  std::array<Shard, NumShards> itsShards;
+  std::atomic<std::size_t> itsSize{0};
+  std::atomic<std::uint64_t> itsSequence{0};
+  std::atomic<std::size_t> itsEvictionCount{0};
+  std::atomic<std::size_t> itsWriteFailures{0};
+  std::atomic<std::size_t> itsCompressedInserts{0};
+  std::atomic<std::size_t> itsCompressionSavings{0};
   std::size_t itsMaxSize = 0;
-  std::size_t itsInsertCount = 0;
-  std::size_t itsMissCount = 0;
-  std::size_t itsHitCount = 0;
-  std::size_t itsEvictionCount = 0;
+  CacheCompression itsCompression;
   const DateTime itsStartTime = Fmi::SecondClock::universal_time();
   std::filesystem::path itsDirectory;
-  MapType itsContentMap;
-  mutable MutexType itsMutex;
+  std::mutex itsSpaceMutex;  // serializes space reservations and cleanup
+
+  // Journal records are buffered under itsJournalMutex, which may be taken
+  // under a shard lock. The file is written under itsJournalFileMutex, which
+  // is taken first and never under a shard lock.
+  std::mutex itsJournalMutex;
+  std::string itsJournalBuffer;
+  std::atomic<std::size_t> itsJournalBuffered{0};
+  std::mutex itsJournalFileMutex;
+  std::ofstream itsJournal;
+  std::size_t itsJournalRecords = 0;  // appended since the last rewrite
+  std::size_t itsJournalLive = 0;     // entries at the last rewrite
+
+  // Write-behind queue
+  mutable boost::mutex itsQueueMutex;
+  boost::condition_variable itsQueueCondition;
+  std::deque<WriteItem> itsQueue;
+  bool itsWriting = false;
+  bool itsStopping = false;
+  std::unique_ptr<Fmi::AsyncTask> itsWriter;  // must be destroyed first
 };
 
 }  // namespace Cache
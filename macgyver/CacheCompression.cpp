@@ -0,0 +1,260 @@
+#include "CacheCompression.h"
+#include "Exception.h"
+#include <boost/iostreams/copy.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/filter/bzip2.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#ifndef WIN32
+#include <boost/iostreams/filter/lzma.hpp>
+#include <boost/iostreams/filter/zstd.hpp>
+#endif
+#include <cstdint>
+#include <cstring>
+#include <optional>
+
+namespace Fmi
+{
+namespace Cache
+{
+namespace
+{
+const char EncodingMagic[4] = {'F', 'M', 'I', 'Z'};
+const std::size_t HeaderSize = sizeof(EncodingMagic) + 1 + sizeof(std::uint64_t);
+
+bool validCodec(int codec)
+{
+  switch (codec)
+  {
+    case Fmi::Compression::BZIP2:
+    case Fmi::Compression::GZIP:
+#ifndef WIN32
+    case Fmi::Compression::XZ:
+    case Fmi::Compression::ZSTD:
+#endif
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Compression contexts are expensive to create, hence each thread reuses its own.
+// Copies of a boost::iostreams filter share the context of the original.
+template <class Filter>
+std::optional<Filter>& threadFilter()
+{
+  thread_local std::optional<Filter> filter;
+  return filter;
+}
+
+template <class Filter, class Default>
+Filter& compressor(int theLevel, Default theDefault)
+{
+  thread_local int level = 0;
+  auto& filter = threadFilter<Filter>();
+  if (!filter || level != theLevel)
+  {
+    filter.emplace(theLevel > 0 ? theLevel : theDefault);
+    level = theLevel;
+  }
+  return *filter;
+}
+
+template <class Filter>
+Filter& decompressor()
+{
+  auto& filter = threadFilter<Filter>();
+  if (!filter)
+    filter.emplace();
+  return *filter;
+}
+
+// A filter may be left in an undefined state by an error
+void resetThreadFilters()
+{
+  threadFilter<boost::iostreams::gzip_compressor>().reset();
+  threadFilter<boost::iostreams::gzip_decompressor>().reset();
+  threadFilter<boost::iostreams::bzip2_compressor>().reset();
+  threadFilter<boost::iostreams::bzip2_decompressor>().reset();
+#ifndef WIN32
+  threadFilter<boost::iostreams::lzma_compressor>().reset();
+  threadFilter<boost::iostreams::lzma_decompressor>().reset();
+  threadFilter<boost::iostreams::zstd_compressor>().reset();
+  threadFilter<boost::iostreams::zstd_decompressor>().reset();
+#endif
+}
+
+void pushCompressor(boost::iostreams::filtering_ostream& out, Fmi::Compression codec, int level)
+{
+  namespace io = boost::iostreams;
+  switch (codec)
+  {
+    case Fmi::Compression::GZIP:
+      out.push(compressor<io::gzip_compressor>(level, io::gzip::default_compression));
+      break;
+    case Fmi::Compression::BZIP2:
+      out.push(compressor<io::bzip2_compressor>(level, io::bzip2::default_block_size));
+      break;
+#ifndef WIN32
+    case Fmi::Compression::XZ:
+      out.push(compressor<io::lzma_compressor>(level, io::lzma::default_compression));
+      break;
+    case Fmi::Compression::ZSTD:
+      out.push(compressor<io::zstd_compressor>(level, io::zstd::default_compression));
+      break;
+#endif
+    default:
+      break;
+  }
+}
+
+void pushDecompressor(boost::iostreams::filtering_istream& in, Fmi::Compression codec)
+{
+  namespace io = boost::iostreams;
+  switch (codec)
+  {
+    case Fmi::Compression::GZIP:
+      in.push(decompressor<io::gzip_decompressor>());
+      break;
+    case Fmi::Compression::BZIP2:
+      in.push(decompressor<io::bzip2_decompressor>());
+      break;
+#ifndef WIN32
+    case Fmi::Compression::XZ:
+      in.push(decompressor<io::lzma_decompressor>());
+      break;
+    case Fmi::Compression::ZSTD:
+      in.push(decompressor<io::zstd_decompressor>());
+      break;
+#endif
+    default:
+      break;
+  }
+}
+
+}  // namespace
+
+std::string compress(std::string_view data, Fmi::Compression codec, int level)
+{
+  try
+  {
+    std::string ret;
+    if (codec == Fmi::Compression::NONE)
+      return ret.assign(data.data(), data.size());
+
+    boost::iostreams::filtering_ostream out;
+    pushCompressor(out, codec, level);
+    out.push(boost::iostreams::back_inserter(ret));
+    out.write(data.data(), data.size());
+    out.reset();  // flushes the compressor
+    return ret;
+  }
+  catch (...)
+  {
+    resetThreadFilters();
+    throw Fmi::Exception::Trace(BCP, "Compression failed!");
+  }
+}
+
+std::string decompress(std::string_view data, Fmi::Compression codec, std::size_t sizeHint)
+{
+  try
+  {
+    std::string ret;
+    if (codec == Fmi::Compression::NONE)
+      return ret.assign(data.data(), data.size());
+
+    boost::iostreams::filtering_istream in;
+    pushDecompressor(in, codec);
+    in.push(boost::iostreams::array_source(data.data(), data.size()));
+
+    // Read the expected size directly, and anything beyond it by copying
+    ret.resize(sizeHint);
+    if (sizeHint > 0)
+    {
+      in.read(&ret[0], static_cast<std::streamsize>(sizeHint));
+      ret.resize(static_cast<std::size_t>(in.gcount()));
+    }
+    boost::iostreams::copy(in, boost::iostreams::back_inserter(ret));
+    return ret;
+  }
+  catch (...)
+  {
+    resetThreadFilters();
+    throw Fmi::Exception::Trace(BCP, "Decompression failed!");
+  }
+}
+
+bool isEncoded(std::string_view stored)
+{
+  return (stored.size() >= HeaderSize &&
+          std::memcmp(stored.data(), EncodingMagic, sizeof(EncodingMagic)) == 0 &&
+          validCodec(static_cast<unsigned char>(stored[sizeof(EncodingMagic)])));
+}
+
+std::string encodeValue(std::string_view value, const CacheCompression& options)
+{
+  try
+  {
+    // Short values are stored as is unless they could be mistaken for encoded ones
+    const bool compressible = options.enabled() && value.size() >= options.threshold;
+    if (!compressible && !isEncoded(value))
+      return std::string(value);
+
+    const auto codec = (options.enabled() ? options.codec : Fmi::Compression::ZSTD);
+    std::string data = compress(value, codec, options.level);
+    if (data.size() + HeaderSize >= value.size() && !isEncoded(value))
+      return std::string(value);
+
+    std::string ret;
+    ret.reserve(HeaderSize + data.size());
+    ret.append(EncodingMagic, sizeof(EncodingMagic));
+    ret.push_back(static_cast<char>(codec));
+    const auto rawSize = static_cast<std::uint64_t>(value.size());
+    ret.append(reinterpret_cast<const char*>(&rawSize), sizeof(rawSize));
+    ret.append(data);
+    return ret;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+std::size_t decodedSize(std::string_view stored)
+{
+  if (!isEncoded(stored))
+    return stored.size();
+  std::uint64_t rawSize = 0;
+  std::memcpy(&rawSize, stored.data() + sizeof(EncodingMagic) + 1, sizeof(rawSize));
+  return rawSize;
+}
+
+std::string decodeValue(std::string_view stored)
+{
+  try
+  {
+    if (!isEncoded(stored))
+      return std::string(stored);
+
+    const auto codec = static_cast<Fmi::Compression>(stored[sizeof(EncodingMagic)]);
+    const auto rawSize = decodedSize(stored);
+    std::string ret = decompress(stored.substr(HeaderSize), codec, rawSize);
+    if (ret.size() != rawSize)
+    {
+      Fmi::Exception ex(BCP, "Decompressed cache value has wrong size");
+      ex.addParameter("Expected", std::to_string(rawSize));
+      ex.addParameter("Actual", std::to_string(ret.size()));
+      throw ex;
+    }
+    return ret;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Operation failed!");
+  }
+}
+
+}  // namespace Cache
+}  // namespace Fmi
@@ -0,0 +1,100 @@
+// ======================================================================
+/*!
+ * \brief Transparent value compression for Cache and FileCache
+ *
+ * Values are encoded either as is, or compressed with a small header
+ * recording the codec and the original size:
+ *
+ *   "FMIZ" | codec (1 byte) | original size (8 bytes) | compressed data
+ *
+ * Values shorter than the threshold, and values which would not shrink,
+ * are stored as is. Stored values are decoded only when they are read,
+ * which for caches means on a hit after the shard lock has been released.
+ *
+ * For Cache use CompressedValue as the value type together with
+ * CompressedSizeFunction, which accounts the cache size in stored bytes:
+ *
+ *   using Storage = Cache<Key, CompressedValue, CompressedSizeFunction>;
+ *   CacheCompression options{Fmi::Compression::ZSTD, 512};
+ *   cache.insert(key, CompressedValue(json, options));
+ *   auto handle = cache.findHandle(key);  // still compressed
+ *   std::string json = handle->value();   // decompressed here
+ *
+ * FileCache takes the options in its constructor.
+ */
+// ======================================================================
+
+#pragma once
+
+#include "FileSystem.h"
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace Fmi
+{
+namespace Cache
+{
+struct CacheCompression
+{
+  Fmi::Compression codec = Fmi::Compression::NONE;
+  std::size_t threshold = 256;  // shorter values are stored uncompressed
+  int level = 0;                // codec specific level, zero for the codec default
+
+  bool enabled() const { return codec != Fmi::Compression::NONE; }
+};
+
+// Compress or decompress raw data with the given codec
+std::string compress(std::string_view data, Fmi::Compression codec, int level = 0);
+std::string decompress(std::string_view data, Fmi::Compression codec, std::size_t sizeHint = 0);
+
+// Encode a value for storage, compressing it if the options permit
+std::string encodeValue(std::string_view value, const CacheCompression& options);
+
+// True if the stored bytes carry a compression header
+bool isEncoded(std::string_view stored);
+
+// Decode stored bytes, which may also be an uncompressed value
+std::string decodeValue(std::string_view stored);
+
+// Size of the decoded value without decoding it
+std::size_t decodedSize(std::string_view stored);
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief A cache value stored in its encoded form
+ */
+// ----------------------------------------------------------------------
+
+class CompressedValue
+{
+ public:
+  CompressedValue() = default;
+  CompressedValue(std::string_view value, const CacheCompression& options)
+      : itsData(encodeValue(value, options))
+  {
+  }
+
+  std::string value() const { return decodeValue(itsData); }
+  bool compressed() const { return isEncoded(itsData); }
+  std::size_t size() const { return itsData.size(); }  // stored bytes
+  std::size_t rawSize() const { return decodedSize(itsData); }
+  const std::string& data() const { return itsData; }
+
+ private:
+  std::string itsData;
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Size function accounting compressed values in stored bytes
+ */
+// ----------------------------------------------------------------------
+
+struct CompressedSizeFunction
+{
+  static std::size_t getSize(const CompressedValue& theValue) { return theValue.size(); }
+};
+
+}  // namespace Cache
+}  // namespace Fmi
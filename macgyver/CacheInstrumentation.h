@@ -0,0 +1,199 @@
+// ======================================================================
+/*!
+ * \brief Optional per-shard instrumentation for Fmi::Cache::Cache
+ *
+ * The instrumentation is selected with the Instrumentation template
+ * parameter of the cache. NoInstrumentation (the default) compiles to
+ * nothing. ShardInstrumentation records for each shard
+ *
+ *  - a histogram of the time spent waiting for the shard lock
+ *  - the number of find() calls which upgraded to an exclusive lock
+ *  - a sample of the hottest keys (space-saving algorithm)
+ *
+ * The results are returned by Cache::detailedStatistics() together with
+ * the per-shard sizes and hit ratios, which are available always.
+ *
+ * An instrumentation provides a "static constexpr bool Enabled" and a
+ * nested "template <class KeyType> class State" with the methods
+ *
+ *  - recordWait(duration)     time spent acquiring or upgrading the lock
+ *  - recordUpgrade()          find() needed the exclusive lock
+ *  - recordAccess(key)        key was looked up, called under a shared lock,
+ *                             the key may be of any type usable in lookups
+ *  - report(CacheShardStats&) add counters to the statistics
+ *  - hotKeys(vector&)         append the sampled hot keys
+ */
+// ======================================================================
+
+#pragma once
+
+#include "CacheStats.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace Fmi
+{
+namespace Cache
+{
+// Bucket i of a lock wait histogram counts waits of [2^i, 2^(i+1)) nanoseconds,
+// bucket zero counts also the waits shorter than a nanosecond
+constexpr std::size_t LockWaitBuckets = 32;
+
+using LockWaitHistogram = std::array<std::size_t, LockWaitBuckets>;
+
+struct CacheShardStats
+{
+  std::size_t size = 0;
+  std::size_t maxsize = 0;
+  std::size_t inserts = 0;
+  std::size_t hits = 0;
+  std::size_t misses = 0;
+  std::size_t evictions = 0;
+  std::size_t upgrades = 0;
+  LockWaitHistogram lockwaits{};
+
+  double hitRatio() const
+  {
+    const std::size_t lookups = hits + misses;
+    return lookups == 0 ? 0.0 : static_cast<double>(hits) / lookups;
+  }
+};
+
+// Estimated number of lookups of a key. The true count is between
+// count - error and count.
+template <class KeyType>
+struct HotKey
+{
+  KeyType key;
+  std::size_t count = 0;
+  std::size_t error = 0;
+};
+
+template <class KeyType>
+struct CacheDetailedStats
+{
+  CacheStats totals;
+  bool instrumented = false;
+  std::vector<CacheShardStats> shards;
+  std::vector<HotKey<KeyType>> hotkeys;  // most frequent first
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief No instrumentation, all calls compile away
+ */
+// ----------------------------------------------------------------------
+
+struct NoInstrumentation
+{
+  static constexpr bool Enabled = false;
+
+  template <class KeyType>
+  class State
+  {
+   public:
+    template <typename Duration>
+    void recordWait(Duration /* theWait */) const
+    {
+    }
+    void recordUpgrade() const {}
+    template <class LookupKey>
+    void recordAccess(const LookupKey& /* theKey */) const
+    {
+    }
+    void report(CacheShardStats& /* theStats */) const {}
+    void hotKeys(std::vector<HotKey<KeyType>>& /* theKeys */) const {}
+  };
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Lock wait histograms, upgrade counts and a hot-key sampler
+ *
+ * Every SampleRate'th lookup of a shard is fed to a space-saving summary
+ * of TopK counters. Sampled counts are scaled back by SampleRate. A sample
+ * is skipped rather than waited for if another thread holds the summary.
+ */
+// ----------------------------------------------------------------------
+
+template <std::size_t TopK = 16, std::size_t SampleRate = 16>
+struct ShardInstrumentation
+{
+  static constexpr bool Enabled = true;
+
+  static_assert(TopK > 0, "TopK must be greater than 0");
+  static_assert(SampleRate > 0, "SampleRate must be greater than 0");
+
+  template <class KeyType>
+  class State
+  {
+   public:
+    template <typename Duration>
+    void recordWait(Duration theWait) const
+    {
+      const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(theWait).count();
+      std::size_t bucket = 0;
+      for (auto n = ns; n > 1 && bucket < LockWaitBuckets - 1; n >>= 1)
+        ++bucket;
+      itsLockWaits[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void recordUpgrade() const { itsUpgrades.fetch_add(1, std::memory_order_relaxed); }
+
+    template <class LookupKey>
+    void recordAccess(const LookupKey& theKey) const
+    {
+      if (itsAccesses.fetch_add(1, std::memory_order_relaxed) % SampleRate != 0)
+        return;
+
+      std::unique_lock<std::mutex> lock(itsSamplerMutex, std::try_to_lock);
+      if (!lock.owns_lock())
+        return;
+
+      auto it = std::find_if(
+          itsSamples.begin(), itsSamples.end(), [&theKey](const auto& s) { return s.key == theKey; });
+      if (it != itsSamples.end())
+        ++it->count;
+      else if (itsSamples.size() < TopK)
+        itsSamples.push_back(HotKey<KeyType>{KeyType(theKey), 1, 0});
+      else
+      {
+        // Replace the least frequent key, inheriting its count as the error
+        auto least = std::min_element(itsSamples.begin(),
+                                      itsSamples.end(),
+                                      [](const auto& a, const auto& b) { return a.count < b.count; });
+        *least = HotKey<KeyType>{KeyType(theKey), least->count + 1, least->count};
+      }
+    }
+
+    void report(CacheShardStats& theStats) const
+    {
+      theStats.upgrades += itsUpgrades.load(std::memory_order_relaxed);
+      for (std::size_t i = 0; i < LockWaitBuckets; i++)
+        theStats.lockwaits[i] += itsLockWaits[i].load(std::memory_order_relaxed);
+    }
+
+    void hotKeys(std::vector<HotKey<KeyType>>& theKeys) const
+    {
+      std::lock_guard<std::mutex> lock(itsSamplerMutex);
+      for (const auto& sample : itsSamples)
+        theKeys.push_back(
+            HotKey<KeyType>{sample.key, sample.count * SampleRate, sample.error * SampleRate});
+    }
+
+   private:
+    mutable std::array<std::atomic<std::size_t>, LockWaitBuckets> itsLockWaits{};
+    mutable std::atomic<std::size_t> itsUpgrades{0};
+    mutable std::atomic<std::size_t> itsAccesses{0};
+    mutable std::mutex itsSamplerMutex;
+    mutable std::vector<HotKey<KeyType>> itsSamples;
+  };
+};
+
+}  // namespace Cache
+}  // namespace Fmi
@@ -0,0 +1,194 @@
+#include "CacheMissRatio.h"
+#include "Exception.h"
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+namespace Fmi
+{
+namespace Cache
+{
+namespace
+{
+// Distances below this are counted exactly, above it with 16 buckets per power of two
+const std::size_t LinearBuckets = 32;
+const std::size_t SubBuckets = 16;
+const std::size_t HistogramSize = LinearBuckets + 59 * SubBuckets;
+const std::size_t MinTreeSize = 1024;
+}  // namespace
+
+ReuseDistanceTracker::ReuseDistanceTracker(double samplingRate, std::size_t maxTrackedKeys)
+    : itsMaxTrackedKeys(maxTrackedKeys), itsTree(MinTreeSize + 1), itsHistogram(HistogramSize)
+{
+  if (!(samplingRate > 0 && samplingRate <= 1))
+    throw Fmi::Exception(BCP, "Sampling rate must be in range (0,1]")
+        .addParameter("Rate", std::to_string(samplingRate));
+  if (maxTrackedKeys == 0)
+    throw Fmi::Exception(BCP, "The number of tracked keys must be positive");
+
+  const double scale = static_cast<double>(1ULL << SampleBits);
+  itsThreshold = static_cast<std::uint32_t>(std::max(1.0, std::round(samplingRate * scale)));
+}
+
+double ReuseDistanceTracker::samplingRate() const
+{
+  return itsThreshold.load() / static_cast<double>(1ULL << SampleBits);
+}
+
+std::size_t ReuseDistanceTracker::sampledLookups() const
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  return itsSampledLookups;
+}
+
+std::size_t ReuseDistanceTracker::trackedKeys() const
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  return itsLastAccess.size();
+}
+
+void ReuseDistanceTracker::clear()
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  itsLastAccess.clear();
+  itsTree.assign(MinTreeSize + 1, 0);
+  itsTime = 0;
+  std::fill(itsHistogram.begin(), itsHistogram.end(), 0.0);
+  itsColdLookups = 0;
+  itsTotalLookups = 0;
+  itsSampledLookups = 0;
+}
+
+void ReuseDistanceTracker::record(std::size_t hash)
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+
+  // The threshold may have been lowered after the unlocked check
+  const std::uint32_t threshold = itsThreshold.load(std::memory_order_relaxed);
+  if (sampleValue(hash) >= threshold)
+    return;
+
+  if (itsTime + 1 >= itsTree.size())
+    compact();
+
+  const double weight = static_cast<double>(1ULL << SampleBits) / threshold;
+  const std::uint64_t now = itsTime++;
+  ++itsSampledLookups;
+  itsTotalLookups += weight;
+
+  auto it = itsLastAccess.find(hash);
+  if (it == itsLastAccess.end())
+  {
+    itsColdLookups += weight;
+    itsLastAccess.emplace(hash, now);
+  }
+  else
+  {
+    // Distinct sampled keys looked up after the previous lookup of this key. Each
+    // key has one marked time, all of them before now.
+    const auto marked = static_cast<std::int64_t>(itsLastAccess.size());
+    const std::int64_t distance = marked - countUpTo(it->second + 1);
+    itsHistogram[bucket(static_cast<double>(distance) * weight)] += weight;
+    mark(it->second, -1);
+    it->second = now;
+  }
+  mark(now, 1);
+
+  if (itsLastAccess.size() > itsMaxTrackedKeys)
+    lowerRate();
+}
+
+// Drop the keys with the highest sample values until the limit is met again
+void ReuseDistanceTracker::lowerRate()
+{
+  std::uint32_t threshold = itsThreshold.load(std::memory_order_relaxed);
+  while (itsLastAccess.size() > itsMaxTrackedKeys * 9 / 10 && threshold > 1)
+  {
+    threshold = std::max<std::uint32_t>(1, threshold * 9 / 10);
+    for (auto it = itsLastAccess.begin(); it != itsLastAccess.end();)
+    {
+      if (sampleValue(it->first) >= threshold)
+      {
+        mark(it->second, -1);
+        it = itsLastAccess.erase(it);
+      }
+      else
+        ++it;
+    }
+  }
+  itsThreshold.store(threshold, std::memory_order_relaxed);
+}
+
+// Renumber the last lookups of the tracked keys to 0...n-1 keeping their order
+void ReuseDistanceTracker::compact()
+{
+  std::vector<std::pair<std::uint64_t, std::size_t>> order;
+  order.reserve(itsLastAccess.size());
+  for (const auto& item : itsLastAccess)
+    order.emplace_back(item.second, item.first);
+  std::sort(order.begin(), order.end());
+
+  itsTree.assign(std::max(MinTreeSize, 8 * order.size()) + 1, 0);
+  itsTime = 0;
+  for (const auto& item : order)
+  {
+    itsLastAccess[item.second] = itsTime;
+    mark(itsTime++, 1);
+  }
+}
+
+void ReuseDistanceTracker::mark(std::uint64_t time, int delta)
+{
+  for (std::size_t i = time + 1; i < itsTree.size(); i += i & (~i + 1))
+    itsTree[i] += delta;
+}
+
+std::int64_t ReuseDistanceTracker::countUpTo(std::uint64_t time) const
+{
+  std::int64_t sum = 0;
+  for (std::size_t i = time; i > 0; i -= i & (~i + 1))
+    sum += itsTree[i];
+  return sum;
+}
+
+std::size_t ReuseDistanceTracker::bucket(double distance)
+{
+  if (distance < LinearBuckets)
+    return static_cast<std::size_t>(distance);
+
+  const auto d = static_cast<std::uint64_t>(std::min(distance, 1e18));
+  const int exponent = 63 - __builtin_clzll(d);  // at least 5
+  const std::size_t sub = (d >> (exponent - 4)) & (SubBuckets - 1);
+  return std::min(HistogramSize - 1, LinearBuckets + (exponent - 5) * SubBuckets + sub);
+}
+
+double ReuseDistanceTracker::bucketStart(std::size_t index)
+{
+  if (index < LinearBuckets)
+    return static_cast<double>(index);
+  const std::size_t exponent = 5 + (index - LinearBuckets) / SubBuckets;
+  const std::size_t sub = (index - LinearBuckets) % SubBuckets;
+  return std::ldexp(static_cast<double>(SubBuckets + sub), static_cast<int>(exponent) - 4);
+}
+
+double ReuseDistanceTracker::hitRatio(double entries) const
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  if (itsTotalLookups == 0)
+    return 0;
+
+  // Lookups with a distance below the size hit, interpolating within the bucket
+  double hits = 0;
+  for (std::size_t i = 0; i < itsHistogram.size(); i++)
+  {
+    const double start = bucketStart(i);
+    if (start >= entries)
+      break;
+    const double end = bucketStart(i + 1);
+    hits += itsHistogram[i] * std::min(1.0, (entries - start) / (end - start));
+  }
+  return std::min(1.0, hits / itsTotalLookups);
+}
+
+}  // namespace Cache
+}  // namespace Fmi
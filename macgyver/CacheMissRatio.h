@@ -0,0 +1,108 @@
+// ======================================================================
+/*!
+ * \brief Sampled reuse distance tracking for cache sizing
+ *
+ * ReuseDistanceTracker estimates the hit ratio an LRU cache would have
+ * at any size from the stream of lookups, using the spatial sampling of
+ * SHARDS (Waldspurger et al., FAST'15): only keys whose hash falls below
+ * a threshold are tracked, and the reuse distances measured among them
+ * are scaled up by the inverse of the sampling rate.
+ *
+ * The reuse distance of a lookup is the number of distinct keys looked
+ * up since the previous lookup of the same key. An LRU cache of N
+ * entries hits if and only if the distance is less than N, hence the
+ * histogram of the distances gives the hit ratio for all sizes at once.
+ *
+ * Lookups of keys outside the sample cost a multiplication and a
+ * comparison. Sampled lookups take a mutex and do O(log n) work. If more
+ * than maxTrackedKeys keys are being tracked, the sampling rate is
+ * lowered and the keys no longer in the sample are dropped.
+ */
+// ======================================================================
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace Fmi
+{
+namespace Cache
+{
+struct MissRatioPoint
+{
+  std::size_t size = 0;   // cache size in the units of the cache size function
+  double entries = 0;     // the same in entries
+  double hitRatio = 0;    // estimated LRU hit ratio
+};
+
+struct MissRatioCurve
+{
+  double samplingRate = 0;
+  std::size_t sampledLookups = 0;
+  std::size_t trackedKeys = 0;
+  std::vector<MissRatioPoint> points;
+};
+
+class ReuseDistanceTracker
+{
+ public:
+  explicit ReuseDistanceTracker(double samplingRate = 0.01, std::size_t maxTrackedKeys = 100000);
+
+  ReuseDistanceTracker(const ReuseDistanceTracker& other) = delete;
+  ReuseDistanceTracker& operator=(const ReuseDistanceTracker& other) = delete;
+
+  // Record a lookup of a key with the given hash
+  void access(std::size_t hash)
+  {
+    if (sampleValue(hash) < itsThreshold.load(std::memory_order_relaxed))
+      record(hash);
+  }
+
+  // Estimated LRU hit ratio for a cache of the given number of entries
+  double hitRatio(double entries) const;
+
+  double samplingRate() const;
+  std::size_t sampledLookups() const;
+  std::size_t trackedKeys() const;
+
+  void clear();
+
+ private:
+  static constexpr unsigned SampleBits = 24;
+
+  static std::uint32_t sampleValue(std::size_t hash)
+  {
+    return static_cast<std::uint32_t>((hash * 0xff51afd7ed558ccdULL) >> (64 - SampleBits));
+  }
+
+  void record(std::size_t hash);
+  void lowerRate();
+  void compact();
+  void mark(std::uint64_t time, int delta);
+  std::int64_t countUpTo(std::uint64_t time) const;  // marked times < time
+
+  static std::size_t bucket(double distance);
+  static double bucketStart(std::size_t index);
+
+  mutable std::mutex itsMutex;
+  std::atomic<std::uint32_t> itsThreshold;
+  std::size_t itsMaxTrackedKeys;
+
+  std::unordered_map<std::size_t, std::uint64_t> itsLastAccess;  // hash to logical time
+  std::vector<std::int32_t> itsTree;  // Fenwick tree marking the last access of each key
+  std::uint64_t itsTime = 0;
+
+  // Scaled lookup counts by scaled reuse distance, and for first lookups
+  std::vector<double> itsHistogram;
+  double itsColdLookups = 0;
+  double itsTotalLookups = 0;
+  std::size_t itsSampledLookups = 0;
+};
+
+}  // namespace Cache
+}  // namespace Fmi
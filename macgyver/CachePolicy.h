@@ -0,0 +1,496 @@
+// ======================================================================
+/*!
+ * \brief Replacement policies for Fmi::Cache::Cache
+ *
+ * A policy decides the order in which the entries of one cache shard are
+ * evicted and whether a newly inserted entry is allowed to displace an
+ * older one. The policy type provides
+ *
+ *   static constexpr bool SharedHits;  // hits never need reordering
+ *   struct EntryData;                  // per entry bookkeeping
+ *   template <class List> class State; // per shard ordering state
+ *
+ * where List is the std::list of cache entries. The entries expose the
+ * members key, size, hash and policy (an EntryData). State must provide
+ *
+ *   void reset(std::size_t capacity);             exclusive lock
+ *   iterator emplace(Args&&... args);             exclusive lock, new entry
+ *   void erase(iterator it);                      exclusive lock
+ *   bool touchShared(iterator it) const;          shared lock
+ *   void touch(iterator it);                      exclusive lock
+ *   void recordAccess(std::size_t hash);          shared lock
+ *   iterator victim();                            exclusive lock, not empty
+ *   void forEach(F f) const;                      shared lock
+ *   bool empty() const;
+ *   void clear();                                 exclusive lock
+ *   void report(CacheStats& stats) const;         shared lock
+ *
+ * touchShared() records a hit which needs no reordering of the entries
+ * and returns true. If it returns false the cache upgrades to an
+ * exclusive lock and calls touch(). If SharedHits is true touchShared()
+ * must always succeed, and find() then takes a plain shared lock instead
+ * of an upgrade lock, which is exclusive among concurrent finds.
+ */
+// ======================================================================
+
+#pragma once
+
+#include "CacheStats.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <utility>
+
+namespace Fmi
+{
+namespace Cache
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Plain least-recently-used ordering (the default policy)
+ */
+// ----------------------------------------------------------------------
+
+struct LRUPolicy
+{
+  static constexpr bool SharedHits = false;
+
+  struct EntryData
+  {
+  };
+
+  template <class List>
+  class State
+  {
+   public:
+    using iterator = typename List::iterator;
+
+    void reset(std::size_t /* theCapacity */) {}
+
+    template <class... Args>
+    iterator emplace(Args&&... args)
+    {
+      itsList.emplace_back(std::forward<Args>(args)...);
+      return std::prev(itsList.end());
+    }
+
+    void erase(iterator it) { itsList.erase(it); }
+
+    // The splice would be a no-op if the entry is already the MRU entry
+    bool touchShared(iterator it) const { return std::next(it) == itsList.end(); }
+
+    void touch(iterator it) { itsList.splice(itsList.end(), itsList, it); }
+
+    void recordAccess(std::size_t /* theHash */) {}
+
+    iterator victim() { return itsList.begin(); }
+
+    template <class F>
+    void forEach(F&& f) const
+    {
+      for (const auto& entry : itsList)
+        f(entry);
+    }
+
+    bool empty() const { return itsList.empty(); }
+
+    void clear() { itsList.clear(); }
+
+    void report(CacheStats& /* theStats */) const {}
+
+   private:
+    List itsList;  // front = LRU, back = MRU
+  };
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief CLOCK (second chance) approximation of LRU
+ *
+ * A hit only sets the reference bit of the entry, which is an atomic flag
+ * and hence safe to modify under a shared lock. The list is reordered
+ * only when evicting: referenced entries at the front get their bit
+ * cleared and are moved to the back, the first unreferenced entry is
+ * the victim. find() therefore never needs an exclusive lock.
+ *
+ * Reported counters: clock_second_chances.
+ */
+// ----------------------------------------------------------------------
+
+struct ClockPolicy
+{
+  static constexpr bool SharedHits = true;
+
+  struct EntryData
+  {
+    std::atomic<bool> referenced{false};
+  };
+
+  template <class List>
+  class State
+  {
+   public:
+    using iterator = typename List::iterator;
+
+    void reset(std::size_t /* theCapacity */) {}
+
+    template <class... Args>
+    iterator emplace(Args&&... args)
+    {
+      itsList.emplace_back(std::forward<Args>(args)...);
+      return std::prev(itsList.end());
+    }
+
+    void erase(iterator it) { itsList.erase(it); }
+
+    // Test first to avoid writing to the cache line of a hot entry
+    bool touchShared(iterator it) const
+    {
+      if (!it->policy.referenced.load(std::memory_order_relaxed))
+        it->policy.referenced.store(true, std::memory_order_relaxed);
+      return true;
+    }
+
+    void touch(iterator it) { touchShared(it); }
+
+    void recordAccess(std::size_t /* theHash */) {}
+
+    iterator victim()
+    {
+      while (itsList.front().policy.referenced.load(std::memory_order_relaxed))
+      {
+        auto it = itsList.begin();
+        it->policy.referenced.store(false, std::memory_order_relaxed);
+        itsList.splice(itsList.end(), itsList, it);
+        ++itsSecondChances;
+      }
+      return itsList.begin();
+    }
+
+    template <class F>
+    void forEach(F&& f) const
+    {
+      for (const auto& entry : itsList)
+        f(entry);
+    }
+
+    bool empty() const { return itsList.empty(); }
+
+    void clear() { itsList.clear(); }
+
+    void report(CacheStats& theStats) const
+    {
+      theStats.counters["clock_second_chances"] += itsSecondChances;
+    }
+
+   private:
+    List itsList;  // front = next to be examined by the clock hand
+    std::size_t itsSecondChances = 0;
+  };
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Count-min sketch of 8-bit access frequencies with periodic aging
+ *
+ * Counters are updated with relaxed atomics so that accesses can be
+ * recorded while holding only a shared lock. Lost updates due to races
+ * are harmless, the estimates are approximate anyway.
+ */
+// ----------------------------------------------------------------------
+
+class FrequencySketch
+{
+ public:
+  void reset(std::size_t theCapacity)
+  {
+    std::size_t width = 16;
+    while (width < theCapacity && width < MaxWidth)
+      width <<= 1;
+
+    if (width != itsWidth)
+    {
+      itsWidth = width;
+      itsTable = std::make_unique<std::atomic<std::uint8_t>[]>(Depth * itsWidth);
+      itsAdditions = 0;
+    }
+    itsSampleSize = 10 * itsWidth;
+  }
+
+  void increment(std::size_t theHash)
+  {
+    for (std::size_t row = 0; row < Depth; row++)
+    {
+      auto& counter = itsTable[index(theHash, row)];
+      if (counter.load(std::memory_order_relaxed) < MaxCount)
+        counter.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Halve all counters once enough samples have been seen so that
+    // the frequencies follow changes in popularity
+    if (itsAdditions.fetch_add(1, std::memory_order_relaxed) + 1 == itsSampleSize)
+    {
+      for (std::size_t i = 0; i < Depth * itsWidth; i++)
+        itsTable[i].store(itsTable[i].load(std::memory_order_relaxed) >> 1,
+                          std::memory_order_relaxed);
+      itsAdditions.store(itsSampleSize / 2, std::memory_order_relaxed);
+    }
+  }
+
+  std::size_t estimate(std::size_t theHash) const
+  {
+    std::size_t result = MaxCount;
+    for (std::size_t row = 0; row < Depth; row++)
+      result = std::min<std::size_t>(
+          result, itsTable[index(theHash, row)].load(std::memory_order_relaxed));
+    return result;
+  }
+
+ private:
+  static constexpr std::size_t Depth = 4;
+  static constexpr std::size_t MaxWidth = 1 << 16;
+  static constexpr std::uint8_t MaxCount = 255;
+
+  // boost::hash is the identity for integers, hence remix per row
+  std::size_t index(std::size_t theHash, std::size_t theRow) const
+  {
+    std::uint64_t x = theHash + (theRow + 1) * 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= (x >> 31);
+    return theRow * itsWidth + (x & (itsWidth - 1));
+  }
+
+  std::size_t itsWidth = 0;
+  std::size_t itsSampleSize = 0;
+  std::unique_ptr<std::atomic<std::uint8_t>[]> itsTable;
+  std::atomic<std::size_t> itsAdditions{0};
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief W-TinyLFU: scan resistant admission on top of segmented LRU
+ *
+ * New entries go to a small LRU window (1% of capacity). Entries pushed
+ * out of the window compete against the LRU victim of the main region,
+ * and the one with the higher estimated access frequency is kept. The
+ * main region is a segmented LRU: entries hit while on probation are
+ * promoted to the protected segment (80% of the main region).
+ *
+ * A single sweep over cold keys thus only churns the window and the
+ * probation segment instead of flushing the whole working set.
+ *
+ * Reported counters: tinylfu_admissions, tinylfu_rejections and
+ * tinylfu_promotions.
+ */
+// ----------------------------------------------------------------------
+
+struct TinyLFUPolicy
+{
+  static constexpr bool SharedHits = false;
+
+  enum class Segment : std::uint8_t
+  {
+    Window,
+    Probation,
+    Protected
+  };
+
+  struct EntryData
+  {
+    Segment segment = Segment::Window;
+  };
+
+  template <class List>
+  class State
+  {
+   public:
+    using iterator = typename List::iterator;
+
+    void reset(std::size_t theCapacity)
+    {
+      itsCapacity = theCapacity;
+      itsWindowCapacity = std::max<std::size_t>(1, theCapacity / 100);
+      const std::size_t mainCapacity =
+          (theCapacity > itsWindowCapacity ? theCapacity - itsWindowCapacity : 0);
+      itsProtectedCapacity = mainCapacity * 4 / 5;
+      itsSketch.reset(theCapacity);
+      demote();
+    }
+
+    template <class... Args>
+    iterator emplace(Args&&... args)
+    {
+      itsWindow.emplace_back(std::forward<Args>(args)...);
+      auto it = std::prev(itsWindow.end());
+      it->policy.segment = Segment::Window;
+      itsWindowSize += it->size;
+      itsSize += it->size;
+
+      // Window overflow needs no contest while the cache is not full
+      while (itsWindowSize > itsWindowCapacity && itsSize <= itsCapacity && itsWindow.size() > 1)
+        admit(itsWindow.begin());
+
+      return it;
+    }
+
+    void erase(iterator it)
+    {
+      itsSize -= it->size;
+      switch (it->policy.segment)
+      {
+        case Segment::Window:
+          itsWindowSize -= it->size;
+          itsWindow.erase(it);
+          break;
+        case Segment::Probation:
+          itsProbation.erase(it);
+          break;
+        case Segment::Protected:
+          itsProtectedSize -= it->size;
+          itsProtected.erase(it);
+          break;
+      }
+    }
+
+    bool touchShared(iterator it) const
+    {
+      switch (it->policy.segment)
+      {
+        case Segment::Window:
+          return std::next(it) == itsWindow.end();
+        case Segment::Protected:
+          return std::next(it) == itsProtected.end();
+        case Segment::Probation:
+          break;
+      }
+      return false;  // promotion needed
+    }
+
+    void touch(iterator it)
+    {
+      switch (it->policy.segment)
+      {
+        case Segment::Window:
+          itsWindow.splice(itsWindow.end(), itsWindow, it);
+          break;
+        case Segment::Probation:
+          itsProtected.splice(itsProtected.end(), itsProbation, it);
+          it->policy.segment = Segment::Protected;
+          itsProtectedSize += it->size;
+          ++itsPromotions;
+          demote();
+          break;
+        case Segment::Protected:
+          itsProtected.splice(itsProtected.end(), itsProtected, it);
+          break;
+      }
+    }
+
+    void recordAccess(std::size_t theHash) { itsSketch.increment(theHash); }
+
+    iterator victim()
+    {
+      while (itsWindowSize > itsWindowCapacity && !itsWindow.empty())
+      {
+        auto candidate = itsWindow.begin();
+
+        if (itsProbation.empty() && itsProtected.empty())
+        {
+          admit(candidate);
+          continue;
+        }
+
+        auto victim = (!itsProbation.empty() ? itsProbation.begin() : itsProtected.begin());
+
+        if (itsSketch.estimate(candidate->hash) > itsSketch.estimate(victim->hash))
+        {
+          ++itsAdmissions;
+          admit(candidate);
+          return victim;
+        }
+
+        ++itsRejections;
+        return candidate;
+      }
+
+      if (!itsProbation.empty())
+        return itsProbation.begin();
+      if (!itsProtected.empty())
+        return itsProtected.begin();
+      return itsWindow.begin();
+    }
+
+    // Probation entries are the first eviction candidates
+    template <class F>
+    void forEach(F&& f) const
+    {
+      for (const auto& entry : itsProbation)
+        f(entry);
+      for (const auto& entry : itsProtected)
+        f(entry);
+      for (const auto& entry : itsWindow)
+        f(entry);
+    }
+
+    bool empty() const { return itsWindow.empty() && itsProbation.empty() && itsProtected.empty(); }
+
+    void clear()
+    {
+      itsWindow.clear();
+      itsProbation.clear();
+      itsProtected.clear();
+      itsSize = 0;
+      itsWindowSize = 0;
+      itsProtectedSize = 0;
+    }
+
+    void report(CacheStats& theStats) const
+    {
+      theStats.counters["tinylfu_admissions"] += itsAdmissions;
+      theStats.counters["tinylfu_rejections"] += itsRejections;
+      theStats.counters["tinylfu_promotions"] += itsPromotions;
+    }
+
+   private:
+    // Move a window entry to the MRU end of the probation segment
+    void admit(iterator it)
+    {
+      itsProbation.splice(itsProbation.end(), itsWindow, it);
+      it->policy.segment = Segment::Probation;
+      itsWindowSize -= it->size;
+    }
+
+    // Move protected LRU entries back to probation until the segment fits
+    void demote()
+    {
+      while (itsProtectedSize > itsProtectedCapacity && !itsProtected.empty())
+      {
+        auto it = itsProtected.begin();
+        itsProbation.splice(itsProbation.end(), itsProtected, it);
+        it->policy.segment = Segment::Probation;
+        itsProtectedSize -= it->size;
+      }
+    }
+
+    List itsWindow;
+    List itsProbation;
+    List itsProtected;
+    std::size_t itsSize = 0;
+    std::size_t itsWindowSize = 0;
+    std::size_t itsProtectedSize = 0;
+    std::size_t itsCapacity = 0;
+    std::size_t itsWindowCapacity = 1;
+    std::size_t itsProtectedCapacity = 0;
+    std::size_t itsAdmissions = 0;
+    std::size_t itsRejections = 0;
+    std::size_t itsPromotions = 0;
+    FrequencySketch itsSketch;
+  };
+};
+
+}  // namespace Cache
+}  // namespace Fmi
@@ -8,6 +8,7 @@
 
 #include "DateTime.h"
 #include <map>
+#include <string>
 
 namespace Fmi
 {
@@ -41,6 +42,7 @@ struct CacheStats
   std::size_t hits = 0;
   std::size_t misses = 0;
   std::size_t evictions = 0;
+  std::map<std::string, std::size_t> counters;  // policy and feature specific counters
 };
 
 using CacheStatistics = std::map<std::string, CacheStats>;
@@ -0,0 +1,96 @@
+#include "DeadlineScheduler.h"
+#include <algorithm>
+
+namespace Fmi
+{
+namespace ThreadPool
+{
+DeadlineScheduler::DeadlineScheduler(std::size_t maxSize, LateCallback onLate)
+    : itsMaxSize(maxSize), itsOnLate(std::move(onLate))
+{
+  itsDeadlineStats.name = "deadline";
+  itsNoDeadlineStats.name = "none";
+}
+
+SchedulerClassStatistics& DeadlineScheduler::stats(const Item& theItem)
+{
+  return (theItem.deadline == Clock::time_point::max() ? itsNoDeadlineStats : itsDeadlineStats);
+}
+
+bool DeadlineScheduler::push(const Task& theTask)
+{
+  return insert(Item{theTask, LateCallback(), Clock::time_point::max(), Clock::now(), 0});
+}
+
+bool DeadlineScheduler::push(const Task& theTask,
+                             Clock::time_point theDeadline,
+                             LateCallback onLate)
+{
+  return insert(Item{theTask, std::move(onLate), theDeadline, Clock::now(), 0});
+}
+
+bool DeadlineScheduler::insert(Item&& theItem)
+{
+  auto& counters = stats(theItem);
+  if (itsHeap.size() >= itsMaxSize)
+  {
+    ++counters.rejected;
+    return false;
+  }
+
+  theItem.serial = itsSerial++;
+  itsHeap.push_back(std::move(theItem));
+  std::push_heap(itsHeap.begin(), itsHeap.end(), later);
+  ++counters.scheduled;
+  return true;
+}
+
+// Late tasks without any callback are skipped here, the first one with a
+// callback is replaced by a task running the callback
+Task DeadlineScheduler::pop()
+{
+  const auto now = Clock::now();
+  while (!itsHeap.empty())
+  {
+    std::pop_heap(itsHeap.begin(), itsHeap.end(), later);
+    Item item = std::move(itsHeap.back());
+    itsHeap.pop_back();
+    auto& counters = stats(item);
+
+    if (item.deadline < now)
+    {
+      ++counters.dropped;
+      LateCallback onLate = (item.onLate ? std::move(item.onLate) : itsOnLate);
+      if (!onLate)
+        continue;
+      const auto lateness = now - item.deadline;
+      return [onLate, lateness]() { onLate(lateness); };
+    }
+
+    const auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(now - item.enqueued);
+    ++counters.started;
+    counters.totalWait += wait;
+    counters.maxWait = std::max(counters.maxWait, wait);
+    return std::move(item.task);
+  }
+
+  // Everything was late, the pool expects a task nevertheless
+  return []() {};
+}
+
+std::vector<SchedulerClassStatistics> DeadlineScheduler::statistics() const
+{
+  const auto now = Clock::now();
+  std::vector<SchedulerClassStatistics> ret{itsDeadlineStats, itsNoDeadlineStats};
+  for (const auto& item : itsHeap)
+  {
+    auto& counters = (item.deadline == Clock::time_point::max() ? ret[1] : ret[0]);
+    ++counters.depth;
+    const auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(now - item.enqueued);
+    counters.oldestWait = std::max(counters.oldestWait, wait);
+  }
+  return ret;
+}
+
+}  // namespace ThreadPool
+}  // namespace Fmi
@@ -0,0 +1,86 @@
+// ======================================================================
+/*!
+ * \brief Earliest deadline first scheduler for Fmi::ThreadPool
+ *
+ * Tasks are started in the order of their deadlines, tasks without a
+ * deadline after all tasks with one in FIFO order:
+ *
+ *   auto onLate = [](std::chrono::steady_clock::duration lateness) { ... };
+ *   ThreadPool<DeadlineScheduler> pool(8, 1000, "edf", onLate);
+ *   pool.schedule(task, std::chrono::steady_clock::now() + 200ms);
+ *   pool.schedule(task, deadline, taskSpecificOnLate);
+ *
+ * A task whose deadline has already passed when it would be started is
+ * dropped. Instead of the task the worker then runs its late callback,
+ * or the one given to the scheduler, with the lateness as the argument.
+ * The callbacks are hence called outside the pool mutex.
+ *
+ * Statistics are reported for the classes "deadline" and "none".
+ */
+// ======================================================================
+
+#pragma once
+
+#include "ThreadPool.h"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace Fmi
+{
+namespace ThreadPool
+{
+class DeadlineScheduler
+{
+ public:
+  using Clock = std::chrono::steady_clock;
+  using LateCallback = std::function<void(Clock::duration theLateness)>;
+
+  explicit DeadlineScheduler(std::size_t maxSize, LateCallback onLate = LateCallback());
+
+  bool push(const Task& theTask);  // no deadline
+  bool push(const Task& theTask,
+            Clock::time_point theDeadline,
+            LateCallback onLate = LateCallback());
+  Task pop();
+
+  std::size_t size() const { return itsHeap.size(); }
+  std::size_t maxSize() const { return itsMaxSize; }
+  bool empty() const { return itsHeap.empty(); }
+
+  std::vector<SchedulerClassStatistics> statistics() const;
+
+ private:
+  struct Item
+  {
+    Task task;
+    LateCallback onLate;
+    Clock::time_point deadline;
+    Clock::time_point enqueued;
+    std::uint64_t serial;  // FIFO order for equal deadlines
+  };
+
+  // Heap order, the earliest deadline at the front
+  static bool later(const Item& theItem, const Item& theOther)
+  {
+    if (theItem.deadline != theOther.deadline)
+      return theItem.deadline > theOther.deadline;
+    return theItem.serial > theOther.serial;
+  }
+
+  bool insert(Item&& theItem);
+  SchedulerClassStatistics& stats(const Item& theItem);
+
+  const std::size_t itsMaxSize;
+  const LateCallback itsOnLate;
+  std::vector<Item> itsHeap;
+  std::uint64_t itsSerial = 0;
+
+  SchedulerClassStatistics itsDeadlineStats;
+  SchedulerClassStatistics itsNoDeadlineStats;
+};
+
+}  // namespace ThreadPool
+}  // namespace Fmi
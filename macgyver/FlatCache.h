@@ -0,0 +1,410 @@
+// ======================================================================
+/*!
+ * \brief Sharded LRU cache with allocation-free flat shard storage
+ *
+ * An alternative layout to Fmi::Cache::Cache for caches with many small
+ * entries. Each shard keeps its entries in a contiguous slab linked into
+ * an LRU list by indices, and indexes them with an open-addressing hash
+ * table using SwissTable-style control bytes: a probe compares 16 control
+ * bytes holding 7 bits of the hash at once and touches the slab only on
+ * a likely match.
+ *
+ * With TrivialSizeFunction the slab and the table are preallocated from
+ * the maximum size, so inserts allocate only what the key and value
+ * types themselves allocate. Other size functions grow the slab on demand.
+ *
+ * Supports the basic Cache API: insert, upsert, find, clear, resize,
+ * size, maxSize and statistics, and can be selected as the storage of
+ * Fmi::LRUCache through its Storage template parameter.
+ */
+// ======================================================================
+
+#pragma once
+
+#include "Cache.h"
+#include <boost/functional/hash.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace Fmi
+{
+namespace Cache
+{
+template <class KeyType,
+          class ValueType,
+          class SizeFunc = TrivialSizeFunction<ValueType>,
+          std::size_t NumShards = 16>
+class FlatCache
+{
+ public:
+  FlatCache() : FlatCache(0) {}
+
+  FlatCache(const FlatCache& other) = delete;
+  FlatCache(FlatCache&& other) = delete;
+  FlatCache& operator=(const FlatCache& other) = delete;
+  FlatCache& operator=(FlatCache&& other) = delete;
+
+  explicit FlatCache(std::size_t maxSize)
+      : itsMaxSizePerShard((maxSize + NumShards - 1) / NumShards)
+  {
+    static_assert(NumShards > 0, "NumShards must be greater than 0");
+    for (auto& shard : itsShards)
+      preallocate(shard);
+  }
+
+  CacheStats statistics() const
+  {
+    CacheStats stats(itsStartTime);
+    stats.maxsize = itsMaxSizePerShard * NumShards;
+    for (const auto& shard : itsShards)
+    {
+      boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+      stats.size += shard.size;
+      stats.inserts += shard.insertCount;
+      stats.evictions += shard.evictionCount;
+      stats.hits += shard.hitCount.load(std::memory_order_relaxed);
+      stats.misses += shard.missCount.load(std::memory_order_relaxed);
+    }
+    return stats;
+  }
+
+  // Insert value; returns false if key already present or value exceeds shard capacity
+  bool insert(const KeyType& key, const ValueType& value) { return insertEntry(key, value, false); }
+
+  // Insert or replace value; returns false only if value exceeds shard capacity
+  bool upsert(const KeyType& key, const ValueType& value) { return insertEntry(key, value, true); }
+
+  std::optional<ValueType> find(const KeyType& key)
+  {
+    const std::size_t hash = boost::hash<KeyType>{}(key);
+    auto& shard = itsShards[getShardIndex(hash)];
+    boost::upgrade_lock<boost::shared_mutex> lock(shard.mutex);
+
+    const std::uint32_t index = lookup(shard, key, hash);
+    if (index == None)
+    {
+      shard.missCount.fetch_add(1, std::memory_order_relaxed);
+      return {};
+    }
+
+    shard.hitCount.fetch_add(1, std::memory_order_relaxed);
+    if (index == shard.tail)
+      return shard.nodes[index].item->second;
+
+    boost::upgrade_to_unique_lock<boost::shared_mutex> wlock(lock);
+    unlink(shard, index);
+    linkTail(shard, index);
+    return shard.nodes[index].item->second;
+  }
+
+  void clear()
+  {
+    for (auto& shard : itsShards)
+    {
+      boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
+      while (shard.head != None)
+        erase(shard, shard.head);
+    }
+  }
+
+  void resize(std::size_t newMaxSize)
+  {
+    itsMaxSizePerShard = (newMaxSize + NumShards - 1) / NumShards;
+    for (auto& shard : itsShards)
+    {
+      boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
+      evict(shard);
+      preallocate(shard);
+    }
+  }
+
+  std::size_t size() const
+  {
+    std::size_t total = 0;
+    for (const auto& shard : itsShards)
+    {
+      boost::shared_lock<boost::shared_mutex> lock(shard.mutex);
+      total += shard.size;
+    }
+    return total;
+  }
+
+  std::size_t maxSize() const { return itsMaxSizePerShard * NumShards; }
+
+ private:
+  static constexpr std::uint32_t None = 0xffffffff;
+  static constexpr std::size_t GroupWidth = 16;
+  static constexpr std::int8_t Empty = -128;
+  static constexpr std::int8_t Deleted = -2;
+
+  struct Node
+  {
+    std::optional<std::pair<KeyType, ValueType>> item;  // empty while on the free list
+    std::size_t size = 0;
+    std::uint32_t prev = None;
+    std::uint32_t next = None;  // also links the free list
+    std::uint32_t slot = 0;     // position in the hash table
+  };
+
+  struct Shard
+  {
+    std::vector<Node> nodes;          // slab, linked into the LRU list by index
+    std::vector<std::int8_t> ctrl;    // Empty, Deleted or the low 7 bits of the hash
+    std::vector<std::uint32_t> slots;  // slab index of each table position
+    std::uint32_t head = None;         // LRU
+    std::uint32_t tail = None;         // MRU
+    std::uint32_t freeList = None;
+    std::size_t count = 0;
+    std::size_t tombstones = 0;
+    std::size_t size = 0;
+    std::size_t insertCount = 0;
+    std::size_t evictionCount = 0;
+    mutable boost::shared_mutex mutex;
+    mutable std::atomic<std::size_t> hitCount{0};
+    mutable std::atomic<std::size_t> missCount{0};
+  };
+
+  static std::size_t getShardIndex(std::size_t hash)
+  {
+    constexpr std::size_t prime = 2654435761ULL;
+    return (hash * prime) % NumShards;
+  }
+
+  // boost::hash is the identity for integers, spread the bits before splitting
+  static std::uint64_t mix(std::size_t hash)
+  {
+    std::uint64_t x = hash * 0x9e3779b97f4a7c15ULL;
+    return x ^ (x >> 32);
+  }
+
+  static std::int8_t h2(std::uint64_t mixed) { return static_cast<std::int8_t>(mixed & 0x7f); }
+
+  // Bitmask of the positions in the group whose control byte equals the given one
+  static std::uint32_t match(const std::int8_t* group, std::int8_t value)
+  {
+#if defined(__SSE2__)
+    const __m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+    return static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(value))));
+#else
+    std::uint32_t mask = 0;
+    for (std::size_t i = 0; i < GroupWidth; i++)
+      if (group[i] == value)
+        mask |= (1u << i);
+    return mask;
+#endif
+  }
+
+  // Bitmask of the empty or deleted positions in the group
+  static std::uint32_t matchFree(const std::int8_t* group)
+  {
+#if defined(__SSE2__)
+    const __m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+    return static_cast<std::uint32_t>(_mm_movemask_epi8(ctrl));
+#else
+    std::uint32_t mask = 0;
+    for (std::size_t i = 0; i < GroupWidth; i++)
+      if (group[i] < 0)
+        mask |= (1u << i);
+    return mask;
+#endif
+  }
+
+  static int lowestBit(std::uint32_t mask) { return __builtin_ctz(mask); }
+
+  // Returns the slab index of the key or None. Probes whole groups with a
+  // triangular sequence, which visits every group of a power of two table.
+  std::uint32_t lookup(const Shard& shard, const KeyType& key, std::size_t hash) const
+  {
+    if (shard.count == 0)
+      return None;
+
+    const std::uint64_t mixed = mix(hash);
+    const std::size_t groupMask = shard.ctrl.size() / GroupWidth - 1;
+    std::size_t group = (mixed >> 7) & groupMask;
+    for (std::size_t step = 1;; step++)
+    {
+      const std::int8_t* ctrl = shard.ctrl.data() + group * GroupWidth;
+      for (std::uint32_t mask = match(ctrl, h2(mixed)); mask != 0; mask &= mask - 1)
+      {
+        const std::uint32_t index = shard.slots[group * GroupWidth + lowestBit(mask)];
+        if (shard.nodes[index].item->first == key)
+          return index;
+      }
+      if (match(ctrl, Empty) != 0 || step > groupMask)
+        return None;
+      group = (group + step) & groupMask;
+    }
+  }
+
+  // Place a slab index into the table; the caller makes sure there is room
+  static void place(Shard& shard, std::uint32_t index, std::size_t hash)
+  {
+    const std::uint64_t mixed = mix(hash);
+    const std::size_t groupMask = shard.ctrl.size() / GroupWidth - 1;
+    std::size_t group = (mixed >> 7) & groupMask;
+    for (std::size_t step = 1;; step++)
+    {
+      const std::uint32_t mask = matchFree(shard.ctrl.data() + group * GroupWidth);
+      if (mask != 0)
+      {
+        const std::size_t slot = group * GroupWidth + lowestBit(mask);
+        if (shard.ctrl[slot] == Deleted)
+          --shard.tombstones;
+        shard.ctrl[slot] = h2(mixed);
+        shard.slots[slot] = index;
+        shard.nodes[index].slot = static_cast<std::uint32_t>(slot);
+        return;
+      }
+      group = (group + step) & groupMask;
+    }
+  }
+
+  // Rebuild the table with the given number of positions, dropping tombstones
+  static void rehash(Shard& shard, std::size_t capacity)
+  {
+    shard.ctrl.assign(capacity, Empty);
+    shard.slots.assign(capacity, None);
+    shard.tombstones = 0;
+    for (std::uint32_t index = shard.head; index != None; index = shard.nodes[index].next)
+      place(shard, index, boost::hash<KeyType>{}(shard.nodes[index].item->first));
+  }
+
+  // Table positions needed for the given number of entries at 7/8 load
+  static std::size_t tableCapacity(std::size_t entries)
+  {
+    std::size_t capacity = GroupWidth;
+    while (capacity * 7 / 8 < entries)
+      capacity *= 2;
+    return capacity;
+  }
+
+  // Reserve the slab and the table when the entry count limit is known
+  void preallocate(Shard& shard)
+  {
+    std::size_t entries = shard.count;
+    if constexpr (std::is_same_v<SizeFunc, TrivialSizeFunction<ValueType>>)
+    {
+      entries = std::max(entries, itsMaxSizePerShard);
+      shard.nodes.reserve(entries);
+    }
+    const std::size_t capacity = tableCapacity(entries);
+    if (capacity > shard.ctrl.size())
+      rehash(shard, capacity);
+  }
+
+  bool insertEntry(const KeyType& key, const ValueType& value, bool replace)
+  {
+    const std::size_t hash = boost::hash<KeyType>{}(key);
+    auto& shard = itsShards[getShardIndex(hash)];
+    boost::unique_lock<boost::shared_mutex> lock(shard.mutex);
+
+    const std::uint32_t existing = lookup(shard, key, hash);
+    if (existing != None)
+    {
+      if (!replace)
+        return false;
+      erase(shard, existing);
+    }
+
+    const std::size_t valueSize = SizeFunc::getSize(value);
+    if (valueSize > itsMaxSizePerShard)
+      return false;
+
+    shard.size += valueSize;
+    evict(shard);
+
+    // Drop tombstones in place, or grow if the live entries alone need the room
+    if (shard.count + shard.tombstones + 1 > shard.ctrl.size() * 7 / 8)
+    {
+      std::size_t capacity = shard.ctrl.size();
+      if (shard.count + 1 > capacity * 7 / 16)
+        capacity *= 2;
+      rehash(shard, capacity);
+    }
+
+    std::uint32_t index = shard.freeList;
+    if (index != None)
+      shard.freeList = shard.nodes[index].next;
+    else
+    {
+      index = static_cast<std::uint32_t>(shard.nodes.size());
+      shard.nodes.emplace_back();
+    }
+
+    auto& node = shard.nodes[index];
+    node.item.emplace(key, value);
+    node.size = valueSize;
+    linkTail(shard, index);
+    place(shard, index, hash);
+    ++shard.count;
+    ++shard.insertCount;
+    return true;
+  }
+
+  // Evict LRU entries until the shard is within capacity (exclusive lock held)
+  void evict(Shard& shard)
+  {
+    while (shard.size > itsMaxSizePerShard && shard.head != None)
+    {
+      erase(shard, shard.head);
+      ++shard.evictionCount;
+    }
+  }
+
+  // Remove an entry and return its node to the free list
+  static void erase(Shard& shard, std::uint32_t index)
+  {
+    auto& node = shard.nodes[index];
+    shard.ctrl[node.slot] = Deleted;
+    ++shard.tombstones;
+    shard.size -= node.size;
+    --shard.count;
+    unlink(shard, index);
+    node.item.reset();
+    node.next = shard.freeList;
+    shard.freeList = index;
+  }
+
+  static void unlink(Shard& shard, std::uint32_t index)
+  {
+    auto& node = shard.nodes[index];
+    if (node.prev != None)
+      shard.nodes[node.prev].next = node.next;
+    else
+      shard.head = node.next;
+    if (node.next != None)
+      shard.nodes[node.next].prev = node.prev;
+    else
+      shard.tail = node.prev;
+    node.prev = node.next = None;
+  }
+
+  static void linkTail(Shard& shard, std::uint32_t index)
+  {
+    auto& node = shard.nodes[index];
+    node.prev = shard.tail;
+    node.next = None;
+    if (shard.tail != None)
+      shard.nodes[shard.tail].next = index;
+    else
+      shard.head = index;
+    shard.tail = index;
+  }
+
+  std::array<Shard, NumShards> itsShards;
+  std::size_t itsMaxSizePerShard = 0;
+  const DateTime itsStartTime = Fmi::SecondClock::universal_time();
+};
+
+}  // namespace Cache
+}  // namespace Fmi
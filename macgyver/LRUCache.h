@@ -1,5 +1,7 @@
 // Thin wrapper around Fmi::Cache::Cache providing the LRUCache API
 // (put/get/getStats) for backward compatibility with existing call sites.
+// The shard storage can be switched to Fmi::Cache::FlatCache (FlatCache.h).
+// BasicLRUCache takes the key type as a parameter, LRUCache uses std::size_t.
 
 #pragma once
 
@@ -7,22 +9,48 @@
 #include <cstddef>
 #include <memory>
 #include <optional>
+#include <type_traits>
 
 namespace Fmi
 {
-template <typename T, std::size_t NumShards = 32>
-class LRUCache
+template <typename KeyType,
+          typename T,
+          std::size_t NumShards = 32,
+          template <class, class, class, std::size_t> class Storage = Fmi::Cache::Cache>
+class BasicLRUCache
 {
   using ValueType = std::shared_ptr<T>;
-  Fmi::Cache::Cache<std::size_t, ValueType, Fmi::Cache::TrivialSizeFunction<ValueType>, NumShards>
-      itsCache;
+  using StorageType =
+      Storage<KeyType, ValueType, Fmi::Cache::TrivialSizeFunction<ValueType>, NumShards>;
+  StorageType itsCache;
 
  public:
-  explicit LRUCache(std::size_t total_capacity) : itsCache(total_capacity) {}
+  explicit BasicLRUCache(std::size_t total_capacity) : itsCache(total_capacity) {}
 
-  void put(std::size_t key, const ValueType& value) { itsCache.upsert(key, value); }
+  void put(const KeyType& key, const ValueType& value) { itsCache.upsert(key, value); }
 
-  std::optional<ValueType> get(std::size_t key) { return itsCache.find(key); }
+  std::optional<ValueType> get(const KeyType& key) { return itsCache.find(key); }
+
+  // Lookups with equivalent keys of other types and with precomputed hashes,
+  // available with Fmi::Cache::Cache storage
+  template <typename K,
+            typename = std::enable_if_t<Fmi::Cache::IsCacheLookupKey<KeyType, K>::value>>
+  std::optional<ValueType> get(const K& key)
+  {
+    return itsCache.find(key);
+  }
+
+  template <typename K>
+  std::optional<ValueType> get(const K& key, const Fmi::HashValue& hash)
+  {
+    return itsCache.find(key, hash);
+  }
+
+  template <typename K>
+  static Fmi::HashValue hashKey(const K& key)
+  {
+    return StorageType::hashKey(key);
+  }
 
   Fmi::Cache::CacheStats getStats() const { return itsCache.statistics(); }
 
@@ -31,4 +59,13 @@ class LRUCache
   std::size_t getCapacityPerShard() const { return itsCache.maxSize() / NumShards; }
 };
 
+template <typename T,
+          std::size_t NumShards = 32,
+          template <class, class, class, std::size_t> class Storage = Fmi::Cache::Cache>
+class LRUCache : public BasicLRUCache<std::size_t, T, NumShards, Storage>
+{
+ public:
+  using BasicLRUCache<std::size_t, T, NumShards, Storage>::BasicLRUCache;
+};
+
 }  // namespace Fmi
@@ -0,0 +1,257 @@
+#include "MemoryGovernor.h"
+#include "Exception.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+
+namespace Fmi
+{
+namespace Cache
+{
+namespace
+{
+// Parse "some avg10=1.23 avg60=..." from a PSI file
+std::optional<double> readSomeAvg10(const std::filesystem::path& path)
+{
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line))
+  {
+    std::istringstream fields(line);
+    std::string kind;
+    fields >> kind;
+    if (kind != "some")
+      continue;
+    std::string field;
+    while (fields >> field)
+    {
+      if (field.compare(0, 6, "avg10=") == 0)
+      {
+        try
+        {
+          return std::stod(field.substr(6));
+        }
+        catch (...)
+        {
+          return {};
+        }
+      }
+    }
+  }
+  return {};
+}
+
+// Read a byte count, "max" and missing files yield nothing
+std::optional<std::size_t> readBytes(const std::filesystem::path& path)
+{
+  std::ifstream in(path);
+  std::string value;
+  if (!(in >> value) || value == "max")
+    return {};
+  try
+  {
+    return static_cast<std::size_t>(std::stoull(value));
+  }
+  catch (...)
+  {
+    return {};
+  }
+}
+
+}  // namespace
+
+std::optional<double> MemoryPressure::usage() const
+{
+  if (!current || !limit || *limit == 0)
+    return {};
+  return static_cast<double>(*current) / static_cast<double>(*limit);
+}
+
+MemoryGovernor::MemoryGovernor(MemoryGovernorOptions options) : itsOptions(std::move(options))
+{
+  if (!(itsOptions.shrinkFactor > 0 && itsOptions.shrinkFactor < 1))
+    throw Fmi::Exception(BCP, "Memory governor shrink factor must be in range (0,1)");
+  if (!(itsOptions.minFraction > 0 && itsOptions.minFraction <= 1))
+    throw Fmi::Exception(BCP, "Memory governor minimum fraction must be in range (0,1]");
+}
+
+MemoryGovernor::~MemoryGovernor()
+{
+  stop();
+}
+
+void MemoryGovernor::add(const std::string& name,
+                         int priority,
+                         std::size_t nominalSize,
+                         std::function<void(std::size_t)> resize)
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  for (const auto& cache : itsCaches)
+    if (cache.name == name)
+      throw Fmi::Exception(BCP, "Cache already registered to the memory governor")
+          .addParameter("Name", name);
+
+  Governed cache{name, priority, nominalSize, nominalSize, std::move(resize)};
+  auto pos = std::upper_bound(itsCaches.begin(),
+                              itsCaches.end(),
+                              priority,
+                              [](int p, const Governed& c) { return p < c.priority; });
+  itsCaches.insert(pos, std::move(cache));
+}
+
+bool MemoryGovernor::remove(const std::string& name)
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  auto it = std::find_if(
+      itsCaches.begin(), itsCaches.end(), [&name](const Governed& c) { return c.name == name; });
+  if (it == itsCaches.end())
+    return false;
+  if (it->currentSize != it->nominalSize)
+    it->resize(it->nominalSize);
+  itsCaches.erase(it);
+  return true;
+}
+
+std::filesystem::path MemoryGovernor::cgroupDirectory() const
+{
+  if (!itsOptions.cgroupDirectory.empty())
+    return itsOptions.cgroupDirectory;
+
+  // cgroup v2 has a single "0::/path" entry
+  std::ifstream in(itsOptions.procDirectory / "self" / "cgroup");
+  std::string line;
+  while (std::getline(in, line))
+    if (line.compare(0, 3, "0::") == 0)
+      return itsOptions.cgroupRoot / std::filesystem::path(line.substr(3)).relative_path();
+  return itsOptions.cgroupRoot;
+}
+
+MemoryPressure MemoryGovernor::readPressure() const
+{
+  MemoryPressure pressure;
+  pressure.someAvg10 = readSomeAvg10(itsOptions.procDirectory / "pressure" / "memory");
+  const auto cgroup = cgroupDirectory();
+  pressure.current = readBytes(cgroup / "memory.current");
+  pressure.limit = readBytes(cgroup / "memory.max");
+  return pressure;
+}
+
+MemoryGovernor::Action MemoryGovernor::update()
+{
+  try
+  {
+    const MemoryPressure pressure = readPressure();
+    const auto usage = pressure.usage();
+
+    const bool high = ((pressure.someAvg10 && *pressure.someAvg10 >= itsOptions.pressureHigh) ||
+                       (usage && *usage >= itsOptions.usageHigh));
+    const bool low = ((!pressure.someAvg10 || *pressure.someAvg10 < itsOptions.pressureLow) &&
+                      (!usage || *usage < itsOptions.usageLow));
+
+    std::lock_guard<std::mutex> lock(itsMutex);
+    itsPressure = pressure;
+    if (high && shrink())
+    {
+      ++itsShrinks;
+      return Action::Shrink;
+    }
+    if (low && grow())
+    {
+      ++itsGrows;
+      return Action::Grow;
+    }
+    return Action::None;
+  }
+  catch (...)
+  {
+    throw Fmi::Exception::Trace(BCP, "Memory governor update failed!");
+  }
+}
+
+// Shrink the caches of the lowest priority which can still shrink
+bool MemoryGovernor::shrink()
+{
+  std::optional<int> level;
+  for (auto& cache : itsCaches)
+  {
+    if (level && cache.priority != *level)
+      break;
+    const auto minSize = std::max<std::size_t>(
+        1, static_cast<std::size_t>(itsOptions.minFraction * cache.nominalSize));
+    if (cache.currentSize <= minSize)
+      continue;
+    const auto newSize = std::max(
+        minSize, static_cast<std::size_t>(itsOptions.shrinkFactor * cache.currentSize));
+    cache.resize(newSize);
+    cache.currentSize = newSize;
+    level = cache.priority;
+  }
+  return level.has_value();
+}
+
+// Grow the caches of the highest priority which have been shrunk. Rounding up and
+// growing by at least one guarantees progress for tiny sizes.
+bool MemoryGovernor::grow()
+{
+  std::optional<int> level;
+  for (auto it = itsCaches.rbegin(); it != itsCaches.rend(); ++it)
+  {
+    auto& cache = *it;
+    if (level && cache.priority != *level)
+      break;
+    if (cache.currentSize >= cache.nominalSize)
+      continue;
+    const auto grown = static_cast<std::size_t>(
+        std::ceil(static_cast<double>(cache.currentSize) / itsOptions.shrinkFactor));
+    const auto newSize = std::min(cache.nominalSize, std::max(cache.currentSize + 1, grown));
+    cache.resize(newSize);
+    cache.currentSize = newSize;
+    level = cache.priority;
+  }
+  return level.has_value();
+}
+
+void MemoryGovernor::start()
+{
+  if (!itsTask)
+    itsTask = std::make_unique<Fmi::AsyncTask>("upd-mem-gov", [this]() { run(); });
+}
+
+// The task destructor interrupts the sleep and joins the thread
+void MemoryGovernor::stop()
+{
+  itsTask.reset();
+}
+
+void MemoryGovernor::run()
+{
+  while (true)
+  {
+    boost::this_thread::sleep_for(boost::chrono::milliseconds(itsOptions.interval.count()));
+    try
+    {
+      update();
+    }
+    catch (...)
+    {
+      Fmi::Exception::Trace(BCP, "Memory governor failed to resize caches").printError();
+    }
+  }
+}
+
+MemoryGovernorStatus MemoryGovernor::status() const
+{
+  std::lock_guard<std::mutex> lock(itsMutex);
+  MemoryGovernorStatus ret;
+  ret.pressure = itsPressure;
+  ret.shrinks = itsShrinks;
+  ret.grows = itsGrows;
+  for (const auto& cache : itsCaches)
+    ret.caches.push_back(
+        GovernedCacheStatus{cache.name, cache.priority, cache.nominalSize, cache.currentSize});
+  return ret;
+}
+
+}  // namespace Cache
+}  // namespace Fmi
@@ -0,0 +1,163 @@
+// ======================================================================
+/*!
+ * \brief Resizes caches according to the memory pressure of the host
+ *
+ * The governor reads the Linux pressure stall information
+ *
+ *   <proc>/pressure/memory    "some avg10=..." is used
+ *
+ * and the cgroup v2 memory usage and limit of the process
+ *
+ *   <cgroup>/memory.current
+ *   <cgroup>/memory.max       "max" if unlimited
+ *
+ * The cgroup directory is found from <proc>/self/cgroup unless given in
+ * the options. Missing files are treated as no pressure, so the governor
+ * does nothing on systems without PSI or cgroup v2.
+ *
+ * Under pressure each update shrinks the registered caches with the
+ * lowest priority number which have not reached their minimum size.
+ * When the pressure has cleared each update grows back the caches with
+ * the highest priority number which are below their nominal size, the
+ * size they had when registered. In between the sizes are kept.
+ *
+ *   MemoryGovernor governor;
+ *   governor.add("products", productCache, 0);  // shrunk first
+ *   governor.add("metadata", metadataCache, 10);
+ *   governor.start();
+ *
+ * Caches must outlive the governor, or be removed from it first.
+ */
+// ======================================================================
+
+#pragma once
+
+#include "AsyncTask.h"
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace Fmi
+{
+namespace Cache
+{
+struct MemoryGovernorOptions
+{
+  std::filesystem::path procDirectory = "/proc";
+  std::filesystem::path cgroupRoot = "/sys/fs/cgroup";
+  std::filesystem::path cgroupDirectory;  // found from <proc>/self/cgroup if empty
+
+  double pressureHigh = 10.0;  // PSI "some avg10" percentage which starts shrinking
+  double pressureLow = 1.0;    // and below which caches may grow back
+  double usageHigh = 0.90;     // memory.current / memory.max which starts shrinking
+  double usageLow = 0.80;      // and below which caches may grow back
+
+  double shrinkFactor = 0.75;  // new size relative to the old one when shrinking
+  double minFraction = 0.25;   // smallest size relative to the nominal size
+  std::chrono::milliseconds interval{1000};
+};
+
+// Memory state of the host as seen by the governor
+struct MemoryPressure
+{
+  std::optional<double> someAvg10;     // PSI percentage
+  std::optional<std::size_t> current;  // cgroup memory use in bytes
+  std::optional<std::size_t> limit;    // cgroup memory limit in bytes
+
+  std::optional<double> usage() const;  // current / limit
+};
+
+struct GovernedCacheStatus
+{
+  std::string name;
+  int priority = 0;
+  std::size_t nominalSize = 0;
+  std::size_t currentSize = 0;
+};
+
+struct MemoryGovernorStatus
+{
+  MemoryPressure pressure;
+  std::size_t shrinks = 0;
+  std::size_t grows = 0;
+  std::vector<GovernedCacheStatus> caches;
+};
+
+class MemoryGovernor
+{
+ public:
+  enum class Action
+  {
+    None,
+    Shrink,
+    Grow
+  };
+
+  explicit MemoryGovernor(MemoryGovernorOptions options = MemoryGovernorOptions());
+  ~MemoryGovernor();
+
+  MemoryGovernor(const MemoryGovernor& other) = delete;
+  MemoryGovernor(MemoryGovernor&& other) = delete;
+  MemoryGovernor& operator=(const MemoryGovernor& other) = delete;
+  MemoryGovernor& operator=(MemoryGovernor&& other) = delete;
+
+  // Register a cache with its current maximum size as the nominal size
+  template <class CacheType>
+  void add(const std::string& name, CacheType& cache, int priority)
+  {
+    add(name,
+        priority,
+        cache.maxSize(),
+        [&cache](std::size_t size) { cache.resize(size); });
+  }
+
+  void add(const std::string& name,
+           int priority,
+           std::size_t nominalSize,
+           std::function<void(std::size_t)> resize);
+
+  // Restores the nominal size of the cache before forgetting it
+  bool remove(const std::string& name);
+
+  // Check the pressure once and resize if necessary
+  Action update();
+
+  // Run update() periodically in the background
+  void start();
+  void stop();
+
+  MemoryPressure readPressure() const;
+  MemoryGovernorStatus status() const;
+
+ private:
+  struct Governed
+  {
+    std::string name;
+    int priority = 0;
+    std::size_t nominalSize = 0;
+    std::size_t currentSize = 0;
+    std::function<void(std::size_t)> resize;
+  };
+
+  std::filesystem::path cgroupDirectory() const;
+  void run();
+  bool shrink();
+  bool grow();
+
+  const MemoryGovernorOptions itsOptions;
+  mutable std::mutex itsMutex;
+  std::vector<Governed> itsCaches;  // in priority order
+  MemoryPressure itsPressure;
+  std::size_t itsShrinks = 0;
+  std::size_t itsGrows = 0;
+  std::unique_ptr<Fmi::AsyncTask> itsTask;
+};
+
+}  // namespace Cache
+}  // namespace Fmi
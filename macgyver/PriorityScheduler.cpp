@@ -0,0 +1,110 @@
+#include "PriorityScheduler.h"
+#include "Exception.h"
+#include <algorithm>
+
+namespace Fmi
+{
+namespace ThreadPool
+{
+PriorityScheduler::PriorityScheduler(std::size_t maxSize, PrioritySchedulerOptions options)
+    : itsMaxSize(maxSize), itsOptions(options), itsLevels(options.levels)
+{
+  if (itsOptions.levels == 0)
+    throw Fmi::Exception(BCP, "Priority scheduler must have at least one level");
+  if (itsOptions.defaultLevel >= itsOptions.levels)
+    throw Fmi::Exception(BCP, "Default priority level out of range")
+        .addParameter("Level", std::to_string(itsOptions.defaultLevel))
+        .addParameter("Levels", std::to_string(itsOptions.levels));
+
+  for (std::size_t i = 0; i < itsLevels.size(); i++)
+    itsLevels[i].stats.name = std::to_string(i);
+}
+
+bool PriorityScheduler::push(const Task& theTask)
+{
+  return push(theTask, itsOptions.defaultLevel);
+}
+
+bool PriorityScheduler::push(const Task& theTask, std::size_t thePriority)
+{
+  if (thePriority >= itsLevels.size())
+    throw Fmi::Exception(BCP, "Task priority out of range")
+        .addParameter("Priority", std::to_string(thePriority))
+        .addParameter("Levels", std::to_string(itsLevels.size()));
+
+  auto& level = itsLevels[thePriority];
+  if (itsSize >= itsMaxSize)
+  {
+    ++level.stats.rejected;
+    return false;
+  }
+
+  level.queue.push_back(Item{theTask, Clock::now()});
+  ++level.stats.scheduled;
+  ++itsSize;
+  return true;
+}
+
+// Only the heads need to be compared, they have waited longest in their levels
+Task PriorityScheduler::pop()
+{
+  const auto now = Clock::now();
+  const auto aging = std::chrono::duration_cast<Clock::duration>(itsOptions.aging);
+
+  std::size_t best = itsLevels.size();
+  std::size_t mostUrgent = itsLevels.size();
+  long long bestRank = 0;
+  for (std::size_t i = 0; i < itsLevels.size(); i++)
+  {
+    const auto& queue = itsLevels[i].queue;
+    if (queue.empty())
+      continue;
+    if (mostUrgent == itsLevels.size())
+      mostUrgent = i;
+
+    long long rank = static_cast<long long>(i);
+    if (aging.count() > 0)
+      rank -= static_cast<long long>((now - queue.front().enqueued) / aging);
+
+    if (best == itsLevels.size() || rank < bestRank ||
+        (rank == bestRank && queue.front().enqueued < itsLevels[best].queue.front().enqueued))
+    {
+      best = i;
+      bestRank = rank;
+    }
+  }
+
+  auto& level = itsLevels[best];
+  Item item = std::move(level.queue.front());
+  level.queue.pop_front();
+  --itsSize;
+
+  const auto wait = std::chrono::duration_cast<std::chrono::nanoseconds>(now - item.enqueued);
+  auto& stats = level.stats;
+  ++stats.started;
+  stats.totalWait += wait;
+  stats.maxWait = std::max(stats.maxWait, wait);
+  if (best != mostUrgent)
+    ++stats.promoted;
+
+  return std::move(item.task);
+}
+
+std::vector<SchedulerClassStatistics> PriorityScheduler::statistics() const
+{
+  const auto now = Clock::now();
+  std::vector<SchedulerClassStatistics> ret;
+  for (const auto& level : itsLevels)
+  {
+    ret.push_back(level.stats);
+    auto& stats = ret.back();
+    stats.depth = level.queue.size();
+    if (!level.queue.empty())
+      stats.oldestWait =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(now - level.queue.front().enqueued);
+  }
+  return ret;
+}
+
+}  // namespace ThreadPool
+}  // namespace Fmi
@@ -0,0 +1,81 @@
+// ======================================================================
+/*!
+ * \brief Multi-level priority scheduler for Fmi::ThreadPool
+ *
+ * Tasks are queued in FIFO order within a fixed number of priority
+ * levels, level 0 being the most urgent:
+ *
+ *   PrioritySchedulerOptions options;  // levels 0,1,2 with 100 ms aging
+ *   ThreadPool<PriorityScheduler> pool(8, 1000, "prio", options);
+ *   pool.schedule(interactiveTask, 0);
+ *   pool.schedule(batchTask, 2);
+ *   pool.schedule(otherTask);  // options.defaultLevel
+ *
+ * Aging protects the less urgent levels from starvation: a task which has
+ * waited for N aging intervals competes as if it were N levels more
+ * urgent, and ties go to the task which has waited longer. A task of
+ * level L is hence started at the latest about (L+1) aging intervals after
+ * it has reached the head of its own level.
+ *
+ * Statistics are reported per level, see ThreadPool::getSchedulerStatistics().
+ */
+// ======================================================================
+
+#pragma once
+
+#include "ThreadPool.h"
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+namespace Fmi
+{
+namespace ThreadPool
+{
+struct PrioritySchedulerOptions
+{
+  std::size_t levels = 3;
+  std::size_t defaultLevel = 1;          // for tasks scheduled without a priority
+  std::chrono::milliseconds aging{100};  // zero disables aging
+};
+
+class PriorityScheduler
+{
+ public:
+  explicit PriorityScheduler(std::size_t maxSize,
+                             PrioritySchedulerOptions options = PrioritySchedulerOptions());
+
+  bool push(const Task& theTask);
+  bool push(const Task& theTask, std::size_t thePriority);
+  Task pop();
+
+  std::size_t size() const { return itsSize; }
+  std::size_t maxSize() const { return itsMaxSize; }
+  bool empty() const { return itsSize == 0; }
+
+  std::vector<SchedulerClassStatistics> statistics() const;
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Item
+  {
+    Task task;
+    Clock::time_point enqueued;
+  };
+
+  struct Level
+  {
+    std::deque<Item> queue;
+    SchedulerClassStatistics stats;
+  };
+
+  const std::size_t itsMaxSize;
+  const PrioritySchedulerOptions itsOptions;
+  std::size_t itsSize = 0;
+  std::vector<Level> itsLevels;
+};
+
+}  // namespace ThreadPool
+}  // namespace Fmi
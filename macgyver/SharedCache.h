@@ -0,0 +1,540 @@
+// ======================================================================
+/*!
+ * \brief Sharded LRU cache in a named POSIX shared memory segment
+ *
+ * Several processes on the same host can open the same SharedCache by
+ * name and share its contents instead of each holding a copy. The first
+ * process to open the segment creates it, the rest attach to it and use
+ * its original maximum size.
+ *
+ *   SharedCache<std::size_t, std::string> cache("smartmet-products", 512 * 1024 * 1024);
+ *   cache.insert(hash, product);
+ *   auto product = cache.find(hash);
+ *
+ * Keys must be trivially copyable. Values may be trivially copyable or
+ * std::string blobs, both are stored as bytes. The size of the cache is
+ * accounted in stored key and value bytes. The segment also holds the
+ * container nodes, hence it is by default twice the maximum size; if it
+ * still fills up least recently used entries are evicted to make room.
+ *
+ * The containers use offset pointers, since the segment may be mapped
+ * at a different address in each process. Each shard is protected by a
+ * robust process-shared mutex: if a process dies holding it, the next
+ * locker takes over, and if the shard was being modified at the time it
+ * is reset to empty. The nodes of the reset shard are leaked into the
+ * segment, reported as "lock_recoveries" in the statistics. The segment
+ * allocator uses robust mutexes too, but cannot repair its own state.
+ *
+ * The segment persists until remove() is called for it, even if no
+ * process has it open.
+ */
+// ======================================================================
+
+#pragma once
+
+#include "CacheStats.h"
+#include "Exception.h"
+#include <boost/functional/hash.hpp>
+#include <boost/interprocess/allocators/allocator.hpp>
+#include <boost/interprocess/containers/list.hpp>
+#include <boost/interprocess/containers/vector.hpp>
+#include <boost/interprocess/indexes/iset_index.hpp>
+#include <boost/interprocess/managed_shared_memory.hpp>
+#include <boost/interprocess/mem_algo/rbtree_best_fit.hpp>
+#include <boost/unordered_map.hpp>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <new>
+#include <optional>
+#include <pthread.h>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+namespace Fmi
+{
+namespace Cache
+{
+// ----------------------------------------------------------------------
+/*!
+ * \brief Conversion of SharedCache values to and from stored bytes
+ */
+// ----------------------------------------------------------------------
+
+template <typename ValueType, typename Enable = void>
+struct SharedValueTraits
+{
+  static_assert(std::is_trivially_copyable<ValueType>::value,
+                "SharedCache values must be trivially copyable or std::string");
+
+  static constexpr std::uint32_t Kind = sizeof(ValueType);
+  static std::size_t size(const ValueType& /* theValue */) { return sizeof(ValueType); }
+  static const char* data(const ValueType& theValue)
+  {
+    return reinterpret_cast<const char*>(&theValue);
+  }
+  static ValueType read(const char* theData, std::size_t /* theSize */)
+  {
+    ValueType value;
+    std::memcpy(&value, theData, sizeof(ValueType));
+    return value;
+  }
+};
+
+template <>
+struct SharedValueTraits<std::string>
+{
+  static constexpr std::uint32_t Kind = 0;  // variable size
+  static std::size_t size(const std::string& theValue) { return theValue.size(); }
+  static const char* data(const std::string& theValue) { return theValue.data(); }
+  static std::string read(const char* theData, std::size_t theSize)
+  {
+    return std::string(theData, theSize);
+  }
+};
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Robust process-shared mutex
+ *
+ * lock() returns false if the previous owner died holding the mutex, in
+ * which case the protected data may be inconsistent.
+ */
+// ----------------------------------------------------------------------
+
+template <bool Recursive>
+class BasicSharedCacheMutex
+{
+ public:
+  BasicSharedCacheMutex()
+  {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (Recursive)
+      pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    const int rc = pthread_mutex_init(&itsMutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (rc != 0)
+      throw Fmi::Exception(BCP, "Failed to initialize a process-shared mutex")
+          .addParameter("Error", std::strerror(rc));
+  }
+
+  BasicSharedCacheMutex(const BasicSharedCacheMutex& other) = delete;
+  BasicSharedCacheMutex& operator=(const BasicSharedCacheMutex& other) = delete;
+
+  bool lock() { return check(pthread_mutex_lock(&itsMutex)); }
+
+  bool try_lock()
+  {
+    const int rc = pthread_mutex_trylock(&itsMutex);
+    if (rc == EBUSY)
+      return false;
+    check(rc);
+    return true;
+  }
+
+  void unlock() { pthread_mutex_unlock(&itsMutex); }
+
+ private:
+  bool check(int rc)
+  {
+    if (rc == EOWNERDEAD)
+    {
+      pthread_mutex_consistent(&itsMutex);
+      return false;
+    }
+    if (rc != 0)
+      throw Fmi::Exception(BCP, "Failed to lock a process-shared mutex")
+          .addParameter("Error", std::strerror(rc));
+    return true;
+  }
+
+  pthread_mutex_t itsMutex;
+};
+
+using SharedCacheMutex = BasicSharedCacheMutex<false>;
+
+// Robust mutexes for the segment allocator and its index of named objects
+struct SharedCacheMutexFamily
+{
+  using mutex_type = BasicSharedCacheMutex<false>;
+  using recursive_mutex_type = BasicSharedCacheMutex<true>;
+};
+
+template <typename KeyType, typename ValueType, std::size_t NumShards = 16>
+class SharedCache
+{
+ public:
+  // ----------------------------------------------------------------------
+  /*!
+   * \brief Create or open the named cache
+   *
+   * maxSize is the maximum number of stored key and value bytes. A zero
+   * segmentSize selects twice the maximum size plus some room for the
+   * bookkeeping. Both are ignored if the segment exists already.
+   */
+  // ----------------------------------------------------------------------
+
+  SharedCache(const std::string& name, std::size_t maxSize, std::size_t segmentSize = 0)
+  {
+    static_assert(NumShards > 0, "NumShards must be greater than 0");
+    static_assert(std::is_trivially_copyable<KeyType>::value,
+                  "SharedCache keys must be trivially copyable");
+    try
+    {
+      if (segmentSize == 0)
+        segmentSize = 2 * maxSize + MinSegmentSize;
+      itsSegment = Segment(boost::interprocess::open_or_create, name.c_str(), segmentSize);
+      itsHeader = itsSegment.find_or_construct<Header>(HeaderName)(
+          itsSegment.get_segment_manager(), maxSize);
+
+      if (itsHeader->magic != Magic || itsHeader->numShards != NumShards ||
+          itsHeader->keySize != sizeof(KeyType) ||
+          itsHeader->valueKind != SharedValueTraits<ValueType>::Kind)
+      {
+        Fmi::Exception ex(BCP, "Shared memory cache was created with a different layout");
+        ex.addParameter("Name", name);
+        throw ex;
+      }
+    }
+    catch (...)
+    {
+      throw Fmi::Exception::Trace(BCP, "Failed to open shared memory cache")
+          .addParameter("Name", name);
+    }
+  }
+
+  SharedCache(const SharedCache& other) = delete;
+  SharedCache(SharedCache&& other) = delete;
+  SharedCache& operator=(const SharedCache& other) = delete;
+  SharedCache& operator=(SharedCache&& other) = delete;
+
+  // Remove the named segment. Processes having it open keep their mapping.
+  static bool remove(const std::string& name)
+  {
+    return boost::interprocess::shared_memory_object::remove(name.c_str());
+  }
+
+  // Insert value; returns false if key already present or value exceeds shard capacity
+  bool insert(const KeyType& key, const ValueType& value) { return insertEntry(key, value, false); }
+
+  // Insert or replace value; returns false only if value exceeds shard capacity
+  bool upsert(const KeyType& key, const ValueType& value) { return insertEntry(key, value, true); }
+
+  std::optional<ValueType> find(const KeyType& key)
+  {
+    const std::size_t hash = boost::hash<KeyType>{}(key);
+    auto& shard = itsHeader->shards[getShardIndex(hash)];
+    ShardLock lock(*this, shard);
+
+    auto mapIt = shard.map.find(key);
+    if (mapIt == shard.map.end())
+    {
+      ++shard.missCount;
+      return {};
+    }
+
+    ++shard.hitCount;
+    auto listIt = mapIt->second;
+    if (std::next(listIt) != shard.list.end())
+    {
+      Modification modification(shard);
+      shard.list.splice(shard.list.end(), shard.list, listIt);
+    }
+    return SharedValueTraits<ValueType>::read(listIt->value.data(), listIt->value.size());
+  }
+
+  bool erase(const KeyType& key)
+  {
+    const std::size_t hash = boost::hash<KeyType>{}(key);
+    auto& shard = itsHeader->shards[getShardIndex(hash)];
+    ShardLock lock(*this, shard);
+
+    auto mapIt = shard.map.find(key);
+    if (mapIt == shard.map.end())
+      return false;
+
+    Modification modification(shard);
+    removeEntry(shard, mapIt);
+    return true;
+  }
+
+  void clear()
+  {
+    for (auto& shard : itsHeader->shards)
+    {
+      ShardLock lock(*this, shard);
+      Modification modification(shard);
+      shard.map.clear();
+      shard.list.clear();
+      shard.size = 0;
+    }
+  }
+
+  // The new size applies to all processes sharing the cache
+  void resize(std::size_t newMaxSize)
+  {
+    itsHeader->maxSizePerShard = (newMaxSize + NumShards - 1) / NumShards;
+    for (auto& shard : itsHeader->shards)
+    {
+      ShardLock lock(*this, shard);
+      Modification modification(shard);
+      evict(shard, 0);
+    }
+  }
+
+  // Stored key and value bytes
+  std::size_t size() const
+  {
+    std::size_t total = 0;
+    for (auto& shard : itsHeader->shards)
+    {
+      ShardLock lock(*this, shard);
+      total += shard.size;
+    }
+    return total;
+  }
+
+  std::size_t maxSize() const { return itsHeader->maxSizePerShard * NumShards; }
+
+  // For crash tests: called by inserts in this process with the shard locked and marked
+  // as being modified, before the segment allocator is used
+  void setModificationHook(std::function<void()> hook) { itsModificationHook = std::move(hook); }
+
+  CacheStats statistics() const
+  {
+    CacheStats stats(Fmi::date_time::from_time_t(itsHeader->startTime));
+    stats.maxsize = maxSize();
+    std::size_t entries = 0;
+    for (auto& shard : itsHeader->shards)
+    {
+      ShardLock lock(*this, shard);
+      stats.size += shard.size;
+      stats.inserts += shard.insertCount;
+      stats.evictions += shard.evictionCount;
+      stats.hits += shard.hitCount;
+      stats.misses += shard.missCount;
+      entries += shard.map.size();
+    }
+    stats.counters["entries"] = entries;
+    stats.counters["lock_recoveries"] = itsHeader->recoveries.load();
+    stats.counters["segment_size"] = itsSegment.get_size();
+    stats.counters["segment_free_bytes"] = itsSegment.get_free_memory();
+    return stats;
+  }
+
+ private:
+  using Segment = boost::interprocess::basic_managed_shared_memory<
+      char,
+      boost::interprocess::rbtree_best_fit<SharedCacheMutexFamily>,
+      boost::interprocess::iset_index>;
+  using SegmentManager = Segment::segment_manager;
+  template <typename T>
+  using Allocator = boost::interprocess::allocator<T, SegmentManager>;
+
+  using Bytes = boost::interprocess::vector<char, Allocator<char>>;
+
+  struct Entry
+  {
+    Entry(const KeyType& theKey, const ValueType& theValue, const Allocator<char>& theAllocator)
+        : key(theKey),
+          value(SharedValueTraits<ValueType>::data(theValue),
+                SharedValueTraits<ValueType>::data(theValue) +
+                    SharedValueTraits<ValueType>::size(theValue),
+                theAllocator)
+    {
+    }
+
+    KeyType key;
+    Bytes value;
+  };
+
+  using List = boost::interprocess::list<Entry, Allocator<Entry>>;
+  using MapValue = std::pair<const KeyType, typename List::iterator>;
+  using Map = boost::unordered_map<KeyType,
+                                   typename List::iterator,
+                                   boost::hash<KeyType>,
+                                   std::equal_to<KeyType>,
+                                   Allocator<MapValue>>;
+
+  struct Shard
+  {
+    explicit Shard(SegmentManager* manager) : list(manager), map(manager) {}
+
+    SharedCacheMutex mutex;
+    std::atomic<bool> modifying{false};  // set while the containers may be inconsistent
+    List list;                           // LRU first
+    Map map;
+    std::size_t size = 0;
+    std::size_t insertCount = 0;
+    std::size_t evictionCount = 0;
+    std::size_t hitCount = 0;
+    std::size_t missCount = 0;
+  };
+
+  struct Header
+  {
+    Header(SegmentManager* manager, std::size_t maxSize)
+        : maxSizePerShard((maxSize + NumShards - 1) / NumShards),
+          shards(makeShards(manager, std::make_index_sequence<NumShards>()))
+    {
+    }
+
+    template <std::size_t... I>
+    static std::array<Shard, NumShards> makeShards(SegmentManager* manager,
+                                                   std::index_sequence<I...> /* unused */)
+    {
+      return {{((void)I, Shard(manager))...}};
+    }
+
+    std::uint32_t magic = Magic;
+    std::uint32_t numShards = NumShards;
+    std::uint32_t keySize = sizeof(KeyType);
+    std::uint32_t valueKind = SharedValueTraits<ValueType>::Kind;
+    std::time_t startTime = std::time(nullptr);
+    std::atomic<std::size_t> maxSizePerShard;
+    std::atomic<std::size_t> recoveries{0};
+    std::array<Shard, NumShards> shards;
+  };
+
+  // Locks a shard, resetting it if the previous owner died in the middle of a modification
+  class ShardLock
+  {
+   public:
+    ShardLock(const SharedCache& cache, Shard& shard) : itsShard(shard)
+    {
+      if (!shard.mutex.lock() && shard.modifying)
+        cache.recover(shard);
+    }
+    ~ShardLock() { itsShard.mutex.unlock(); }
+
+    ShardLock(const ShardLock& other) = delete;
+    ShardLock& operator=(const ShardLock& other) = delete;
+
+   private:
+    Shard& itsShard;
+  };
+
+  // Marks the shard inconsistent for the duration of a modification
+  class Modification
+  {
+   public:
+    explicit Modification(Shard& shard) : itsShard(shard) { shard.modifying = true; }
+    ~Modification() { itsShard.modifying = false; }
+
+    Modification(const Modification& other) = delete;
+    Modification& operator=(const Modification& other) = delete;
+
+   private:
+    Shard& itsShard;
+  };
+
+  static constexpr std::uint32_t Magic = 0x464d4943;  // "FMIC"
+  static constexpr const char* HeaderName = "fmi-shared-cache";
+  static constexpr std::size_t MinSegmentSize = 1024 * 1024;
+
+  static std::size_t getShardIndex(std::size_t hash)
+  {
+    constexpr std::size_t prime = 2654435761ULL;
+    return (hash * prime) % NumShards;
+  }
+
+  static std::size_t entrySize(std::size_t valueSize) { return sizeof(KeyType) + valueSize; }
+
+  // The old containers cannot be trusted, hence their nodes are abandoned
+  void recover(Shard& shard) const
+  {
+    auto* manager = itsSegment.get_segment_manager();
+    new (&shard.list) List(manager);
+    new (&shard.map) Map(manager);
+    shard.size = 0;
+    shard.modifying = false;
+    ++itsHeader->recoveries;
+  }
+
+  bool insertEntry(const KeyType& key, const ValueType& value, bool replace)
+  {
+    const std::size_t size = entrySize(SharedValueTraits<ValueType>::size(value));
+    if (size > itsHeader->maxSizePerShard)
+      return false;
+
+    const std::size_t hash = boost::hash<KeyType>{}(key);
+    auto& shard = itsHeader->shards[getShardIndex(hash)];
+    ShardLock lock(*this, shard);
+
+    auto mapIt = shard.map.find(key);
+    if (mapIt != shard.map.end() && !replace)
+      return false;
+
+    Modification modification(shard);
+    if (itsModificationHook)
+      itsModificationHook();
+    if (mapIt != shard.map.end())
+      removeEntry(shard, mapIt);
+
+    evict(shard, size);
+
+    // Make room in the segment by evicting more if necessary
+    while (true)
+    {
+      try
+      {
+        shard.list.emplace_back(key, value, Allocator<char>(itsSegment.get_segment_manager()));
+        try
+        {
+          shard.map.emplace(key, std::prev(shard.list.end()));
+        }
+        catch (...)
+        {
+          shard.list.pop_back();
+          throw;
+        }
+        break;
+      }
+      catch (const boost::interprocess::bad_alloc&)
+      {
+        if (shard.list.empty())
+          return false;
+        removeEntry(shard, shard.map.find(shard.list.front().key));
+        ++shard.evictionCount;
+      }
+    }
+
+    shard.size += size;
+    ++shard.insertCount;
+    return true;
+  }
+
+  // Evict LRU entries until the given size fits
+  void evict(Shard& shard, std::size_t size)
+  {
+    const std::size_t maxSize = itsHeader->maxSizePerShard;
+    while (!shard.list.empty() && shard.size + size > maxSize)
+    {
+      removeEntry(shard, shard.map.find(shard.list.front().key));
+      ++shard.evictionCount;
+    }
+  }
+
+  void removeEntry(Shard& shard, typename Map::iterator mapIt)
+  {
+    auto listIt = mapIt->second;
+    shard.size -= entrySize(listIt->value.size());
+    shard.map.erase(mapIt);
+    shard.list.erase(listIt);
+  }
+
+  mutable Segment itsSegment;
+  Header* itsHeader = nullptr;
+  std::function<void()> itsModificationHook;
+};
+
+}  // namespace Cache
+}  // namespace Fmi
@@ -0,0 +1,319 @@
+#include "TaskInstrumentation.h"
+#include "AsyncTask.h"
+#include "Exception.h"
+#include <boost/chrono.hpp>
+#include <boost/thread.hpp>
+#include <fmt/format.h>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+namespace Fmi
+{
+namespace
+{
+std::chrono::nanoseconds since(TaskInstrumentation::Clock::time_point theStart,
+                               TaskInstrumentation::Clock::time_point theEnd)
+{
+  return std::max(std::chrono::nanoseconds(0),
+                  std::chrono::duration_cast<std::chrono::nanoseconds>(theEnd - theStart));
+}
+
+// Name of a thread known to be alive, see Fmi::get_thread_name
+std::string threadName(pthread_t theThread)
+{
+#if defined(__linux__)
+  char name[16] = {};
+  if (pthread_getname_np(theThread, name, sizeof(name)) == 0)
+    return name;
+#endif
+  return {};
+}
+
+void printSlowTask(const std::string& theExecutor, const RunningTask& theTask)
+{
+  std::cerr << fmt::format(
+      "WARNING: task '{}' of '{}' has been running for {:.3f} seconds in thread '{}'\n",
+      theTask.name,
+      theExecutor,
+      std::chrono::duration<double>(theTask.running).count(),
+      theTask.thread);
+}
+}  // namespace
+
+// Buckets 0-15 are exact, then bucket 16 + 8 * (m - 4) + s covers
+// [(8 + s) * 2^(m-3), (9 + s) * 2^(m-3)) for the highest set bit m >= 4
+std::size_t LatencyHistogram::bucket(std::chrono::nanoseconds theDuration)
+{
+  const auto ns = static_cast<std::uint64_t>(std::max<std::int64_t>(theDuration.count(), 0));
+  if (ns < 2 * SubBuckets)
+    return ns;
+
+  std::size_t magnitude = 0;
+  for (auto n = ns; n > 1; n >>= 1)
+    ++magnitude;
+
+  const std::size_t index =
+      2 * SubBuckets + (magnitude - 4) * SubBuckets + ((ns >> (magnitude - 3)) & (SubBuckets - 1));
+  return std::min(index, Buckets - 1);
+}
+
+std::chrono::nanoseconds LatencyHistogram::lowerBound(std::size_t theBucket)
+{
+  if (theBucket < 2 * SubBuckets)
+    return std::chrono::nanoseconds(theBucket);
+
+  const std::size_t magnitude = (theBucket - 2 * SubBuckets) / SubBuckets + 4;
+  const std::size_t sub = (theBucket - 2 * SubBuckets) % SubBuckets;
+  return std::chrono::nanoseconds(static_cast<std::int64_t>((SubBuckets + sub) << (magnitude - 3)));
+}
+
+void LatencyHistogram::record(std::chrono::nanoseconds theDuration)
+{
+  ++itsCounts[bucket(theDuration)];
+  ++itsCount;
+  itsTotal += theDuration;
+  itsMax = std::max(itsMax, theDuration);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& theOther)
+{
+  for (std::size_t i = 0; i < Buckets; i++)
+    itsCounts[i] += theOther.itsCounts[i];
+  itsCount += theOther.itsCount;
+  itsTotal += theOther.itsTotal;
+  itsMax = std::max(itsMax, theOther.itsMax);
+}
+
+void TaskTimingStats::merge(const TaskTimingStats& theOther)
+{
+  started += theOther.started;
+  finished += theOther.finished;
+  wait.merge(theOther.wait);
+  run.merge(theOther.run);
+}
+
+std::chrono::nanoseconds LatencyHistogram::mean() const
+{
+  if (itsCount == 0)
+    return std::chrono::nanoseconds(0);
+  return itsTotal / static_cast<std::int64_t>(itsCount);
+}
+
+std::chrono::nanoseconds LatencyHistogram::percentile(double theQuantile) const
+{
+  if (itsCount == 0)
+    return std::chrono::nanoseconds(0);
+
+  const double quantile = std::min(std::max(theQuantile, 0.0), 1.0);
+  const auto rank = std::max<std::size_t>(
+      1, static_cast<std::size_t>(std::ceil(quantile * static_cast<double>(itsCount))));
+
+  std::size_t seen = 0;
+  for (std::size_t i = 0; i < Buckets - 1; i++)
+  {
+    seen += itsCounts[i];
+    if (seen >= rank)
+      return std::min(itsMax, lowerBound(i + 1) - std::chrono::nanoseconds(1));
+  }
+  return itsMax;
+}
+
+std::vector<std::pair<std::chrono::nanoseconds, std::size_t>> LatencyHistogram::buckets() const
+{
+  std::vector<std::pair<std::chrono::nanoseconds, std::size_t>> ret;
+  for (std::size_t i = 0; i < Buckets; i++)
+    if (itsCounts[i] > 0)
+      ret.emplace_back(lowerBound(i), itsCounts[i]);
+  return ret;
+}
+
+TaskInstrumentation::TaskInstrumentation(std::string theName, TaskInstrumentationOptions theOptions)
+    : itsName(std::move(theName)), itsOptions(std::move(theOptions))
+{
+  if (itsOptions.slowTaskThreshold.count() > 0)
+  {
+    if (itsOptions.watchdogInterval.count() <= 0)
+      throw Fmi::Exception(BCP, "Task watchdog interval must be positive");
+    itsWatchdog = std::make_unique<Fmi::AsyncTask>("upd-task-wd", [this]() { watch(); });
+  }
+}
+
+// The task destructor interrupts the sleep and joins the thread
+TaskInstrumentation::~TaskInstrumentation()
+{
+  itsWatchdog.reset();
+}
+
+TaskInstrumentation::Scope::Scope(TaskInstrumentation* theInstrumentation,
+                                  const std::string& theTaskName,
+                                  Clock::time_point theEnqueueTime)
+    : itsInstrumentation(theInstrumentation)
+{
+  if (itsInstrumentation)
+  {
+    itsSlot = slotIndex();
+    itsId = itsInstrumentation->started(
+        itsInstrumentation->itsSlots[itsSlot], theTaskName, theEnqueueTime);
+  }
+}
+
+TaskInstrumentation::Scope::~Scope()
+{
+  if (itsInstrumentation)
+    itsInstrumentation->finished(itsInstrumentation->itsSlots[itsSlot], itsId);
+}
+
+// Slot of the calling thread, threads share slots only if there are many of them
+std::size_t TaskInstrumentation::slotIndex()
+{
+  static std::atomic<std::size_t> nextIndex{0};
+  thread_local const std::size_t index = nextIndex.fetch_add(1) % Slots;
+  return index;
+}
+
+// Caller holds the slot mutex. The shared names are consulted only the first time
+// the slot sees a name, once they are used up the rest share one entry.
+TaskTimingStats* TaskInstrumentation::taskStats(Slot& theSlot, const std::string& theTaskName)
+{
+  auto it = theSlot.tasks.find(theTaskName);
+  if (it != theSlot.tasks.end())
+    return &it->second;
+
+  bool known = false;
+  {
+    std::lock_guard<std::mutex> lock(itsTaskNamesMutex);
+    known = (itsTaskNames.count(theTaskName) > 0);
+    if (!known && itsTaskNames.size() < itsOptions.maxTaskNames)
+      known = itsTaskNames.insert(theTaskName).second;
+  }
+  return &theSlot.tasks[known ? theTaskName : std::string(OtherTasks)];
+}
+
+std::uint64_t TaskInstrumentation::started(Slot& theSlot,
+                                           const std::string& theTaskName,
+                                           Clock::time_point theEnqueueTime)
+{
+  const auto now = Clock::now();
+  const auto wait = since(theEnqueueTime, now);
+
+  std::lock_guard<std::mutex> lock(theSlot.mutex);
+  TaskTimingStats* stats = nullptr;
+  if (!theTaskName.empty())
+  {
+    stats = taskStats(theSlot, theTaskName);
+    ++stats->started;
+    stats->wait.record(wait);
+  }
+  ++theSlot.total.started;
+  theSlot.total.wait.record(wait);
+
+  const auto id = ++theSlot.nextId;
+  theSlot.running.emplace(id, Running{theTaskName, pthread_self(), theEnqueueTime, now, stats});
+  return id;
+}
+
+void TaskInstrumentation::finished(Slot& theSlot, std::uint64_t theId)
+{
+  const auto now = Clock::now();
+
+  std::lock_guard<std::mutex> lock(theSlot.mutex);
+  auto it = theSlot.running.find(theId);
+  if (it == theSlot.running.end())
+    return;
+
+  const auto run = since(it->second.started, now);
+  if (it->second.stats)
+  {
+    ++it->second.stats->finished;
+    it->second.stats->run.record(run);
+  }
+  ++theSlot.total.finished;
+  theSlot.total.run.record(run);
+  theSlot.running.erase(it);
+}
+
+TaskInstrumentationStats TaskInstrumentation::statistics() const
+{
+  const auto now = Clock::now();
+  TaskInstrumentationStats ret;
+  ret.name = itsName;
+
+  ret.slowTasks = itsSlowTasks;
+  for (const auto& slot : itsSlots)
+  {
+    std::lock_guard<std::mutex> lock(slot.mutex);
+    ret.total.merge(slot.total);
+    for (const auto& item : slot.tasks)
+      ret.tasks[item.first].merge(item.second);
+    for (const auto& item : slot.running)
+    {
+      const auto& task = item.second;
+      ret.running.push_back(RunningTask{task.name,
+                                        threadName(task.thread),
+                                        since(task.enqueued, task.started),
+                                        since(task.started, now)});
+    }
+  }
+  std::sort(ret.running.begin(),
+            ret.running.end(),
+            [](const RunningTask& a, const RunningTask& b) { return a.running > b.running; });
+  return ret;
+}
+
+// The reports are made outside the mutexes, a task may hence finish meanwhile
+std::size_t TaskInstrumentation::checkSlowTasks()
+{
+  const auto now = Clock::now();
+  const auto threshold = std::chrono::duration_cast<Clock::duration>(itsOptions.slowTaskThreshold);
+
+  std::vector<RunningTask> slow;
+  for (auto& slot : itsSlots)
+  {
+    std::lock_guard<std::mutex> lock(slot.mutex);
+    for (auto& item : slot.running)
+    {
+      auto& task = item.second;
+      if (task.reported || now - task.started <= threshold)
+        continue;
+      task.reported = true;
+      slow.push_back(RunningTask{task.name,
+                                 threadName(task.thread),
+                                 since(task.enqueued, task.started),
+                                 since(task.started, now)});
+    }
+  }
+  itsSlowTasks += slow.size();
+
+  for (const auto& task : slow)
+  {
+    if (itsOptions.onSlowTask)
+      itsOptions.onSlowTask(itsName, task);
+    else
+      printSlowTask(itsName, task);
+  }
+  return slow.size();
+}
+
+void TaskInstrumentation::watch()
+{
+  while (true)
+  {
+    boost::this_thread::sleep_for(
+        boost::chrono::milliseconds(itsOptions.watchdogInterval.count()));
+    try
+    {
+      checkSlowTasks();
+    }
+    catch (const boost::thread_interrupted&)
+    {
+      throw;
+    }
+    catch (...)
+    {
+      Fmi::Exception::Trace(BCP, "Task watchdog failed").printError();
+    }
+  }
+}
+
+}  // namespace Fmi
@@ -0,0 +1,207 @@
+// ======================================================================
+/*!
+ * \brief Opt-in timing of tasks run by pools and asynchronous tasks
+ *
+ * A TaskInstrumentation records for each task the time it waited to be
+ * started and the time it ran, into histograms of the whole executor
+ * and of each task name:
+ *
+ *   TaskInstrumentationOptions options;
+ *   options.slowTaskThreshold = std::chrono::seconds(10);
+ *   pool.enableInstrumentation(options);
+ *   pool.scheduleNamed("fetch", task);
+ *   auto stats = pool.getInstrumentationStats();
+ *   stats.total.wait.percentile(0.99);
+ *
+ * The same is available for Fmi::AsyncTask and Fmi::AsyncTaskGroup. If
+ * the threshold is set, a watchdog thread reports each task which has
+ * been running longer, once, together with the name of the thread given
+ * with Fmi::set_thread_name.
+ *
+ * Recording a task takes a mutex twice, the instrumentation is hence
+ * meant for tasks of at least some tens of microseconds. The mutexes are
+ * those of per-thread slots, threads share them only if there are many
+ * of them. At most maxTaskNames names get timings of their own, further
+ * names are recorded as "other" so that per-item names cannot exhaust
+ * the memory.
+ */
+// ======================================================================
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Fmi
+{
+class AsyncTask;
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Log-linear histogram of durations
+ *
+ * Durations below 16 ns have buckets of their own, longer ones are split
+ * into 8 buckets per power of two, giving a relative error of at most
+ * 12.5%. Durations of hours share the last bucket.
+ */
+// ----------------------------------------------------------------------
+
+class LatencyHistogram
+{
+ public:
+  static constexpr std::size_t SubBuckets = 8;
+  static constexpr std::size_t Buckets = 2 * SubBuckets + 40 * SubBuckets;
+
+  void record(std::chrono::nanoseconds theDuration);
+  void merge(const LatencyHistogram& theOther);
+
+  std::size_t count() const { return itsCount; }
+  std::chrono::nanoseconds total() const { return itsTotal; }
+  std::chrono::nanoseconds max() const { return itsMax; }
+  std::chrono::nanoseconds mean() const;
+
+  // Upper bound of the bucket of the given quantile (0...1), at most max()
+  std::chrono::nanoseconds percentile(double theQuantile) const;
+
+  // Non-empty buckets as (lower bound, count) pairs
+  std::vector<std::pair<std::chrono::nanoseconds, std::size_t>> buckets() const;
+
+  static std::size_t bucket(std::chrono::nanoseconds theDuration);
+  static std::chrono::nanoseconds lowerBound(std::size_t theBucket);
+
+ private:
+  std::array<std::size_t, Buckets> itsCounts{};
+  std::size_t itsCount = 0;
+  std::chrono::nanoseconds itsTotal{0};
+  std::chrono::nanoseconds itsMax{0};
+};
+
+struct TaskTimingStats
+{
+  std::size_t started = 0;
+  std::size_t finished = 0;
+  LatencyHistogram wait;  // from enqueueing to start
+  LatencyHistogram run;   // from start to finish
+
+  void merge(const TaskTimingStats& theOther);
+};
+
+struct RunningTask
+{
+  std::string name;
+  std::string thread;  // see Fmi::set_thread_name
+  std::chrono::nanoseconds waited{0};
+  std::chrono::nanoseconds running{0};
+};
+
+struct TaskInstrumentationStats
+{
+  std::string name;
+  TaskTimingStats total;
+  std::map<std::string, TaskTimingStats> tasks;  // named tasks only
+  std::vector<RunningTask> running;              // longest running first
+  std::size_t slowTasks = 0;                     // reported by the watchdog
+};
+
+struct TaskInstrumentationOptions
+{
+  std::chrono::milliseconds slowTaskThreshold{0};  // zero disables the watchdog
+  std::chrono::milliseconds watchdogInterval{1000};
+  std::size_t maxTaskNames = 100;  // names timed separately, the rest are "other"
+
+  // Called from the watchdog thread, by default a warning is printed
+  std::function<void(const std::string& theExecutor, const RunningTask& theTask)> onSlowTask;
+};
+
+class TaskInstrumentation
+{
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr const char* OtherTasks = "other";  // the names beyond maxTaskNames
+
+  explicit TaskInstrumentation(std::string theName,
+                               TaskInstrumentationOptions theOptions = TaskInstrumentationOptions());
+  ~TaskInstrumentation();
+
+  // Times the task run by the calling thread during its lifetime
+  class Scope
+  {
+   public:
+    Scope(TaskInstrumentation* theInstrumentation,
+          const std::string& theTaskName,
+          Clock::time_point theEnqueueTime);
+    ~Scope();
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+   private:
+    TaskInstrumentation* itsInstrumentation;
+    std::size_t itsSlot = 0;
+    std::uint64_t itsId = 0;
+  };
+
+  TaskInstrumentationStats statistics() const;
+
+  const std::string& name() const { return itsName; }
+
+  // Run by the watchdog, returns the number of new slow tasks
+  std::size_t checkSlowTasks();
+
+ private:
+  struct Running
+  {
+    std::string name;
+    pthread_t thread;  // alive while the task is running, the name is read when reported
+    Clock::time_point enqueued;
+    Clock::time_point started;
+    TaskTimingStats* stats = nullptr;  // of the name, map nodes are stable
+    bool reported = false;
+  };
+
+  static constexpr std::size_t Slots = 16;
+
+  // Timings recorded by a group of threads
+  struct alignas(64) Slot
+  {
+    mutable std::mutex mutex;
+    TaskTimingStats total;
+    std::map<std::string, TaskTimingStats> tasks;
+    std::map<std::uint64_t, Running> running;
+    std::uint64_t nextId = 0;
+  };
+
+  static std::size_t slotIndex();
+  std::uint64_t started(Slot& theSlot,
+                        const std::string& theTaskName,
+                        Clock::time_point theEnqueueTime);
+  void finished(Slot& theSlot, std::uint64_t theId);
+  TaskTimingStats* taskStats(Slot& theSlot, const std::string& theTaskName);
+  void watch();
+
+  const std::string itsName;
+  const TaskInstrumentationOptions itsOptions;
+
+  std::array<Slot, Slots> itsSlots;
+  std::mutex itsTaskNamesMutex;       // may be taken under a slot mutex
+  std::set<std::string> itsTaskNames;  // the names timed separately
+  std::atomic<std::size_t> itsSlowTasks{0};
+
+  // Last so that the thread is stopped before the rest is destroyed
+  std::unique_ptr<AsyncTask> itsWatchdog;
+};
+
+}  // namespace Fmi
@@ -36,4 +36,14 @@ void set_thread_name(const std::string& name)
 #endif
 }
 
+std::string get_thread_name()
+{
+#if defined(__linux__)
+  char name[16] = {};
+  if (pthread_getname_np(pthread_self(), name, sizeof(name)) == 0)
+    return name;
+#endif
+  return {};
+}
+
 }  // namespace Fmi
@@ -24,4 +24,11 @@ namespace Fmi
  */
 void set_thread_name(const std::string& name);
 
+/**
+ * \brief Get the name of the calling thread.
+ *
+ * Returns an empty string on platforms without pthread thread names.
+ */
+std::string get_thread_name();
+
 }  // namespace Fmi
@@ -7,17 +7,32 @@
 // ======================================================================
 
 #pragma once
+#include "AsyncTask.h"
+#include "AtomicSharedPtr.h"
+#include "Exception.h"
+#include "TaskInstrumentation.h"
 #include "ThreadName.h"
+#include "ThreadPoolFuture.h"
 #include <boost/chrono/duration.hpp>
 #include <boost/chrono/system_clocks.hpp>
 #include <boost/thread.hpp>
 #include <fmt/format.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <functional>
 #include <iostream>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <queue>
 #include <stdexcept>
 #include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace Fmi
@@ -86,6 +101,7 @@ class Worker : public std::enable_shared_from_this<Worker<Executor> >
   {
     if (!itsName.empty())
       Fmi::set_thread_name(itsName);
+    itsParent->workerStarted();
     bool success = true;
     while (success)
     {
@@ -164,9 +180,104 @@ class Worker : public std::enable_shared_from_this<Worker<Executor> >
  *
  * bool empty();
  * Check if task queue is empty
+ *
+ * A Scheduler may also accept extra arguments, such as a priority, in
+ * further push() overloads and in its constructor after maxSize. They
+ * are passed through ThreadPool::schedule() and the ThreadPool
+ * constructor. A Scheduler may report per-class statistics with
+ *
+ * std::vector<SchedulerClassStatistics> statistics();
+ *
+ * Concurrent scheduler concept
+ *
+ * The ThreadPool calls the methods of a Scheduler with the pool mutex
+ * locked. A scheduler which is thread safe by itself may instead declare
+ *
+ * static constexpr bool concurrent = true;
+ *
+ * in which case the pool calls push() and the methods below without the
+ * mutex, and takes the mutex only to put idle workers to sleep:
+ *
+ * bool tryPop(TaskType& task);
+ * Get the next task for the calling worker, false if there is none
+ *
+ * void attachWorker();
+ * void detachWorker();
+ * Called by each worker thread when it starts and before it exits
+ *
+ * size() and empty() must be safe to call concurrently with the rest.
+ * See WorkStealingScheduler.h for a model.
  */
 // ======================================================================
 
+// Per task class counters reported by Schedulers which support them
+struct SchedulerClassStatistics
+{
+  std::string name;
+  std::size_t depth = 0;      // tasks queued now
+  std::size_t scheduled = 0;  // tasks accepted by push()
+  std::size_t rejected = 0;   // tasks refused since the queue was full
+  std::size_t started = 0;    // tasks given to a worker
+  std::size_t promoted = 0;   // started before more urgent tasks due to aging
+  std::size_t dropped = 0;    // tasks dropped since they were late
+
+  std::chrono::nanoseconds totalWait{0};   // queueing time of the started tasks
+  std::chrono::nanoseconds maxWait{0};     // longest queueing time of a started task
+  std::chrono::nanoseconds oldestWait{0};  // queueing time so far of the oldest queued task
+
+  std::chrono::nanoseconds meanWait() const
+  {
+    if (started == 0)
+      return std::chrono::nanoseconds(0);
+    return totalWait / static_cast<std::int64_t>(started);
+  }
+};
+
+// See ThreadPool::enableAutoscaling()
+struct AutoscalerOptions
+{
+  std::size_t minWorkers = 1;
+  std::size_t maxWorkers = 64;
+  std::size_t growStep = 1;                       // workers added at a time
+  std::chrono::milliseconds waitThreshold{10};    // p95 queueing time which triggers growth
+  std::chrono::milliseconds holdDown{30000};      // how long workers must idle before removal
+  std::chrono::milliseconds interval{100};        // zero disables the background thread
+};
+
+struct AutoscalerStatistics
+{
+  std::size_t evaluations = 0;
+  std::size_t grows = 0;           // decisions to add workers
+  std::size_t shrinks = 0;         // decisions to remove workers
+  std::size_t workersAdded = 0;
+  std::size_t workersRemoved = 0;
+  std::size_t waitSamples = 0;     // tasks started during the last interval
+  std::chrono::nanoseconds p95Wait{0};  // of the tasks started during the last interval
+  double utilization = 0;          // busy fraction of the workers at the last evaluation
+};
+
+template <class Scheduler, class = void>
+struct IsConcurrentScheduler : std::false_type
+{
+};
+
+template <class Scheduler>
+struct IsConcurrentScheduler<Scheduler, std::enable_if_t<Scheduler::concurrent>> : std::true_type
+{
+};
+
+template <class Scheduler, class = void>
+struct HasSchedulerStatistics : std::false_type
+{
+};
+
+template <class Scheduler>
+struct HasSchedulerStatistics<Scheduler,
+                              std::void_t<decltype(std::declval<Scheduler&>().statistics())>>
+    : std::true_type
+{
+};
+
 // ======================================================================
 /*!
  * \brief Declaration of FifoScheduler class
@@ -232,13 +343,16 @@ class ThreadPool
    * \brief Constructor
    *
    * Constructs ThreadPool with start pool size and maximum task
-   * queue size.
+   * queue size. Any further arguments are passed to the scheduler
+   * constructor.
    */
   // ======================================================================
 
+  template <typename... SchedulerArgs>
   ThreadPool(std::size_t poolSize,
              std::size_t schedulerSize = std::numeric_limits<std::size_t>::max(),
-             std::string name = "")
+             std::string name = "",
+             SchedulerArgs&&... schedulerArgs)
       : itsIsRunning(false),
         itsWorkerCount(0),
         itsTargetWorkerCount(poolSize),
@@ -248,7 +362,7 @@ class ThreadPool
         itsWorkerDeathEvent(),
         itsAllIdleEvent(),
         itsMutex(),
-        itsScheduler(schedulerSize),
+        itsScheduler(schedulerSize, std::forward<SchedulerArgs>(schedulerArgs)...),
         itsName(std::move(name))
   {
   }
@@ -278,8 +392,11 @@ class ThreadPool
 
   void shutdown(double theTimeoutSeconds = 0.0)
   {
+    disableAutoscaling();
+
     Lock lock(itsMutex);
     itsTargetWorkerCount = 0;
+    itsExcessWorkers = (itsWorkerCount > 0);
     itsDataEvent.notify_all();
 
     bool timedOut = false;
@@ -373,16 +490,235 @@ class ThreadPool
    * \brief Schedule task for processing
    *
    * Attempts to add task to the task queue. Returnts true if succesfull.
-   * May fail if task queue is full.
+   * May fail if task queue is full. Any further arguments, such as a
+   * priority, are passed to the scheduler.
+   */
+  // ======================================================================
+
+  template <typename... SchedulingArgs>
+  bool schedule(const Task& newTask, SchedulingArgs&&... schedulingArgs)
+  {
+    return scheduleNamed(std::string(), newTask, std::forward<SchedulingArgs>(schedulingArgs)...);
+  }
+
+  // ======================================================================
+  /*!
+   * \brief Schedule a task recorded under its name by the instrumentation
    */
   // ======================================================================
 
-  bool schedule(const Task& newTask)
+  template <typename... SchedulingArgs>
+  bool scheduleNamed(const std::string& theTaskName,
+                     const Task& newTask,
+                     SchedulingArgs&&... schedulingArgs)
   {
+    // Measure the queueing time for the autoscaler and the instrumentation
+    // Acquire pairs with the release in enableAutoscaling(), publishing itsWaitSamples
+    const bool sampleWait = itsSampleWaits.load(std::memory_order_acquire);
+    std::shared_ptr<TaskInstrumentation> instrumentation;
+    if (itsInstrumented.load(std::memory_order_relaxed))
+      instrumentation = itsInstrumentation.load();
+
+    if (sampleWait || instrumentation)
+      return push(timed(newTask, theTaskName, std::move(instrumentation), sampleWait),
+                  std::forward<SchedulingArgs>(schedulingArgs)...);
+    return push(newTask, std::forward<SchedulingArgs>(schedulingArgs)...);
+  }
+
+  // ======================================================================
+  /*!
+   * \brief Start recording the wait and run times of the scheduled tasks
+   *
+   * Replaces the previous recordings if instrumentation was already
+   * enabled. Tasks scheduled while the instrumentation is enabled are
+   * recorded even if it is disabled before they finish.
+   */
+  // ======================================================================
+
+  void enableInstrumentation(const TaskInstrumentationOptions& theOptions =
+                                 TaskInstrumentationOptions())
+  {
+    auto instrumentation = std::make_shared<TaskInstrumentation>(
+        itsName.empty() ? std::string("ThreadPool") : itsName, theOptions);
+    itsInstrumentation.exchange(instrumentation);
+    itsInstrumented = true;
+  }
+
+  void disableInstrumentation()
+  {
+    itsInstrumented = false;
+    itsInstrumentation.reset();
+  }
+
+  // Empty if instrumentation is not enabled
+  TaskInstrumentationStats getInstrumentationStats() const
+  {
+    const auto instrumentation = itsInstrumentation.load();
+    return instrumentation ? instrumentation->statistics() : TaskInstrumentationStats();
+  }
+
+  // ======================================================================
+  /*!
+   * \brief Start resizing the pool according to the load
+   *
+   * The pool grows by growStep workers up to maxWorkers whenever the
+   * 95th percentile of the queueing times of the tasks started since the
+   * previous evaluation exceeds waitThreshold, or if tasks are queued but
+   * none was started. If some workers have been idle at every evaluation
+   * for the hold-down period, the fewest idle seen meanwhile are removed,
+   * down to minWorkers.
+   *
+   * The load is evaluated every interval in a background thread, or only
+   * by calls to evaluateAutoscaling() if the interval is zero. Workers are
+   * added and removed as in resize().
+   */
+  // ======================================================================
+
+  void enableAutoscaling(const AutoscalerOptions& theOptions)
+  {
+    if (theOptions.minWorkers > theOptions.maxWorkers || theOptions.maxWorkers == 0 ||
+        theOptions.growStep == 0)
+      throw std::invalid_argument("Invalid ThreadPool autoscaler options");
+
+    disableAutoscaling();
+    {
+      std::lock_guard<std::mutex> lock(itsAutoscaleMutex);
+      itsAutoscalerOptions = theOptions;
+      itsAutoscaling = true;
+      itsIdleSince.reset();
+      if (!itsWaitSamples)
+        itsWaitSamples.reset(new std::atomic<std::int64_t>[WaitSamples]());
+      itsLastWaitCount = itsWaitCount.load();
+      itsSampleWaits.store(true, std::memory_order_release);
+      if (theOptions.interval.count() > 0)
+        itsAutoscaler = std::make_unique<Fmi::AsyncTask>("upd-pool-scale",
+                                                         [this]() { runAutoscaler(); });
+    }
+  }
+
+  void disableAutoscaling()
+  {
+    std::unique_ptr<Fmi::AsyncTask> autoscaler;
+    {
+      std::lock_guard<std::mutex> lock(itsAutoscaleMutex);
+      itsAutoscaling = false;
+      itsSampleWaits = false;
+      autoscaler.swap(itsAutoscaler);
+    }
+    // The destructor interrupts and joins the thread, which may need the lock
+  }
+
+  enum class AutoscaleAction
+  {
+    None,
+    Grow,
+    Shrink
+  };
+
+  AutoscaleAction evaluateAutoscaling()
+  {
+    std::lock_guard<std::mutex> scaleLock(itsAutoscaleMutex);
+    if (!itsAutoscaling)
+      return AutoscaleAction::None;
+
+    const auto& options = itsAutoscalerOptions;
+    auto& stats = itsAutoscalerStatistics;
+    const auto now = std::chrono::steady_clock::now();
+
+    // Queueing times of the tasks started since the previous evaluation, or as many as kept
+    const std::size_t count = itsWaitCount.load();
+    const std::size_t n = std::min<std::size_t>(count - itsLastWaitCount, WaitSamples);
+    itsLastWaitCount = count;
+    std::vector<std::int64_t> waits(n);
+    for (std::size_t i = 0; i < n; i++)
+      waits[i] = itsWaitSamples[(count - n + i) % WaitSamples].load(std::memory_order_relaxed);
+
+    std::chrono::nanoseconds p95(0);
+    if (n > 0)
+    {
+      auto pos = waits.begin() + static_cast<std::ptrdiff_t>((n * 95 + 99) / 100 - 1);
+      std::nth_element(waits.begin(), pos, waits.end());
+      p95 = std::chrono::nanoseconds(*pos);
+    }
+
+    std::size_t workers = 0;
+    std::size_t active = 0;
+    std::size_t queued = 0;
+    {
+      Lock lock(itsMutex);
+      if (!itsIsRunning || itsTargetWorkerCount < itsWorkerCount)
+        return AutoscaleAction::None;  // not started, shutting down or already shrinking
+      workers = itsWorkerCount;
+      active = std::min(itsActiveCount, itsWorkerCount);
+      queued = itsScheduler.size();
+    }
+
+    ++stats.evaluations;
+    stats.waitSamples = n;
+    stats.p95Wait = p95;
+    stats.utilization = (workers > 0 ? static_cast<double>(active) / workers : 0.0);
+
+    const bool overloaded = (n > 0 ? p95 > options.waitThreshold : queued > 0);
+    if (overloaded && workers < options.maxWorkers)
+    {
+      const std::size_t newSize = std::min(options.maxWorkers, workers + options.growStep);
+      resize(newSize);
+      ++stats.grows;
+      stats.workersAdded += newSize - workers;
+      itsIdleSince.reset();
+      return AutoscaleAction::Grow;
+    }
+
+    const std::size_t idle = workers - active;
+    if (overloaded || idle == 0 || workers <= options.minWorkers)
+    {
+      itsIdleSince.reset();
+      return AutoscaleAction::None;
+    }
+
+    if (!itsIdleSince)
+    {
+      itsIdleSince = now;
+      itsMinIdle = idle;
+      return AutoscaleAction::None;
+    }
+
+    itsMinIdle = std::min(itsMinIdle, idle);
+    if (now - *itsIdleSince < options.holdDown)
+      return AutoscaleAction::None;
+
+    const std::size_t newSize = std::max(options.minWorkers, workers - itsMinIdle);
+    resize(newSize);
+    ++stats.shrinks;
+    stats.workersRemoved += workers - newSize;
+    itsIdleSince.reset();
+    return AutoscaleAction::Shrink;
+  }
+
+  AutoscalerStatistics getAutoscalerStatistics()
+  {
+    std::lock_guard<std::mutex> lock(itsAutoscaleMutex);
+    return itsAutoscalerStatistics;
+  }
+
+ private:
+  template <typename... SchedulingArgs>
+  bool push(const Task& newTask, SchedulingArgs&&... schedulingArgs)
+  {
+    if constexpr (IsConcurrentScheduler<SchedulingPolicy>::value)
+    {
+      if (!itsScheduler.push(newTask, std::forward<SchedulingArgs>(schedulingArgs)...))
+        return false;
+      // The task is visible before the counts are read, see takeConcurrent()
+      if (itsSearching.load() == 0 && itsSleepers.load() > 0)
+        wakeOne();
+      return true;
+    }
+
     bool inserted;
     Lock lock(itsMutex);
     {
-      inserted = itsScheduler.push(newTask);
+      inserted = itsScheduler.push(newTask, std::forward<SchedulingArgs>(schedulingArgs)...);
       if (inserted)
       {
         // Tell threads that new data is available
@@ -392,6 +728,91 @@ class ThreadPool
     return inserted;
   }
 
+  // ======================================================================
+  /*!
+   * \brief Record the queueing time of the task when it is started
+   *
+   * The wait is sampled for the autoscaler if sampling was on when the
+   * task was scheduled, the samples are then allocated.
+   */
+  // ======================================================================
+
+  Task timed(const Task& theTask,
+             const std::string& theTaskName,
+             std::shared_ptr<TaskInstrumentation> theInstrumentation,
+             bool sampleWait)
+  {
+    return [this,
+            theTask,
+            theTaskName,
+            instrumentation = std::move(theInstrumentation),
+            sampleWait,
+            enqueued = std::chrono::steady_clock::now()]()
+    {
+      if (sampleWait)
+      {
+        const auto wait = std::chrono::steady_clock::now() - enqueued;
+        const std::size_t index = itsWaitCount.fetch_add(1) % WaitSamples;
+        itsWaitSamples[index].store(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(wait).count(),
+            std::memory_order_relaxed);
+      }
+      TaskInstrumentation::Scope scope(instrumentation.get(), theTaskName, enqueued);
+      theTask();
+    };
+  }
+
+  void runAutoscaler()
+  {
+    while (true)
+    {
+      boost::this_thread::sleep_for(
+          boost::chrono::milliseconds(itsAutoscalerOptions.interval.count()));
+      try
+      {
+        evaluateAutoscaling();
+      }
+      catch (const boost::thread_interrupted&)
+      {
+        throw;
+      }
+      catch (...)
+      {
+        Fmi::Exception::Trace(BCP, "ThreadPool autoscaling failed").printError();
+      }
+    }
+  }
+
+ public:
+  // ======================================================================
+  /*!
+   * \brief Schedule a function call and return a future for its result
+   *
+   * The arguments are copied. An exception thrown by the function is
+   * stored in the future, as is an error if the task queue is full.
+   * See ThreadPoolFuture.h for continuations.
+   */
+  // ======================================================================
+
+  template <typename F, typename... Args>
+  auto submit(F&& theFunction, Args&&... theArgs)
+  {
+    using Function = std::decay_t<F>;
+    using Result = std::invoke_result_t<Function&, std::decay_t<Args>&...>;
+
+    auto state = std::make_shared<Detail::FutureState<Result> >();
+    Task task = [state,
+                 function = Function(std::forward<F>(theFunction)),
+                 args = std::make_tuple(std::forward<Args>(theArgs)...)]() mutable
+    { Detail::fulfil(*state, [&]() -> Result { return std::apply(function, args); }); };
+
+    if (!schedule(task))
+      state->setException(
+          std::make_exception_ptr(Fmi::Exception(BCP, "ThreadPool task queue is full")));
+
+    return Future<Result>(state, [this](const Task& theTask) { return schedule(theTask); });
+  }
+
   // ======================================================================
   /*!
    * \brief Resize the thread pool
@@ -407,7 +828,12 @@ class ThreadPool
     Lock lock(itsMutex);
 
     if (newSize == itsWorkerCount)
+    {
+      // Cancel a pending reduction the workers have not acted on yet
+      itsTargetWorkerCount = newSize;
+      itsExcessWorkers = false;
       return;
+    }
 
     if (newSize < itsWorkerCount)
     {
@@ -425,6 +851,7 @@ class ThreadPool
 
       itsTargetWorkerCount = newSize;
     }
+    itsExcessWorkers = (itsTargetWorkerCount < itsWorkerCount);
   }
 
   // ======================================================================
@@ -463,6 +890,23 @@ class ThreadPool
     return itsScheduler.maxSize();
   }
 
+  // ======================================================================
+  /*!
+   * \brief Get the per-class statistics of the scheduler, if it has any
+   */
+  // ======================================================================
+
+  std::vector<SchedulerClassStatistics> getSchedulerStatistics()
+  {
+    if constexpr (HasSchedulerStatistics<SchedulingPolicy>::value)
+    {
+      Lock lock(itsMutex);
+      return itsScheduler.statistics();
+    }
+    else
+      return {};
+  }
+
   // ======================================================================
   /*!
    * \brief Get active count (number of busy workers)
@@ -499,6 +943,12 @@ class ThreadPool
   {
     Task thisTask;
 
+    if constexpr (IsConcurrentScheduler<SchedulingPolicy>::value)
+    {
+      if (!takeConcurrent(thisTask))
+        return false;
+    }
+    else
     {
       Lock lock(itsMutex);
 
@@ -555,6 +1005,111 @@ class ThreadPool
     return true;
   }
 
+  // ======================================================================
+  /*!
+   * \brief Take a task from a concurrent scheduler
+   *
+   * The pool mutex is taken only when there is nothing to do, or when
+   * the pool is being shrunk. A worker announces itself as a sleeper
+   * before checking the scheduler one last time, and schedule() checks
+   * for sleepers after publishing the task, so one of them always sees
+   * the other.
+   *
+   * A worker woken by wakeOne() is searching until it finds a task or
+   * goes back to sleep. schedule() wakes nobody while some worker is
+   * searching, instead a searcher which finds a task wakes the next one
+   * if there is more work. This avoids waking a worker per task when the
+   * workers already keep up.
+   */
+  // ======================================================================
+
+  bool takeConcurrent(Task& theTask)
+  {
+    bool searching = false;
+    while (true)
+    {
+      if (itsExcessWorkers.load(std::memory_order_relaxed))
+      {
+        Lock lock(itsMutex);
+        if (itsTargetWorkerCount < itsWorkerCount)
+        {
+          if (searching)
+            --itsSearching;
+          return false;
+        }
+      }
+
+      if (itsScheduler.tryPop(theTask))
+      {
+        if (searching && --itsSearching == 0 && !itsScheduler.empty())
+          wakeOne();
+        return true;
+      }
+
+      Lock lock(itsMutex);
+      if (searching)
+      {
+        --itsSearching;
+        searching = false;
+      }
+
+      if (itsTargetWorkerCount < itsWorkerCount)
+        return false;
+
+      ++itsSleepers;
+      if (itsScheduler.empty())
+      {
+        --itsActiveCount;
+
+        // Signal if all workers are idle
+        if (itsActiveCount == 0)
+        {
+          itsAllIdleEvent.notify_one();
+        }
+
+        itsDataEvent.wait(lock);
+        ++itsActiveCount;
+
+        // wakeOne() counted us as searching already
+        if (itsWakeups > 0)
+        {
+          --itsWakeups;
+          searching = true;
+        }
+      }
+      --itsSleepers;
+    }
+  }
+
+  // ======================================================================
+  /*!
+   * \brief Wake up one sleeping worker to search for tasks
+   */
+  // ======================================================================
+
+  void wakeOne()
+  {
+    Lock lock(itsMutex);
+    if (itsSleepers > itsWakeups)
+    {
+      ++itsWakeups;
+      ++itsSearching;
+      itsDataEvent.notify_one();
+    }
+  }
+
+  // ======================================================================
+  /*!
+   * \brief Called by a new worker thread before it takes any tasks
+   */
+  // ======================================================================
+
+  void workerStarted()
+  {
+    if constexpr (IsConcurrentScheduler<SchedulingPolicy>::value)
+      itsScheduler.attachWorker();
+  }
+
   // ======================================================================
   /*!
    * \brief Adds a new worker to the pool
@@ -590,10 +1145,14 @@ class ThreadPool
   void workerDied(std::shared_ptr<Worker<PoolType> > theWorkerThatDied)
   {
     // Is called from the worker thread, must lock the pool mutex
+    if constexpr (IsConcurrentScheduler<SchedulingPolicy>::value)
+      itsScheduler.detachWorker();
+
     Lock lock(itsMutex);
 
     itsWorkers.erase(theWorkerThatDied->getLocation());
     --itsWorkerCount;
+    itsExcessWorkers = (itsTargetWorkerCount < itsWorkerCount);
     --itsActiveCount;
 #ifndef NDEBUG
     std::cout << "Thread " << boost::this_thread::get_id() << " dies" << std::endl;
@@ -637,7 +1196,50 @@ class ThreadPool
 
   unsigned itsWorkerSerial{0};
 
+  // Used only with concurrent schedulers. The sleepers and wakeups are
+  // modified with itsMutex locked, the searching count also without.
+  std::atomic<std::size_t> itsSleepers{0};
+
+  std::atomic<std::size_t> itsSearching{0};
+
+  std::size_t itsWakeups{0};
+
+  std::atomic<bool> itsExcessWorkers{false};
+
   std::list<std::shared_ptr<Worker<PoolType> > > itsWorkers;
+
+  // Autoscaling. The samples are kept once allocated, since tasks
+  // scheduled meanwhile may record their waits after autoscaling has
+  // been disabled.
+  static constexpr std::size_t WaitSamples = 1024;
+
+  std::atomic<bool> itsSampleWaits{false};
+
+  std::unique_ptr<std::atomic<std::int64_t>[]> itsWaitSamples;
+
+  std::atomic<std::size_t> itsWaitCount{0};
+
+  std::mutex itsAutoscaleMutex;
+
+  bool itsAutoscaling = false;
+
+  AutoscalerOptions itsAutoscalerOptions;
+
+  AutoscalerStatistics itsAutoscalerStatistics;
+
+  std::size_t itsLastWaitCount = 0;
+
+  std::optional<std::chrono::steady_clock::time_point> itsIdleSince;
+
+  std::size_t itsMinIdle = 0;
+
+  // Instrumentation, the flag avoids the shared pointer load when disabled
+  std::atomic<bool> itsInstrumented{false};
+
+  Fmi::AtomicSharedPtr<TaskInstrumentation> itsInstrumentation;
+
+  // Last so that the thread is stopped before the rest is destroyed
+  std::unique_ptr<Fmi::AsyncTask> itsAutoscaler;
 };
 }  // namespace ThreadPool
 }  // namespace Fmi
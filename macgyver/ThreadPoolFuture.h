@@ -0,0 +1,357 @@
+// ======================================================================
+/*!
+ * \brief Futures with continuations for Fmi::ThreadPool
+ *
+ * ThreadPool::submit() returns a Future for the result of the function,
+ * or the exception it threw:
+ *
+ *   auto a = pool.submit(fetch, id1);
+ *   auto b = pool.submit(fetch, id2);
+ *   auto both = when_all(std::vector<Future<Data>>{a, b});
+ *   auto merged = both.then([](const std::vector<Future<Data>>& parts) { ... });
+ *   merged.get();
+ *
+ * then() schedules the continuation to the pool once the future is
+ * ready, no worker waits for it meanwhile. The continuation may take
+ * either the value, in which case an exception skips it and passes
+ * straight to the returned future, or the ready Future itself. If the
+ * pool refuses the continuation, it is run in the completing thread.
+ *
+ * Futures are shared: they may be copied, and get() returns a reference
+ * to the value. Pending continuations refer to the pool, which must hence
+ * outlive them. Calling get() in a task blocks the worker, use then()
+ * instead.
+ */
+// ======================================================================
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace Fmi
+{
+namespace ThreadPool
+{
+using Task = std::function<void()>;
+
+// Schedules a task to a pool, false if the task was refused
+using Executor = std::function<bool(const Task&)>;
+
+template <typename R>
+class Future;
+
+namespace Detail
+{
+struct Unit
+{
+};
+
+template <typename R>
+class FutureState : public std::enable_shared_from_this<FutureState<R>>
+{
+ public:
+  using Value = std::conditional_t<std::is_void_v<R>, Unit, R>;
+  using Continuation = std::function<void(const std::shared_ptr<FutureState<R>>&)>;
+
+  template <typename... Args>
+  void setValue(Args&&... theArgs)
+  {
+    {
+      std::lock_guard<std::mutex> lock(itsMutex);
+      itsValue.emplace(std::forward<Args>(theArgs)...);
+    }
+    complete();
+  }
+
+  void setException(std::exception_ptr theException)
+  {
+    {
+      std::lock_guard<std::mutex> lock(itsMutex);
+      itsException = std::move(theException);
+    }
+    complete();
+  }
+
+  bool ready() const
+  {
+    std::lock_guard<std::mutex> lock(itsMutex);
+    return itsDone;
+  }
+
+  void wait() const
+  {
+    std::unique_lock<std::mutex> lock(itsMutex);
+    itsReady.wait(lock, [this]() { return itsDone; });
+  }
+
+  template <typename Rep, typename Period>
+  bool waitFor(const std::chrono::duration<Rep, Period>& theTimeout) const
+  {
+    std::unique_lock<std::mutex> lock(itsMutex);
+    return itsReady.wait_for(lock, theTimeout, [this]() { return itsDone; });
+  }
+
+  // The value and exception are immutable once ready
+  const Value& get() const
+  {
+    wait();
+    if (itsException)
+      std::rethrow_exception(itsException);
+    return *itsValue;
+  }
+
+  std::exception_ptr exception() const
+  {
+    wait();
+    return itsException;
+  }
+
+  // Called with this state once ready, immediately if already ready
+  void addContinuation(Continuation theContinuation)
+  {
+    {
+      std::lock_guard<std::mutex> lock(itsMutex);
+      if (!itsDone)
+      {
+        itsContinuations.push_back(std::move(theContinuation));
+        return;
+      }
+    }
+    theContinuation(this->shared_from_this());
+  }
+
+ private:
+  void complete()
+  {
+    std::vector<Continuation> continuations;
+    {
+      std::lock_guard<std::mutex> lock(itsMutex);
+      itsDone = true;
+      continuations.swap(itsContinuations);
+    }
+    itsReady.notify_all();
+    const auto self = this->shared_from_this();
+    for (auto& continuation : continuations)
+      continuation(self);
+  }
+
+  mutable std::mutex itsMutex;
+  mutable std::condition_variable itsReady;
+  bool itsDone = false;
+  std::optional<Value> itsValue;
+  std::exception_ptr itsException;
+  std::vector<Continuation> itsContinuations;
+};
+
+// Store the result of the function or the exception it throws
+template <typename R, typename F>
+void fulfil(FutureState<R>& theState, F&& theFunction)
+{
+  try
+  {
+    if constexpr (std::is_void_v<R>)
+    {
+      theFunction();
+      theState.setValue();
+    }
+    else
+      theState.setValue(theFunction());
+  }
+  catch (...)
+  {
+    theState.setException(std::current_exception());
+  }
+}
+
+// Continuations take either the ready future or the value
+template <typename R, typename F, typename = void>
+struct ContinuationResult
+{
+  using type = std::invoke_result_t<F&, const R&>;
+};
+
+template <typename F>
+struct ContinuationResult<void, F, std::enable_if_t<!std::is_invocable_v<F&, Future<void>>>>
+{
+  using type = std::invoke_result_t<F&>;
+};
+
+template <typename R, typename F>
+struct ContinuationResult<R, F, std::enable_if_t<std::is_invocable_v<F&, Future<R>>>>
+{
+  using type = std::invoke_result_t<F&, Future<R>>;
+};
+
+// Run a continuation now if there is no pool or the pool refuses it
+inline void execute(const Executor& theExecutor, const Task& theTask)
+{
+  if (!theExecutor || !theExecutor(theTask))
+    theTask();
+}
+
+}  // namespace Detail
+
+template <typename R>
+class Future
+{
+ public:
+  using State = Detail::FutureState<R>;
+
+  Future() = default;
+  Future(std::shared_ptr<State> theState, Executor theExecutor)
+      : itsState(std::move(theState)), itsExecutor(std::move(theExecutor))
+  {
+  }
+
+  bool valid() const { return itsState != nullptr; }
+  bool ready() const { return itsState->ready(); }
+  void wait() const { itsState->wait(); }
+
+  template <typename Rep, typename Period>
+  bool wait_for(const std::chrono::duration<Rep, Period>& theTimeout) const
+  {
+    return itsState->waitFor(theTimeout);
+  }
+
+  // Waits for the result, rethrows the exception of the task if there was one
+  decltype(auto) get() const
+  {
+    if constexpr (std::is_void_v<R>)
+      itsState->get();
+    else
+      return itsState->get();
+  }
+
+  template <typename F>
+  auto then(F&& theFunction) const
+  {
+    using Function = std::decay_t<F>;
+    using Result = typename Detail::ContinuationResult<R, Function>::type;
+
+    auto result = std::make_shared<Detail::FutureState<Result>>();
+    const Executor executor = itsExecutor;
+    itsState->addContinuation(
+        [result, executor, function = Function(std::forward<F>(theFunction))](
+            const std::shared_ptr<State>& theState) mutable
+        {
+          Detail::execute(executor,
+                          [result, executor, function, theState]() mutable
+                          {
+                            Future<R> ready(theState, executor);
+                            if constexpr (std::is_invocable_v<Function&, Future<R>>)
+                            {
+                              Detail::fulfil(*result, [&]() -> Result { return function(ready); });
+                            }
+                            else if (auto exception = theState->exception())
+                            {
+                              result->setException(exception);
+                            }
+                            else if constexpr (std::is_void_v<R>)
+                            {
+                              Detail::fulfil(*result, [&]() -> Result { return function(); });
+                            }
+                            else
+                            {
+                              Detail::fulfil(*result,
+                                             [&]() -> Result { return function(theState->get()); });
+                            }
+                          });
+        });
+    return Future<Result>(result, executor);
+  }
+
+  const std::shared_ptr<State>& state() const { return itsState; }
+  const Executor& executor() const { return itsExecutor; }
+
+ private:
+  std::shared_ptr<State> itsState;
+  Executor itsExecutor;
+};
+
+// Ready once all the futures are, failed or not
+template <typename R>
+Future<std::vector<Future<R>>> when_all(const std::vector<Future<R>>& theFutures)
+{
+  using Result = std::vector<Future<R>>;
+  auto result = std::make_shared<Detail::FutureState<Result>>();
+  const Executor executor = (theFutures.empty() ? Executor() : theFutures.front().executor());
+  if (theFutures.empty())
+  {
+    result->setValue();
+    return Future<Result>(result, executor);
+  }
+
+  // The collected futures are all ready, hence hold no continuations referring back here
+  struct Collector
+  {
+    std::mutex mutex;
+    Result futures;
+    std::size_t remaining;
+  };
+  auto collector = std::make_shared<Collector>();
+  collector->futures.resize(theFutures.size());
+  collector->remaining = theFutures.size();
+
+  for (std::size_t i = 0; i < theFutures.size(); i++)
+  {
+    theFutures[i].state()->addContinuation(
+        [result, collector, executor, i](const std::shared_ptr<Detail::FutureState<R>>& theState)
+        {
+          {
+            std::lock_guard<std::mutex> lock(collector->mutex);
+            collector->futures[i] = Future<R>(theState, executor);
+            if (--collector->remaining > 0)
+              return;
+          }
+          result->setValue(std::move(collector->futures));
+        });
+  }
+  return Future<Result>(result, executor);
+}
+
+template <typename R>
+struct WhenAnyResult
+{
+  std::size_t index = 0;
+  Future<R> future;
+};
+
+// Ready once the first of the futures is
+template <typename R>
+Future<WhenAnyResult<R>> when_any(const std::vector<Future<R>>& theFutures)
+{
+  auto result = std::make_shared<Detail::FutureState<WhenAnyResult<R>>>();
+  if (theFutures.empty())
+  {
+    result->setException(std::make_exception_ptr(std::invalid_argument("when_any of no futures")));
+    return Future<WhenAnyResult<R>>(result, Executor());
+  }
+
+  const Executor executor = theFutures.front().executor();
+  auto done = std::make_shared<std::atomic<bool>>(false);
+  for (std::size_t i = 0; i < theFutures.size(); i++)
+  {
+    theFutures[i].state()->addContinuation(
+        [result, done, executor, i](const std::shared_ptr<Detail::FutureState<R>>& theState)
+        {
+          if (!done->exchange(true))
+            result->setValue(WhenAnyResult<R>{i, Future<R>(theState, executor)});
+        });
+  }
+  return Future<WhenAnyResult<R>>(result, executor);
+}
+
+}  // namespace ThreadPool
+}  // namespace Fmi
@@ -0,0 +1,264 @@
+// ======================================================================
+/*!
+ * \brief Two-tier cache of strings in memory and on disk
+ *
+ * The memory tier is a Fmi::Cache::Cache and the disk tier a FileCache.
+ * Entries evicted from memory are demoted to disk, and disk hits are
+ * promoted back into memory. Values are assumed immutable per key like
+ * in FileCache, hence the disk copy of a promoted entry is kept.
+ *
+ * Demotions are written asynchronously by a single thread in batches of
+ * up to DemotionBatchSize entries, or whatever has been queued within
+ * DemotionDelay. Queued demotions are served from memory. If the queue
+ * holds maxQueuedDemotions entries further demotions are dropped.
+ *
+ * statistics() reports the tiers separately as "memory" and "disk".
+ */
+// ======================================================================
+
+#pragma once
+
+#include "AsyncTask.h"
+#include "Cache.h"
+#include "CacheCompression.h"
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <atomic>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+namespace Fmi
+{
+namespace Cache
+{
+template <class SizeFunc = TrivialSizeFunction<std::string>,
+          std::size_t NumShards = 16,
+          class Policy = LRUPolicy>
+class TieredCache
+{
+ public:
+  using MemoryCache = Cache<std::size_t, std::string, SizeFunc, NumShards, Policy>;
+
+  static constexpr std::size_t DemotionBatchSize = 64;
+  static constexpr boost::chrono::milliseconds DemotionDelay{20};
+
+  TieredCache(std::size_t memorySize,
+              const std::filesystem::path& directory,
+              std::size_t diskSize,
+              const CacheCompression& compression = CacheCompression(),
+              std::size_t maxQueuedDemotions = 10000)
+      : itsMemory(memorySize),
+        itsDisk(directory, diskSize, false, compression),
+        itsMaxQueuedDemotions(maxQueuedDemotions)
+  {
+    itsDemoter = std::make_unique<Fmi::AsyncTask>("upd-tcache-dem", [this]() { runDemoter(); });
+  }
+
+  ~TieredCache()
+  {
+    try
+    {
+      // Queued demotions are written before the thread exits
+      {
+        boost::unique_lock<boost::mutex> lock(itsQueueMutex);
+        itsStopping = true;
+      }
+      itsQueueCondition.notify_all();
+      itsDemoter->wait();
+    }
+    catch (...)
+    {
+    }
+  }
+
+  TieredCache(const TieredCache& other) = delete;
+  TieredCache(TieredCache&& other) = delete;
+  TieredCache& operator=(const TieredCache& other) = delete;
+  TieredCache& operator=(TieredCache&& other) = delete;
+
+  bool insert(std::size_t key, const std::string& value)
+  {
+    typename MemoryCache::ItemVector evicted;
+    const bool ok = itsMemory.insert(key, value, evicted);
+    demote(evicted);
+    return ok;
+  }
+
+  std::optional<std::string> find(std::size_t key)
+  {
+    if (auto handle = itsMemory.findHandle(key))
+      return *handle;
+
+    std::shared_ptr<const std::string> value;
+    {
+      boost::unique_lock<boost::mutex> lock(itsQueueMutex);
+      auto it = itsPending.find(key);
+      if (it != itsPending.end())
+      {
+        value = it->second;
+        ++itsPendingHits;
+      }
+    }
+
+    if (!value)
+    {
+      auto stored = itsDisk.find(key);
+      if (!stored)
+        return std::optional<std::string>();
+      value = std::make_shared<const std::string>(std::move(*stored));
+    }
+
+    typename MemoryCache::ItemVector evicted;
+    if (itsMemory.insert(key, *value, evicted))
+      ++itsPromotions;
+    demote(evicted);
+    return *value;
+  }
+
+  // Wait until the queued demotions have been written
+  void flush()
+  {
+    boost::unique_lock<boost::mutex> lock(itsQueueMutex);
+    ++itsFlushers;
+    itsQueueCondition.notify_all();
+    while (!itsQueue.empty() || itsWriting)
+      itsQueueCondition.wait(lock);
+    --itsFlushers;
+  }
+
+  MemoryCache& memory() { return itsMemory; }
+  const MemoryCache& memory() const { return itsMemory; }
+  FileCache& disk() { return itsDisk; }
+  const FileCache& disk() const { return itsDisk; }
+
+  CacheStatistics statistics() const
+  {
+    CacheStatistics ret;
+    auto memory = itsMemory.statistics();
+    memory.counters["promotions"] = itsPromotions;
+    memory.counters["demotions"] = itsDemotions;
+
+    auto disk = itsDisk.statistics();
+    {
+      boost::unique_lock<boost::mutex> lock(itsQueueMutex);
+      disk.counters["queued_demotions"] = itsQueue.size();
+    }
+    disk.counters["demotion_batches"] = itsDemotionBatches;
+    disk.counters["dropped_demotions"] = itsDroppedDemotions;
+    disk.counters["pending_hits"] = itsPendingHits;
+
+    ret["memory"] = memory;
+    ret["disk"] = disk;
+    return ret;
+  }
+
+ private:
+  struct Demotion
+  {
+    std::size_t key;
+    std::shared_ptr<const std::string> value;
+  };
+
+  void demote(typename MemoryCache::ItemVector& evicted)
+  {
+    if (evicted.empty())
+      return;
+
+    {
+      boost::unique_lock<boost::mutex> lock(itsQueueMutex);
+      for (auto& item : evicted)
+      {
+        if (itsQueue.size() >= itsMaxQueuedDemotions)
+        {
+          ++itsDroppedDemotions;
+          continue;
+        }
+        auto value = std::make_shared<const std::string>(std::move(item.second));
+        itsQueue.push_back(Demotion{item.first, value});
+        itsPending[item.first] = std::move(value);
+        ++itsDemotions;
+      }
+    }
+    itsQueueCondition.notify_all();
+  }
+
+  void runDemoter()
+  {
+    while (true)
+    {
+      std::deque<Demotion> batch;
+      {
+        boost::unique_lock<boost::mutex> lock(itsQueueMutex);
+        while (itsQueue.empty() && !itsStopping)
+          itsQueueCondition.wait(lock);
+
+        // Collect a full batch unless somebody is waiting for the writes
+        const auto deadline = boost::chrono::steady_clock::now() + DemotionDelay;
+        while (itsQueue.size() < DemotionBatchSize && !itsStopping && itsFlushers == 0)
+          if (itsQueueCondition.wait_until(lock, deadline) == boost::cv_status::timeout)
+            break;
+
+        if (itsQueue.empty())
+          return;
+        while (!itsQueue.empty() && batch.size() < DemotionBatchSize)
+        {
+          batch.push_back(std::move(itsQueue.front()));
+          itsQueue.pop_front();
+        }
+        itsWriting = true;
+      }
+
+      for (const auto& item : batch)
+      {
+        try
+        {
+          itsDisk.insert(item.key, *item.value);
+        }
+        catch (...)
+        {
+          ++itsDroppedDemotions;
+        }
+      }
+
+      {
+        boost::unique_lock<boost::mutex> lock(itsQueueMutex);
+        for (const auto& item : batch)
+        {
+          auto it = itsPending.find(item.key);
+          if (it != itsPending.end() && it->second == item.value)
+            itsPending.erase(it);
+        }
+        itsWriting = false;
+        ++itsDemotionBatches;
+      }
+      itsQueueCondition.notify_all();
+    }
+  }
+
+  MemoryCache itsMemory;
+  FileCache itsDisk;
+  std::size_t itsMaxQueuedDemotions;
+
+  std::atomic<std::size_t> itsPromotions{0};
+  std::atomic<std::size_t> itsDemotions{0};
+  std::atomic<std::size_t> itsDroppedDemotions{0};
+  std::atomic<std::size_t> itsDemotionBatches{0};
+  std::atomic<std::size_t> itsPendingHits{0};
+
+  // Demotion queue, and the queued values by key for lookups
+  mutable boost::mutex itsQueueMutex;
+  boost::condition_variable itsQueueCondition;
+  std::deque<Demotion> itsQueue;
+  std::unordered_map<std::size_t, std::shared_ptr<const std::string>> itsPending;
+  std::size_t itsFlushers = 0;
+  bool itsWriting = false;
+  bool itsStopping = false;
+  std::unique_ptr<Fmi::AsyncTask> itsDemoter;  // must be destroyed first
+};
+
+}  // namespace Cache
+}  // namespace Fmi
@@ -0,0 +1,311 @@
+#include "WorkStealingScheduler.h"
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+
+namespace Fmi
+{
+namespace ThreadPool
+{
+namespace
+{
+// Every so often a worker checks the injection queue before its own deque
+// so that external tasks are not starved by tasks which keep spawning more
+const unsigned InjectionCheckInterval = 61;
+
+struct CurrentWorker
+{
+  const WorkStealingScheduler* owner = nullptr;
+  std::size_t slot = 0;
+  unsigned pops = 0;
+  std::uint64_t random = 0;
+};
+
+thread_local CurrentWorker current;
+
+std::uint64_t nextRandom()
+{
+  // xorshift64*, seeded from the address of the thread local state
+  if (current.random == 0)
+    current.random = reinterpret_cast<std::uintptr_t>(&current) | 1;
+  current.random ^= current.random >> 12;
+  current.random ^= current.random << 25;
+  current.random ^= current.random >> 27;
+  return current.random * 0x2545f4914f6cdd1dULL;
+}
+
+}  // namespace
+
+// ----------------------------------------------------------------------
+/*!
+ * \brief Chase-Lev deque of heap allocated tasks
+ *
+ * Only the owner calls push() and pop(), anyone may call steal(). The
+ * circular array grows as needed, retired arrays are kept until the deque
+ * is destroyed since a thief may still be reading one.
+ */
+// ----------------------------------------------------------------------
+
+class WorkStealingScheduler::Deque
+{
+ public:
+  Deque() : itsArray(newArray(64)) {}
+
+  ~Deque()
+  {
+    Array* array = itsArray.load();
+    for (std::int64_t i = itsTop.load(); i < itsBottom.load(); i++)
+      delete array->get(i);
+  }
+
+  void push(Task* theTask)
+  {
+    const std::int64_t b = itsBottom.load(std::memory_order_relaxed);
+    const std::int64_t t = itsTop.load(std::memory_order_acquire);
+    Array* array = itsArray.load(std::memory_order_relaxed);
+    if (b - t > array->capacity - 1)
+      array = grow(array, t, b);
+    array->put(b, theTask);
+    itsBottom.store(b + 1, std::memory_order_release);
+  }
+
+  Task* pop()
+  {
+    const std::int64_t b = itsBottom.load(std::memory_order_relaxed) - 1;
+    Array* array = itsArray.load(std::memory_order_relaxed);
+    itsBottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::int64_t t = itsTop.load(std::memory_order_relaxed);
+
+    if (t > b)
+    {
+      itsBottom.store(b + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+
+    Task* task = array->get(b);
+    if (t == b)
+    {
+      // The last task, race against thieves for it
+      if (!itsTop.compare_exchange_strong(
+              t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        task = nullptr;
+      itsBottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return task;
+  }
+
+  // Returns nullptr if empty or if another thread won the race
+  Task* steal()
+  {
+    std::int64_t t = itsTop.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const std::int64_t b = itsBottom.load(std::memory_order_acquire);
+    if (t >= b)
+      return nullptr;
+
+    Array* array = itsArray.load(std::memory_order_acquire);
+    Task* task = array->get(t);
+    if (!itsTop.compare_exchange_strong(
+            t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+      return nullptr;
+    return task;
+  }
+
+ private:
+  struct Array
+  {
+    explicit Array(std::int64_t theCapacity)
+        : capacity(theCapacity), items(new std::atomic<Task*>[theCapacity])
+    {
+    }
+
+    Task* get(std::int64_t i) const
+    {
+      return items[i & (capacity - 1)].load(std::memory_order_relaxed);
+    }
+    void put(std::int64_t i, Task* task)
+    {
+      items[i & (capacity - 1)].store(task, std::memory_order_relaxed);
+    }
+
+    const std::int64_t capacity;  // a power of two
+    std::unique_ptr<std::atomic<Task*>[]> items;
+  };
+
+  Array* newArray(std::int64_t capacity)
+  {
+    itsArrays.push_back(std::make_unique<Array>(capacity));
+    return itsArrays.back().get();
+  }
+
+  Array* grow(Array* theOld, std::int64_t theTop, std::int64_t theBottom)
+  {
+    Array* array = newArray(2 * theOld->capacity);
+    for (std::int64_t i = theTop; i < theBottom; i++)
+      array->put(i, theOld->get(i));
+    itsArray.store(array, std::memory_order_release);
+    return array;
+  }
+
+  std::vector<std::unique_ptr<Array>> itsArrays;  // current and retired, owner only
+  alignas(64) std::atomic<std::int64_t> itsTop{0};
+  alignas(64) std::atomic<std::int64_t> itsBottom{0};
+  std::atomic<Array*> itsArray;
+};
+
+WorkStealingScheduler::WorkStealingScheduler(std::size_t maxSize) : itsMaxSize(maxSize)
+{
+  for (auto& deque : itsDeques)
+    deque.store(nullptr);
+}
+
+WorkStealingScheduler::~WorkStealingScheduler()
+{
+  for (auto& deque : itsDeques)
+    delete deque.load();
+}
+
+bool WorkStealingScheduler::push(const Task& theTask)
+{
+  if (itsReserved.fetch_add(1) >= itsMaxSize)
+  {
+    itsReserved.fetch_sub(1);
+    return false;
+  }
+
+  try
+  {
+    if (current.owner == this)
+      itsDeques[current.slot].load(std::memory_order_relaxed)->push(new Task(theTask));
+    else
+      inject(Task(theTask));
+  }
+  catch (...)
+  {
+    itsReserved.fetch_sub(1);
+    throw;
+  }
+
+  itsQueued.fetch_add(1);
+  return true;
+}
+
+void WorkStealingScheduler::inject(Task&& theTask)
+{
+  std::lock_guard<std::mutex> lock(itsGlobalMutex);
+  itsGlobalQueue.push_back(std::move(theTask));
+  itsGlobalSize.fetch_add(1);
+}
+
+bool WorkStealingScheduler::tryPop(Task& theTask)
+{
+  std::unique_ptr<Task> task;
+  const bool attached = (current.owner == this);
+  const bool injectionFirst = (!attached || ++current.pops % InjectionCheckInterval == 0);
+
+  if (attached && !injectionFirst)
+    task.reset(itsDeques[current.slot].load(std::memory_order_relaxed)->pop());
+
+  if (!task && itsGlobalSize.load() > 0)
+  {
+    std::lock_guard<std::mutex> lock(itsGlobalMutex);
+    if (!itsGlobalQueue.empty())
+    {
+      theTask = std::move(itsGlobalQueue.front());
+      itsGlobalQueue.pop_front();
+      itsGlobalSize.fetch_sub(1);
+      taken();
+      return true;
+    }
+  }
+
+  if (!task && attached && injectionFirst)
+    task.reset(itsDeques[current.slot].load(std::memory_order_relaxed)->pop());
+
+  if (!task)
+    task.reset(steal());
+
+  if (!task)
+    return false;
+
+  theTask = std::move(*task);
+  taken();
+  return true;
+}
+
+void WorkStealingScheduler::taken()
+{
+  itsQueued.fetch_sub(1);
+  itsReserved.fetch_sub(1);
+}
+
+// Try the deques in random order, twice since a steal may lose a race
+Task* WorkStealingScheduler::steal()
+{
+  const std::size_t n = itsDequeCount.load(std::memory_order_acquire);
+  if (n == 0)
+    return nullptr;
+
+  const std::size_t self = (current.owner == this ? current.slot : n);
+  const std::size_t start = nextRandom() % n;
+  for (std::size_t i = 0; i < 2 * n; i++)
+  {
+    const std::size_t victim = (start + i) % n;
+    if (victim == self)
+      continue;
+    Deque* deque = itsDeques[victim].load(std::memory_order_acquire);
+    if (deque == nullptr)
+      continue;
+    if (Task* task = deque->steal())
+    {
+      itsSteals.fetch_add(1, std::memory_order_relaxed);
+      return task;
+    }
+  }
+  return nullptr;
+}
+
+void WorkStealingScheduler::attachWorker()
+{
+  std::lock_guard<std::mutex> lock(itsSlotMutex);
+
+  std::size_t slot = 0;
+  if (!itsFreeSlots.empty())
+  {
+    slot = itsFreeSlots.back();
+    itsFreeSlots.pop_back();
+  }
+  else
+  {
+    slot = itsDequeCount.load();
+    if (slot >= MaxWorkers)
+      return;  // injection queue and stealing only
+    itsDeques[slot].store(new Deque(), std::memory_order_release);
+    itsDequeCount.store(slot + 1, std::memory_order_release);
+  }
+
+  current.owner = this;
+  current.slot = slot;
+}
+
+// Move the remaining local tasks to the injection queue before giving up the deque
+void WorkStealingScheduler::detachWorker()
+{
+  if (current.owner != this)
+    return;
+
+  Deque* deque = itsDeques[current.slot].load(std::memory_order_relaxed);
+  while (Task* task = deque->pop())
+  {
+    std::unique_ptr<Task> owned(task);
+    inject(std::move(*owned));
+  }
+
+  std::lock_guard<std::mutex> lock(itsSlotMutex);
+  itsFreeSlots.push_back(current.slot);
+  current.owner = nullptr;
+}
+
+}  // namespace ThreadPool
+}  // namespace Fmi
@@ -0,0 +1,94 @@
+// ======================================================================
+/*!
+ * \brief Work-stealing scheduler for Fmi::ThreadPool
+ *
+ * Each worker has its own Chase-Lev deque (Chase and Lev, SPAA'05, with
+ * the memory orderings of Le et al., PPoPP'13). Tasks scheduled from a
+ * worker thread go to the bottom of its own deque, and the worker takes
+ * them back from the bottom without contention. Tasks scheduled from
+ * other threads go to a global injection queue. A worker with an empty
+ * deque takes from the injection queue and otherwise steals from the top
+ * of the deque of a random victim.
+ *
+ *   Fmi::ThreadPool::ThreadPool<Fmi::ThreadPool::WorkStealingScheduler> pool(8);
+ *
+ * Tasks are no longer started in FIFO order: a worker runs its own latest
+ * task first. Up to MaxWorkers workers get a deque, any further workers
+ * use only the injection queue and stealing.
+ */
+// ======================================================================
+
+#pragma once
+
+#include "ThreadPool.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace Fmi
+{
+namespace ThreadPool
+{
+class WorkStealingScheduler
+{
+ public:
+  static constexpr bool concurrent = true;
+  static constexpr std::size_t MaxWorkers = 256;
+
+  explicit WorkStealingScheduler(std::size_t maxSize);
+  ~WorkStealingScheduler();
+
+  WorkStealingScheduler(const WorkStealingScheduler& other) = delete;
+  WorkStealingScheduler& operator=(const WorkStealingScheduler& other) = delete;
+
+  bool push(const Task& theTask);
+  bool tryPop(Task& theTask);
+
+  void attachWorker();
+  void detachWorker();
+
+  std::size_t size() const
+  {
+    return static_cast<std::size_t>(std::max<std::int64_t>(0, itsQueued.load()));
+  }
+  std::size_t maxSize() const { return itsMaxSize; }
+  bool empty() const { return itsQueued.load() <= 0; }
+
+  // Number of tasks taken from the deque of another worker
+  std::size_t steals() const { return itsSteals.load(std::memory_order_relaxed); }
+
+ private:
+  class Deque;
+
+  Task* steal();
+  void inject(Task&& theTask);
+  void taken();
+
+  const std::size_t itsMaxSize;
+  std::atomic<std::size_t> itsReserved{0};  // accepted tasks, for the size limit
+
+  // Published tasks. Counted after publishing so that idle workers do not spin
+  // on a task which is not there yet, hence briefly negative if taken first.
+  std::atomic<std::int64_t> itsQueued{0};
+  std::atomic<std::size_t> itsSteals{0};
+
+  // Deques are created on demand and kept until destruction so that
+  // thieves never see a deleted one. A detached worker leaves its slot
+  // empty for the next worker to attach.
+  std::array<std::atomic<Deque*>, MaxWorkers> itsDeques;
+  std::atomic<std::size_t> itsDequeCount{0};
+  std::mutex itsSlotMutex;
+  std::vector<std::size_t> itsFreeSlots;
+
+  std::mutex itsGlobalMutex;
+  std::deque<Task> itsGlobalQueue;
+  std::atomic<std::size_t> itsGlobalSize{0};
+};
+
+}  // namespace ThreadPool
+}  // namespace Fmi
@@ -0,0 +1,660 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Throughput benchmarks for Fmi::Cache::Cache and FlatCache
+ *
+ * Not run by "make test", use "make bench" instead.
+ */
+// ======================================================================
+
+#include "Cache.h"
+#include "CacheCompression.h"
+#include "FlatCache.h"
+#include <malloc.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using namespace Fmi::Cache;
+
+// Allocations are counted for the lookup benchmark
+static thread_local std::size_t allocations = 0;
+
+void* operator new(std::size_t size)
+{
+  ++allocations;
+  if (void* ptr = std::malloc(size))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t /* size */) noexcept
+{
+  std::free(ptr);
+}
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+
+// Run the given function in the given number of threads and return the total calls/second
+double throughput(int theThreads, int theCalls, const std::function<void(int, int)>& theFunction)
+{
+  std::vector<std::thread> threads;
+  const auto start = Clock::now();
+  for (int t = 0; t < theThreads; t++)
+    threads.emplace_back(
+        [&theFunction, theCalls, t]()
+        {
+          for (int i = 0; i < theCalls; i++)
+            theFunction(t, i);
+        });
+  for (auto& thread : threads)
+    thread.join();
+  const std::chrono::duration<double> elapsed = Clock::now() - start;
+  return theThreads * theCalls / elapsed.count();
+}
+
+// Hits on popular-but-not-latest keys: the splice based LRU upgrades to an
+// exclusive lock on nearly every find, CLOCK stays in shared mode
+template <typename CacheType>
+double findscalability(int theThreads)
+{
+  const int nkeys = 10000;
+  const int ncalls = 200000;
+
+  CacheType cache(2 * nkeys);
+  for (int i = 0; i < nkeys; i++)
+    cache.insert(i, std::to_string(i));
+
+  return throughput(theThreads,
+                    ncalls,
+                    [&cache](int t, int i) { cache.find((i * 7919 + t * 104729) % nkeys); });
+}
+
+void benchmarkfind()
+{
+  using LRU = Cache<int, std::string>;
+  using CLOCK = Cache<int, std::string, TrivialSizeFunction<std::string>, 16, ClockPolicy>;
+
+  std::printf("Cache::find hits, calls/second\n");
+  std::printf("%8s %14s %14s %8s\n", "threads", "LRU", "CLOCK", "ratio");
+  for (int threads = 1; threads <= 64; threads *= 2)
+  {
+    const double lru = findscalability<LRU>(threads);
+    const double clock = findscalability<CLOCK>(threads);
+    std::printf("%8d %14.0f %14.0f %8.2f\n", threads, lru, clock, clock / lru);
+  }
+  std::printf("\n");
+}
+
+// Cost of the optional shard instrumentation
+void benchmarkinstrumentation()
+{
+  using Plain = Cache<int, std::string>;
+  using Instrumented =
+      Cache<int, std::string, TrivialSizeFunction<std::string>, 16, LRUPolicy, ShardInstrumentation<>>;
+
+  std::printf("Cache::find hits with instrumentation, calls/second\n");
+  std::printf("%8s %14s %14s %8s\n", "threads", "plain", "instrumented", "ratio");
+  for (int threads : {1, 8})
+  {
+    const double plain = findscalability<Plain>(threads);
+    const double instrumented = findscalability<Instrumented>(threads);
+    std::printf("%8d %14.0f %14.0f %8.2f\n", threads, plain, instrumented, instrumented / plain);
+  }
+  std::printf("\n");
+}
+
+// One find per key versus a single findMany call
+void benchmarkbatch()
+{
+  const int nkeys = 100000;
+  Cache<int, std::string> cache(2 * nkeys);
+  for (int i = 0; i < nkeys; i++)
+    cache.insert(i, std::to_string(i));
+
+  std::mt19937 generator(12345);
+  std::uniform_int_distribution<int> distribution(0, 2 * nkeys - 1);
+
+  std::printf("Cache::find loop versus findMany, microseconds per batch\n");
+  std::printf("%8s %14s %14s %8s\n", "keys", "loop", "findMany", "ratio");
+  for (int batchsize : {100, 1000})
+  {
+    std::vector<int> keys(batchsize);
+    for (auto& key : keys)
+      key = distribution(generator);
+    std::vector<std::optional<std::string>> results(batchsize);
+
+    const int repeats = 2000000 / batchsize;
+
+    auto start = Clock::now();
+    for (int r = 0; r < repeats; r++)
+      for (int i = 0; i < batchsize; i++)
+        results[i] = cache.find(keys[i]);
+    const std::chrono::duration<double, std::micro> loop = Clock::now() - start;
+
+    start = Clock::now();
+    for (int r = 0; r < repeats; r++)
+      cache.findMany(keys.data(), keys.size(), results.data());
+    const std::chrono::duration<double, std::micro> batch = Clock::now() - start;
+
+    std::printf("%8d %14.2f %14.2f %8.2f\n",
+                batchsize,
+                loop.count() / repeats,
+                batch.count() / repeats,
+                loop.count() / batch.count());
+  }
+  std::printf("\n");
+}
+
+// Resident set size in bytes
+std::size_t rss()
+{
+  std::size_t pages = 0;
+  std::size_t resident = 0;
+  std::ifstream in("/proc/self/statm");
+  in >> pages >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Fill a cache with 1M entries and measure the RSS growth and the latency of random hits
+template <typename CacheType>
+void lookuplatency(const char* theName)
+{
+  const std::uint64_t nkeys = 1000000;
+  const int ncalls = 5000000;
+
+  malloc_trim(0);
+  const std::size_t before = rss();
+  {
+    CacheType cache(nkeys);
+    for (std::uint64_t i = 0; i < nkeys; i++)
+      cache.insert(i * 11400714819323198485ULL, i);
+    const std::size_t after = rss();
+
+    std::mt19937_64 generator(12345);
+    std::uniform_int_distribution<std::uint64_t> distribution(0, nkeys - 1);
+    std::vector<std::uint64_t> keys(ncalls);
+    for (auto& key : keys)
+      key = distribution(generator) * 11400714819323198485ULL;
+
+    std::uint64_t sum = 0;
+    const auto start = Clock::now();
+    for (auto key : keys)
+      sum += *cache.find(key);
+    const std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+
+    std::printf("%8s %14.1f %14.1f %14.1f\n",
+                theName,
+                elapsed.count() / ncalls,
+                (after - before) / 1048576.0,
+                (after - before) / double(nkeys));
+    if (sum == 0)
+      std::printf("unexpected sum\n");
+  }
+}
+
+void benchmarkstorage()
+{
+  using Flat = FlatCache<std::uint64_t, std::uint64_t>;
+  using List = Cache<std::uint64_t, std::uint64_t>;
+
+  std::printf("Shard storage with 1M entries\n");
+  std::printf("%8s %14s %14s %14s\n", "storage", "ns/find", "RSS MB", "bytes/entry");
+  lookuplatency<Flat>("flat");
+  lookuplatency<List>("list");
+  std::printf("\n");
+}
+
+// Save and load 1M entries
+void benchmarksnapshot()
+{
+  const int nkeys = 1000000;
+  using CacheType = Cache<int, std::string>;
+  const BinarySerializer<int, std::string> serializer;
+  const std::filesystem::path path =
+      std::filesystem::temp_directory_path() / "MacGyver_CacheBenchmark_snapshot";
+
+  CacheType cache(nkeys);
+  for (int i = 0; i < nkeys; i++)
+    cache.insert(i, "value number " + std::to_string(i));
+
+  auto start = Clock::now();
+  cache.save(path, serializer);
+  const std::chrono::duration<double, std::milli> save = Clock::now() - start;
+
+  CacheType restored(nkeys);
+  start = Clock::now();
+  const std::size_t loaded = restored.load(path, serializer);
+  const std::chrono::duration<double, std::milli> load = Clock::now() - start;
+
+  std::printf("Snapshot of %d entries, %.1f MB\n", nkeys, std::filesystem::file_size(path) / 1048576.0);
+  std::printf("%8s %14.1f ms\n", "save", save.count());
+  std::printf("%8s %14.1f ms (%zu entries)\n", "load", load.count(), loaded);
+  std::printf("\n");
+  std::filesystem::remove(path);
+}
+
+// Mean insert and find latencies of a FileCache in microseconds with concurrent threads
+template <typename Insert, typename Find>
+void filecachelatency(const char* theName, int theThreads, Insert&& insert, Find&& find)
+{
+  const int ninserts = 2000;
+  const int nfinds = 20000;
+  const std::string value(4096, 'x');
+
+  std::atomic<long> insertTime{0};
+  std::atomic<long> findTime{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < theThreads; t++)
+    threads.emplace_back(
+        [&, t]()
+        {
+          auto start = Clock::now();
+          for (int i = 0; i < ninserts; i++)
+            insert(static_cast<std::size_t>(t * ninserts + i) * 2654435761ULL, value);
+          insertTime += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start)
+                            .count();
+
+          std::mt19937 generator(t);
+          std::uniform_int_distribution<int> distribution(0, theThreads * ninserts - 1);
+          start = Clock::now();
+          for (int i = 0; i < nfinds; i++)
+            find(static_cast<std::size_t>(distribution(generator)) * 2654435761ULL);
+          findTime += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start)
+                          .count();
+        });
+  for (auto& thread : threads)
+    thread.join();
+
+  std::printf("%12s %8d %14.2f %14.2f\n",
+              theName,
+              theThreads,
+              insertTime / 1000.0 / (theThreads * ninserts),
+              findTime / 1000.0 / (theThreads * nfinds));
+}
+
+void benchmarkfilecache()
+{
+  const auto dir = std::filesystem::temp_directory_path() / "MacGyver_CacheBenchmark_filecache";
+
+  std::printf("FileCache latency, microseconds per call\n");
+  std::printf("%12s %8s %14s %14s\n", "mode", "threads", "insert", "find");
+  for (int threads : {1, 8})
+  {
+    for (bool writeBehind : {false, true})
+    {
+      std::filesystem::remove_all(dir);
+      FileCache cache(dir, 1000000000, writeBehind);
+      filecachelatency(
+          writeBehind ? "queued/copy" : "sync/copy",
+          threads,
+          [&cache](std::size_t key, const std::string& value) { cache.insert(key, value); },
+          [&cache](std::size_t key) { cache.find(key); });
+    }
+
+    std::filesystem::remove_all(dir);
+    FileCache cache(dir, 1000000000);
+    filecachelatency(
+        "sync/view",
+        threads,
+        [&cache](std::size_t key, const std::string& value) { cache.insert(key, value); },
+        [&cache](std::size_t key) { cache.findView(key); });
+  }
+  std::filesystem::remove_all(dir);
+  std::printf("\n");
+}
+
+// FileCache startup with 1M files, from the journal and with a directory scan
+void benchmarkfilecachestartup()
+{
+  const std::size_t nfiles = 1000000;
+  const auto dir = std::filesystem::temp_directory_path() / "MacGyver_CacheBenchmark_startup";
+  std::filesystem::remove_all(dir);
+
+  // Files are created directly in the FileCache layout, which is faster than inserting
+  for (std::size_t i = 0; i < nfiles; i++)
+  {
+    const std::size_t key = i * 2654435761ULL;
+    char subdir[32];
+    char name[32];
+    std::snprintf(subdir, sizeof(subdir), "%zx", key & 0xff);
+    std::snprintf(name, sizeof(name), "%zx", key >> 8);
+    if (i < 256)
+      std::filesystem::create_directories(dir / subdir);
+    std::ofstream(dir / subdir / name) << "value";
+  }
+
+  auto startup = [&dir]()
+  {
+    const auto start = Clock::now();
+    FileCache cache(dir, 100000000);
+    const std::chrono::duration<double, std::milli> elapsed = Clock::now() - start;
+    return std::make_pair(elapsed.count(), cache.getContent().size());
+  };
+
+  const auto scan = startup();  // no journal yet
+  const auto journal = startup();
+  std::filesystem::remove(dir / "index.journal");
+  const auto rescan = startup();
+
+  std::printf("FileCache startup with %zu files, milliseconds\n", nfiles);
+  std::printf("%8s %14.1f (%zu entries)\n", "scan", scan.first, scan.second);
+  std::printf("%8s %14.1f (%zu entries)\n", "journal", journal.first, journal.second);
+  std::printf("%8s %14.1f (%zu entries)\n", "rescan", rescan.first, rescan.second);
+  std::printf("\n");
+  std::filesystem::remove_all(dir);
+}
+
+// Representative payloads of about 8 kB with varying numbers
+std::string samplepayload(const std::string& theType, std::mt19937& theGenerator)
+{
+  std::uniform_real_distribution<double> temperature(-30, 30);
+  std::uniform_int_distribution<int> station(1000, 99999);
+  char line[256];
+  std::string ret;
+  for (int i = 0; ret.size() < 8000; i++)
+  {
+    const int fmisid = station(theGenerator);
+    const double t = temperature(theGenerator);
+    if (theType == "json")
+      std::snprintf(line,
+                    sizeof(line),
+                    "{\"fmisid\":%d,\"time\":\"2026-10-16T%02d:00:00Z\",\"t2m\":%.1f,"
+                    "\"name\":\"Station %d\"},",
+                    fmisid,
+                    i % 24,
+                    t,
+                    fmisid);
+    else if (theType == "xml")
+      std::snprintf(line,
+                    sizeof(line),
+                    "<wfs:member><BsWfs:BsWfsElement><BsWfs:Time>2026-10-16T%02d:00:00Z"
+                    "</BsWfs:Time><BsWfs:ParameterValue>%.1f</BsWfs:ParameterValue>"
+                    "</BsWfs:BsWfsElement></wfs:member>\n",
+                    i % 24,
+                    t);
+    else
+      std::snprintf(line, sizeof(line), "%d,2026-10-16T%02d:00:00Z,%.1f\n", fmisid, i % 24, t);
+    ret += line;
+  }
+  return ret;
+}
+
+// Compression ratio, cost and the number of values fitting into a fixed byte budget
+void benchmarkcompression()
+{
+  const int nvalues = 2000;
+  const std::size_t budget = 512 * 1024;
+  using CacheType = Cache<int, CompressedValue, CompressedSizeFunction>;
+
+  std::printf("Value compression, %d values of 8 kB, %zu kB cache\n", nvalues, budget / 1024);
+  std::printf("%6s %6s %8s %14s %14s %10s\n", "data", "codec", "ratio", "compress us",
+              "decompress us", "capacity");
+  const std::pair<const char*, Fmi::Compression> codecs[] = {
+      {"none", Fmi::Compression::NONE},
+      {"zstd", Fmi::Compression::ZSTD},
+      {"gzip", Fmi::Compression::GZIP}};
+
+  for (const std::string type : {"json", "xml", "csv"})
+  {
+    std::mt19937 generator(1);
+    std::vector<std::string> payloads;
+    std::size_t rawBytes = 0;
+    for (int i = 0; i < nvalues; i++)
+    {
+      payloads.push_back(samplepayload(type, generator));
+      rawBytes += payloads.back().size();
+    }
+
+    std::size_t rawCapacity = 0;
+    for (const auto& codec : codecs)
+    {
+      const CacheCompression options{codec.second, 256};
+      std::vector<CompressedValue> values;
+      values.reserve(nvalues);
+      auto start = Clock::now();
+      for (const auto& payload : payloads)
+        values.emplace_back(payload, options);
+      const std::chrono::duration<double, std::micro> compress = Clock::now() - start;
+
+      std::size_t storedBytes = 0;
+      std::size_t check = 0;
+      start = Clock::now();
+      for (const auto& value : values)
+      {
+        storedBytes += value.size();
+        check += value.value().size();
+      }
+      const std::chrono::duration<double, std::micro> decompress = Clock::now() - start;
+      if (check != rawBytes)
+        std::printf("Round trip failed for %s/%s\n", type.c_str(), codec.first);
+
+      CacheType cache(budget);
+      for (int i = 0; i < nvalues; i++)
+        cache.insert(i, values[i]);
+      std::size_t capacity = 0;
+      for (int i = 0; i < nvalues; i++)
+        capacity += (cache.findHandle(i) != nullptr);
+      if (codec.second == Fmi::Compression::NONE)
+        rawCapacity = capacity;
+
+      std::printf("%6s %6s %8.2f %14.1f %14.1f %9.1fx\n",
+                  type.c_str(),
+                  codec.first,
+                  static_cast<double>(rawBytes) / storedBytes,
+                  compress.count() / nvalues,
+                  decompress.count() / nvalues,
+                  static_cast<double>(capacity) / rawCapacity);
+    }
+  }
+  std::printf("\n");
+}
+
+// Worst lookup latency while another thread dumps the cache contents
+void benchmarkvisit()
+{
+  const int nkeys = 500000;
+  using CacheType = Cache<int, std::string>;
+  CacheType cache(nkeys);
+  for (int i = 0; i < nkeys; i++)
+    cache.insert(i, std::string(1000, 'x'));
+
+  auto worstlatency = [&cache](const std::function<void()>& theDump)
+  {
+    std::atomic<bool> running{true};
+    double worst = 0;
+    std::thread reader(
+        [&]()
+        {
+          for (int i = 0; running; i++)
+          {
+            const auto start = Clock::now();
+            cache.find((i * 7919) % nkeys);
+            const std::chrono::duration<double, std::micro> elapsed = Clock::now() - start;
+            worst = std::max(worst, elapsed.count());
+          }
+        });
+    const auto start = Clock::now();
+    theDump();
+    const std::chrono::duration<double, std::milli> elapsed = Clock::now() - start;
+    running = false;
+    reader.join();
+    return std::make_pair(elapsed.count(), worst);
+  };
+
+  std::size_t bytes = 0;
+  const auto content = worstlatency([&]() { bytes = cache.getContent().size(); });
+  const auto text = worstlatency([&]() { bytes = cache.getTextContent().size(); });
+  const auto visit = worstlatency(
+      [&]() { cache.visit([&](const CacheType::EntryInfo& info) { bytes += info.size; }); });
+
+  std::printf("Dump of %d entries while finding, dump ms / worst find us\n", nkeys);
+  std::printf("%12s %10.1f %12.1f\n", "getContent", content.first, content.second);
+  std::printf("%12s %10.1f %12.1f\n", "getText", text.first, text.second);
+  std::printf("%12s %10.1f %12.1f\n", "visit", visit.first, visit.second);
+  std::printf("\n");
+}
+
+// Lookups of string keys given as views: constructing a key, a view lookup
+// and a lookup with a precomputed hash
+void benchmarkheterogeneous()
+{
+  const int nkeys = 10000;
+  const int nlookups = 2000000;
+  using CacheType = Cache<std::string, int>;
+
+  CacheType cache(2 * nkeys);
+  std::vector<std::string> keys;
+  for (int i = 0; i < nkeys; i++)
+  {
+    keys.push_back("/wms?layer=temperature&time=2026-10-16T12:00:00Z&bbox=" + std::to_string(i));
+    cache.insert(keys.back(), i);
+  }
+  std::vector<std::string_view> views(keys.begin(), keys.end());
+  std::vector<Fmi::HashValue> hashes;
+  for (const auto& view : views)
+    hashes.push_back(CacheType::hashKey(view));
+
+  auto measure = [&](const char* theName, const std::function<bool(int)>& theLookup)
+  {
+    std::size_t found = 0;
+    const std::size_t before = allocations;
+    const auto start = Clock::now();
+    for (int i = 0; i < nlookups; i++)
+      found += theLookup(static_cast<int>((i * 7919LL) % nkeys));
+    const std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+    std::printf("%14s %10.1f ns %8.2f allocations/lookup%s\n",
+                theName,
+                elapsed.count() / nlookups,
+                static_cast<double>(allocations - before) / nlookups,
+                found == nlookups ? "" : " (misses!)");
+  };
+
+  std::printf("Lookups of %zu character string keys given as string_view\n", keys[0].size());
+  measure("std::string", [&](int i) { return cache.findHandle(std::string(views[i])) != nullptr; });
+  measure("string_view", [&](int i) { return cache.findHandle(views[i]) != nullptr; });
+  measure("precomputed", [&](int i) { return cache.findHandle(views[i], hashes[i]) != nullptr; });
+  std::printf("\n");
+}
+
+}  // namespace
+
+// A handful of very hot keys, such as timezone names, with and without the near cache
+double hotkeys(int theThreads, bool theNearCache)
+{
+  const int nkeys = 16;
+  const int ncalls = 500000;
+
+  Cache<std::string, int> cache(1000);
+  if (theNearCache)
+    cache.enableNearCache();
+  std::vector<std::string> keys;
+  for (int i = 0; i < nkeys; i++)
+  {
+    keys.push_back("Europe/Zone" + std::to_string(i));
+    cache.insert(keys.back(), i);
+  }
+
+  return throughput(theThreads,
+                    ncalls,
+                    [&](int t, int i) { cache.findHandle(keys[(i + t) % nkeys]); });
+}
+
+void benchmarknearcache()
+{
+  std::printf("Cache::findHandle hits on 16 hot keys, calls/second\n");
+  std::printf("%8s %14s %14s %8s\n", "threads", "shared", "near", "ratio");
+  for (int threads = 1; threads <= 16; threads *= 2)
+  {
+    const double shared = hotkeys(threads, false);
+    const double near = hotkeys(threads, true);
+    std::printf("%8d %14.0f %14.0f %8.2f\n", threads, shared, near, near / shared);
+  }
+  std::printf("\n");
+}
+
+// Overhead of miss ratio curve tracking on finds. The difference between two
+// find loops is lost in the noise, hence the tracking is timed separately
+// with the same key sequence and compared to the time of a plain find.
+void benchmarkmissratio()
+{
+  const int nkeys = 100000;
+  const int ncalls = 2000000;
+
+  std::mt19937 gen(4321);
+  std::exponential_distribution<double> distribution(5.0 / nkeys);
+  std::vector<int> keys(ncalls);
+  for (auto& key : keys)
+    key = static_cast<int>(distribution(gen)) % (2 * nkeys);
+
+  auto nanoseconds = [&](const std::function<void(int)>& theFunction)
+  {
+    double best = 1e100;
+    for (int run = 0; run < 3; run++)
+    {
+      const auto start = Clock::now();
+      for (int i = 0; i < ncalls; i++)
+        theFunction(i);
+      const std::chrono::duration<double, std::nano> elapsed = Clock::now() - start;
+      best = std::min(best, elapsed.count() / ncalls);
+    }
+    return best;
+  };
+
+  Cache<int, int> cache(nkeys);
+  for (int i = 0; i < nkeys; i++)
+    cache.insert(i, i);
+  const double find = nanoseconds([&](int i) { cache.findHandle(keys[i]); });
+
+  std::printf("Miss ratio curve tracking, Cache::findHandle takes %.0f ns\n", find);
+  std::printf("%10s %14s %10s %10s\n", "sampling", "ns/lookup", "overhead", "keys");
+  for (double rate : {0.001, 0.01, 0.1, 1.0})
+  {
+    ReuseDistanceTracker tracker(rate);
+    const double tracking =
+        nanoseconds([&](int i) { tracker.access(CacheKeyHash<int>()(keys[i])); });
+    std::printf("%9.1f%% %14.1f %9.2f%% %10zu\n",
+                100 * rate,
+                tracking,
+                100 * tracking / find,
+                tracker.trackedKeys());
+  }
+  std::printf("\n");
+}
+
+int main()
+{
+  benchmarkfind();
+  benchmarkinstrumentation();
+  benchmarkbatch();
+  benchmarkstorage();
+  benchmarksnapshot();
+  benchmarkfilecache();
+  benchmarkfilecachestartup();
+  benchmarkcompression();
+  benchmarkvisit();
+  benchmarkheterogeneous();
+  benchmarknearcache();
+  benchmarkmissratio();
+  return 0;
+}
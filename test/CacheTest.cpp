@@ -1,4 +1,10 @@
 #include "Cache.h"
+#include "CacheCompression.h"
+#include "FlatCache.h"
+#include "SharedCache.h"
+#include "ThreadName.h"
+#include "ThreadPool.h"
+#include "TieredCache.h"
 
 #include <boost/algorithm/string.hpp>
 #include <filesystem>
@@ -6,10 +12,22 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/thread.hpp>
 #include <regression/tframe.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <ctime>
+#include <fstream>
 #include <iostream>
 #include <list>
+#include <map>
+#include <random>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 // FIXME: unfortunatelly no similar function to boost::filesystem::unique_pth is
 //        present in std::filesystem. As result we have to use boost::filesystem in tests
@@ -19,7 +37,7 @@ using namespace Fmi::Cache;
 
 namespace fs = std::filesystem;
 
-static std::filesystem::path* testpaths[3] = {nullptr};
+static std::filesystem::path* testpaths[9] = {nullptr};
 
 namespace CacheTest
 {
@@ -164,6 +182,307 @@ void testfilecachesize()
   TEST_PASSED();
 }
 
+void testfilecacheview()
+{
+  fs::path testdir(*testpaths[4]);
+
+  FileCache cache(testdir, 10);
+  cache.insert(1, "12345");
+  cache.insert(2, "");
+
+  auto view = cache.findView(1);
+  if (!view || view.view() != "12345")
+    TEST_FAILED("findView returned wrong content '" + view.str() + "'");
+
+  auto empty = cache.findView(2);
+  if (!empty || empty.size() != 0)
+    TEST_FAILED("findView should find the empty value");
+
+  if (cache.findView(3))
+    TEST_FAILED("findView should return an empty view on a miss");
+
+  // The mapping stays valid after the entry is evicted and the file removed
+  cache.insert(3, "abcdefghij");
+  if (cache.findView(1))
+    TEST_FAILED("Entry 1 should have been evicted");
+  if (view.str() != "12345")
+    TEST_FAILED("View content changed after eviction");
+
+  TEST_PASSED();
+}
+
+void testfilecachewritebehind()
+{
+  fs::path testdir(*testpaths[5]);
+
+  {
+    FileCache cache(testdir, 1000, true);
+    for (std::size_t i = 0; i < 50; i++)
+      cache.insert(i * 1000003, "value" + to_string(i));
+
+    // Queued or stored, the values can be found
+    for (std::size_t i = 0; i < 50; i++)
+    {
+      auto value = cache.find(i * 1000003);
+      if (!value || *value != "value" + to_string(i))
+        TEST_FAILED("Wrong value for key " + to_string(i * 1000003));
+    }
+
+    cache.flush();
+    const auto stats = cache.statistics();
+    if (stats.counters.at("queued_writes") != 0 || stats.counters.at("write_failures") != 0)
+      TEST_FAILED("Write queue should be empty after flush");
+    if (stats.inserts != 50 || stats.hits != 50)
+      TEST_FAILED("Wrong insert or hit count");
+
+    // Queued writes are completed on destruction
+    cache.insert(999, "last");
+  }
+
+  FileCache cache(testdir, 1000);
+  if (cache.getContent().size() != 51)
+    TEST_FAILED("Expected 51 files on disk, found " + to_string(cache.getContent().size()));
+  auto value = cache.find(999);
+  if (!value || *value != "last")
+    TEST_FAILED("Value queued at destruction was not written");
+
+  // Concurrent inserts and finds keep the global size limit
+  std::atomic<bool> wrong{false};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++)
+    threads.emplace_back(
+        [&cache, &wrong, t]()
+        {
+          for (std::size_t i = 0; i < 500; i++)
+          {
+            const std::size_t key = t * 100000 + 2000 + i;
+            cache.insert(key, std::string(10, 'a' + t));
+            auto found = cache.find(key - 7);
+            if (found && *found != std::string(10, 'a' + t))
+              wrong = true;
+          }
+        });
+  for (auto& thread : threads)
+    thread.join();
+
+  if (wrong)
+    TEST_FAILED("Found a wrong value during concurrent inserts");
+
+  if (cache.getSize() > 1000)
+    TEST_FAILED("Cache size " + to_string(cache.getSize()) + " exceeds the limit");
+
+  TEST_PASSED();
+}
+
+void testfilecachejournal()
+{
+  fs::path testdir(*testpaths[6]);
+
+  std::vector<std::size_t> order;
+  {
+    FileCache cache(testdir, 1000);
+    for (std::size_t i = 1; i <= 20; i++)
+      cache.insert(i * 7919, "value" + to_string(i));
+    for (std::size_t i = 2; i <= 20; i += 3)
+      cache.find(i * 7919);
+    order = cache.getContent();
+  }
+
+  if (!fs::exists(testdir / "index.journal"))
+    TEST_FAILED("Journal was not written");
+
+  // The journal restores the LRU order, which a directory scan cannot do
+  {
+    FileCache cache(testdir, 1000);
+    if (cache.getContent() != order)
+      TEST_FAILED("LRU order was not restored from the journal");
+  }
+
+  // Changes made behind our back are found by rescanning the modified subdirectories
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  fs::remove(testdir / "ef" / "1e");  // key 7919 = 0x1eef
+  fs::create_directories(testdir / "ab");
+  {
+    std::ofstream out(testdir / "ab" / "cd", std::ios::binary);
+    out << "external";
+  }
+  {
+    FileCache cache(testdir, 1000);
+    auto content = cache.getContent();
+    if (std::find(content.begin(), content.end(), 7919) != content.end())
+      TEST_FAILED("Removed file is still in the cache");
+    auto value = cache.find(0xcdab);
+    if (!value || *value != "external")
+      TEST_FAILED("Externally added file was not found");
+    if (content.size() != 20)
+      TEST_FAILED("Expected 20 entries, got " + to_string(content.size()));
+
+    // The order of the unmodified entries is kept
+    std::vector<std::size_t> expected;
+    for (auto key : order)
+      if (key != 7919)
+        expected.push_back(key);
+    content.erase(std::remove(content.begin(), content.end(), 0xcdab), content.end());
+    if (content != expected)
+      TEST_FAILED("LRU order was lost for unmodified subdirectories");
+  }
+
+  // A corrupt journal falls back to a full scan
+  {
+    std::ofstream out(testdir / "index.journal", std::ios::binary | std::ios::trunc);
+    out << "garbage";
+  }
+  {
+    FileCache cache(testdir, 1000);
+    if (cache.getContent().size() != 20)
+      TEST_FAILED("Full scan found " + to_string(cache.getContent().size()) + " entries");
+  }
+
+  // flush() records the LRU order, which survives without the final rewrite
+  {
+    FileCache cache(testdir, 1000);
+    const auto keys = cache.getContent();
+    for (std::size_t i = 0; i < keys.size(); i += 3)
+      cache.find(keys[i]);
+    cache.flush();
+    order = cache.getContent();
+    fs::copy_file(testdir / "index.journal",
+                  testdir / "journal.copy",
+                  fs::copy_options::overwrite_existing);
+  }
+  fs::rename(testdir / "journal.copy", testdir / "index.journal");
+  {
+    FileCache cache(testdir, 1000);
+    if (cache.getContent() != order)
+      TEST_FAILED("LRU order recorded by flush() was not restored");
+  }
+
+  // Hits do not write the journal
+  {
+    FileCache cache(testdir, 1000);
+    const auto size = fs::file_size(testdir / "index.journal");
+    const auto keys = cache.getContent();
+    for (int round = 0; round < 100; round++)
+      for (auto key : keys)
+        cache.find(key);
+    if (fs::file_size(testdir / "index.journal") != size)
+      TEST_FAILED("Hits were journaled");
+  }
+
+  // The journal is compacted while running, 12000 insert and removal records would
+  // take 300 kB
+  {
+    FileCache cache(testdir, 1000);
+    for (std::size_t i = 0; i < 6000; i++)
+      cache.insert(1000000 + i * 7919, "churn" + to_string(i));
+    const auto size = fs::file_size(testdir / "index.journal");
+    if (size > 150000)
+      TEST_FAILED("Journal was not compacted, size " + to_string(size));
+    cache.flush();
+    order = cache.getContent();
+  }
+  {
+    FileCache cache(testdir, 1000);
+    if (cache.getContent() != order)
+      TEST_FAILED("LRU order was lost after compaction");
+  }
+
+  TEST_PASSED();
+}
+
+void testfilecachecompression()
+{
+  fs::path testdir(*testpaths[7]);
+
+  const CacheCompression options{Fmi::Compression::ZSTD, 64};
+  std::string json = "[";
+  for (int i = 0; i < 200; i++)
+    json += "{\"id\":" + to_string(i) + ",\"name\":\"station\",\"value\":1.5},";
+  json += "]";
+
+  {
+    FileCache cache(testdir, 100000, false, options);
+    cache.insert(1, json);
+    cache.insert(2, "short");
+
+    // Sizes are accounted in stored bytes
+    if (cache.getSize() >= json.size())
+      TEST_FAILED("Compressed value should use less than " + to_string(json.size()) + " bytes");
+    if (fs::file_size(testdir / "1" / "0") != cache.getSize() - 5)
+      TEST_FAILED("Stored file size does not match the accounted size");
+    if (fs::file_size(testdir / "2" / "0") != 5)
+      TEST_FAILED("Short value should be stored uncompressed");
+
+    if (cache.find(1) != std::optional<std::string>(json))
+      TEST_FAILED("Decompressed value differs from the inserted one");
+    if (cache.findView(1).view() != json)
+      TEST_FAILED("Decompressed view differs from the inserted one");
+    if (cache.find(2) != std::optional<std::string>("short"))
+      TEST_FAILED("Short value was not found");
+
+    auto stats = cache.statistics();
+    if (stats.counters["compressed_inserts"] != 1)
+      TEST_FAILED("Expected one compressed insert");
+  }
+
+  // Compressed files are readable without compression enabled
+  {
+    FileCache cache(testdir, 100000);
+    if (cache.find(1) != std::optional<std::string>(json))
+      TEST_FAILED("Compressed value was not read by an uncompressed cache");
+  }
+
+  TEST_PASSED();
+}
+
+void testtieredcache()
+{
+  fs::path testdir(*testpaths[8]);
+
+  {
+    TieredCache<TrivialSizeFunction<std::string>, 1> cache(4, testdir, 100000);
+    for (std::size_t i = 1; i <= 10; i++)
+      cache.insert(i, "value" + to_string(i));
+
+    // Evicted entries are found while queued or after being written
+    if (cache.find(1) != std::optional<std::string>("value1"))
+      TEST_FAILED("Demoted value was not found");
+
+    cache.flush();
+    auto stats = cache.statistics();
+    if (stats["memory"].size != 4)
+      TEST_FAILED("Memory tier should hold 4 entries, has " + to_string(stats["memory"].size));
+    if (stats["memory"].counters["demotions"] != 7)
+      TEST_FAILED("Expected 7 demotions, got " + to_string(stats["memory"].counters["demotions"]));
+    if (stats["disk"].counters["queued_demotions"] != 0)
+      TEST_FAILED("Demotion queue should be empty after flush");
+    if (stats["disk"].size == 0 || stats["disk"].counters["demotion_batches"] == 0)
+      TEST_FAILED("Demotions were not written to disk");
+
+    // A disk hit is promoted back into memory
+    const auto promotions = stats["memory"].counters["promotions"];
+    if (cache.find(2) != std::optional<std::string>("value2"))
+      TEST_FAILED("Value was not found on disk");
+    stats = cache.statistics();
+    if (stats["memory"].counters["promotions"] != promotions + 1)
+      TEST_FAILED("Disk hit was not promoted");
+    if (!cache.memory().findHandle(2))
+      TEST_FAILED("Promoted value is not in memory");
+
+    if (cache.find(99))
+      TEST_FAILED("Missing key was found");
+  }
+
+  // Demotions survive in the disk tier
+  {
+    TieredCache<TrivialSizeFunction<std::string>, 1> cache(4, testdir, 100000);
+    if (cache.find(3) != std::optional<std::string>("value3"))
+      TEST_FAILED("Value was not found on disk after a restart");
+  }
+
+  TEST_PASSED();
+}
+
 void testcustomtype()
 {
   Cache<int, custom_type, custom_comparator, 1> thisCache(115);
@@ -348,6 +667,1346 @@ void testcounters()
   TEST_PASSED();
 }
 
+// Replay a zipfian workload interleaved with long scans over cold keys and
+// return the hit rate of the zipfian part
+template <typename CacheType>
+double zipfscanhitrate(CacheType& cache)
+{
+  const int nkeys = 20000;
+  const int nrequests = 200000;
+  const int scaninterval = 5000;
+  const int scanlength = 2000;
+
+  std::vector<double> cdf(nkeys);
+  double sum = 0;
+  for (int i = 0; i < nkeys; i++)
+  {
+    sum += 1.0 / (i + 1);
+    cdf[i] = sum;
+  }
+
+  std::mt19937 generator(12345);
+  std::uniform_real_distribution<double> uniform(0, sum);
+
+  int hits = 0;
+  int scankey = nkeys;
+  for (int request = 1; request <= nrequests; request++)
+  {
+    const int key = int(std::lower_bound(cdf.begin(), cdf.end(), uniform(generator)) - cdf.begin());
+    if (cache.find(key))
+      ++hits;
+    else
+      cache.insert(key, key);
+
+    if (request % scaninterval == 0)
+    {
+      for (int i = 0; i < scanlength; i++, scankey++)
+        if (!cache.find(scankey))
+          cache.insert(scankey, scankey);
+    }
+  }
+  return double(hits) / nrequests;
+}
+
+void testtinylfu()
+{
+  Cache<int, int, TrivialSizeFunction<int>, 4> lru(1000);
+  Cache<int, int, TrivialSizeFunction<int>, 4, TinyLFUPolicy> tinylfu(1000);
+
+  const double lrurate = zipfscanhitrate(lru);
+  const double tinylfurate = zipfscanhitrate(tinylfu);
+
+  if (tinylfurate < lrurate + 0.05)
+    TEST_FAILED("W-TinyLFU hit rate " + std::to_string(tinylfurate) +
+                " should clearly exceed the LRU hit rate " + std::to_string(lrurate));
+
+  if (tinylfu.size() != 1000)
+    TEST_FAILED("W-TinyLFU cache should be full, size is " + std::to_string(tinylfu.size()));
+
+  auto stats = tinylfu.statistics();
+  if (stats.counters["tinylfu_rejections"] == 0)
+    TEST_FAILED("W-TinyLFU should have rejected scanned keys");
+  if (stats.evictions != stats.inserts - 1000)
+    TEST_FAILED("W-TinyLFU eviction count does not match the inserts");
+
+  TEST_PASSED();
+}
+
+void testtinylfuorder()
+{
+  Cache<int, string, TrivialSizeFunction<string>, 1, TinyLFUPolicy> thisCache(5);
+
+  thisCache.insert(1, "eka");
+  thisCache.insert(2, "toka");
+  thisCache.insert(3, "kolmas");
+
+  // Make 1 and 2 popular
+  for (int i = 0; i < 5; i++)
+  {
+    thisCache.find(1);
+    thisCache.find(2);
+  }
+
+  // A scan of cold keys must not displace the popular entries
+  for (int key = 10; key < 30; key++)
+    thisCache.insert(key, "kylma");
+
+  if (!thisCache.find(1) || !thisCache.find(2))
+    TEST_FAILED("Popular entries should survive a scan: " + thisCache.getTextContent());
+
+  if (thisCache.size() != 5)
+    TEST_FAILED("Wrong cache size: " + std::to_string(thisCache.size()) + ", should be 5");
+
+  TEST_PASSED();
+}
+
+void testclock()
+{
+  Cache<int, string, TrivialSizeFunction<string>, 1, ClockPolicy> thisCache(3);
+
+  thisCache.insert(1, "eka");
+  thisCache.insert(2, "toka");
+  thisCache.insert(3, "kolmas");
+
+  // 1 gets a second chance, 2 is the first unreferenced entry
+  thisCache.find(1);
+  thisCache.insert(4, "neljas");
+
+  std::string expected = "kolmas,neljas,eka";
+  if (thisCache.getTextContent() != expected)
+    TEST_FAILED("Wrong cache content:\"" + thisCache.getTextContent() + "\", expected \"" +
+                expected + "\"");
+
+  auto stats = thisCache.statistics();
+  if (stats.counters["clock_second_chances"] != 1)
+    TEST_FAILED("Expected one second chance, got " +
+                std::to_string(stats.counters["clock_second_chances"]));
+
+  TEST_PASSED();
+}
+
+void testclockthreads()
+{
+  Cache<int, int, TrivialSizeFunction<int>, 16, ClockPolicy> thisCache(2000);
+
+  for (int i = 0; i < 1000; i++)
+    thisCache.insert(i, i);
+
+  const int nthreads = 8;
+  const int nfinds = 10000;
+  std::atomic<int> errors{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < nthreads; t++)
+    threads.emplace_back(
+        [&thisCache, &errors, t]()
+        {
+          for (int i = 0; i < nfinds; i++)
+          {
+            const int key = (i * 7 + t) % 1000;
+            auto value = thisCache.find(key);
+            if (!value || *value != key)
+              ++errors;
+            if (i % 100 == 0)
+              thisCache.upsert(key, key);
+          }
+        });
+  for (auto& thread : threads)
+    thread.join();
+
+  if (errors > 0)
+    TEST_FAILED(std::to_string(errors) + " lookups failed");
+
+  auto stats = thisCache.statistics();
+  if (stats.hits != nthreads * nfinds)
+    TEST_FAILED("Expected " + std::to_string(nthreads * nfinds) + " hits, got " +
+                std::to_string(stats.hits));
+  if (stats.size != 1000)
+    TEST_FAILED("Cache size should be 1000, got " + std::to_string(stats.size));
+
+  TEST_PASSED();
+}
+
+void testttl()
+{
+  using namespace std::chrono_literals;
+  Cache<int, string, TrivialSizeFunction<string>, 1> thisCache(10);
+
+  thisCache.insert(1, "eka", 50ms);
+  thisCache.insert(2, "toka");
+  thisCache.upsert(3, "kolmas", 50ms);
+
+  if (!thisCache.find(1) || !thisCache.find(3))
+    TEST_FAILED("Entries should not have expired yet");
+
+  std::this_thread::sleep_for(100ms);
+
+  if (thisCache.find(1))
+    TEST_FAILED("Expired entry 1 was returned by find");
+  if (!thisCache.find(2))
+    TEST_FAILED("Entry without TTL should not expire");
+
+  // Inserting over an expired entry must succeed
+  if (!thisCache.insert(3, "kolmas uudestaan"))
+    TEST_FAILED("Insert over an expired entry failed");
+  if (thisCache.find(3) != std::optional<string>("kolmas uudestaan"))
+    TEST_FAILED("Expired entry was not replaced");
+
+  auto stats = thisCache.statistics();
+  if (stats.counters["expirations"] != 2)
+    TEST_FAILED("Expected 2 expirations, got " + std::to_string(stats.counters["expirations"]));
+  if (thisCache.size() != 2)
+    TEST_FAILED("Cache size should be 2, got " + std::to_string(thisCache.size()));
+
+  // Default TTL
+  thisCache.setDefaultTTL(50ms);
+  thisCache.insert(4, "neljas");
+  std::this_thread::sleep_for(100ms);
+  if (thisCache.expire() != 1)
+    TEST_FAILED("expire() should have removed the entry inserted with the default TTL");
+  if (thisCache.size() != 2)
+    TEST_FAILED("Cache size should be 2 after expire(), got " + std::to_string(thisCache.size()));
+
+  TEST_PASSED();
+}
+
+void testexpirysweeper()
+{
+  using namespace std::chrono_literals;
+  Cache<int, int, TrivialSizeFunction<int>, 4> thisCache(1000, 20ms);
+  thisCache.startExpirySweeper(10ms);
+
+  for (int i = 0; i < 100; i++)
+    thisCache.insert(i, i);
+  thisCache.insert(1000, 1000, 1h);
+
+  for (int i = 0; i < 100 && thisCache.size() > 1; i++)
+    std::this_thread::sleep_for(10ms);
+
+  if (thisCache.size() != 1)
+    TEST_FAILED("Sweeper should have removed expired entries, size is " +
+                std::to_string(thisCache.size()));
+
+  TEST_PASSED();
+}
+
+void testnegative()
+{
+  using namespace std::chrono_literals;
+  Cache<int, string, TrivialSizeFunction<string>, 1> thisCache(10);
+
+  thisCache.insertNegative(1, 50ms);
+  if (!thisCache.findNegative(1))
+    TEST_FAILED("Negative entry not found");
+  if (thisCache.findNegative(2))
+    TEST_FAILED("Unexpected negative entry");
+  if (thisCache.find(1))
+    TEST_FAILED("Negative entry should not be returned by find");
+  if (thisCache.size() != 0)
+    TEST_FAILED("Negative entries should not count towards the size");
+
+  std::this_thread::sleep_for(100ms);
+  if (thisCache.findNegative(1))
+    TEST_FAILED("Negative entry should have expired");
+
+  thisCache.insertNegative(2, 1h);
+  thisCache.insert(2, "toka");
+  if (thisCache.findNegative(2))
+    TEST_FAILED("Insert should replace the negative entry");
+
+  auto stats = thisCache.statistics();
+  if (stats.counters["negative_hits"] != 1)
+    TEST_FAILED("Expected one negative hit, got " +
+                std::to_string(stats.counters["negative_hits"]));
+
+  TEST_PASSED();
+}
+
+void testgetorcompute()
+{
+  using namespace std::chrono_literals;
+  Cache<int, string, TrivialSizeFunction<string>, 4> thisCache(100);
+
+  std::atomic<int> calls{0};
+  std::atomic<int> errors{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 16; t++)
+    threads.emplace_back(
+        [&]()
+        {
+          auto value = thisCache.getOrCompute(1,
+                                              [&calls]()
+                                              {
+                                                ++calls;
+                                                std::this_thread::sleep_for(100ms);
+                                                return string("eka");
+                                              });
+          if (value != "eka")
+            ++errors;
+        });
+  for (auto& thread : threads)
+    thread.join();
+
+  if (calls != 1)
+    TEST_FAILED("Factory should have been called once, got " + std::to_string(calls) + " calls");
+  if (errors > 0)
+    TEST_FAILED("Some callers got the wrong value");
+  if (thisCache.find(1) != std::optional<string>("eka"))
+    TEST_FAILED("Computed value should have been cached");
+
+  TEST_PASSED();
+}
+
+void testgetorcomputeerrors()
+{
+  using namespace std::chrono_literals;
+  Cache<int, string, TrivialSizeFunction<string>, 4> thisCache(100);
+
+  std::atomic<int> failures{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; t++)
+    threads.emplace_back(
+        [&]()
+        {
+          try
+          {
+            thisCache.getOrCompute(1,
+                                   []() -> string
+                                   {
+                                     std::this_thread::sleep_for(100ms);
+                                     throw std::runtime_error("backend failure");
+                                   });
+          }
+          catch (const std::runtime_error&)
+          {
+            ++failures;
+          }
+        });
+  for (auto& thread : threads)
+    thread.join();
+
+  if (failures != 8)
+    TEST_FAILED("All callers should have got the exception, got " + std::to_string(failures));
+  if (thisCache.find(1))
+    TEST_FAILED("Failed computation must not be cached");
+  if (thisCache.getOrCompute(1, []() { return string("eka"); }) != "eka")
+    TEST_FAILED("Recomputation after a failure failed");
+
+  // A waiter gives up after its timeout
+  std::thread slow(
+      [&]()
+      {
+        thisCache.getOrCompute(2,
+                               []()
+                               {
+                                 std::this_thread::sleep_for(300ms);
+                                 return string("toka");
+                               });
+      });
+  std::this_thread::sleep_for(50ms);
+  bool timedout = false;
+  try
+  {
+    thisCache.getOrCompute(2, []() { return string("wrong"); }, 10ms);
+  }
+  catch (const Fmi::Exception&)
+  {
+    timedout = true;
+  }
+  slow.join();
+  if (!timedout)
+    TEST_FAILED("Waiting for the computation should have timed out");
+  if (thisCache.find(2) != std::optional<string>("toka"))
+    TEST_FAILED("The slow computation should have been cached");
+
+  TEST_PASSED();
+}
+
+void testbatch()
+{
+  Cache<int, string, TrivialSizeFunction<string>, 4> thisCache(100);
+
+  Cache<int, string, TrivialSizeFunction<string>, 4>::ItemVector items;
+  for (int i = 0; i < 20; i++)
+    items.emplace_back(i, std::to_string(i));
+
+  if (thisCache.insertMany(items) != 20)
+    TEST_FAILED("insertMany should have inserted 20 values");
+  if (thisCache.insertMany(items) != 0)
+    TEST_FAILED("insertMany should not replace existing values");
+
+  items[0].second = "nolla";
+  if (thisCache.upsertMany(items) != 20)
+    TEST_FAILED("upsertMany should have replaced 20 values");
+
+  std::vector<int> keys = {0, 5, 100, 19, 5, -1};
+  auto results = thisCache.findMany(keys);
+  if (results.size() != keys.size())
+    TEST_FAILED("findMany returned a wrong number of results");
+  if (results[0] != std::optional<string>("nolla") || results[1] != std::optional<string>("5") ||
+      results[2] || results[3] != std::optional<string>("19") ||
+      results[4] != std::optional<string>("5") || results[5])
+    TEST_FAILED("findMany returned wrong values");
+
+  auto stats = thisCache.statistics();
+  if (stats.hits != 4 || stats.misses != 2)
+    TEST_FAILED("findMany should have counted 4 hits and 2 misses, got " +
+                std::to_string(stats.hits) + " and " + std::to_string(stats.misses));
+
+  TEST_PASSED();
+}
+
+struct copy_counter
+{
+  explicit copy_counter(string theText) : text(std::move(theText)) {}
+  copy_counter(const copy_counter& other) : text(other.text) { ++copies; }
+  copy_counter& operator=(const copy_counter& other) = delete;
+
+  string text;
+  static int copies;
+};
+
+int copy_counter::copies = 0;
+
+void testhandle()
+{
+  Cache<int, copy_counter, TrivialSizeFunction<copy_counter>, 1> thisCache(1);
+
+  thisCache.insert(1, copy_counter("eka"));
+  const int copies = copy_counter::copies;
+
+  auto handle = thisCache.findHandle(1);
+  if (!handle || handle->text != "eka")
+    TEST_FAILED("findHandle did not find the inserted value");
+  if (copy_counter::copies != copies)
+    TEST_FAILED("findHandle should not copy the value");
+  if (thisCache.findHandle(2))
+    TEST_FAILED("findHandle should return an empty handle on a miss");
+
+  // The handle keeps the value alive after eviction
+  thisCache.insert(2, copy_counter("toka"));
+  if (thisCache.findHandle(1))
+    TEST_FAILED("Entry 1 should have been evicted");
+  if (handle->text != "eka")
+    TEST_FAILED("Handle content changed after eviction");
+
+  TEST_PASSED();
+}
+
+void testflatcache()
+{
+  FlatCache<int, string, TrivialSizeFunction<string>, 1> thisCache(5);
+
+  thisCache.insert(1, "eka");
+  thisCache.insert(2, "toka");
+  thisCache.insert(3, "kolmas");
+  thisCache.insert(4, "neljas");
+  thisCache.insert(5, "viides");
+
+  if (thisCache.insert(1, "uusi"))
+    TEST_FAILED("insert should not replace an existing entry");
+
+  thisCache.find(4);
+  thisCache.find(3);
+  thisCache.find(2);
+  thisCache.find(1);
+
+  // This must remove the "5" entry from the cache since it is the least recently used
+  thisCache.insert(6, "kuudes");
+  if (thisCache.find(5))
+    TEST_FAILED("Entry 5 should have been evicted");
+
+  thisCache.upsert(4, "uusi");
+  auto value = thisCache.find(4);
+  if (!value || *value != "uusi")
+    TEST_FAILED("upsert did not replace the value");
+
+  if (thisCache.size() != 5)
+    TEST_FAILED("Wrong cache size: " + to_string(thisCache.size()) + ", should be 5");
+
+  thisCache.resize(2);
+  if (thisCache.size() != 2 || !thisCache.find(4) || !thisCache.find(6))
+    TEST_FAILED("resize should keep the two most recently used entries");
+
+  thisCache.clear();
+  if (thisCache.size() != 0 || thisCache.find(4))
+    TEST_FAILED("clear did not empty the cache");
+
+  const auto stats = thisCache.statistics();
+  if (stats.inserts != 7 || stats.evictions != 1 + 3)
+    TEST_FAILED("Wrong counters: inserts=" + to_string(stats.inserts) +
+                " evictions=" + to_string(stats.evictions));
+
+  TEST_PASSED();
+}
+
+// Random operations against a reference model, with enough churn to rehash the tables
+void testflatcachechurn()
+{
+  const std::size_t capacity = 1000;
+  FlatCache<int, custom_type, custom_comparator, 4> thisCache(capacity);
+  std::map<int, unsigned int> model;
+
+  std::mt19937 generator(12345);
+  std::uniform_int_distribution<int> keys(0, 3000);
+  std::uniform_int_distribution<unsigned int> sizes(1, 5);
+
+  for (int i = 0; i < 200000; i++)
+  {
+    const int key = keys(generator);
+    if (i % 3 == 0)
+    {
+      const unsigned int number = sizes(generator);
+      thisCache.upsert(key, custom_type{number, to_string(key)});
+      model[key] = number;
+    }
+    else
+    {
+      auto value = thisCache.find(key);
+      if (value && (value->text != to_string(key) || model.count(key) == 0 ||
+                    model[key] != value->number))
+        TEST_FAILED("Wrong value for key " + to_string(key));
+    }
+  }
+
+  // Evicted entries may be missing, present ones must have their latest value
+  std::size_t size = 0;
+  for (const auto& item : model)
+  {
+    auto value = thisCache.find(item.first);
+    if (value)
+    {
+      if (value->number != item.second)
+        TEST_FAILED("Stale value for key " + to_string(item.first));
+      size += value->number;
+    }
+  }
+
+  if (size != thisCache.size() || size > capacity)
+    TEST_FAILED("Wrong cache size " + to_string(thisCache.size()) + ", entries sum to " +
+                to_string(size));
+
+  TEST_PASSED();
+}
+
+void testdetailedstatistics()
+{
+  Cache<int, string, TrivialSizeFunction<string>, 4> thisCache(100);
+  for (int i = 0; i < 50; i++)
+    thisCache.insert(i, to_string(i));
+  for (int i = 0; i < 80; i++)
+    thisCache.find(i);
+
+  const auto stats = thisCache.detailedStatistics();
+  if (stats.instrumented || !stats.hotkeys.empty())
+    TEST_FAILED("Instrumentation should be disabled by default");
+  if (stats.shards.size() != 4)
+    TEST_FAILED("Expected 4 shards, got " + to_string(stats.shards.size()));
+
+  std::size_t size = 0;
+  std::size_t hits = 0;
+  std::size_t misses = 0;
+  for (const auto& shard : stats.shards)
+  {
+    size += shard.size;
+    hits += shard.hits;
+    misses += shard.misses;
+    if (shard.hitRatio() <= 0 || shard.hitRatio() >= 1)
+      TEST_FAILED("Shard hit ratio should be between 0 and 1");
+  }
+  if (size != 50 || hits != 50 || misses != 30)
+    TEST_FAILED("Shard statistics do not add up: size=" + to_string(size) +
+                " hits=" + to_string(hits) + " misses=" + to_string(misses));
+  if (stats.totals.hits != hits || stats.totals.size != size)
+    TEST_FAILED("Totals differ from shard statistics");
+
+  TEST_PASSED();
+}
+
+void testinstrumentation()
+{
+  using InstrumentedCache = Cache<int,
+                                  string,
+                                  TrivialSizeFunction<string>,
+                                  4,
+                                  LRUPolicy,
+                                  ShardInstrumentation<4, 1>>;
+  InstrumentedCache thisCache(1000);
+  for (int i = 0; i < 100; i++)
+    thisCache.insert(i, to_string(i));
+
+  // Key 7 is hot, the others are looked up once each in a cycle which
+  // keeps moving other entries to the MRU position
+  for (int round = 0; round < 10; round++)
+  {
+    for (int i = 0; i < 100; i++)
+    {
+      thisCache.find(i);
+      if (i % 5 == 0)
+        thisCache.find(7);
+    }
+  }
+
+  const auto stats = thisCache.detailedStatistics();
+  if (!stats.instrumented)
+    TEST_FAILED("Instrumentation should be enabled");
+  if (stats.hotkeys.empty() || stats.hotkeys.front().key != 7)
+    TEST_FAILED("Key 7 should be the hottest key");
+  if (stats.hotkeys.front().count < 200)
+    TEST_FAILED("Hot key count too low: " + to_string(stats.hotkeys.front().count));
+
+  std::size_t upgrades = 0;
+  std::size_t waits = 0;
+  for (const auto& shard : stats.shards)
+  {
+    upgrades += shard.upgrades;
+    for (auto n : shard.lockwaits)
+      waits += n;
+  }
+  if (upgrades == 0 || upgrades > stats.totals.hits)
+    TEST_FAILED("Wrong number of upgrades: " + to_string(upgrades));
+
+  // Every insert and find acquires the lock once, finds which reorder upgrade too
+  const std::size_t expected = 100 + 1200 + upgrades;
+  if (waits != expected)
+    TEST_FAILED("Expected " + to_string(expected) + " lock waits, got " + to_string(waits));
+
+  TEST_PASSED();
+}
+
+// Keys and hit counts in replacement order
+template <typename CacheType>
+std::string snapshotcontent(const CacheType& cache)
+{
+  std::string result;
+  for (const auto& object : cache.getContent())
+    result += to_string(object.itsKey) + ":" + object.itsValue + ":" +
+              to_string(object.itsHits) + ",";
+  return result;
+}
+
+void testsnapshot()
+{
+  using CacheType = Cache<int, string, TrivialSizeFunction<string>, 4>;
+  const BinarySerializer<int, string> serializer;
+  fs::create_directories(*testpaths[3]);
+  const fs::path path = *testpaths[3] / "snapshot";
+
+  CacheType thisCache(100);
+  for (int i = 0; i < 100; i++)
+    thisCache.insert(i, "value" + to_string(i));
+  for (int i = 0; i < 100; i += 3)
+    thisCache.find(i);
+  for (int i = 0; i < 100; i += 7)
+    thisCache.find(i);
+  thisCache.upsert(5, "expiring", std::chrono::hours(1));
+  thisCache.upsert(6, "expired", std::chrono::milliseconds(1));
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+  thisCache.save(path, serializer);
+  if (fs::exists(path.string() + ".tmp"))
+    TEST_FAILED("Temporary snapshot file was left behind");
+
+  // Entry 6 has expired and is neither saved nor loaded
+  // The loader threads are named, the calling thread keeps its name
+  Fmi::set_thread_name("test-main");
+  CacheType restored(100);
+  const std::size_t loaded = restored.load(path, serializer);
+  if (loaded != 99)
+    TEST_FAILED("Expected 99 loaded entries, got " + to_string(loaded));
+  if (Fmi::get_thread_name() != "test-main")
+    TEST_FAILED("load() renamed the calling thread to " + Fmi::get_thread_name());
+  thisCache.expire();
+  if (snapshotcontent(restored) != snapshotcontent(thisCache))
+    TEST_FAILED("Restored content differs:\n" + snapshotcontent(restored) + "\nexpected\n" +
+                snapshotcontent(thisCache));
+
+  // The TTL survives the round trip
+  thisCache.insert(5, "again");
+  if (restored.insert(5, "again"))
+    TEST_FAILED("Entry 5 should still be valid after loading");
+
+  // A smaller cache keeps the most recently used entries of each shard
+  CacheType small(20);
+  small.load(path, serializer);
+  thisCache.resize(20);
+  if (snapshotcontent(small) != snapshotcontent(thisCache))
+    TEST_FAILED("Trimmed content differs:\n" + snapshotcontent(small) + "\nexpected\n" +
+                snapshotcontent(thisCache));
+
+  // Different shard layout
+  Cache<int, string, TrivialSizeFunction<string>, 3> other(100);
+  if (other.load(path, serializer) != 99 || other.find(42) != std::optional<string>("value42"))
+    TEST_FAILED("Loading into a different shard layout failed");
+
+  // Corrupt input is reported
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << "garbage";
+  }
+  try
+  {
+    restored.load(path, serializer);
+    TEST_FAILED("Loading garbage should throw");
+  }
+  catch (const Fmi::Exception&)
+  {
+  }
+
+  // A forged section count is rejected before allocating for it
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    const std::uint32_t version = 1;
+    const std::uint32_t sections = 0xffffffff;
+    const std::int64_t savedAt = 0;
+    out.write("FMICACHE", 8);
+    out.write(reinterpret_cast<const char*>(&version), sizeof(version));
+    out.write(reinterpret_cast<const char*>(&sections), sizeof(sections));
+    out.write(reinterpret_cast<const char*>(&savedAt), sizeof(savedAt));
+  }
+  try
+  {
+    restored.load(path, serializer);
+    TEST_FAILED("Loading a huge section count should throw");
+  }
+  catch (const Fmi::Exception&)
+  {
+  }
+
+  // Forged record and string lengths are rejected without allocating for them
+  const auto forgeRecord = [&](std::uint64_t at, std::uint64_t length)
+  {
+    thisCache.save(path, serializer);
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+    std::uint64_t offset = 0;
+    file.seekg(24);  // the first section in the table
+    file.read(reinterpret_cast<char*>(&offset), sizeof(offset));
+    file.seekp(offset + at);
+    file.write(reinterpret_cast<const char*>(&length), sizeof(length));
+  };
+  for (const auto at : {24, 36})  // record length, value length after the int key
+  {
+    forgeRecord(at, 0x7fffffffffffULL);
+    try
+    {
+      restored.load(path, serializer);
+      TEST_FAILED("Loading a forged length at " + to_string(at) + " should throw");
+    }
+    catch (const Fmi::Exception&)
+    {
+    }
+  }
+
+  // A failed save leaves neither a temporary file nor a partial snapshot
+  struct FailingSerializer : BinarySerializer<int, string>
+  {
+    void writeValue(std::ostream& /* out */, const string& /* value */) const
+    {
+      throw std::runtime_error("serializer failed");
+    }
+  };
+  fs::remove(path);
+  try
+  {
+    thisCache.save(path, FailingSerializer());
+    TEST_FAILED("Save with a failing serializer should throw");
+  }
+  catch (const std::runtime_error&)
+  {
+  }
+  if (fs::exists(path) || fs::exists(path.string() + ".tmp"))
+    TEST_FAILED("Failed save left files behind");
+
+  TEST_PASSED();
+}
+
+void testcompressedvalue()
+{
+  using CacheType = Cache<int, CompressedValue, CompressedSizeFunction>;
+
+  std::string csv;
+  for (int i = 0; i < 500; i++)
+    csv += "2026-10-16T12:00:00Z,helsinki," + to_string(i % 30) + ".5\n";
+
+  for (auto codec : {Fmi::Compression::ZSTD, Fmi::Compression::GZIP})
+  {
+    const CacheCompression options{codec, 100};
+    const CompressedValue value(csv, options);
+    if (!value.compressed() || value.size() >= csv.size() / 4)
+      TEST_FAILED("CSV should compress to less than a quarter, got " + to_string(value.size()));
+    if (value.rawSize() != csv.size() || value.value() != csv)
+      TEST_FAILED("Round trip failed");
+  }
+
+  const CacheCompression options{Fmi::Compression::ZSTD, 100};
+  if (CompressedValue("tiny", options).compressed())
+    TEST_FAILED("Values below the threshold should not be compressed");
+
+  // Incompressible data is stored as is
+  std::string noise;
+  std::mt19937 gen(1);
+  for (int i = 0; i < 1000; i++)
+    noise += static_cast<char>(gen());
+  const CompressedValue random(noise, options);
+  if (random.compressed() || random.value() != noise)
+    TEST_FAILED("Incompressible value should be stored as is");
+
+  // A value which looks like an encoded one must survive even without compression
+  std::string fake = "FMIZ";
+  fake += static_cast<char>(Fmi::Compression::ZSTD);
+  fake += "12345678garbage";
+  if (CompressedValue(fake, CacheCompression()).value() != fake)
+    TEST_FAILED("Value resembling the compression header was corrupted");
+
+  // The capacity is measured in stored bytes, so many more values fit
+  const std::size_t capacity = 16 * csv.size();
+  CacheType cache(capacity);
+  for (int i = 0; i < 100; i++)
+    cache.insert(i, CompressedValue(csv, options));
+  int found = 0;
+  for (int i = 0; i < 100; i++)
+    found += (cache.findHandle(i) != nullptr);
+  if (found != 100)
+    TEST_FAILED("Expected 100 compressed values to fit, found " + to_string(found));
+  if (cache.size() > capacity)
+    TEST_FAILED("Cache size " + to_string(cache.size()) + " exceeds the capacity");
+
+  // Lookups return the stored form, decompression happens when the value is read
+  auto handle = cache.findHandle(42);
+  if (!handle || !handle->compressed() || handle->value() != csv)
+    TEST_FAILED("Compressed lookup failed");
+
+  TEST_PASSED();
+}
+
+void testvisit()
+{
+  using CacheType = Cache<int, string, TrivialSizeFunction<string>, 4>;
+  CacheType cache(10000);
+  for (int i = 0; i < 10000; i++)
+    cache.insert(i, "value" + to_string(i));
+  for (int i = 0; i < 100; i++)
+    cache.find(7);
+
+  // Every entry is reported once with its hits, values are shared rather than copied
+  std::vector<int> keys;
+  std::size_t hits = 0;
+  auto count = cache.visit(
+      [&](const CacheType::EntryInfo& info)
+      {
+        keys.push_back(info.key);
+        if (info.key == 7)
+        {
+          hits = info.hits;
+          if (*info.value != "value7" || info.size != 1)
+            TEST_FAILED("Wrong value or size reported for key 7");
+        }
+      },
+      100);
+  std::sort(keys.begin(), keys.end());
+  if (count != 10000 || keys.size() != 10000 || std::unique(keys.begin(), keys.end()) != keys.end())
+    TEST_FAILED("Expected 10000 distinct entries, got " + to_string(count));
+  if (hits != 100)
+    TEST_FAILED("Expected 100 hits for key 7, got " + to_string(hits));
+
+  // The shard locks are not held while the visitor runs
+  std::size_t inserted = 0;
+  cache.visit(
+      [&](const CacheType::EntryInfo& info)
+      {
+        if (info.key % 1000 == 0)
+          inserted += cache.upsert(info.key, "updated");
+        return true;
+      });
+  if (inserted != 10)
+    TEST_FAILED("Expected 10 updates during the walk, got " + to_string(inserted));
+
+  // Returning false stops the walk
+  count = cache.visit([](const CacheType::EntryInfo& /* info */) { return false; });
+  if (count != 1)
+    TEST_FAILED("Walk did not stop, visited " + to_string(count));
+
+  // The sample is stable and of the requested size
+  std::vector<int> sample1;
+  std::vector<int> sample2;
+  cache.visitSampled([&](const CacheType::EntryInfo& info) { sample1.push_back(info.key); }, 0.1);
+  cache.visitSampled([&](const CacheType::EntryInfo& info) { sample2.push_back(info.key); }, 0.1, 7);
+  std::sort(sample1.begin(), sample1.end());
+  std::sort(sample2.begin(), sample2.end());
+  if (sample1 != sample2)
+    TEST_FAILED("Sample differs between calls");
+  if (sample1.size() < 800 || sample1.size() > 1200)
+    TEST_FAILED("Expected about 1000 sampled entries, got " + to_string(sample1.size()));
+  if (cache.visitSampled([](const CacheType::EntryInfo& /* info */) {}, 0.0) != 0)
+    TEST_FAILED("Empty sample expected");
+
+  TEST_PASSED();
+}
+
+void testheterogeneous()
+{
+  using CacheType = Cache<string, int>;
+  CacheType cache(100);
+  for (int i = 0; i < 50; i++)
+    cache.insert("key" + to_string(i), i);
+
+  const std::string_view key = "key42";
+  if (cache.find(key) != std::optional<int>(42))
+    TEST_FAILED("string_view lookup failed");
+  if (cache.find("key7") != std::optional<int>(7))
+    TEST_FAILED("const char* lookup failed");
+  if (cache.find(std::string_view("key99")))
+    TEST_FAILED("Missing key was found");
+
+  // A precomputed hash selects both the shard and the bucket
+  const auto hash = CacheType::hashKey(key);
+  if (hash.value != CacheType::hashKey(std::string(key)).value)
+    TEST_FAILED("string_view and string keys must hash equally");
+  auto handle = cache.findHandle(key, hash);
+  if (!handle || *handle != 42 || cache.find(std::string(key), hash) != std::optional<int>(42))
+    TEST_FAILED("Lookup with a precomputed hash failed");
+
+  std::size_t hits = 0;
+  cache.find(std::string(key), hits);
+  if (hits != 4)
+    TEST_FAILED("Expected 4 hits for key42, got " + to_string(hits));
+
+  // Hot keys are reported with lookups of any key type
+  Cache<string, int, TrivialSizeFunction<int>, 4, LRUPolicy, ShardInstrumentation<4, 1>> hot(100);
+  hot.insert("hot", 1);
+  for (int i = 0; i < 10; i++)
+    hot.find(std::string_view("hot"));
+  const auto stats = hot.detailedStatistics();
+  if (stats.hotkeys.empty() || stats.hotkeys.front().key != "hot")
+    TEST_FAILED("Hot key of string_view lookups was not reported");
+
+  TEST_PASSED();
+}
+
+// Wait until the given number of refreshes have finished either way
+template <typename CacheType>
+bool waitForRefreshes(CacheType& cache, std::size_t count)
+{
+  for (int i = 0; i < 500; i++)
+  {
+    auto stats = cache.statistics();
+    if (stats.counters["refreshes"] + stats.counters["refresh_failures"] >= count)
+      return true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+  return false;
+}
+
+void testrefresh()
+{
+  using namespace std::chrono_literals;
+  Fmi::ThreadPool::ThreadPool<> pool(2);
+  pool.start();
+
+  // The pool must be stopped even if the test fails
+  struct PoolGuard
+  {
+    Fmi::ThreadPool::ThreadPool<>& pool;
+    ~PoolGuard() { pool.shutdown(); }
+  } guard{pool};
+
+  std::atomic<int> calls{0};
+  std::atomic<bool> fail{false};
+  std::atomic<bool> hold{false};
+  Cache<int, string, TrivialSizeFunction<string>, 1> cache(10);
+  cache.enableRefresh(
+      pool,
+      [&](const int& key)
+      {
+        ++calls;
+        while (hold)
+          std::this_thread::sleep_for(1ms);
+        if (fail)
+          throw std::runtime_error("refresh failed");
+        return "new" + to_string(key);
+      },
+      50ms,
+      300ms);
+
+  cache.insert(1, "old1");
+  if (cache.find(1) != std::optional<string>("old1") || calls != 0)
+    TEST_FAILED("Fresh entry should not be refreshed");
+
+  // Stale hits return the old value and schedule a single refresh
+  std::this_thread::sleep_for(80ms);
+  fail = true;
+  hold = true;
+  for (int i = 0; i < 5; i++)
+    if (cache.find(1) != std::optional<string>("old1"))
+      TEST_FAILED("Stale hit should return the old value");
+  hold = false;
+  if (!waitForRefreshes(cache, 1) || calls != 1)
+    TEST_FAILED("Expected one failed refresh, got " + to_string(calls));
+
+  // After a failure the next hit tries again
+  fail = false;
+  cache.find(1);
+  if (!waitForRefreshes(cache, 2) || calls != 2 ||
+      cache.find(1) != std::optional<string>("new1"))
+    TEST_FAILED("Refresh after a failure did not replace the value");
+
+  auto stats = cache.statistics();
+  if (stats.counters["refreshes"] != 1 || stats.counters["refresh_failures"] != 1)
+    TEST_FAILED("Expected 1 refresh and 1 failure, got " + to_string(stats.counters["refreshes"]) +
+                " and " + to_string(stats.counters["refresh_failures"]));
+  if (stats.counters["stale_hits"] != 6)
+    TEST_FAILED("Expected 6 stale hits, got " + to_string(stats.counters["stale_hits"]));
+
+  // Batch lookups refresh stale entries too
+  cache.insert(3, "old3");
+  std::this_thread::sleep_for(80ms);
+  if (cache.findMany(std::vector<int>{3, 4})[0] != std::optional<string>("old3"))
+    TEST_FAILED("Stale batch hit should return the old value");
+  if (!waitForRefreshes(cache, 3) || cache.find(3) != std::optional<string>("new3"))
+    TEST_FAILED("Stale batch hit did not refresh the value");
+  if (cache.statistics().counters["stale_hits"] != 7)
+    TEST_FAILED("Stale batch hit was not counted");
+
+  // Exceptions from the pool are counted apart from a full queue
+  struct ThrowingPool
+  {
+    bool schedule(const std::function<void()>& /* task */)
+    {
+      throw std::runtime_error("pool failed");
+    }
+  } throwingPool;
+  Cache<int, string, TrivialSizeFunction<string>, 1> other(10);
+  other.enableRefresh(
+      throwingPool, [](const int& key) { return to_string(key); }, 10ms, 300ms);
+  other.insert(1, "old");
+  std::this_thread::sleep_for(20ms);
+  other.find(1);
+  other.find(1);
+  stats = other.statistics();
+  if (stats.counters["refresh_schedule_errors"] != 2 || stats.counters["refresh_failures"] != 0)
+    TEST_FAILED("Expected 2 schedule errors and no failures, got " +
+                to_string(stats.counters["refresh_schedule_errors"]) + " and " +
+                to_string(stats.counters["refresh_failures"]));
+
+  // Entries not hit after the hard deadline are misses
+  cache.insert(2, "old2");
+  std::this_thread::sleep_for(350ms);
+  if (cache.find(2))
+    TEST_FAILED("Entry past the hard deadline was returned");
+
+  TEST_PASSED();
+}
+
+using SharedCacheType = SharedCache<std::size_t, string, 4>;
+const char* const SharedCacheChild = "shared-cache-child";
+
+// Entry point of the processes started by testsharedcache. They open the
+// segment themselves, after exec it is mapped at an unrelated address.
+int sharedcachechild(int argc, char* argv[])
+{
+  if (argc != 5)
+    return 4;
+  try
+  {
+    const std::string name = argv[2];
+    const std::string mode = argv[3];
+    const std::size_t arg = std::stoul(argv[4]);
+    SharedCacheType cache(name, 100000);
+
+    if (mode == "fill")
+    {
+      const std::size_t nkeys = 100;
+      for (std::size_t i = 0; i < nkeys; i++)
+      {
+        const std::size_t key = arg * 1000 + i;
+        if (!cache.insert(key, "value" + to_string(key)))
+          return 1;
+      }
+      for (std::size_t i = 0; i < nkeys; i++)
+        if (!cache.find(arg * 1000 + i))
+          return 2;
+      return 0;
+    }
+
+    if (mode == "crash")
+    {
+      // Tell the parent the shard is locked and being modified, then wait to be killed
+      const int fd = static_cast<int>(arg);
+      cache.setModificationHook(
+          [fd]()
+          {
+            const char ready = 1;
+            if (write(fd, &ready, 1) != 1)
+              _exit(5);
+            while (true)
+              pause();
+          });
+      cache.upsert(20000, "crashed");
+    }
+  }
+  catch (...)
+  {
+    return 3;
+  }
+  return 4;
+}
+
+pid_t startsharedcachechild(const std::string& name,
+                            const std::string& mode,
+                            const std::string& arg)
+{
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    const char* args[] = {
+        "CacheTest", SharedCacheChild, name.c_str(), mode.c_str(), arg.c_str(), nullptr};
+    execv("/proc/self/exe", const_cast<char* const*>(args));
+    _exit(6);
+  }
+  return pid;
+}
+
+void testsharedcache()
+{
+  const std::string name = "fmi-cachetest-" + to_string(getpid());
+  SharedCacheType::remove(name);
+
+  // Several processes create or open the cache by name and fill it
+  const int nprocs = 4;
+  const std::size_t nkeys = 100;
+  std::vector<pid_t> children;
+  for (int p = 0; p < nprocs; p++)
+  {
+    pid_t pid = startsharedcachechild(name, "fill", to_string(p));
+    if (pid < 0)
+      TEST_FAILED("fork failed");
+    children.push_back(pid);
+  }
+
+  for (auto pid : children)
+  {
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      TEST_FAILED("Child process failed with status " + to_string(WEXITSTATUS(status)));
+  }
+
+  SharedCacheType cache(name, 100000);
+  for (int p = 0; p < nprocs; p++)
+    for (std::size_t i = 0; i < nkeys; i++)
+    {
+      const std::size_t key = p * 1000 + i;
+      if (cache.find(key) != std::optional<string>("value" + to_string(key)))
+        TEST_FAILED("Value inserted by another process was not found: " + to_string(key));
+    }
+
+  auto stats = cache.statistics();
+  if (stats.inserts != nprocs * nkeys || stats.counters["entries"] != nprocs * nkeys)
+    TEST_FAILED("Expected " + to_string(nprocs * nkeys) + " inserts, got " +
+                to_string(stats.inserts));
+  if (stats.size != cache.size() || stats.size == 0)
+    TEST_FAILED("Byte size accounting mismatch");
+
+  // A process killed in the middle of modifying a shard must not leave it locked
+  // or inconsistent. Deaths inside the segment allocator are not recoverable.
+  int fds[2];
+  if (pipe(fds) != 0)
+    TEST_FAILED("pipe failed");
+  pid_t writer = startsharedcachechild(name, "crash", to_string(fds[1]));
+  close(fds[1]);
+  alarm(10);  // fail instead of hanging
+  char ready = 0;
+  const bool modifying = (read(fds[0], &ready, 1) == 1);
+  close(fds[0]);
+  kill(writer, SIGKILL);
+  waitpid(writer, nullptr, 0);
+  if (!modifying)
+    TEST_FAILED("Writer process did not reach the shard modification");
+
+  for (std::size_t key = 10000; key < 10100; key++)
+  {
+    cache.upsert(key, "after");
+    if (cache.find(key) != std::optional<string>("after"))
+      TEST_FAILED("Cache is unusable after a writer was killed");
+  }
+  alarm(0);
+
+  stats = cache.statistics();
+  if (stats.counters["lock_recoveries"] != 1)
+    TEST_FAILED("Expected one lock recovery, got " +
+                to_string(stats.counters["lock_recoveries"]));
+  if (cache.find(20000))
+    TEST_FAILED("The insert of the killed writer should not be visible");
+  if (stats.counters["entries"] <= 100 || stats.counters["entries"] >= nprocs * nkeys + 100)
+    TEST_FAILED("Only the shard being modified should have been reset, entries = " +
+                to_string(stats.counters["entries"]));
+
+  // Opening the segment with a different layout must fail
+  try
+  {
+    SharedCache<std::size_t, string, 8> other(name, 100000);
+    TEST_FAILED("Opening with a different number of shards should fail");
+  }
+  catch (const Fmi::Exception&)
+  {
+  }
+
+  SharedCacheType::remove(name);
+  TEST_PASSED();
+}
+
+void testnearcache()
+{
+  using namespace std::chrono_literals;
+  using CacheType = Cache<string, int>;
+  CacheType cache(100);
+  cache.enableNearCache();
+  cache.insert("a", 1);
+
+  // The first find fills the near cache, the second one is served from it
+  if (cache.find("a") != std::optional<int>(1) || cache.find("a") != std::optional<int>(1))
+    TEST_FAILED("Near cache returned a wrong value");
+  auto stats = cache.statistics();
+  if (stats.hits != 1 || stats.counters["near_hits"] != 1)
+    TEST_FAILED("Expected 1 shared hit and 1 near hit, got " + to_string(stats.hits) + " and " +
+                to_string(stats.counters["near_hits"]));
+
+  // Upserts, clear and resize invalidate the near copies
+  cache.upsert("a", 2);
+  if (cache.find(std::string_view("a")) != std::optional<int>(2))
+    TEST_FAILED("Near cache returned a value replaced by upsert");
+  cache.resize(200);
+  if (cache.find("a") != std::optional<int>(2))
+    TEST_FAILED("Value lost in resize");
+  cache.clear();
+  if (cache.find("a"))
+    TEST_FAILED("Near cache returned a value after clear");
+  stats = cache.statistics();
+  if (stats.hits != 3 || stats.counters["near_hits"] != 1)
+    TEST_FAILED("Invalidated near copies must not be used");
+
+  // Expired entries are not served from the near cache
+  cache.insert("t", 3, 50ms);
+  cache.find("t");
+  if (cache.find("t") != std::optional<int>(3))
+    TEST_FAILED("Entry with a TTL was not found");
+  std::this_thread::sleep_for(80ms);
+  if (cache.find("t"))
+    TEST_FAILED("Near cache returned an expired value");
+
+  // Evicted and re-inserted keys are not served from the near cache
+  Cache<int, int, TrivialSizeFunction<int>, 1> tiny(2);
+  tiny.enableNearCache();
+  tiny.insert(1, 100);
+  tiny.insert(2, 200);
+  if (tiny.find(1) != std::optional<int>(100) || tiny.find(1) != std::optional<int>(100))
+    TEST_FAILED("Near cache returned a wrong value");
+  tiny.insert(3, 300);
+  tiny.insert(4, 400);
+  if (tiny.find(1))
+    TEST_FAILED("Near cache returned an evicted value");
+  tiny.insert(1, 111);
+  if (tiny.find(1) != std::optional<int>(111))
+    TEST_FAILED("Near cache returned the value of an evicted entry after a new insert");
+
+  // Caches of the same type have separate near caches
+  CacheType other(100);
+  other.enableNearCache();
+  other.insert("a", 10);
+  cache.insert("a", 20);
+  for (int i = 0; i < 3; i++)
+    if (cache.find("a") != std::optional<int>(20) || other.find("a") != std::optional<int>(10))
+      TEST_FAILED("Near caches of different caches were mixed up");
+
+  // The near copies of a destroyed cache are released when the thread next uses a near cache
+  CacheType::ValueHandle handle;
+  {
+    CacheType temporary(100);
+    temporary.enableNearCache();
+    temporary.insert("r", 5);
+    handle = temporary.findHandle("r");
+    if (!handle || temporary.findHandle("r") != handle)
+      TEST_FAILED("Near cache returned a wrong handle");
+  }
+  if (handle.use_count() != 2)
+    TEST_FAILED("Expected the near cache to hold the value of the destroyed cache");
+  cache.find("a");
+  if (handle.use_count() != 1)
+    TEST_FAILED("Near cache retained a value of a destroyed cache");
+
+  // Each thread fills its own near cache, all finds are counted once
+  CacheType shared(100);
+  shared.enableNearCache();
+  shared.insert("x", 1);
+  const int nthreads = 4;
+  const int nfinds = 1000;
+  std::vector<std::thread> threads;
+  std::atomic<int> found{0};
+  for (int t = 0; t < nthreads; t++)
+    threads.emplace_back(
+        [&]()
+        {
+          for (int i = 0; i < nfinds; i++)
+            if (shared.find("x"))
+              ++found;
+        });
+  for (auto& thread : threads)
+    thread.join();
+  stats = shared.statistics();
+  if (found != nthreads * nfinds || stats.hits != nthreads ||
+      stats.hits + stats.counters["near_hits"] != nthreads * nfinds)
+    TEST_FAILED("Expected " + to_string(nthreads) + " shared hits, got " + to_string(stats.hits));
+
+  TEST_PASSED();
+}
+
+void testmissratiocurve()
+{
+  // Cycling over more keys than fit in an LRU cache never hits
+  Cache<int, int> cyclic(1100);
+  cyclic.enableMissRatioCurve(1.0);
+  for (int round = 0; round < 10; round++)
+    for (int i = 0; i < 1000; i++)
+      if (!cyclic.find(i))
+        cyclic.insert(i, i);
+
+  auto curve = cyclic.missRatioCurve({0.5, 1, 2});
+  if (curve.points.size() != 3 || curve.sampledLookups != 10000 || curve.trackedKeys != 1000)
+    TEST_FAILED("Expected 10000 sampled lookups of 1000 keys");
+  if (curve.points[0].hitRatio > 0.01)
+    TEST_FAILED("Half size cache should not hit, estimate " + to_string(curve.points[0].hitRatio));
+  if (std::abs(curve.points[1].hitRatio - 0.9) > 0.01 ||
+      std::abs(curve.points[2].hitRatio - 0.9) > 0.01)
+    TEST_FAILED("Full size cache should hit 90%, estimate " + to_string(curve.points[1].hitRatio));
+
+  // A sampled estimate is close to the hit ratio of an actual LRU cache
+  const int nkeys = 50000;
+  const int nlookups = 300000;
+  const std::size_t size = 4000;
+  Cache<int, int, TrivialSizeFunction<int>, 1> lru(size);
+  lru.enableMissRatioCurve(0.1);
+  std::mt19937 gen(1234);
+  std::exponential_distribution<double> distribution(5.0 / nkeys);
+  for (int i = 0; i < nlookups; i++)
+  {
+    const int key = static_cast<int>(distribution(gen)) % nkeys;
+    if (!lru.find(key))
+      lru.insert(key, key);
+  }
+  const auto stats = lru.statistics();
+  const double actual = static_cast<double>(stats.hits) / (stats.hits + stats.misses);
+  const double estimate = lru.missRatioCurve({1}).points[0].hitRatio;
+  if (std::abs(actual - estimate) > 0.05)
+    TEST_FAILED("Estimated hit ratio " + to_string(estimate) + " differs from the actual " +
+                to_string(actual));
+
+  // Without tracking there is no curve
+  Cache<int, int> plain(10);
+  if (!plain.missRatioCurve().points.empty())
+    TEST_FAILED("Curve reported without tracking");
+
+  TEST_PASSED();
+}
+
 class tests : public tframe::tests
 {
   virtual const char* error_message_prefix() const { return "\n\t"; }
@@ -356,12 +2015,40 @@ class tests : public tframe::tests
     TEST(testfilecache);
     TEST(testfilecacheorder);
     TEST(testfilecachesize);
+    TEST(testfilecacheview);
+    TEST(testfilecachewritebehind);
+    TEST(testfilecachejournal);
+    TEST(testfilecachecompression);
+    TEST(testtieredcache);
     TEST(testcustomtype);
     TEST(testsize);
     TEST(testlru);
     TEST(testtagless);
     TEST(testevictionvector);
     TEST(testcounters);
+    TEST(testtinylfu);
+    TEST(testtinylfuorder);
+    TEST(testclock);
+    TEST(testclockthreads);
+    TEST(testttl);
+    TEST(testexpirysweeper);
+    TEST(testnegative);
+    TEST(testgetorcompute);
+    TEST(testgetorcomputeerrors);
+    TEST(testbatch);
+    TEST(testhandle);
+    TEST(testflatcache);
+    TEST(testflatcachechurn);
+    TEST(testdetailedstatistics);
+    TEST(testinstrumentation);
+    TEST(testsnapshot);
+    TEST(testcompressedvalue);
+    TEST(testvisit);
+    TEST(testheterogeneous);
+    TEST(testrefresh);
+    TEST(testsharedcache);
+    TEST(testnearcache);
+    TEST(testmissratiocurve);
   }
 };
 }  // namespace CacheTest
@@ -378,9 +2065,12 @@ static void atexit_handler()
   }
 }
 
-int main(void)
+int main(int argc, char* argv[])
 {
   using namespace std;
+  if (argc > 1 && std::string(argv[1]) == CacheTest::SharedCacheChild)
+    return CacheTest::sharedcachechild(argc, argv);
+
   cout << endl << "Cache" << endl << "=========" << endl;
   atexit(atexit_handler);  // Remove this if you need to debug test directory contents after test
   for (unsigned int i = 0; i < sizeof(testpaths) / sizeof(*testpaths); i++)
@@ -2,9 +2,12 @@
 #include "catch2/catch.hpp"
 #include <chrono>
 #include <random>
+#include <string>
+#include <string_view>
 #include <thread>
 #include <vector>
 
+#include "FlatCache.h"
 #include "LRUCache.h"
 
 using namespace Fmi;
@@ -57,6 +60,44 @@ TEST_CASE("LRUCache basic operations", "[single-threaded]")
   }
 }
 
+TEST_CASE("LRUCache with flat storage", "[single-threaded]")
+{
+  LRUCache<int, 4, Fmi::Cache::FlatCache> cache(100);
+
+  for (int i = 0; i < 150; ++i)
+  {
+    cache.put(i, std::make_shared<int>(i * 10));
+  }
+
+  auto stats = cache.getStats();
+  REQUIRE(stats.evictions > 0);
+  REQUIRE(stats.size <= 100);
+  REQUIRE(cache.get(0) == std::nullopt);
+  REQUIRE(cache.get(149).has_value());
+  REQUIRE(*cache.get(149).value() == 1490);
+
+  cache.put(149, std::make_shared<int>(1));
+  REQUIRE(*cache.get(149).value() == 1);
+}
+
+TEST_CASE("BasicLRUCache with string keys", "[single-threaded]")
+{
+  BasicLRUCache<std::string, int, 4> cache(100);
+
+  cache.put("helsinki", std::make_shared<int>(1));
+  cache.put("tampere", std::make_shared<int>(2));
+
+  REQUIRE(*cache.get(std::string("helsinki")).value() == 1);
+  REQUIRE(*cache.get(std::string_view("tampere")).value() == 2);
+  REQUIRE(*cache.get("helsinki").value() == 1);
+  REQUIRE(cache.get(std::string_view("oulu")) == std::nullopt);
+
+  const std::string_view key = "tampere";
+  const auto hash = cache.hashKey(key);
+  REQUIRE(*cache.get(key, hash).value() == 2);
+  REQUIRE(*cache.get(std::string(key), hash).value() == 2);
+}
+
 TEST_CASE("LRUCache concurrent operations", "[multi-threaded]")
 {
   const int NUM_THREADS = 4;
@@ -0,0 +1,232 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Regression tests for Fmi::Cache::MemoryGovernor
+ */
+// ======================================================================
+
+#include "Cache.h"
+#include "MemoryGovernor.h"
+#include <boost/test/included/unit_test.hpp>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+using namespace boost::unit_test;
+using Fmi::Cache::MemoryGovernor;
+
+test_suite* init_unit_test_suite(int argc, char* argv[])
+{
+  const char* name = "Fmi::Cache::MemoryGovernor tester";
+  unit_test_log.set_threshold_level(log_messages);
+  framework::master_test_suite().p_name.value = name;
+  BOOST_TEST_MESSAGE("");
+  BOOST_TEST_MESSAGE(name);
+  BOOST_TEST_MESSAGE(std::string(std::strlen(name), '='));
+  return nullptr;
+}
+
+namespace
+{
+// A fake /proc and cgroup v2 hierarchy in a temporary directory
+class FakeSystem
+{
+ public:
+  FakeSystem()
+      : itsRoot(std::filesystem::temp_directory_path() /
+                ("MacGyver_MemoryGovernorTest_" + std::to_string(getpid())))
+  {
+    std::filesystem::remove_all(itsRoot);
+    std::filesystem::create_directories(itsRoot / "proc" / "pressure");
+    std::filesystem::create_directories(itsRoot / "proc" / "self");
+    std::filesystem::create_directories(itsRoot / "cgroup" / "system.slice" / "smartmet.service");
+    write("proc/self/cgroup", "0::/system.slice/smartmet.service\n");
+    setPressure(0.0);
+    setMemory(100, "1000");
+  }
+
+  ~FakeSystem() { std::filesystem::remove_all(itsRoot); }
+
+  void setPressure(double avg10)
+  {
+    write("proc/pressure/memory",
+          "some avg10=" + std::to_string(avg10) + " avg60=0.00 avg300=0.00 total=1234\n" +
+              "full avg10=0.00 avg60=0.00 avg300=0.00 total=567\n");
+  }
+
+  void setMemory(std::size_t current, const std::string& max)
+  {
+    write("cgroup/system.slice/smartmet.service/memory.current", std::to_string(current) + "\n");
+    write("cgroup/system.slice/smartmet.service/memory.max", max + "\n");
+  }
+
+  Fmi::Cache::MemoryGovernorOptions options() const
+  {
+    Fmi::Cache::MemoryGovernorOptions options;
+    options.procDirectory = itsRoot / "proc";
+    options.cgroupRoot = itsRoot / "cgroup";
+    options.shrinkFactor = 0.5;
+    options.minFraction = 0.25;
+    return options;
+  }
+
+ private:
+  void write(const std::string& name, const std::string& content)
+  {
+    std::ofstream out(itsRoot / name, std::ios::trunc);
+    out << content;
+  }
+
+  std::filesystem::path itsRoot;
+};
+
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(read_pressure)
+{
+  BOOST_TEST_MESSAGE(" + Reading PSI and cgroup v2 files");
+  FakeSystem fake;
+  fake.setPressure(12.5);
+  fake.setMemory(800, "1000");
+  MemoryGovernor governor(fake.options());
+
+  auto pressure = governor.readPressure();
+  BOOST_REQUIRE(pressure.someAvg10);
+  BOOST_CHECK_CLOSE(*pressure.someAvg10, 12.5, 1e-6);
+  BOOST_REQUIRE(pressure.usage());
+  BOOST_CHECK_CLOSE(*pressure.usage(), 0.8, 1e-6);
+
+  // No limit, and no files at all
+  fake.setMemory(800, "max");
+  BOOST_CHECK(!governor.readPressure().usage());
+
+  auto options = fake.options();
+  options.procDirectory = "/nonexistent";
+  options.cgroupDirectory = "/nonexistent";
+  MemoryGovernor missing(options);
+  BOOST_CHECK(!missing.readPressure().someAvg10);
+  BOOST_CHECK(missing.update() == MemoryGovernor::Action::None);
+}
+
+BOOST_AUTO_TEST_CASE(shrink_and_grow_by_priority)
+{
+  BOOST_TEST_MESSAGE(" + Shrinking and growing caches in priority order");
+  FakeSystem fake;
+  Fmi::Cache::Cache<int, int> products(1600);
+  Fmi::Cache::Cache<int, int> metadata(800);
+  for (int i = 0; i < 1600; i++)
+    products.insert(i, i);
+
+  MemoryGovernor governor(fake.options());
+  governor.add("metadata", metadata, 10);
+  governor.add("products", products, 0);
+
+  // No pressure, nothing to do
+  BOOST_CHECK(governor.update() == MemoryGovernor::Action::None);
+
+  // PSI pressure shrinks the lowest priority first, down to its minimum
+  fake.setPressure(50);
+  BOOST_CHECK(governor.update() == MemoryGovernor::Action::Shrink);
+  BOOST_CHECK_EQUAL(products.maxSize(), 800);
+  BOOST_CHECK_EQUAL(metadata.maxSize(), 800);
+  BOOST_CHECK_LE(products.size(), 800);
+
+  BOOST_CHECK(governor.update() == MemoryGovernor::Action::Shrink);
+  BOOST_CHECK_EQUAL(products.maxSize(), 400);
+  BOOST_CHECK(governor.update() == MemoryGovernor::Action::Shrink);
+  BOOST_CHECK_EQUAL(metadata.maxSize(), 400);
+  BOOST_CHECK_EQUAL(products.maxSize(), 400);
+
+  // cgroup usage alone is pressure too
+  fake.setPressure(0);
+  fake.setMemory(950, "1000");
+  BOOST_CHECK(governor.update() == MemoryGovernor::Action::Shrink);
+  BOOST_CHECK_EQUAL(metadata.maxSize(), 208);  // 200 rounded up to 16 shards
+  BOOST_CHECK(governor.update() == MemoryGovernor::Action::None);
+
+  // Between the thresholds the sizes are kept
+  fake.setMemory(850, "1000");
+  BOOST_CHECK(governor.update() == MemoryGovernor::Action::None);
+
+  // Once the pressure clears the highest priority grows back first
+  fake.setMemory(100, "1000");
+  BOOST_CHECK(governor.update() == MemoryGovernor::Action::Grow);
+  BOOST_CHECK_EQUAL(metadata.maxSize(), 400);
+  BOOST_CHECK_EQUAL(products.maxSize(), 400);
+  BOOST_CHECK(governor.update() == MemoryGovernor::Action::Grow);
+  BOOST_CHECK_EQUAL(metadata.maxSize(), 800);
+  BOOST_CHECK(governor.update() == MemoryGovernor::Action::Grow);
+  BOOST_CHECK_EQUAL(products.maxSize(), 800);
+  BOOST_CHECK(governor.update() == MemoryGovernor::Action::Grow);
+  BOOST_CHECK_EQUAL(products.maxSize(), 1600);
+  BOOST_CHECK(governor.update() == MemoryGovernor::Action::None);
+
+  const auto status = governor.status();
+  BOOST_CHECK_EQUAL(status.shrinks, 4);
+  BOOST_CHECK_EQUAL(status.grows, 4);
+  BOOST_REQUIRE_EQUAL(status.caches.size(), 2);
+  BOOST_CHECK_EQUAL(status.caches[0].name, "products");
+  BOOST_CHECK_EQUAL(status.caches[0].currentSize, 1600);
+}
+
+BOOST_AUTO_TEST_CASE(tiny_sizes)
+{
+  BOOST_TEST_MESSAGE(" + Tiny caches are never shrunk to zero and grow back fully");
+  FakeSystem fake;
+  std::vector<std::size_t> sizes;
+  MemoryGovernor governor(fake.options());
+  governor.add("tiny", 0, 3, [&sizes](std::size_t size) { sizes.push_back(size); });
+
+  fake.setPressure(50);
+  BOOST_CHECK(governor.update() == MemoryGovernor::Action::Shrink);
+  BOOST_CHECK(governor.update() == MemoryGovernor::Action::None);
+
+  fake.setPressure(0);
+  BOOST_CHECK(governor.update() == MemoryGovernor::Action::Grow);
+  BOOST_CHECK(governor.update() == MemoryGovernor::Action::Grow);
+  BOOST_CHECK(governor.update() == MemoryGovernor::Action::None);
+
+  const std::vector<std::size_t> expected{1, 2, 3};
+  BOOST_CHECK_EQUAL_COLLECTIONS(sizes.begin(), sizes.end(), expected.begin(), expected.end());
+  const auto status = governor.status();
+  BOOST_CHECK_EQUAL(status.shrinks, 1);
+  BOOST_CHECK_EQUAL(status.grows, 2);
+  BOOST_CHECK_EQUAL(status.caches.at(0).currentSize, 3);
+}
+
+BOOST_AUTO_TEST_CASE(remove_restores_size)
+{
+  BOOST_TEST_MESSAGE(" + Removing a cache restores its nominal size");
+  FakeSystem fake;
+  Fmi::Cache::Cache<int, int> cache(1600);
+  MemoryGovernor governor(fake.options());
+  governor.add("cache", cache, 0);
+  BOOST_CHECK_THROW(governor.add("cache", cache, 1), Fmi::Exception);
+
+  fake.setPressure(50);
+  governor.update();
+  BOOST_CHECK_EQUAL(cache.maxSize(), 800);
+  BOOST_CHECK(governor.remove("cache"));
+  BOOST_CHECK_EQUAL(cache.maxSize(), 1600);
+  BOOST_CHECK(!governor.remove("cache"));
+}
+
+BOOST_AUTO_TEST_CASE(background_updates)
+{
+  BOOST_TEST_MESSAGE(" + Periodic updates in the background");
+  FakeSystem fake;
+  Fmi::Cache::Cache<int, int> cache(1600);
+  auto options = fake.options();
+  options.interval = std::chrono::milliseconds(10);
+  MemoryGovernor governor(options);
+  governor.add("cache", cache, 0);
+  fake.setPressure(50);
+  governor.start();
+
+  for (int i = 0; i < 200 && cache.maxSize() > 400; i++)
+    boost::this_thread::sleep_for(boost::chrono::milliseconds(10));
+  governor.stop();
+  BOOST_CHECK_EQUAL(cache.maxSize(), 400);
+}
@@ -0,0 +1,221 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Regression tests for Fmi::TaskInstrumentation
+ */
+// ======================================================================
+
+#include "AsyncTask.h"
+#include "AsyncTaskGroup.h"
+#include "TaskInstrumentation.h"
+#include "ThreadName.h"
+#include <boost/test/included/unit_test.hpp>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace boost::unit_test;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::nanoseconds;
+
+test_suite* init_unit_test_suite(int argc, char* argv[])
+{
+  const char* name = "Fmi::TaskInstrumentation tester";
+  unit_test_log.set_threshold_level(log_messages);
+  framework::master_test_suite().p_name.value = name;
+  BOOST_TEST_MESSAGE("");
+  BOOST_TEST_MESSAGE(name);
+  BOOST_TEST_MESSAGE(std::string(std::strlen(name), '='));
+  return nullptr;
+}
+
+BOOST_AUTO_TEST_CASE(histogram_buckets)
+{
+  using Fmi::LatencyHistogram;
+
+  // Exact below 16 ns, then 8 buckets per power of two
+  BOOST_CHECK_EQUAL(LatencyHistogram::bucket(nanoseconds(0)), 0);
+  BOOST_CHECK_EQUAL(LatencyHistogram::bucket(nanoseconds(15)), 15);
+  BOOST_CHECK_EQUAL(LatencyHistogram::bucket(nanoseconds(16)), 16);
+  BOOST_CHECK_EQUAL(LatencyHistogram::bucket(nanoseconds(31)), 23);
+  BOOST_CHECK_EQUAL(LatencyHistogram::bucket(nanoseconds(32)), 24);
+  BOOST_CHECK_EQUAL(LatencyHistogram::bucket(nanoseconds(-5)), 0);
+  BOOST_CHECK_EQUAL(LatencyHistogram::bucket(std::chrono::hours(1000)),
+                    LatencyHistogram::Buckets - 1);
+
+  // Every duration is within its bucket, and the relative error is at most 1/8
+  for (std::int64_t ns = 1; ns < 1000000000000LL; ns = ns * 3 + 1)
+  {
+    const auto b = LatencyHistogram::bucket(nanoseconds(ns));
+    const auto lower = LatencyHistogram::lowerBound(b).count();
+    const auto upper = LatencyHistogram::lowerBound(b + 1).count();
+    BOOST_CHECK_LE(lower, ns);
+    BOOST_CHECK_LT(ns, upper);
+    BOOST_CHECK_LE(upper - lower, std::max<std::int64_t>(1, lower / 8));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(histogram_percentiles)
+{
+  Fmi::LatencyHistogram histogram;
+  BOOST_CHECK_EQUAL(histogram.percentile(0.5).count(), 0);
+
+  for (int i = 1; i <= 100; i++)
+    histogram.record(microseconds(i));
+
+  BOOST_CHECK_EQUAL(histogram.count(), 100);
+  BOOST_CHECK_EQUAL(histogram.max().count(), 100000);
+  BOOST_CHECK_EQUAL(histogram.mean().count(), 50500);
+  BOOST_CHECK_EQUAL(histogram.percentile(1.0).count(), 100000);
+
+  const auto p50 = histogram.percentile(0.5).count();
+  BOOST_CHECK_GE(p50, 50000);
+  BOOST_CHECK_LE(p50, 50000 * 9 / 8);
+  const auto p95 = histogram.percentile(0.95).count();
+  BOOST_CHECK_GE(p95, 95000);
+  BOOST_CHECK_LE(p95, 100000);
+
+  std::size_t total = 0;
+  for (const auto& bucket : histogram.buckets())
+    total += bucket.second;
+  BOOST_CHECK_EQUAL(total, 100);
+
+  Fmi::LatencyHistogram other;
+  other.record(milliseconds(1));
+  histogram.merge(other);
+  BOOST_CHECK_EQUAL(histogram.count(), 101);
+  BOOST_CHECK_EQUAL(histogram.max().count(), 1000000);
+}
+
+BOOST_AUTO_TEST_CASE(async_task_timings)
+{
+  auto instrumentation = std::make_shared<Fmi::TaskInstrumentation>("tasks");
+  {
+    Fmi::AsyncTask task(
+        "timed",
+        []() { std::this_thread::sleep_for(milliseconds(20)); },
+        std::function<void()>(),
+        instrumentation);
+    task.wait();
+  }
+
+  const auto stats = instrumentation->statistics();
+  BOOST_CHECK_EQUAL(stats.name, "tasks");
+  BOOST_CHECK_EQUAL(stats.total.started, 1);
+  BOOST_CHECK_EQUAL(stats.total.finished, 1);
+  BOOST_CHECK_GE(stats.total.run.max().count(), 20000000);
+  BOOST_CHECK(stats.running.empty());
+  BOOST_REQUIRE_EQUAL(stats.tasks.count("timed"), 1);
+  BOOST_CHECK_EQUAL(stats.tasks.at("timed").run.count(), 1);
+}
+
+// The wait includes the time add() blocks for a free slot
+BOOST_AUTO_TEST_CASE(async_task_group_timings)
+{
+  Fmi::AsyncTaskGroup group(1);
+  group.enable_instrumentation("group");
+  for (int i = 0; i < 3; i++)
+    group.add(i == 0 ? "first" : "rest",
+              []() { std::this_thread::sleep_for(milliseconds(10)); });
+  group.wait();
+
+  const auto stats = group.get_instrumentation_stats();
+  BOOST_CHECK_EQUAL(stats.total.finished, 3);
+  BOOST_CHECK_EQUAL(stats.tasks.at("first").finished, 1);
+  BOOST_CHECK_EQUAL(stats.tasks.at("rest").finished, 2);
+  BOOST_CHECK_GE(stats.tasks.at("rest").wait.max().count(), 10000000);
+  BOOST_CHECK_EQUAL(Fmi::AsyncTaskGroup().get_instrumentation_stats().total.started, 0);
+}
+
+// Threads record into slots of their own, the names beyond the limit are folded into one
+BOOST_AUTO_TEST_CASE(task_names_and_threads)
+{
+  Fmi::TaskInstrumentationOptions options;
+  options.maxTaskNames = 3;
+  Fmi::TaskInstrumentation instrumentation("items", options);
+
+  for (int i = 0; i < 10; i++)
+    Fmi::TaskInstrumentation::Scope scope(
+        &instrumentation, "item" + std::to_string(i), Fmi::TaskInstrumentation::Clock::now());
+
+  auto stats = instrumentation.statistics();
+  BOOST_CHECK_EQUAL(stats.total.finished, 10);
+  BOOST_CHECK_EQUAL(stats.tasks.size(), 4);
+  BOOST_CHECK_EQUAL(stats.tasks.count("item0"), 1);
+  BOOST_CHECK_EQUAL(stats.tasks.count("item9"), 0);
+  BOOST_REQUIRE_EQUAL(stats.tasks.count(Fmi::TaskInstrumentation::OtherTasks), 1);
+  BOOST_CHECK_EQUAL(stats.tasks.at(Fmi::TaskInstrumentation::OtherTasks).finished, 7);
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++)
+    threads.emplace_back(
+        [&instrumentation]()
+        {
+          for (int i = 0; i < 1000; i++)
+            Fmi::TaskInstrumentation::Scope scope(
+                &instrumentation, "item0", Fmi::TaskInstrumentation::Clock::now());
+        });
+  for (auto& thread : threads)
+    thread.join();
+
+  stats = instrumentation.statistics();
+  BOOST_CHECK_EQUAL(stats.total.finished, 4010);
+  BOOST_CHECK_EQUAL(stats.tasks.at("item0").finished, 4001);
+  BOOST_CHECK(stats.running.empty());
+}
+
+BOOST_AUTO_TEST_CASE(watchdog_reports_slow_tasks)
+{
+  std::mutex mutex;
+  std::vector<Fmi::RunningTask> reported;
+
+  Fmi::TaskInstrumentationOptions options;
+  options.slowTaskThreshold = milliseconds(30);
+  options.watchdogInterval = milliseconds(10);
+  options.onSlowTask = [&](const std::string& theExecutor, const Fmi::RunningTask& theTask)
+  {
+    BOOST_CHECK_EQUAL(theExecutor, "watched");
+    std::lock_guard<std::mutex> lock(mutex);
+    reported.push_back(theTask);
+  };
+
+  Fmi::AsyncTaskGroup group;
+  group.enable_instrumentation("watched", options);
+  group.add("slow", []() { std::this_thread::sleep_for(milliseconds(150)); });
+  group.add("fast", []() {});
+
+  // Reported once while it runs
+  std::this_thread::sleep_for(milliseconds(100));
+  auto stats = group.get_instrumentation_stats();
+  BOOST_REQUIRE_EQUAL(stats.running.size(), 1);
+  BOOST_CHECK_EQUAL(stats.running[0].name, "slow");
+  BOOST_CHECK_EQUAL(stats.running[0].thread, "slow");
+  BOOST_CHECK_GE(stats.running[0].running.count(), 30000000);
+
+  group.wait();
+  stats = group.get_instrumentation_stats();
+  BOOST_CHECK_EQUAL(stats.slowTasks, 1);
+  BOOST_CHECK(stats.running.empty());
+
+  std::lock_guard<std::mutex> lock(mutex);
+  BOOST_REQUIRE_EQUAL(reported.size(), 1);
+  BOOST_CHECK_EQUAL(reported[0].name, "slow");
+  BOOST_CHECK_EQUAL(reported[0].thread, "slow");
+}
+
+BOOST_AUTO_TEST_CASE(thread_names)
+{
+  std::string name;
+  std::thread thread(
+      [&name]()
+      {
+        Fmi::set_thread_name("ini-test");
+        name = Fmi::get_thread_name();
+      });
+  thread.join();
+  BOOST_CHECK_EQUAL(name, "ini-test");
+}
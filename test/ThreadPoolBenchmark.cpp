@@ -0,0 +1,129 @@
+// ======================================================================
+/*!
+ * \file
+ * \brief Scalability benchmarks for Fmi::ThreadPool schedulers
+ *
+ * Not run by "make test", use "make bench" instead.
+ */
+// ======================================================================
+
+#include "ThreadPool.h"
+#include "WorkStealingScheduler.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <limits>
+#include <thread>
+
+using namespace Fmi::ThreadPool;
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+
+// A task doing about one microsecond of work
+void work()
+{
+  const auto end = Clock::now() + std::chrono::microseconds(1);
+  while (Clock::now() < end)
+  {
+  }
+}
+
+// Run the tasks scheduled by the given function and return tasks/second
+template <typename Scheduler, typename Function>
+double run(int theWorkers, int theTasks, Function theFunction)
+{
+  ThreadPool<Scheduler> pool(theWorkers, std::numeric_limits<std::size_t>::max(), "bench");
+  pool.start();
+
+  std::atomic<int> done{0};
+  const auto start = Clock::now();
+  theFunction(pool, done);
+  while (done.load() < theTasks)
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+  const std::chrono::duration<double> elapsed = Clock::now() - start;
+
+  pool.shutdown();
+  return theTasks / elapsed.count();
+}
+
+// All tasks are scheduled by a thread outside the pool
+template <typename Scheduler>
+double external(int theWorkers)
+{
+  const int ntasks = 200000;
+  return run<Scheduler>(theWorkers,
+                        ntasks,
+                        [](ThreadPool<Scheduler>& pool, std::atomic<int>& done)
+                        {
+                          for (int i = 0; i < ntasks; i++)
+                            pool.schedule(
+                                [&done]()
+                                {
+                                  work();
+                                  ++done;
+                                });
+                        });
+}
+
+// A few root tasks each schedule many small tasks from inside the pool
+template <typename Scheduler>
+double nested(int theWorkers)
+{
+  const int nroots = 64;
+  const int nchildren = 3000;
+  return run<Scheduler>(theWorkers,
+                        nroots * nchildren,
+                        [](ThreadPool<Scheduler>& pool, std::atomic<int>& done)
+                        {
+                          for (int i = 0; i < nroots; i++)
+                            pool.schedule(
+                                [&pool, &done]()
+                                {
+                                  for (int j = 0; j < nchildren; j++)
+                                    pool.schedule(
+                                        [&done]()
+                                        {
+                                          work();
+                                          ++done;
+                                        });
+                                });
+                        });
+}
+
+void benchmarkexternal()
+{
+  std::printf("Tasks scheduled from outside the pool, 1 microsecond tasks/second\n");
+  std::printf("%8s %14s %14s %8s\n", "workers", "FIFO", "stealing", "ratio");
+  for (int workers = 1; workers <= 64; workers *= 2)
+  {
+    const double fifo = external<FifoScheduler>(workers);
+    const double stealing = external<WorkStealingScheduler>(workers);
+    std::printf("%8d %14.0f %14.0f %8.2f\n", workers, fifo, stealing, stealing / fifo);
+  }
+  std::printf("\n");
+}
+
+void benchmarknested()
+{
+  std::printf("Tasks scheduled from inside the pool, 1 microsecond tasks/second\n");
+  std::printf("%8s %14s %14s %8s\n", "workers", "FIFO", "stealing", "ratio");
+  for (int workers = 1; workers <= 64; workers *= 2)
+  {
+    const double fifo = nested<FifoScheduler>(workers);
+    const double stealing = nested<WorkStealingScheduler>(workers);
+    std::printf("%8d %14.0f %14.0f %8.2f\n", workers, fifo, stealing, stealing / fifo);
+  }
+  std::printf("\n");
+}
+
+}  // namespace
+
+int main()
+{
+  std::printf("Hardware threads: %u\n\n", std::thread::hardware_concurrency());
+  benchmarkexternal();
+  benchmarknested();
+  return 0;
+}
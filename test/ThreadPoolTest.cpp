@@ -1,6 +1,15 @@
 #include "ThreadPool.h"
+#include "DeadlineScheduler.h"
+#include "Exception.h"
+#include "PriorityScheduler.h"
+#include "WorkStealingScheduler.h"
 #include <atomic>
 #include <iostream>
+#include <mutex>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <vector>
 #include <boost/chrono.hpp>
 #include <boost/thread.hpp>
 #include <boost/test/included/unit_test.hpp>
@@ -124,3 +133,520 @@ BOOST_AUTO_TEST_CASE(shutdown_timeout_allows_task_to_finish)
   BOOST_CHECK(completed);            // graceful shutdown let the running task finish
   BOOST_CHECK_LT(elapsed_ms, 4000);  // returned well before the timeout
 }
+
+namespace
+{
+using WorkStealingPool = Fmi::ThreadPool::ThreadPool<Fmi::ThreadPool::WorkStealingScheduler>;
+
+// ThreadPool::join() returns immediately if no worker is active, poll instead
+bool wait_for_count(const std::atomic<int>& count, int expected)
+{
+  const auto deadline = boost::chrono::steady_clock::now() + boost::chrono::seconds(20);
+  while (count < expected && boost::chrono::steady_clock::now() < deadline)
+    boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+  return count == expected;
+}
+}  // namespace
+
+// Tasks scheduled from inside tasks go to the local deques of the workers, the
+// rest of the workers must steal them
+BOOST_AUTO_TEST_CASE(work_stealing_nested_tasks)
+{
+  std::atomic<int> count{0};
+  WorkStealingPool pool(4, std::numeric_limits<std::size_t>::max(), "steal");
+  pool.start();
+
+  const int roots = 8;
+  const int children = 1000;
+  for (int i = 0; i < roots; ++i)
+  {
+    BOOST_REQUIRE(pool.schedule(
+        [&pool, &count]()
+        {
+          for (int j = 0; j < children; ++j)
+            pool.schedule([&count]() { count++; });
+          count++;
+        }));
+  }
+
+  BOOST_CHECK(wait_for_count(count, roots * (children + 1)));
+  BOOST_CHECK_EQUAL(pool.getQueueSize(), 0);
+  pool.shutdown();
+  BOOST_CHECK_EQUAL(pool.getPoolSize(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(work_stealing_bounded_queue)
+{
+  std::atomic<int> count{0};
+  WorkStealingPool pool(2, 3);
+
+  // Not started yet, so the tasks stay in the queue
+  for (int i = 0; i < 3; ++i)
+    BOOST_CHECK(pool.schedule([&count]() { count++; }));
+  BOOST_CHECK(!pool.schedule([&count]() { count++; }));
+  BOOST_CHECK_EQUAL(pool.getQueueSize(), 3);
+
+  pool.start();
+  BOOST_CHECK(wait_for_count(count, 3));
+  BOOST_CHECK(pool.schedule([&count]() { count++; }));
+  BOOST_CHECK(wait_for_count(count, 4));
+  pool.shutdown();
+}
+
+// Shrinking the pool must not lose the tasks left in the deques of the exiting workers,
+// and a worker killed by an exception is replaced
+BOOST_AUTO_TEST_CASE(work_stealing_resize)
+{
+  std::atomic<int> count{0};
+  WorkStealingPool pool(8);
+  pool.start();
+
+  for (int round = 0; round < 20; ++round)
+  {
+    for (int i = 0; i < 8; ++i)
+    {
+      pool.schedule(
+          [&pool, &count]()
+          {
+            for (int j = 0; j < 10; ++j)
+              pool.schedule([&count]() { count++; });
+          });
+    }
+    pool.resize(round % 2 == 0 ? 2 : 8);
+  }
+  BOOST_CHECK(wait_for_count(count, 20 * 8 * 10));
+
+  pool.schedule([]() { throw std::runtime_error("worker dies"); });
+  for (int i = 0; i < 100; ++i)
+    pool.schedule([&count]() { count++; });
+  BOOST_CHECK(wait_for_count(count, 20 * 8 * 10 + 100));
+  BOOST_CHECK_EQUAL(pool.getPoolSize(), 8);
+  pool.shutdown();
+}
+
+BOOST_AUTO_TEST_CASE(priority_scheduler_order)
+{
+  Fmi::ThreadPool::PrioritySchedulerOptions options;
+  options.aging = std::chrono::milliseconds(0);
+  Fmi::ThreadPool::PriorityScheduler scheduler(4, options);
+
+  std::vector<int> order;
+  BOOST_CHECK(scheduler.push([&order]() { order.push_back(2); }, 2));
+  BOOST_CHECK(scheduler.push([&order]() { order.push_back(0); }, 0));
+  BOOST_CHECK(scheduler.push([&order]() { order.push_back(1); }));
+  BOOST_CHECK(scheduler.push([&order]() { order.push_back(10); }, 0));
+  BOOST_CHECK(!scheduler.push([&order]() { order.push_back(-1); }, 0));
+  BOOST_CHECK_THROW(scheduler.push([]() {}, 3), Fmi::Exception);
+
+  while (!scheduler.empty())
+    scheduler.pop()();
+  BOOST_CHECK((order == std::vector<int>{0, 10, 1, 2}));
+
+  const auto stats = scheduler.statistics();
+  BOOST_REQUIRE_EQUAL(stats.size(), 3);
+  BOOST_CHECK_EQUAL(stats[0].scheduled, 2);
+  BOOST_CHECK_EQUAL(stats[0].rejected, 1);
+  BOOST_CHECK_EQUAL(stats[0].started, 2);
+  BOOST_CHECK_EQUAL(stats[2].started, 1);
+  BOOST_CHECK_EQUAL(stats[2].depth, 0);
+  BOOST_CHECK_EQUAL(stats[2].promoted, 0);
+}
+
+// A batch task which has waited long enough is started before a fresh urgent one
+BOOST_AUTO_TEST_CASE(priority_scheduler_aging)
+{
+  Fmi::ThreadPool::PrioritySchedulerOptions options;
+  options.aging = std::chrono::milliseconds(20);
+  Fmi::ThreadPool::PriorityScheduler scheduler(10, options);
+
+  std::vector<int> order;
+  scheduler.push([&order]() { order.push_back(2); }, 2);
+  boost::this_thread::sleep_for(boost::chrono::milliseconds(70));
+  scheduler.push([&order]() { order.push_back(0); }, 0);
+
+  const auto queued = scheduler.statistics();
+  BOOST_CHECK_EQUAL(queued[2].depth, 1);
+  BOOST_CHECK_GE(queued[2].oldestWait.count(), 60000000);
+
+  while (!scheduler.empty())
+    scheduler.pop()();
+  BOOST_CHECK((order == std::vector<int>{2, 0}));
+
+  const auto stats = scheduler.statistics();
+  BOOST_CHECK_EQUAL(stats[2].promoted, 1);
+  BOOST_CHECK_GE(stats[2].maxWait.count(), 60000000);
+  BOOST_CHECK_EQUAL(stats[0].promoted, 0);
+}
+
+BOOST_AUTO_TEST_CASE(deadline_scheduler)
+{
+  using Clock = std::chrono::steady_clock;
+  std::vector<int> order;
+  std::vector<Clock::duration> late;
+  Fmi::ThreadPool::DeadlineScheduler scheduler(
+      10, [&late](Clock::duration lateness) { late.push_back(lateness); });
+
+  const auto now = Clock::now();
+  scheduler.push([&order]() { order.push_back(0); });
+  scheduler.push([&order]() { order.push_back(10); }, now + std::chrono::seconds(10));
+  scheduler.push([&order]() { order.push_back(5); }, now + std::chrono::seconds(5));
+  scheduler.push([&order]() { order.push_back(6); }, now + std::chrono::seconds(5));
+  scheduler.push([&order]() { order.push_back(-1); }, now - std::chrono::milliseconds(10));
+
+  int ownCallbacks = 0;
+  scheduler.push([&order]() { order.push_back(-2); },
+                 now - std::chrono::milliseconds(5),
+                 [&ownCallbacks](Clock::duration) { ++ownCallbacks; });
+
+  auto stats = scheduler.statistics();
+  BOOST_CHECK_EQUAL(stats[0].depth, 5);
+  BOOST_CHECK_EQUAL(stats[1].depth, 1);
+
+  while (!scheduler.empty())
+    scheduler.pop()();
+  BOOST_CHECK((order == std::vector<int>{5, 6, 10, 0}));
+  BOOST_REQUIRE_EQUAL(late.size(), 1);
+  BOOST_CHECK(late[0] >= std::chrono::milliseconds(10));
+  BOOST_CHECK_EQUAL(ownCallbacks, 1);
+
+  stats = scheduler.statistics();
+  BOOST_CHECK_EQUAL(stats[0].name, "deadline");
+  BOOST_CHECK_EQUAL(stats[0].scheduled, 5);
+  BOOST_CHECK_EQUAL(stats[0].started, 3);
+  BOOST_CHECK_EQUAL(stats[0].dropped, 2);
+  BOOST_CHECK_EQUAL(stats[1].started, 1);
+
+  // Late tasks without callbacks are skipped silently
+  Fmi::ThreadPool::DeadlineScheduler silent(10);
+  silent.push([&order]() { order.push_back(-3); }, now - std::chrono::milliseconds(1));
+  silent.pop()();
+  BOOST_CHECK(silent.empty());
+  BOOST_CHECK_EQUAL(order.size(), 4);
+}
+
+// Priorities and scheduler options are passed through the pool
+BOOST_AUTO_TEST_CASE(priority_pool)
+{
+  Fmi::ThreadPool::PrioritySchedulerOptions options;
+  options.levels = 2;
+  options.defaultLevel = 1;
+  Fmi::ThreadPool::ThreadPool<Fmi::ThreadPool::PriorityScheduler> pool(
+      1, std::numeric_limits<std::size_t>::max(), "prio", options);
+
+  std::mutex mutex;
+  std::vector<int> order;
+  std::atomic<int> count{0};
+  auto task = [&](int value)
+  {
+    return [&, value]()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      order.push_back(value);
+      ++count;
+    };
+  };
+
+  // Queued before the worker starts, so the order is deterministic
+  pool.schedule(task(1));
+  pool.schedule(task(2), 1);
+  pool.schedule(task(0), 0);
+  pool.start();
+  BOOST_CHECK(wait_for_count(count, 3));
+  pool.shutdown();
+
+  BOOST_CHECK((order == std::vector<int>{0, 1, 2}));
+  const auto stats = pool.getSchedulerStatistics();
+  BOOST_REQUIRE_EQUAL(stats.size(), 2);
+  BOOST_CHECK_EQUAL(stats[0].started, 1);
+  BOOST_CHECK_EQUAL(stats[1].started, 2);
+  BOOST_CHECK_EQUAL(pool.getQueueSize(), 0);
+}
+
+// Schedulers without per-class statistics report none
+BOOST_AUTO_TEST_CASE(scheduler_statistics_without_support)
+{
+  Fmi::ThreadPool::ThreadPool<> fifo(1);
+  BOOST_CHECK(fifo.getSchedulerStatistics().empty());
+  WorkStealingPool stealing(1);
+  BOOST_CHECK(stealing.getSchedulerStatistics().empty());
+}
+
+BOOST_AUTO_TEST_CASE(submit_futures)
+{
+  Fmi::ThreadPool::ThreadPool<> pool(2);
+  pool.start();
+
+  auto sum = pool.submit([](int a, int b) { return a + b; }, 2, 3);
+  BOOST_CHECK_EQUAL(sum.get(), 5);
+
+  std::atomic<int> calls{0};
+  auto nothing = pool.submit([&calls]() { ++calls; });
+  nothing.get();
+  BOOST_CHECK_EQUAL(calls, 1);
+
+  auto failure = pool.submit([]() -> int { throw std::runtime_error("no result"); });
+  BOOST_CHECK_THROW(failure.get(), std::runtime_error);
+
+  // The worker survives the exception
+  BOOST_CHECK_EQUAL(pool.submit([]() { return std::string("alive"); }).get(), "alive");
+  pool.shutdown();
+}
+
+BOOST_AUTO_TEST_CASE(submit_to_full_queue)
+{
+  Fmi::ThreadPool::ThreadPool<> pool(1, 1);  // not started
+  auto first = pool.submit([]() { return 1; });
+  auto second = pool.submit([]() { return 2; });
+  BOOST_CHECK(second.ready());
+  BOOST_CHECK_THROW(second.get(), Fmi::Exception);
+  pool.start();
+  BOOST_CHECK_EQUAL(first.get(), 1);
+  pool.shutdown();
+}
+
+BOOST_AUTO_TEST_CASE(future_continuations)
+{
+  Fmi::ThreadPool::ThreadPool<> pool(1);
+  pool.start();
+
+  // A long chain on a single worker only completes if no continuation waits in a worker
+  auto value = pool.submit([]() { return 1; });
+  for (int i = 0; i < 100; ++i)
+    value = value.then([](int x) { return x + 1; });
+  BOOST_CHECK_EQUAL(value.get(), 101);
+
+  // Continuations taking the value are skipped on errors, those taking the future are not
+  std::atomic<bool> skipped{true};
+  auto failed = pool.submit([]() -> int { throw std::runtime_error("failed"); })
+                    .then(
+                        [&skipped](int x)
+                        {
+                          skipped = false;
+                          return x;
+                        });
+  BOOST_CHECK_THROW(failed.get(), std::runtime_error);
+  BOOST_CHECK(skipped);
+
+  auto recovered = failed.then(
+      [](const Fmi::ThreadPool::Future<int>& f)
+      {
+        try
+        {
+          return f.get();
+        }
+        catch (const std::runtime_error&)
+        {
+          return -1;
+        }
+      });
+  BOOST_CHECK_EQUAL(recovered.get(), -1);
+
+  // Continuation of a ready future, and of a void one
+  BOOST_CHECK_EQUAL(recovered.then([](int x) { return 2 * x; }).get(), -2);
+  auto done = pool.submit([]() {}).then([]() { return std::string("done"); });
+  BOOST_CHECK_EQUAL(done.get(), "done");
+  pool.shutdown();
+}
+
+BOOST_AUTO_TEST_CASE(future_combinators)
+{
+  using Fmi::ThreadPool::Future;
+  Fmi::ThreadPool::ThreadPool<> pool(4);
+  pool.start();
+
+  std::vector<Future<int>> parts;
+  for (int i = 1; i <= 10; ++i)
+    parts.push_back(pool.submit(
+        [](int x)
+        {
+          if (x == 7)
+            throw std::runtime_error("seven");
+          return x;
+        },
+        i));
+
+  auto total = Fmi::ThreadPool::when_all(parts).then(
+      [](const std::vector<Future<int>>& results)
+      {
+        int sum = 0;
+        for (const auto& result : results)
+        {
+          try
+          {
+            sum += result.get();
+          }
+          catch (const std::runtime_error&)
+          {
+          }
+        }
+        return sum;
+      });
+  BOOST_CHECK_EQUAL(total.get(), 55 - 7);
+  BOOST_CHECK(Fmi::ThreadPool::when_all(std::vector<Future<int>>()).get().empty());
+
+  std::vector<Future<int>> racers;
+  racers.push_back(pool.submit(
+      []()
+      {
+        boost::this_thread::sleep_for(boost::chrono::milliseconds(500));
+        return 0;
+      }));
+  racers.push_back(pool.submit([]() { return 1; }));
+  const auto& first = Fmi::ThreadPool::when_any(racers).get();
+  BOOST_CHECK_EQUAL(first.index, 1);
+  BOOST_CHECK_EQUAL(first.future.get(), 1);
+  BOOST_CHECK_THROW(Fmi::ThreadPool::when_any(std::vector<Future<int>>()).get(),
+                    std::invalid_argument);
+
+  racers[0].wait();
+  pool.shutdown();
+}
+
+namespace
+{
+// Resizing is asynchronous, workers exit only once they see the new size
+bool wait_for_pool_size(Fmi::ThreadPool::ThreadPool<>& pool, std::size_t expected)
+{
+  const auto deadline = boost::chrono::steady_clock::now() + boost::chrono::seconds(20);
+  while (pool.getPoolSize() != expected && boost::chrono::steady_clock::now() < deadline)
+    boost::this_thread::sleep_for(boost::chrono::milliseconds(5));
+  return pool.getPoolSize() == expected;
+}
+}  // namespace
+
+BOOST_AUTO_TEST_CASE(autoscaling_grows_pool)
+{
+  using Fmi::ThreadPool::ThreadPool;
+  std::atomic<int> count{0};
+  ThreadPool<> pool(1);
+  pool.start();
+
+  Fmi::ThreadPool::AutoscalerOptions options;
+  options.maxWorkers = 4;
+  options.waitThreshold = std::chrono::milliseconds(5);
+  options.interval = std::chrono::milliseconds(0);  // evaluated by the test only
+  pool.enableAutoscaling(options);
+
+  // The tasks queued behind the first ones wait for tens of milliseconds
+  for (int i = 0; i < 40; ++i)
+    pool.schedule(
+        [&count]()
+        {
+          boost::this_thread::sleep_for(boost::chrono::milliseconds(10));
+          count++;
+        });
+  boost::this_thread::sleep_for(boost::chrono::milliseconds(35));
+  BOOST_CHECK(pool.evaluateAutoscaling() == ThreadPool<>::AutoscaleAction::Grow);
+
+  for (int i = 0; i < 5; ++i)
+  {
+    boost::this_thread::sleep_for(boost::chrono::milliseconds(30));
+    pool.evaluateAutoscaling();
+  }
+  BOOST_CHECK(wait_for_count(count, 40));
+  BOOST_CHECK_EQUAL(pool.getPoolSize(), 4);
+
+  const auto stats = pool.getAutoscalerStatistics();
+  BOOST_CHECK_EQUAL(stats.grows, 3);
+  BOOST_CHECK_EQUAL(stats.workersAdded, 3);
+  BOOST_CHECK_EQUAL(stats.shrinks, 0);
+  BOOST_CHECK_EQUAL(stats.evaluations, 6);
+  pool.shutdown();
+}
+
+BOOST_AUTO_TEST_CASE(autoscaling_shrinks_idle_pool)
+{
+  using Fmi::ThreadPool::ThreadPool;
+  ThreadPool<> pool(4);
+  pool.start();
+  pool.join();  // new workers count as active until they first wait for tasks
+
+  Fmi::ThreadPool::AutoscalerOptions options;
+  options.minWorkers = 1;
+  options.holdDown = std::chrono::milliseconds(50);
+  options.interval = std::chrono::milliseconds(0);
+  pool.enableAutoscaling(options);
+
+  // The hold-down period starts from the first idle evaluation
+  BOOST_CHECK(pool.evaluateAutoscaling() == ThreadPool<>::AutoscaleAction::None);
+  boost::this_thread::sleep_for(boost::chrono::milliseconds(60));
+  BOOST_CHECK(pool.evaluateAutoscaling() == ThreadPool<>::AutoscaleAction::Shrink);
+  BOOST_CHECK(wait_for_pool_size(pool, 1));
+
+  const auto stats = pool.getAutoscalerStatistics();
+  BOOST_CHECK_EQUAL(stats.shrinks, 1);
+  BOOST_CHECK_EQUAL(stats.workersRemoved, 3);
+  BOOST_CHECK_EQUAL(stats.utilization, 0.0);
+
+  // Workers above the minimum only
+  boost::this_thread::sleep_for(boost::chrono::milliseconds(60));
+  BOOST_CHECK(pool.evaluateAutoscaling() == ThreadPool<>::AutoscaleAction::None);
+  pool.shutdown();
+}
+
+BOOST_AUTO_TEST_CASE(autoscaling_in_background)
+{
+  Fmi::ThreadPool::ThreadPool<> pool(3);
+  pool.start();
+
+  Fmi::ThreadPool::AutoscalerOptions options;
+  options.holdDown = std::chrono::milliseconds(20);
+  options.interval = std::chrono::milliseconds(10);
+  pool.enableAutoscaling(options);
+  BOOST_CHECK(wait_for_pool_size(pool, 1));
+
+  pool.disableAutoscaling();
+  BOOST_CHECK_GE(pool.getAutoscalerStatistics().shrinks, 1);
+  pool.shutdown();
+}
+
+BOOST_AUTO_TEST_CASE(instrumentation)
+{
+  Fmi::ThreadPool::ThreadPool<> pool(1, std::numeric_limits<std::size_t>::max(), "timed");
+  BOOST_CHECK_EQUAL(pool.getInstrumentationStats().total.started, 0);
+
+  Fmi::TaskInstrumentationOptions options;
+  options.slowTaskThreshold = std::chrono::milliseconds(20);
+  options.watchdogInterval = std::chrono::milliseconds(5);
+  std::atomic<int> slow{0};
+  std::string slowThread;
+  options.onSlowTask = [&](const std::string&, const Fmi::RunningTask& theTask)
+  {
+    slowThread = theTask.thread;
+    slow++;
+  };
+  pool.enableInstrumentation(options);
+
+  // Scheduled before the start, so all wait for at least the 20 ms
+  std::atomic<int> count{0};
+  for (int i = 0; i < 5; ++i)
+    pool.scheduleNamed("short", [&count]() { count++; });
+  pool.scheduleNamed("long",
+                     [&count]()
+                     {
+                       boost::this_thread::sleep_for(boost::chrono::milliseconds(60));
+                       count++;
+                     });
+  pool.schedule([&count]() { count++; });
+  boost::this_thread::sleep_for(boost::chrono::milliseconds(20));
+  pool.start();
+  BOOST_CHECK(wait_for_count(count, 7));
+  pool.join();
+
+  const auto stats = pool.getInstrumentationStats();
+  BOOST_CHECK_EQUAL(stats.name, "timed");
+  BOOST_CHECK_EQUAL(stats.total.finished, 7);
+  BOOST_CHECK_EQUAL(stats.tasks.size(), 2);  // unnamed tasks only in the total
+  BOOST_CHECK_EQUAL(stats.tasks.at("short").finished, 5);
+  BOOST_CHECK_GE(stats.tasks.at("short").wait.percentile(0.5).count(), 20000000);
+  BOOST_CHECK_GE(stats.tasks.at("long").run.max().count(), 60000000);
+  BOOST_CHECK_EQUAL(stats.slowTasks, 1);
+  BOOST_CHECK_EQUAL(slow, 1);
+  BOOST_CHECK_EQUAL(slowThread, "timed-1");
+
+  pool.disableInstrumentation();
+  pool.schedule([&count]() { count++; });
+  BOOST_CHECK(wait_for_count(count, 8));
+  BOOST_CHECK_EQUAL(pool.getInstrumentationStats().total.started, 0);
+  pool.shutdown();
+}